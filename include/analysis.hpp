@@ -0,0 +1,66 @@
+#pragma once
+
+#include "nesdefs.hpp"
+#include <unordered_map>
+#include <vector>
+
+namespace cppnes {
+
+  // Static analysis over Subroutine entries, used by the build-time passes.
+  namespace analysis {
+
+    // Per-entry execution weight estimate: 1 for straight-line code, multiplied by
+    // loopFactor for every backward branch/jump whose body encloses the entry.
+    std::vector<uint64_t> entryWeights(const Subroutine &sub, uint64_t loopFactor = 16);
+
+    [[nodiscard]] bool isBranch(Opcode op);
+    // Encoded size in bytes (1-3).
+    [[nodiscard]] uint8_t instructionBytes(const Instruction &inst);
+    // Base cycle count without page-crossing penalties. Branches cost 2 not taken, 3 taken.
+    [[nodiscard]] uint8_t instructionCycles(const Instruction &inst, bool branchTaken = false);
+    // Sum of instructionBytes() over all instructions of a subroutine.
+    [[nodiscard]] uint32_t subroutineBytes(const Subroutine &sub);
+    // Names of the subroutines called with JSR, in call order (with repetitions).
+    [[nodiscard]] std::vector<std::string> callees(const Subroutine &sub);
+
+    // Byte offset of every entry from the start of the subroutine (size() + 1 values, the
+    // last one being the total).
+    [[nodiscard]] std::vector<uint32_t> entryOffsets(const Subroutine &sub);
+    // Address of the CODE segment: $8000 past the ALIGNED data (see layoutConstrainedData).
+    [[nodiscard]] uint16_t codeBase(const Program &prg);
+    // Estimated calls per frame of each subroutine: the NMI handler runs once, callees inherit
+    // their callers' rate times the call site weight (entryWeights). overrides (e.g. profiled
+    // rates) replace the estimate for the subroutines they name.
+    [[nodiscard]] std::unordered_map<std::string, double> callsPerFrame(const Program &prg,
+      const std::unordered_map<std::string, double> &overrides = {});
+
+    // Registers and flags as bits, for liveness checks.
+    enum RegBit : uint8_t {
+      RegA = 0x01, RegX = 0x02, RegY = 0x04,
+      FlagN = 0x08, FlagZ = 0x10, FlagC = 0x20, FlagV = 0x40,
+      RegsAll = 0x7F
+    };
+    struct RegisterUse {
+      uint8_t reads = 0;
+      uint8_t writes = 0;
+    };
+    // Registers/flags an instruction reads and writes (index registers of the operand included).
+    [[nodiscard]] RegisterUse registerUse(const Instruction &inst);
+    // True if none of the regs bits is read after entry index `after` before being overwritten.
+    // Conservative: labels, branches, jumps, calls and returns count as reads of everything.
+    [[nodiscard]] bool deadAfter(const Subroutine &sub, size_t after, uint8_t regs);
+
+    struct DataPlacement {
+      const DataBlock *block;
+      uint32_t offset; // from the start of the page-aligned ALIGNED segment
+    };
+    // Packs the constrained data blocks (DataBlock::align/noPageCross) into the fewest pages,
+    // ordered by offset. Throws if a no-page-cross block is larger than a page.
+    [[nodiscard]] std::vector<DataPlacement> layoutConstrainedData(const Program &prg);
+    // Indexed reads (absx/absy) of unconstrained data blocks inside loops: each may pay
+    // an extra cycle whenever base+index crosses a page.
+    [[nodiscard]] std::vector<std::string> pageCrossWarnings(const Program &prg);
+
+  } // namespace analysis
+
+} // namespace cppnes
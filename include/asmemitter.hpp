@@ -24,9 +24,10 @@ namespace cppnes {
 
     // Primary entry points  called by Rom::emitAsm()
     void emitPrgAsm(const Program &prg, std::ostream &out) const;
-    void emitLinkerConfig(std::ostream &out) const;
+    void emitLinkerConfig(const Rom &rom, std::ostream &out) const;
     void emitInesHeader(const Rom &rom, std::ostream &out) const;
-    void emitChars(const Resources &rc, std::ostream &out) const;
+    // chrRom false (CHR-RAM): the CHR data goes to RODATA as chrTiles instead of CHARS.
+    void emitChars(const Resources &rc, std::ostream &out, bool chrRom = true) const;
     void emitStartup(std::ostream &out) const;
 
   private:
@@ -37,6 +38,8 @@ namespace cppnes {
     std::string formatInlineComment(const InlineComment &c) const;
     std::string formatVectors(const Program &prg) const;
     std::string formatOAM(const Program &prg) const;
+    std::string formatDataBlock(const DataBlock &db) const;
+    std::string formatAlignedData(const Program &prg) const;
     std::string opcodeToString(Opcode op) const;
 
     struct Impl;
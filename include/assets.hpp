@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cppnes {
+
+  // Build-time asset pipeline: a DAG of conversions run on worker threads, each output cached
+  // by the hash of its converter and of its inputs' contents, so only dirty assets rebuild.
+  namespace assets {
+
+    using Bytes = std::vector<uint8_t>;
+
+    // A pure conversion, identified by name and version: bump the version whenever the same
+    // inputs would give a different output, or stale cache entries are reused.
+    struct Converter {
+      std::string name;
+      uint32_t version = 1;
+      std::function<Bytes(const std::vector<const Bytes *> &inputs)> convert;
+    };
+
+    // Stock converters, one input each unless noted.
+    [[nodiscard]] Converter rle();
+    [[nodiscard]] Converter lz();
+    // A pattern table through chr::deduplicate: the surviving tiles.
+    [[nodiscard]] Converter chrDedup(bool flips = false);
+    // Any number of .nam screens through metatiles::compile: a 2-byte metatile count, then the
+    // blocks of metatiles::addDataBlocks in its order: the tl/tr/bl/br tables (one byte per
+    // metatile each), then per screen its 240-byte map, 64-byte attribute table and, with
+    // strips, its 128 bytes of attribute strips.
+    [[nodiscard]] Converter metatileTables(bool strips = false);
+    // A 256x240 PGM/PPM/BMP file through image::convert: its tiles, nametable or palettes.
+    [[nodiscard]] Converter imageChr();
+    [[nodiscard]] Converter imageNametable();
+    [[nodiscard]] Converter imagePalettes();
+
+    struct PipelineStats {
+      size_t converted = 0;
+      size_t cached = 0;
+    };
+
+    class Pipeline {
+    public:
+      using Node = size_t;
+
+      // cacheDir empty: cache in memory only. threads 0: one per hardware thread.
+      explicit Pipeline(std::filesystem::path cacheDir = {}, unsigned threads = 0);
+      // Read (and hashed) on each run.
+      Node addFile(const std::filesystem::path &path);
+      Node addBytes(std::string name, Bytes bytes);
+      // Inputs are earlier nodes, so the graph cannot have cycles. Throws std::out_of_range.
+      Node add(std::string name, Converter converter, std::vector<Node> inputs);
+      // Brings every output up to date. A failed conversion throws std::runtime_error naming
+      // the asset, once the running ones are done.
+      PipelineStats run();
+      // Throws std::logic_error before the node has run.
+      const Bytes &output(Node node) const;
+
+    private:
+      struct Asset {
+        std::string name;
+        std::filesystem::path file;
+        Converter converter;
+        std::vector<Node> inputs;
+        size_t level = 0;
+        Bytes bytes;
+        uint64_t hash = 0; // of bytes
+        bool ready = false;
+      };
+      bool update(Asset &asset); // true if converted, false if taken from the cache
+
+      std::filesystem::path cacheDir_;
+      unsigned threads_;
+      std::vector<Asset> assets_;
+      std::mutex cacheMutex_;
+      std::unordered_map<uint64_t, Bytes> cache_; // key -> output
+    };
+
+  } // namespace assets
+
+} // namespace cppnes
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "metatiles.hpp"
+#include <array>
+#include <vector>
+
+namespace cppnes {
+
+  // Build-time CHR optimizer: merges duplicate tiles, and for sprites tiles that are flips
+  // of others, then remaps the nametables and metasprites that use them.
+  namespace chr {
+
+    using Tile = std::array<uint8_t, 16>; // plane 0 rows, then plane 1 rows
+
+    // OAM attribute bits
+    constexpr uint8_t FlipH = 0x40;
+    constexpr uint8_t FlipV = 0x80;
+
+    [[nodiscard]] Tile flip(const Tile &tile, uint8_t flips);
+
+    struct TileRef {
+      uint8_t tile = 0;
+      uint8_t flip = 0; // FlipH / FlipV: draw the surviving tile flipped
+    };
+
+    // One sprite of a metasprite, relative to its origin.
+    struct SpriteTile {
+      int8_t x = 0;
+      int8_t y = 0;
+      uint8_t tile = 0;
+      uint8_t attributes = 0; // as in OAM: palette, priority, flips
+    };
+
+    struct Dedup {
+      std::vector<uint8_t> chr;     // survivors, in order of first use (tile 0 stays 0)
+      std::vector<TileRef> remap;   // old tile -> survivor
+      std::vector<uint8_t> freed;   // old tiles merged into a survivor
+      size_t duplicates = 0;        // of freed, exact copies
+      size_t flipped = 0;           // of freed, flips
+    };
+
+    // One pattern table (up to 256 tiles). flips: also merge mirrored tiles, for the sprite
+    // table only, since nametable entries cannot flip. Throws std::invalid_argument.
+    [[nodiscard]] Dedup deduplicate(const std::vector<uint8_t> &table, bool flips = false);
+    // Throws std::logic_error if a tile was merged as a flip.
+    void remap(metatiles::Nametable &nametable, const Dedup &dedup);
+    void remap(std::vector<SpriteTile> &metasprite, const Dedup &dedup);
+    // The 8 KB for Resources::setCHR: each table padded to 4 KB so the sprite table stays at
+    // $1000 however many tiles the background lost.
+    [[nodiscard]] std::vector<uint8_t> patternTables(const Dedup &background, const Dedup &sprites);
+
+  } // namespace chr
+
+} // namespace cppnes
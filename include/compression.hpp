@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace cppnes {
+
+  // Build-time packers for PRG data, paired with the bblocks that unpack them on the NES.
+  namespace compression {
+
+    // RLE for nametables, unpacked by bblocks::loadNametableRle:
+    //   tag            the least used byte value of the data
+    //   b              b != tag: one literal byte
+    //   tag, n, b      n copies of b (1-255); also how a literal tag is stored
+    //   tag, 0         end
+    [[nodiscard]] std::vector<uint8_t> rleEncode(const std::vector<uint8_t> &data);
+    // Throws std::invalid_argument on malformed input.
+    [[nodiscard]] std::vector<uint8_t> rleDecode(const std::vector<uint8_t> &packed);
+    // Cycles bblocks::loadNametableRle takes for packed, including its setup, with the data
+    // starting on a page (at most 4 more otherwise).
+    [[nodiscard]] uint32_t rleDecodeCycles(const std::vector<uint8_t> &packed);
+
+    // LZ for CHR-RAM tiles and level data, byte aligned so the 6502 never shifts bits:
+    //   n, n bytes     literals (n = 1-127)
+    //   $80|n, o       n bytes (3-127) copied from o + 1 (1-256) bytes back
+    //   0              end
+    // The 256-byte window lets bblocks::decompressToVram copy from a RAM ring buffer. The
+    // parse is the smallest for the format, with the fewest tokens among equal sizes.
+    [[nodiscard]] std::vector<uint8_t> lzEncode(const std::vector<uint8_t> &data);
+    // Throws std::invalid_argument on malformed input.
+    [[nodiscard]] std::vector<uint8_t> lzDecode(const std::vector<uint8_t> &packed);
+    // lzEncode of each asset, spread over threads workers (0: one per hardware thread).
+    [[nodiscard]] std::vector<std::vector<uint8_t>> lzEncodeAll(const std::vector<std::vector<uint8_t>> &assets, unsigned threads = 0);
+
+  } // namespace compression
+
+} // namespace cppnes
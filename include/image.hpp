@@ -0,0 +1,41 @@
+#pragma once
+
+#include "metatiles.hpp"
+#include <array>
+#include <filesystem>
+#include <vector>
+
+namespace cppnes {
+
+  // Native image to CHR + nametable converter, in place of an external screen tool.
+  namespace image {
+
+    // One NES color ($00-$3F) per pixel, row by row.
+    struct Image {
+      size_t width = 0;
+      size_t height = 0;
+      std::vector<uint8_t> pixels;
+    };
+
+    // Binary PGM (P5: each gray value is the NES color), PPM (P6) and uncompressed BMP (4,
+    // 8 or 24 bits); RGB colors map to the nearest NES color. Throws std::runtime_error.
+    [[nodiscard]] Image decode(const std::vector<uint8_t> &bytes);
+    [[nodiscard]] Image load(const std::filesystem::path &path);
+    // Nearest color of the usual 2C02 palette; black is always $0F.
+    [[nodiscard]] uint8_t nesColor(uint8_t r, uint8_t g, uint8_t b);
+
+    struct Screen {
+      std::vector<uint8_t> chr;          // distinct tiles, 16 bytes each, in order of first use
+      metatiles::Nametable nametable{};  // tile ids and attribute table
+      std::array<uint8_t, 16> palettes{}; // background palettes, for Resources::setPalettes
+    };
+
+    // A 256x240 image: the most used color is the shared background color, and each 16x16
+    // area gets one of 4 fitted 3-color palettes. Throws std::invalid_argument if an area has
+    // more than 4 colors or the areas need more than 4 palettes, std::out_of_range past 256
+    // distinct tiles.
+    [[nodiscard]] Screen convert(const Image &image);
+
+  } // namespace image
+
+} // namespace cppnes
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "nesdefs.hpp"
+#include <array>
+#include <string>
+#include <vector>
+
+namespace cppnes {
+
+  // Build-time metatile compiler: 16x16 pixel (2x2 tile) blocks deduplicated across screens.
+  // A screen becomes a 240-byte map (16x15 metatile ids, row by row); its attribute table is
+  // packed here from each metatile's palette, so the runtime only copies bytes.
+  namespace metatiles {
+
+    using Nametable = std::array<uint8_t, 1024>; // 960 tile ids, then 64 attribute bytes
+
+    struct Metatile {
+      std::array<uint8_t, 4> tiles; // top-left, top-right, bottom-left, bottom-right
+      uint8_t palette;              // 0-3
+      bool operator==(const Metatile &) const = default;
+    };
+
+    struct Screen {
+      std::string label;
+      std::array<uint8_t, 240> map;
+    };
+
+    struct MetatileSet {
+      std::vector<Metatile> metatiles; // id = index, in order of first use
+      std::vector<Screen> screens;
+    };
+
+    // Reads a .nam file (as saved by NES Screen Tool): exactly 1024 bytes.
+    [[nodiscard]] Nametable loadNametable(const std::string &path);
+    // Throws std::out_of_range past 256 distinct metatiles.
+    [[nodiscard]] MetatileSet compile(const std::vector<std::pair<std::string, Nametable>> &screens);
+    // The nametable a screen expands to (bottom half of the last attribute row left 0).
+    [[nodiscard]] Nametable expand(const MetatileSet &set, const Screen &screen);
+
+    // The 64-byte attribute table of a screen (bottom half of the last row left 0).
+    [[nodiscard]] std::array<uint8_t, 64> attributeTable(const MetatileSet &set, const Screen &screen);
+    // For scrolling: 16 strips of 8 bytes, one per metatile column m. Byte m * 8 + r is the
+    // attribute byte of row r with only the quadrants of column m kept (mask $33 for even m,
+    // $CC for odd), ready to be ORed into the other column's bits.
+    [[nodiscard]] std::array<uint8_t, 128> attributeStrips(const MetatileSet &set, const Screen &screen);
+
+    // Adds the metatile tables as <name>_tl/_tr/_bl/_br data blocks (one byte per id, never
+    // crossing a page) and, per screen, its map labelled as the screen and its attribute table
+    // as <screen>_attr; with strips, also <screen>_attrStrips for bblocks::loadAttributeColumn.
+    MetatileTables addDataBlocks(Program &prg, std::string_view name, const MetatileSet &set, bool strips = false);
+
+  } // namespace metatiles
+
+} // namespace cppnes
@@ -10,9 +10,12 @@
 #include <filesystem>
 #include <vector>
 #include <array>
+#include <map>
 #include <variant>
 #include <unordered_map>
 #include <cassert>
+#include <functional>
+#include "assets.hpp"
 
 namespace cppnes {
 
@@ -86,28 +89,99 @@ namespace cppnes {
     }
   };
 
+  // Named, non-overlapping blocks within [min, max], kept sorted by address. Explicit placements
+  // are checked against every live block; automatic ones take the smallest free gap that fits.
+  class IntervalAllocator {
+  public:
+    struct Block {
+      uint16_t address;
+      uint16_t size;
+      std::string name;
+    };
+    IntervalAllocator(uint16_t min, uint16_t max) : min_(min), max_(max) {}
+    // align must be a power of two. Throws std::out_of_range if no free gap fits.
+    [[nodiscard]] uint16_t allocate(std::string_view name, uint16_t size, uint16_t align = 1);
+    // Throws std::out_of_range outside [min, max], std::invalid_argument on overlap.
+    [[nodiscard]] uint16_t allocateAt(std::string_view name, uint16_t address, uint16_t size);
+    // address must be the start of a live block.
+    void free(uint16_t address);
+
+    [[nodiscard]] uint16_t used() const { return used_; }
+    [[nodiscard]] uint16_t peak() const { return peak_; } // most bytes ever in use at once
+    [[nodiscard]] uint16_t available() const { return static_cast<uint16_t>(max_ - min_ + 1 - used_); }
+    [[nodiscard]] uint16_t largestFree() const;
+    // 1 - largestFree / available: 0 when the free space is one gap (or none).
+    [[nodiscard]] double fragmentation() const;
+    [[nodiscard]] std::vector<Block> blocks() const;
+    [[nodiscard]] std::vector<Block> freeGaps() const; // unnamed blocks
+    [[nodiscard]] uint16_t minAddress() const { return min_; }
+    [[nodiscard]] uint16_t maxAddress() const { return max_; }
+  private:
+    uint16_t min_, max_;
+    std::map<uint16_t, Block> blocks_;
+    uint16_t used_ = 0;
+    uint16_t peak_ = 0;
+  };
+
   class ZeroPageAllocator {
-    uint16_t next_ = Min;
+    IntervalAllocator space_{ Min, Max };
   public:
     [[nodiscard]] ZpAddress alloc(std::string_view name, bool constant = false);
     [[nodiscard]] ZpAddress allocBlock(std::string_view name, uint8_t size, bool constant = false);
+    void free(const ZpAddress &addr) { space_.free(addr.value()); }
+    [[nodiscard]] uint16_t available() const { return space_.available(); }
+    [[nodiscard]] uint16_t used() const { return space_.used(); }
+    const IntervalAllocator &space() const { return space_; }
     static constexpr uint16_t Min = 0x0010;
     static constexpr uint16_t Max = 0x00FF;
   };
 
   class RamAllocator {
-    uint16_t next_ = Min;
+    IntervalAllocator space_{ Min, Max };
   public:
     [[nodiscard]] AbsAddress alloc(std::string_view name, bool constant = false);
+    // baseAddress 0: best fit; otherwise exactly there, if free.
     [[nodiscard]] AbsAddress allocBlock(std::string_view name, uint16_t size, uint16_t baseAddress = 0, bool constant = false);
+    // E.g. align 256 for buffers walked with abs,X / abs,Y or copied to OAM/VRAM by page.
+    [[nodiscard]] AbsAddress allocAligned(std::string_view name, uint16_t size, uint16_t align, bool constant = false);
+    void free(const AbsAddress &addr) { space_.free(addr.value()); }
+    [[nodiscard]] uint16_t available() const { return space_.available(); }
+    [[nodiscard]] uint16_t used() const { return space_.used(); }
+    const IntervalAllocator &space() const { return space_; }
     static constexpr uint16_t Min = 0x0300;
     static constexpr uint16_t Max = 0x07FF;
   };
 
+  // Cartridge PRG-RAM. Anything allocated here (or setBattery) adds the MEMORY area to the
+  // linker config; battery-backed RAM also sets the iNES battery flag.
+  class SramAllocator {
+    IntervalAllocator space_{ Min, Max };
+    bool battery_ = false;
+  public:
+    [[nodiscard]] AbsAddress allocBlock(std::string_view name, uint16_t size, uint16_t baseAddress = 0, bool constant = false);
+    [[nodiscard]] AbsAddress allocAligned(std::string_view name, uint16_t size, uint16_t align, bool constant = false);
+    void free(const AbsAddress &addr) { space_.free(addr.value()); }
+    void setBattery(bool battery) { battery_ = battery; }
+    [[nodiscard]] bool battery() const { return battery_; }
+    [[nodiscard]] bool inUse() const { return battery_ || 0 < space_.peak(); }
+    [[nodiscard]] uint16_t available() const { return space_.available(); }
+    [[nodiscard]] uint16_t used() const { return space_.used(); }
+    const IntervalAllocator &space() const { return space_; }
+    static constexpr uint16_t Min = 0x6000;
+    static constexpr uint16_t Max = 0x7FFF;
+  };
+
   class MemoryMap {
   public:
     ZeroPageAllocator zeroPage;
     RamAllocator ram;
+    SramAllocator sram;
+
+    // Every named allocation with its size, the free gaps and fragmentation per area.
+    [[nodiscard]] std::string reportText() const;
+    [[nodiscard]] std::string reportJson() const;
+    // Writes memorymap.txt and memorymap.json into dir.
+    void writeReport(const std::filesystem::path &dir) const;
   };
 
   struct Immediate { uint8_t value; };
@@ -175,6 +249,16 @@ namespace cppnes {
 
   class SubroutineBblocksProxy;
 
+  // Explicit inlining attribute, honoured by Program::inlineSubroutines().
+  enum class InlineHint { Auto, Always, Never };
+
+  // PRG bank of code/data that stays mapped: the last 16KB on UNROM/MMC1/MMC3, all of PRG on
+  // NROM/CNROM. Other bank numbers are the switchable 16KB banks at $8000 (Rom::setPrgBanks).
+  constexpr uint8_t FixedBank = 0xFF;
+
+  enum class Mapper { NROM, MMC1, UNROM, CNROM, MMC3 };
+  enum class Mirroring { Horizontal, Vertical, None };
+
   class Subroutine {
   public:
     // LDA
@@ -187,6 +271,7 @@ namespace cppnes {
     Subroutine &lda(IndexedIndirectX i) { return emitInst(Opcode::LDA, i); }
     Subroutine &lda(IndexedIndirectY i) { return emitInst(Opcode::LDA, i); }
     Subroutine &lda(ImmediateLabel i) { return emitInst(Opcode::LDA, i); }
+    Subroutine &lda(const Label &l) { return emitInst(Opcode::LDA, l); } // absolute, e.g. Label{"Table+3"}
 
     // STA
     Subroutine &sta(ZeroPage i) { return emitInst(Opcode::STA, i); }
@@ -368,10 +453,19 @@ namespace cppnes {
     Subroutine &label(const Label &l) { instructions_.push_back(LabelDef{ l }); return *this; }
     Subroutine &comment(const std::string &c) { instructions_.push_back(LineComment{ c }); return *this; }
     Subroutine &commentPrev(const std::string &c) { instructions_.push_back(InlineComment{ c }); return *this; }
+    Subroutine &append(const std::vector<Entry> &entries) { instructions_.insert(instructions_.end(), entries.begin(), entries.end()); return *this; }
     
 
     SubroutineBblocksProxy bblocks();
 
+    Subroutine &setInline(InlineHint hint) { inline_ = hint; return *this; }
+    InlineHint inlineHint() const { return inline_; }
+    // Callers must map the bank first (bblocks::switchBank), or call from the same bank.
+    Subroutine &setBank(uint8_t bank) { bank_ = bank; return *this; }
+    uint8_t bank() const { return bank_; }
+    // Filler bytes emitted before the subroutine, set by Program::optimizeLayout.
+    uint16_t padBefore() const { return padBefore_; }
+
     std::string name() const { return name_; }
     const std::vector<Entry> &instructions() const { return instructions_; }
   private:
@@ -391,6 +485,9 @@ namespace cppnes {
 
     std::vector<Entry> instructions_;
     std::string name_;
+    InlineHint inline_ = InlineHint::Auto;
+    uint16_t padBefore_ = 0;
+    uint8_t bank_ = FixedBank;
   };
 
 
@@ -413,8 +510,43 @@ namespace cppnes {
       entries_.push_back(WordEntry{ values, std::string(comment) });
       return *this;
     }
+    template<size_t N>
+    DataBlock &addBytes(const std::array<uint8_t, N> &values, std::string_view comment = "") {
+      return addBytes(std::vector<uint8_t>(values.begin(), values.end()), comment);
+    }
+    // Evaluates gen(0..count-1) at build time, 16 bytes per .byte line.
+    DataBlock &generate(size_t count, const std::function<uint8_t(size_t)> &gen, std::string_view comment = "") {
+      for (size_t i = 0; i < count; i += 16) {
+        std::vector<uint8_t> row;
+        for (size_t j = i; j < count && j < i + 16; ++j)
+          row.push_back(gen(j));
+        addBytes(row, i == 0 ? comment : "");
+      }
+      return *this;
+    }
     void clear() { entries_.clear(); }
     std::string_view label() const { return label_; }
+    // Placement constraints, honoured by the layout of the ALIGNED segment.
+    // Indexed reads (absx/absy) of a block that does not cross a page never pay the +1 cycle.
+    DataBlock &align(uint16_t alignment) {
+      if (alignment == 0 || 256 < alignment || (alignment & (alignment - 1)) != 0)
+        throw std::invalid_argument("DataBlock::align: alignment must be a power of two up to 256");
+      alignment_ = alignment;
+      return *this;
+    }
+    DataBlock &noPageCross(bool enable = true) { noPageCross_ = enable; return *this; }
+    // Constrained blocks are always laid out in the fixed bank.
+    DataBlock &setBank(uint8_t bank) { bank_ = bank; return *this; }
+    uint8_t bank() const { return bank_; }
+    uint16_t alignment() const { return alignment_; }
+    bool isNoPageCross() const { return noPageCross_; }
+    bool isConstrained() const { return 1 < alignment_ || noPageCross_; }
+    size_t size() const {
+      size_t n = 0;
+      for (const auto &e : entries_)
+        n += std::holds_alternative<ByteEntry>(e) ? std::get<ByteEntry>(e).data.size() : 2 * std::get<WordEntry>(e).data.size();
+      return n;
+    }
     struct ByteEntry {
       std::vector<uint8_t> data;
       std::string comment;
@@ -428,8 +560,185 @@ namespace cppnes {
   private:
     std::string label_;
     std::vector<Entry> entries_;
+    uint16_t alignment_ = 1;
+    bool noPageCross_ = false;
+    uint8_t bank_ = FixedBank;
+  };
+
+
+  // A 16-bit table stored as two byte tables, <label>_lo and <label>_hi, so entry X is read
+  // with lda(absx(lo)) / lda(absx(hi)) without any index doubling.
+  struct SplitTable {
+    Label lo;
+    Label hi;
+    size_t count;
+  };
+
+  // Up to 128 entities stored as parallel RAM arrays, one per field (struct of arrays), so field
+  // f of entity X is lda(table("f")) -> LDA f,X with no pointer math. Each array is aligned to
+  // the capacity rounded up to a power of two and never crosses a page. Live entities form a
+  // linked list through `next` ($FF ends it); free slots are a stack through the same array.
+  // Built by Program::addEntityTable; see bblocks::entityInit/Spawn/ForEach/Despawn.
+  struct EntityTable {
+    std::string name;
+    uint8_t capacity = 0;
+    std::vector<std::pair<std::string, AbsAddress>> fields;
+    AbsAddress next{ 0 };
+    AbsAddress liveHead{ 0 };
+    AbsAddress freeHead{ 0 };
+    AbsAddress prev{ 0 };   // entityForEach state, temporaries
+    AbsAddress cursor{ 0 };
+
+    [[nodiscard]] AbsAddress field(std::string_view fieldName) const;
+    [[nodiscard]] AbsoluteX operator()(std::string_view fieldName) const { return AbsoluteX{ field(fieldName) }; }
+  };
+
+  // Save slots in battery-backed SRAM, each slotSize data bytes followed by a checksum (byte sum,
+  // then byte XOR). The game edits `buffer` in RAM; bblocks::saveBegin/saveStep copy it to a
+  // slot a few bytes per frame, checksum last, so an interrupted save reads back as invalid.
+  // Built by Program::addSaveSlots.
+  struct SaveSlots {
+    std::string name;
+    uint8_t slotSize = 0;
+    uint8_t count = 0;
+    AbsAddress sram{ 0 };       // slot 0
+    AbsAddress buffer{ 0 };     // RAM working copy
+    SplitTable slotAddress{ Label{ "" }, Label{ "" }, 0 }; // SRAM address of slot X
+    ZpAddress ptr{ 0 };         // 2 bytes, current slot while saving/loading
+    AbsAddress busy{ 0 };       // non-zero while a save is in progress
+    AbsAddress pos{ 0 };        // next byte to write
+    AbsAddress sum{ 0 };
+    AbsAddress eor{ 0 };
+  };
+
+  // A register write at a raster split: a build-time value, or a variable read at the split.
+  struct RegisterWrite {
+    uint16_t reg;
+    std::variant<uint8_t, AbsAddress> value;
+  };
+
+  // Register writes that take effect from scanline (1..239) on.
+  struct RasterSplit {
+    uint8_t scanline;
+    std::vector<RegisterWrite> writes;
+  };
+
+  // MMC3 scanline IRQ chain built by Program::addIrqSplits. The IRQ vector does jmp (target);
+  // each handler does its writes, then re-arms the counter and points target at the next one.
+  // bblocks::irqSplitsFrame starts the chain every frame. Cycle counts are static, from the
+  // start of the 7-cycle IRQ sequence; the interrupted instruction adds 0-6 cycles of jitter.
+  struct IrqChain {
+    std::string name;
+    std::vector<std::string> handlers; // one per split
+    uint8_t firstLatch = 0;
+    AbsAddress target{ 0 };            // 2 bytes, handler of the next split
+    std::vector<uint32_t> firstWriteCycle;
+    std::vector<uint32_t> lastWriteCycle; // of the (up to 3) writes done back to back
+    std::vector<uint32_t> handlerCycles;  // through RTI
+    std::vector<uint32_t> reloadCycle;    // of the $C001 write arming the next split, 0 on the last
+  };
+
+  // Metatile lookup tables, one byte per metatile id; built by metatiles::addDataBlocks.
+  struct MetatileTables {
+    Label tl{ "" }, tr{ "" }, bl{ "" }, br{ "" };
+    AbsAddress scratch{ 0 }; // temporaries of bblocks::loadMetatileScreen
+    ZpAddress ptr{ 0 };      // screen map being read
+  };
+
+  // CHR bank animation, stepped once per frame by bblocks::chrAnimationStep: each bank of the
+  // sequence is shown for frameDelay frames, in a loop. Built by Program::addChrAnimation.
+  struct ChrAnimation {
+    std::string name;
+    Mapper mapper = Mapper::CNROM;
+    uint8_t reg = 0;            // MMC3: CHR register R0-R5 (2KB/1KB bank numbers); CNROM: all 8KB
+    uint8_t frameDelay = 1;
+    uint8_t count = 0;
+    Label sequence{ "" };       // the bank numbers
+    Label bankTable{ "" };      // CNROM bus-conflict table
+    AbsAddress bankSelect{ 0 }; // MMC3: Program::mmc3BankSelect()
+    AbsAddress timer{ 0 };
+    AbsAddress index{ 0 };
+  };
+
+  // CHR-RAM uploads: a ring of (source, tile) entries filled by bblocks::tileQueuePush and
+  // drained in vblank by bblocks::tileQueueFlush, at most tilesPerFrame tiles per frame.
+  // Built by Program::addTileQueue.
+  struct TileQueue {
+    std::string name;
+    uint8_t capacity = 0;       // power of two; one entry is always left free
+    uint8_t tilesPerFrame = 0;
+    AbsAddress srcLo{ 0 }, srcHi{ 0 }, dstLo{ 0 }, dstHi{ 0 }; // capacity bytes each
+    AbsAddress head{ 0 };       // next entry to upload
+    AbsAddress tail{ 0 };       // next free entry
+    AbsAddress budget{ 0 };
+    ZpAddress ptr{ 0 };
+  };
+
+  // A variable declared by name only. Its address (zero page or RAM) is chosen at build time
+  // by Program::resolveVariables() from access counts.
+  struct SymbolicVar {
+    std::string name;
+    uint8_t size = 1;
+    bool constant = true;
+    uint64_t accesses = 0;
+    bool resolved = false;
+    bool zeroPage = false;
+    uint16_t address = 0;
+    bool temporary = false;    // shares its address with temporaries that are never live at the same time
+    bool zeroPageOnly = false; // declared by declareZpTemp, may be used as (zp),Y
+  };
+
+  // Reported by Program::resolveVariables().
+  struct MemoryUsage {
+    uint16_t zeroPageBytes = 0;     // peak: everything allocated from ZeroPageAllocator
+    uint16_t ramBytes = 0;          // peak: everything allocated from RamAllocator
+    uint16_t zeroPageTempBytes = 0; // of zeroPageBytes, the shared temporaries area
+    uint16_t ramTempBytes = 0;      // of ramBytes, the shared temporaries area
+    uint32_t tempBytesDeclared = 0; // what the temporaries would take without sharing
+  };
+
+  namespace superopt { struct RewriteRule; }
+
+  // Program::optimizeLayout().
+  struct LayoutOptions {
+    std::unordered_map<std::string, double> callsPerFrame; // profiled rates, see analysis::callsPerFrame
+    uint32_t paddingBudget = 256; // filler bytes the pass may spend keeping loops inside a page
+  };
+
+  struct LayoutReport {
+    double cyclesSavedPerFrame = 0; // estimated, from the per-frame call rates
+    uint64_t cyclesSavedOnce = 0;   // in code not run per frame (reset, init)
+    int tailCalls = 0;              // JSR + RTS turned into JMP
+    int jumpsRemoved = 0;           // JMP to the next instruction
+    int branchesInverted = 0;       // Bcc over a JMP turned into the inverse branch
+    int loopsAligned = 0;           // loops moved off a page boundary by padding
+    uint32_t paddingBytes = 0;
+  };
+
+  // Program::packBanks().
+  struct BankPackOptions {
+    Mapper mapper = Mapper::UNROM; // the trampolines switch banks with bblocks::switchBankA
+    uint8_t banks = 7;             // switchable banks, Rom::switchableBanks()
+    uint16_t bankBytes = 0x4000;
+    uint16_t fixedBytes = 0x3C00;  // code and data the fixed bank may hold; the rest is for trampolines
+    std::unordered_map<std::string, double> callsPerFrame; // profiled rates, see analysis::callsPerFrame
+    std::vector<std::string> pinned; // subroutines kept in the fixed bank
+    Label bankTable{ "" };         // UNROM: created with Program::addBankTable if empty
   };
 
+  struct BankPackReport {
+    std::vector<uint32_t> bankBytes; // fill of each switchable bank
+    uint32_t fixedBytes = 0;         // code and data left in the fixed bank, trampolines included
+    int trampolines = 0;
+    int farCalls = 0;                // call sites redirected to a trampoline
+    double farCallsPerFrame = 0;     // estimated, from the per-frame call rates
+  };
+
+  // Cost model for Program::inlineSubroutines(). A JSR/RTS pair costs 12 cycles and 4 bytes.
+  struct InlineOptions {
+    uint32_t maxCalleeBytes = 24; // Auto callees above this size are inlined only if called once
+    int32_t romBudget = 256;      // total bytes the program may grow by
+  };
 
   // Program is the 6502 code. Subroutines, labels, memory map, interrupt vectors. Pure logic.
   class Program {
@@ -448,10 +757,62 @@ namespace cppnes {
     Subroutine &addSubroutine(std::string_view name);
     Subroutine &getSubroutine(std::string_view name);
     const std::vector<std::unique_ptr<Subroutine>> &subroutines() const { return subroutines_; }
+    // Copies callee bodies into their JSR call sites (labels renamed) per the cost model and
+    // InlineHint. Fully inlined callees are removed. Returns the number of call sites inlined.
+    int inlineSubroutines(const InlineOptions &options = {});
+    // Peephole stage: rewrites every match of the superoptimizer's rules (superopt.hpp) whose
+    // dead registers/flags are not read afterwards, largest saving first. Returns the rewrites.
+    int peephole(const std::vector<superopt::RewriteRule> &rules);
+    // Orders subroutines hottest first, removes jumps on the fall-through path and pads before
+    // subroutines so that hot loops do not branch across a page (+1 cycle per iteration).
+    // Run last: it resolves variables so instruction sizes are final, and the padding depends
+    // on analysis::codeBase(), so add the aligned data blocks (Resources::addDataBlocks) first.
+    LayoutReport optimizeLayout(const LayoutOptions &options = {});
+    // Throws if the fixed-bank code base moved since optimizeLayout() chose its padding (an
+    // aligned data block added or resized afterwards). Called by AsmEmitter::emitPrgAsm.
+    void checkLayout() const;
+    // Assigns the subroutines and data blocks still in FixedBank to PRG banks. Vectors, code
+    // reachable from NMI/IRQ and the pinned subroutines stay fixed; then the hottest code fills
+    // the fixed bank and the rest is clustered along the heaviest call edges. Data goes with
+    // the code that reads it, or stays fixed when read from several banks or through a pointer.
+    // Calls into another bank are redirected to generated <name>_far trampolines in the fixed
+    // bank; they pass A, X and Y through both ways (flags do not survive). The reset vector then
+    // starts by mapping bank 0, the bank the first trampoline maps back. Run before
+    // optimizeLayout.
+    BankPackReport packBanks(const BankPackOptions &options = {});
 
     DataBlock &addDataBlock(const Label &label);
     DataBlock &getDataBlock(const Label &label);
     const std::unordered_map<std::string, std::unique_ptr<DataBlock>> &dataBlocks() const { return dataBlocks_; }
+    // Evaluates gen(0..count-1) into a lo/hi split table. Tables up to 256 entries never cross
+    // a page; larger ones are page-aligned so each 256-entry half is read without penalty.
+    SplitTable addSplitTable(const Label &label, size_t count, const std::function<uint16_t(size_t)> &gen);
+    // One allocRamAligned array per field (named <name>_<field>) plus the list links; the list
+    // heads are variables placed by resolveVariables().
+    EntityTable addEntityTable(std::string_view name, uint8_t capacity, const std::vector<std::string> &fields);
+    // "bankTable" ("bankTable1", ... on later calls): bytes 0..count-1 in the fixed bank. UNROM/CNROM latches see both the CPU's
+    // value and the ROM byte at the written address (bus conflict); writing bank n to
+    // bankTable+n makes them agree. See bblocks::switchBank.
+    Label addBankTable(uint8_t count);
+    // MMC3: RAM copy of the last value written to the bank select register ($8000), declared on
+    // first use. Main-thread code stores each select value here before writing $8000 (the
+    // switch bblocks do, given it); NMI/IRQ code that selects a register restores $8000 from
+    // it before returning, so an interrupt between the select and the data write is harmless.
+    AbsAddress mmc3BankSelect();
+    // count slots of slotSize (1..254) bytes in SRAM, marked battery-backed.
+    SaveSlots addSaveSlots(std::string_view name, uint8_t slotSize, uint8_t count);
+    // MMC3 IRQ handlers for splits (ascending, at least 2 scanlines apart), set as the IRQ
+    // vector. The first three writes of a split are loaded into A, X, Y and stored back to back.
+    // The next IRQ is armed right after them, before the other writes. Throws
+    // std::invalid_argument if a handler would still run when the next split is due.
+    // Handlers that write $8000 restore it from mmc3BankSelect() afterwards.
+    IrqChain addIrqSplits(std::string_view name, const std::vector<RasterSplit> &splits);
+    // CNROM: 8KB banks, through bankTable (Program::addBankTable(max bank + 1) if empty).
+    // MMC3: animates CHR register reg only, so the other slots keep their tiles.
+    ChrAnimation addChrAnimation(std::string_view name, Mapper mapper, const std::vector<uint8_t> &banks,
+      uint8_t frameDelay, uint8_t reg = 0, const Label &bankTable = Label{ "" });
+    // capacity: power of two, 2..128.
+    TileQueue addTileQueue(std::string_view name, uint8_t capacity, uint8_t tilesPerFrame);
 
     MemoryMap &memoryMap() const { return mmap_; }
 
@@ -465,6 +826,41 @@ namespace cppnes {
     AbsAddress allocRamBlock(std::string_view name, uint16_t size, uint16_t baseAddress = 0) {
       return mmap_.ram.allocBlock(name, size, baseAddress);
     }
+    [[nodiscard]]
+    AbsAddress allocRamAligned(std::string_view name, uint16_t size, uint16_t align = 0x100) {
+      return mmap_.ram.allocAligned(name, size, align);
+    }
+    // $6000-$7FFF cartridge RAM, e.g. for large decompression buffers.
+    [[nodiscard]]
+    AbsAddress allocSramBlock(std::string_view name, uint16_t size, uint16_t baseAddress = 0) {
+      return mmap_.sram.allocBlock(name, size, baseAddress);
+    }
+    void freeZp(const ZpAddress &addr) { mmap_.zeroPage.free(addr); }
+    void freeRam(const AbsAddress &addr) { mmap_.ram.free(addr); }
+
+    // Declares a variable without an address. Access it as abs(var), absx(var + i), etc.;
+    // resolveVariables() later re-encodes those operands to ZeroPage or Absolute. Operands are
+    // matched by name, so the name may not be that of a subroutine, data block, constant,
+    // allocated address or local label (std::logic_error; addSubroutine/addDataBlock check too).
+    [[nodiscard]]
+    AbsAddress declareVar(std::string_view name, uint8_t size = 1, bool constant = true);
+    // Hottest variables get zero page (starting at ZeroPageAllocator::Min), the rest go to RAM.
+    // accessCounts (name -> count, e.g. from an emulator profile) overrides the static counts.
+    // Temporaries share addresses when their lifetimes cannot overlap (see declareTemp).
+    void resolveVariables(const std::unordered_map<std::string, uint64_t> &accessCounts = {});
+    const std::vector<SymbolicVar> &variables() const { return vars_; }
+    // Scratch variable, live only in the code that references it: in each subroutine from its
+    // first to its last reference (whole loops included, and any call to a subroutine that
+    // references it too), plus everything called in between. Outside of that its bytes may be
+    // reused by other temporaries; lifetimes in different interrupt contexts always conflict.
+    [[nodiscard]]
+    AbsAddress declareTemp(std::string_view name, uint8_t size = 1, bool constant = true);
+    // Same, always placed in zero page, for pointers used as (zp),Y.
+    [[nodiscard]]
+    ZpAddress declareZpTemp(std::string_view name, uint8_t size = 2, bool constant = true);
+    const MemoryUsage &memoryUsage() const { return usage_; }
+    // Reads "name count" lines, as exported by an emulator profiling script.
+    static std::unordered_map<std::string, uint64_t> loadAccessProfile(std::string_view path);
 
     void addConstant(std::string_view name, int32_t value);
     bool hasConstant(std::string_view name) const;
@@ -479,30 +875,77 @@ namespace cppnes {
     std::vector<std::unique_ptr<Subroutine>> subroutines_;
     std::unordered_map<std::string, std::unique_ptr<DataBlock>> dataBlocks_;
     std::unordered_map<std::string, int32_t> constants_;
+    std::vector<SymbolicVar> vars_;
+    MemoryUsage usage_;
+    uint32_t layoutBase_ = 0; // analysis::codeBase() seen by optimizeLayout, 0 before it ran
+    int inlineCount_ = 0; // numbers the labels of inlined bodies, per program so output is reproducible
   };
 
+  // Build-time packing of a resource; see compression.hpp for the formats.
+  enum class Compression { None, Rle, Lz };
+
   class Resources {
     std::vector<uint8_t> chrData_;
-    std::array<uint8_t, 16> bgPal_;
-    std::array<uint8_t, 16> spPal_;
+    std::array<uint8_t, 16> bgPal_{};
+    std::array<uint8_t, 16> spPal_{};
+    bool hasPalettes_ = false;
+    uint8_t fadeDark_ = 0;
+    uint8_t fadeLight_ = 0;
     std::string chrPath_;
     bool chrUseFilename_ = false;
     std::unordered_map<std::string, std::string> nametables_; // lable -> filename
+    std::unordered_map<std::string, std::vector<uint8_t>> packedNametables_; // label -> packed bytes
+    struct PendingAsset {
+      std::string label;
+      assets::Converter converter;
+      std::vector<std::string> files;
+    };
+    std::vector<PendingAsset> pendingAssets_; // converted by buildAssets()
+    std::filesystem::path assetCache_;
   public:
+    // One 8KB bank, or a whole number of them (up to 256KB) for CNROM/MMC3 CHR switching.
     void loadCHR(std::string_view path);
+    // Replaces the CHR data (whole tiles), e.g. with the chr::deduplicate survivors of one
+    // table, or of both through chr::patternTables; emitted as bytes.
+    void setCHR(std::vector<uint8_t> data);
+    // .pal: 32 bytes (background, then sprites) or 16 (background only). .nss (NES Screen Tool
+    // session): the active palette set, as the background. Throws std::runtime_error.
     void loadPalettes(std::string_view path);
     void setPalettes(std::array<uint8_t, 16> bg, std::array<uint8_t, 16> spr);
+    bool hasPalettes() const { return hasPalettes_; }
+    std::array<uint8_t, 32> palettes() const;
+    // Fade steps precomputed from the palettes: darkSteps towards black, lightSteps towards
+    // white (see tables::fadeColor), 8 steps at most counting the palettes themselves.
+    void setPaletteFade(uint8_t darkSteps, uint8_t lightSteps = 0);
+    // paletteLabel(): the 32 palette bytes for bblocks::loadPalette, aligned on 32 so they
+    // never cross a page. With setPaletteFade, paletteFadeLabel(): 32 bytes per step, darkest
+    // first (the palettes are step darkSteps), page-aligned, for bblocks::loadPaletteStep.
+    // Call before Program::optimizeLayout; Rom::emitAsm calls it again (it is idempotent).
+    void addDataBlocks(Program &prg) const;
+    static Label paletteLabel() { return Label{ "paletteData" }; }
+    static Label paletteFadeLabel() { return Label{ "paletteFade" }; }
     bool chrUseFilename() const { return chrUseFilename_; }
     std::string chrPath() const { return chrPath_; }
     void setChrUseFilename(bool useFilename) { chrUseFilename_ = useFilename; }
     const std::vector<uint8_t> &chrData() const { return chrData_; }
-    void addNametable(std::string_view label, std::string_view filename);
+    uint8_t chrBanks() const { return static_cast<uint8_t>((chrData_.size() + 0x1FFF) / 0x2000); }
+    // Compression::Rle / Lz: packed by buildAssets() (load it with bblocks::loadNametableRle /
+    // decompressToVram), which logs the ratio, and for Rle the decode cycles.
+    void addNametable(std::string_view label, std::string_view filename, Compression compression = Compression::None);
+    // Already converted (e.g. an assets::Pipeline output): emitted as is.
+    void addNametable(std::string_view label, std::vector<uint8_t> bytes);
+    // The output of converter over the files, emitted as is under label by buildAssets(), e.g.
+    // assets::metatileTables() over .nam screens.
+    void addAsset(std::string_view label, assets::Converter converter, std::vector<std::string> files);
+    // Where buildAssets() caches its conversions across builds; in memory only when unset.
+    void setAssetCache(std::filesystem::path dir) { assetCache_ = std::move(dir); }
+    // Runs the packed nametables and addAsset conversions through an assets::Pipeline, on
+    // worker threads, converting only what changed. Called by Rom::emitAsm.
+    assets::PipelineStats buildAssets();
     std::unordered_map<std::string, std::string> nametables() const { return nametables_; }
+    const std::unordered_map<std::string, std::vector<uint8_t>> &packedNametables() const { return packedNametables_; }
   };
 
-  enum class Mapper { NROM, MMC1, UNROM, CNROM, MMC3 };
-  enum class Mirroring { Horizontal, Vertical, None };
-
   struct AsmEmitterOptions;
 
   // Rom is the final cartridge artifact. Pure packaging.
@@ -517,8 +960,22 @@ namespace cppnes {
     void setResources(Resources &rc);
     void setMapper(Mapper mapper);
     void setMirroring(Mirroring mirroring);
+    // ROM size in 16KB PRG / 8KB CHR banks; 0 (default) picks the mapper's usual size:
+    // NROM 2/1, CNROM 2/4, UNROM/MMC1/MMC3 8/1.
+    void setPrgBanks(uint8_t count);
+    void setChrBanks(uint8_t count);
+    // 8KB of CHR-RAM instead of CHR-ROM: no CHARS segment, the CHR data goes to PRG as
+    // chrTiles for bblocks::tileQueuePush.
+    void setChrRam(bool enable = true);
+    uint8_t prgBanks() const;
+    uint8_t chrBanks() const; // 0 with CHR-RAM; at least the banks of the loaded CHR data
+    // Switchable 16KB banks at $8000 (the last one is fixed at $C000); 0 on NROM/CNROM.
+    uint8_t switchableBanks() const;
+    uint8_t mapperNumber() const;
     void setEmitterOptions(const AsmEmitterOptions &options);
     uint8_t mirroringByte() const;
+    const Program *program() const;
+    Mapper mapper() const;
     void emitAsm(std::string_view dirPath);
     void build(std::string_view outputPath, std::string_view workingDir = "");
   };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "nesdefs.hpp"
+#include "analysis.hpp"
 #include <functional>
 
 namespace cppnes {
@@ -159,13 +160,45 @@ namespace cppnes {
   } // namespace clr
 
 
+  // Speed/size policy for the bulk bblocks (loadNametable, clearPage, clearOAMBuffer, ppuFill).
+  struct Unroll {
+    enum class Kind { Rolled, Partial, Full };
+    Kind kind = Kind::Rolled;
+    uint16_t factor = 1; // copies of the loop body per iteration (Partial only)
+    static Unroll rolled() { return {}; }
+    static Unroll by(uint16_t n) { return { Kind::Partial, n }; }
+    static Unroll full() { return { Kind::Full, 0 }; }
+  };
+
+  // Static cost of a generated block: cycles for one run and ROM bytes.
+  struct BlockCost {
+    uint32_t cycles = 0;
+    uint32_t bytes = 0;
+  };
+
   namespace bblocks {
     Subroutine &waitVBlank(Subroutine &sub);
     Subroutine &clearMemory(Subroutine &sub, AbsAddress start, uint8_t length);
     Subroutine &clearMemory(Subroutine &sub, AbsAddress start, uint16_t length, ZpAddress ptr, ZpAddress count);
-    Subroutine &clearPage(Subroutine &sub, AbsAddress start);
+    Subroutine &clearPage(Subroutine &sub, AbsAddress start, Unroll policy = {});
     Subroutine &loadPalette(Subroutine &sub, const Label &dataLabel);
-    Subroutine &loadNametable(Subroutine &sub, const Label &dataLabel, ZpAddress counter);
+    // In vblank or with rendering off: loads the 32 bytes of fade step `step` (0-7) of a
+    // page-aligned table such as Resources::paletteFadeLabel(). 513c. Leaves PPUADDR at $3F20.
+    // Clobbers A, X, Y.
+    Subroutine &loadPaletteStep(Subroutine &sub, const Label &table, AbsAddress step);
+    Subroutine &loadNametable(Subroutine &sub, const Label &dataLabel, ZpAddress counter, Unroll policy = {});
+    // Rendering off: unpacks compression::rleEncode data straight into PPUDATA from nametable
+    // on. ptr: 3 zero page bytes (pointer, tag). 22c per literal, 42 + 9n per run of n; the
+    // exact count is compression::rleDecodeCycles. Clobbers A, X, Y.
+    Subroutine &loadNametableRle(Subroutine &sub, const Label &dataLabel, ZpAddress ptr, uint16_t nametable = 0x2000);
+    // Unpack compression::lzEncode data. The copy loops are memcpy's (src),Y -> (dst),Y, with
+    // the count from the data. ptr: 6 zero page bytes (source, destination, match source).
+    // ~21c per output byte, ~1380 bytes per NTSC frame. Clobbers A, X, Y.
+    Subroutine &decompressToRam(Subroutine &sub, const Label &dataLabel, AbsAddress dst, ZpAddress ptr);
+    // Rendering off: same into PPUDATA from ppuAddr on. Matches are copied from ring, a
+    // page-aligned 256-byte RAM buffer holding the last output. ptr: 3 zero page bytes
+    // (source, count). ~27c per output byte, ~1090 bytes per NTSC frame. Clobbers A, X, Y.
+    Subroutine &decompressToVram(Subroutine &sub, const Label &dataLabel, uint16_t ppuAddr, AbsAddress ring, ZpAddress ptr);
     Subroutine &loopX(Subroutine &sub, uint8_t count, std::function<void(Subroutine &)> body);
     Subroutine &uploadSprites(Subroutine &sub, AbsAddress oamBuffer = AbsAddress{ 0x0200 });
     Subroutine &setPPUAddr(Subroutine &sub, uint16_t addr);
@@ -176,17 +209,129 @@ namespace cppnes {
     Subroutine &setAddrWord(Subroutine &sub, AbsAddress addr, uint16_t w);
     Subroutine &ppuWriteBytes(Subroutine &sub, const Label &src, uint8_t count);
     Subroutine &ppuWriteBytesZpPtr(Subroutine &sub, ZpAddress ptr, uint8_t count);
-    Subroutine &ppuFill(Subroutine &sub, uint8_t value, uint8_t count);
+    Subroutine &ppuFill(Subroutine &sub, uint8_t value, uint8_t count, Unroll policy = {});
     Subroutine &memcpy(Subroutine &sub, ZpAddress src, ZpAddress dst, uint16_t count, ZpAddress counter);
     Subroutine &memset16(Subroutine &sub, AbsAddress start, uint16_t value, uint16_t count, ZpAddress ptr, ZpAddress cnt, ZpAddress val);
     Subroutine &memset8(Subroutine &sub, AbsAddress start, uint8_t value, uint16_t count, ZpAddress ptr, ZpAddress cnt);
-    Subroutine &clearOAMBuffer(Subroutine &sub, AbsAddress buffer = AbsAddress{ 0x0200 });
+    Subroutine &clearOAMBuffer(Subroutine &sub, AbsAddress buffer = AbsAddress{ 0x0200 }, Unroll policy = {});
     Subroutine &enableRendering(Subroutine &sub, bool enable);
     Subroutine &setPPUMaskBits(Subroutine &sub, uint8_t bitsToSet, uint8_t bitsToClear);
     Subroutine &enableNMI(Subroutine &sub);
     Subroutine &initPadCallback(Subroutine &sub, ZpAddress buttons, std::function<void(Subroutine &, uint8_t)> callback);
 
-    //Subroutine &switchBank(Subroutine &sub, uint8_t bank); // for future implementation
+    // Table readers (see tables.hpp and Program::addSplitTable)
+    Subroutine &lookupWord(Subroutine &sub, const SplitTable &table, ZpAddress dst); // dst = table[X]
+    Subroutine &setPPUAddrRowCol(Subroutine &sub, const SplitTable &rowTable); // PPUADDR = rowTable[Y] + X
+    // result (16-bit) = a * b via quarter squares: qsq = addSplitTable(.., 512, tables::quarterSquare)
+    Subroutine &mul8x8(Subroutine &sub, const SplitTable &qsq, ZpAddress a, ZpAddress b, ZpAddress result);
+
+    // Constant multiply/divide, strength-reduced to the cheapest shift/add/subtract sequence
+    // found for k (by cycles). Results wrap to the operand width; division is unsigned.
+    // When tables is given, the 8-bit forms fall back to a 256-byte table (ldx/lda absx, clobbers X)
+    // if that is faster. 16-bit operands are little-endian and dst must not overlap src.
+    // Clobber A and flags. Verified exhaustively with Simulator (sim6502.hpp).
+    Subroutine &mulConst(Subroutine &sub, ZpAddress dst, ZpAddress src, uint8_t k, Program *tables = nullptr);
+    Subroutine &mulConst16(Subroutine &sub, ZpAddress dst, ZpAddress src, uint16_t k);
+    Subroutine &divConst(Subroutine &sub, ZpAddress dst, ZpAddress src, uint8_t k, Program *tables = nullptr);
+    Subroutine &divConst16(Subroutine &sub, ZpAddress dst, ZpAddress src, uint16_t k);
+
+    // Timed code. clobber is an analysis::RegBit mask of the registers/flags the code may
+    // change; loops need X or Y (or A, C and V) plus N and Z. Branch timings assume the
+    // loops do not cross a page.
+    // Burns exactly n cycles (n != 1) in the fewest bytes found: NOP/JMP/PHP-PLP fillers,
+    // zero-page reads and countdown loops, nested for large n.
+    Subroutine &delayCycles(Subroutine &sub, uint32_t n, uint8_t clobber = 0);
+    // if/else whose two paths take the same cycles: thenBody runs when `skipToElse` (a branch
+    // opcode such as Opcode::BNE) is not taken. Bodies must be straight-line code; the shorter
+    // path is padded with delayCycles.
+    Subroutine &balancedIf(Subroutine &sub, Opcode skipToElse, std::function<void(Subroutine &)> thenBody,
+      std::function<void(Subroutine &)> elseBody, uint8_t clobber = 0);
+
+    // Entity tables (Program::addEntityTable); X is the entity index throughout.
+    // Links every slot into the free list and empties the live list. Clobbers A, X.
+    Subroutine &entityInit(Subroutine &sub, const EntityTable &table);
+    // X = a free slot, now first in the live list; branches to onFull if none is left. Clobbers A.
+    Subroutine &entitySpawn(Subroutine &sub, const EntityTable &table, const Label &onFull);
+    // Runs body for each live entity with X = its index, 16 cycles of overhead per entity. The
+    // body must keep X (other than through entityDespawn) and must not spawn.
+    Subroutine &entityForEach(Subroutine &sub, const EntityTable &table, std::function<void(Subroutine &)> body);
+    // Inside an entityForEach body: frees entity X, after which X no longer refers to it. Clobbers A, Y.
+    Subroutine &entityDespawn(Subroutine &sub, const EntityTable &table);
+
+    // Save slots (Program::addSaveSlots); X is the slot index.
+    // Starts copying slots.buffer to slot X. Clobbers A.
+    Subroutine &saveBegin(Subroutine &sub, const SaveSlots &slots);
+    // Call once per frame: writes up to bytesPerCall bytes of a save in progress (~39 cycles
+    // each), then the checksum. Does nothing when idle. Clobbers A, X, Y.
+    Subroutine &saveStep(Subroutine &sub, const SaveSlots &slots, uint8_t bytesPerCall);
+    // Copies slot X into slots.buffer; branches to onBad if its checksum does not match (the
+    // buffer should then be reset to defaults). Clobbers A, Y.
+    Subroutine &saveLoad(Subroutine &sub, const SaveSlots &slots, const Label &onBad);
+
+    // Bank switching (Rom::setMapper). PRG banks are the 16KB $8000-$BFFF windows numbered as in
+    // Subroutine::setBank; $C000-$FFFF stays fixed. UNROM/CNROM need bankTable (Program::addBankTable),
+    // MMC3 needs bankSelect (Program::mmc3BankSelect()), which gets every value written to $8000.
+    // Clobbers A (and Y for UNROM); throws std::invalid_argument for mappers without PRG banking.
+    Subroutine &switchBank(Subroutine &sub, Mapper mapper, uint8_t bank, const Label &bankTable = Label{ "" },
+      AbsAddress bankSelect = AbsAddress{ 0 });
+    // Same, with the bank number in A. Clobbers A, X, Y.
+    Subroutine &switchBankA(Subroutine &sub, Mapper mapper, const Label &bankTable = Label{ "" },
+      AbsAddress bankSelect = AbsAddress{ 0 });
+    // Maps 8KB CHR bank at PPU $0000-$1FFF (CNROM, MMC1, MMC3). Clobbers A, Y.
+    Subroutine &switchChrBank(Subroutine &sub, Mapper mapper, uint8_t bank, const Label &bankTable = Label{ "" },
+      AbsAddress bankSelect = AbsAddress{ 0 });
+    // Reset-time register setup: MMC1 16KB PRG mode with $C000 fixed, 8KB CHR; MMC3 with IRQs off,
+    // PRG RAM on and PRG bank 0 mapped (bankSelect as for switchBank). Mirroring is hardwired on
+    // the other mappers (no code).
+    Subroutine &mapperInit(Subroutine &sub, Mapper mapper, Mirroring mirroring, AbsAddress bankSelect = AbsAddress{ 0 });
+
+    // MMC3 scanline counter. It counts PPU A12 rises, so backgrounds must use pattern table
+    // $0000 and sprites $1000. Arm: IRQ at the end of the scanline `scanlines` after the next
+    // counted one (from vblank: of scanline scanlines-1). Clobbers A.
+    Subroutine &mmc3IrqArm(Subroutine &sub, uint8_t scanlines);
+    // Acknowledges a pending IRQ and disables further ones.
+    Subroutine &mmc3IrqDisable(Subroutine &sub);
+    // Once per frame in vblank (NMI): restarts the chain at its first split. Clobbers A.
+    // IRQs must be enabled (cli) once after mapperInit.
+    Subroutine &irqSplitsFrame(Subroutine &sub, const IrqChain &chain);
+
+    // Rendering off: expands the 240-byte metatile map at screen into the nametable at
+    // nametable ($2000/$2400/$2800/$2C00), then copies the screen's <screen>_attr table. A
+    // shadow (64 bytes of RAM, e.g. declareVar) also gets the attribute table. Unroll applies to the 16
+    // metatiles of a row. Rolled / by(4) / full: 16512c / 13992c / 13182c, +320c with a shadow.
+    // Clobbers A, X, Y.
+    Subroutine &loadMetatileScreen(Subroutine &sub, const MetatileTables &tables, const Label &screen,
+      uint16_t nametable = 0x2000, Unroll policy = {}, AbsAddress shadow = AbsAddress{ 0 });
+    // In vblank or with rendering off: merges the attributes of metatile column `column` (0-15)
+    // from a <screen>_attrStrips table into shadow (the 64-byte attribute table in RAM) and
+    // writes the 8 changed bytes to the nametable. 287c (odd column) / 289c (even). Clobbers A, X, Y.
+    Subroutine &loadAttributeColumn(Subroutine &sub, const Label &strips, AbsAddress shadow, AbsAddress column,
+      uint16_t nametable = 0x2000);
+
+    // Once per frame (NMI): advances the animation, 8 cycles, 36-39 on a bank change (MMC3:
+    // 46-50, $8000 is restored from anim.bankSelect afterwards). Clobbers A, X, Y.
+    Subroutine &chrAnimationStep(Subroutine &sub, const ChrAnimation &anim);
+
+    // Queues the upload of tile srcTile of tiles (16 bytes each, in PRG; chrTiles is the CHR
+    // data of a CHR-RAM Rom) to pattern table tile dstTile (0-511). Branches to onFull
+    // without queueing if there is no room. Clobbers A, X.
+    Subroutine &tileQueuePush(Subroutine &sub, const TileQueue &queue, const Label &tiles, uint16_t srcTile,
+      uint16_t dstTile, const Label &onFull);
+    // In vblank: uploads up to tilesPerFrame queued tiles. Per tile, rolled / by(4) / full:
+    // 312c / 252c / 234c, plus 14c (54b / 72b / 145b of code); ~7 tiles fit in an NTSC vblank.
+    // Leaves PPUADDR changed (reset the scroll). Clobbers A, X, Y.
+    Subroutine &tileQueueFlush(Subroutine &sub, const TileQueue &queue, Unroll policy = {});
+
+    // Cost of each variant, matching the code the bblocks above emit.
+    //                     rolled          by(8)           full
+    //   loadNametable     14401c / 38b    11713c / 80b    8208c / 6157b
+    //   clearPage/OAM      2563c / 10b     1443c / 31b    1026c /  770b
+    //   ppuFill(n=32)       355c / 12b      151c / 31b     130c /   98b
+    // loadNametable assumes page-aligned data; otherwise (ptr),Y adds a cycle per page crossing.
+    BlockCost loadNametableCost(Unroll policy = {});
+    BlockCost clearPageCost(Unroll policy = {});
+    inline BlockCost clearOAMBufferCost(Unroll policy = {}) { return clearPageCost(policy); }
+    BlockCost ppuFillCost(uint8_t count, Unroll policy = {});
   } // namespace blocks
 
 
@@ -199,9 +344,15 @@ namespace cppnes {
     Subroutine &waitVBlank() { return bblocks::waitVBlank(sub_); }
     Subroutine &clearMemory(AbsAddress start, uint8_t length) { return bblocks::clearMemory(sub_, start, length); }
     Subroutine &clearMemory(AbsAddress start, uint16_t length, ZpAddress ptr, ZpAddress count) { return bblocks::clearMemory(sub_, start, length, ptr, count); }
-    Subroutine &clearPage(AbsAddress start) { return bblocks::clearPage(sub_, start); }
+    Subroutine &clearPage(AbsAddress start, Unroll policy = {}) { return bblocks::clearPage(sub_, start, policy); }
     Subroutine &loadPalette(const Label &dataLabel) { return bblocks::loadPalette(sub_, dataLabel); }
-    Subroutine &loadNametable(const Label &namLabel, ZpAddress counter) { return bblocks::loadNametable(sub_, namLabel, counter); }
+    Subroutine &loadPaletteStep(const Label &table, AbsAddress step) { return bblocks::loadPaletteStep(sub_, table, step); }
+    Subroutine &loadNametable(const Label &namLabel, ZpAddress counter, Unroll policy = {}) { return bblocks::loadNametable(sub_, namLabel, counter, policy); }
+    Subroutine &loadNametableRle(const Label &namLabel, ZpAddress ptr, uint16_t nametable = 0x2000) { return bblocks::loadNametableRle(sub_, namLabel, ptr, nametable); }
+    Subroutine &decompressToRam(const Label &dataLabel, AbsAddress dst, ZpAddress ptr) { return bblocks::decompressToRam(sub_, dataLabel, dst, ptr); }
+    Subroutine &decompressToVram(const Label &dataLabel, uint16_t ppuAddr, AbsAddress ring, ZpAddress ptr) {
+      return bblocks::decompressToVram(sub_, dataLabel, ppuAddr, ring, ptr);
+    }
     Subroutine &loopX(uint8_t count, std::function<void(Subroutine &)> body) { return bblocks::loopX(sub_, count, std::move(body)); }
     Subroutine &uploadSprites(AbsAddress oamBuffer = AbsAddress{ 0x0200 }) { return bblocks::uploadSprites(sub_, oamBuffer); }
     Subroutine &setPPUAddr(uint16_t addr) { return bblocks::setPPUAddr(sub_, addr); }
@@ -214,19 +365,66 @@ namespace cppnes {
     Subroutine &setAddrWord(AbsAddress addr, uint16_t w) { return bblocks::setAddrWord(sub_, addr, w); }
     Subroutine &ppuWriteBytes(const Label &src, uint8_t count) { return bblocks::ppuWriteBytes(sub_, src, count); }
     Subroutine &ppuWriteBytesZpPtr(ZpAddress ptr, uint8_t count) { return bblocks::ppuWriteBytesZpPtr(sub_, ptr, count); }
-    Subroutine &ppuFill(uint8_t value, uint8_t count) { return bblocks::ppuFill(sub_, value, count); }
+    Subroutine &ppuFill(uint8_t value, uint8_t count, Unroll policy = {}) { return bblocks::ppuFill(sub_, value, count, policy); }
     Subroutine &memcpy(ZpAddress src, ZpAddress dst, uint16_t count, ZpAddress counter) { return bblocks::memcpy(sub_, src, dst, count, counter); }
     Subroutine &memset16(AbsAddress start, uint16_t value, uint16_t count, ZpAddress ptr, ZpAddress cnt, ZpAddress val) {
       return bblocks::memset16(sub_, start, value, count, ptr, cnt, val);
     }
     Subroutine &memset8(AbsAddress start, uint8_t value, uint16_t count, ZpAddress ptr, ZpAddress cnt) { return bblocks::memset8(sub_, start, value, count, ptr, cnt); }
-    Subroutine &clearOAMBuffer(AbsAddress buffer = AbsAddress{ 0x0200 }) { return bblocks::clearOAMBuffer(sub_, buffer); }
+    Subroutine &clearOAMBuffer(AbsAddress buffer = AbsAddress{ 0x0200 }, Unroll policy = {}) { return bblocks::clearOAMBuffer(sub_, buffer, policy); }
     Subroutine &enableRendering(bool enable) { return bblocks::enableRendering(sub_, enable); }
     Subroutine &setPPUMaskBits(uint8_t bitsToSet, uint8_t bitsToClear) { return bblocks::setPPUMaskBits(sub_, bitsToSet, bitsToClear); }
     Subroutine &enableNMI() { return bblocks::enableNMI(sub_); }
     Subroutine &initPadCallback(ZpAddress buttons, std::function<void(Subroutine &, uint8_t)> callback) {
       return bblocks::initPadCallback(sub_, buttons, std::move(callback));
     }
+    Subroutine &lookupWord(const SplitTable &table, ZpAddress dst) { return bblocks::lookupWord(sub_, table, dst); }
+    Subroutine &setPPUAddrRowCol(const SplitTable &rowTable) { return bblocks::setPPUAddrRowCol(sub_, rowTable); }
+    Subroutine &mul8x8(const SplitTable &qsq, ZpAddress a, ZpAddress b, ZpAddress result) { return bblocks::mul8x8(sub_, qsq, a, b, result); }
+    Subroutine &mulConst(ZpAddress dst, ZpAddress src, uint8_t k, Program *tables = nullptr) { return bblocks::mulConst(sub_, dst, src, k, tables); }
+    Subroutine &mulConst16(ZpAddress dst, ZpAddress src, uint16_t k) { return bblocks::mulConst16(sub_, dst, src, k); }
+    Subroutine &divConst(ZpAddress dst, ZpAddress src, uint8_t k, Program *tables = nullptr) { return bblocks::divConst(sub_, dst, src, k, tables); }
+    Subroutine &divConst16(ZpAddress dst, ZpAddress src, uint16_t k) { return bblocks::divConst16(sub_, dst, src, k); }
+    Subroutine &delayCycles(uint32_t n, uint8_t clobber = 0) { return bblocks::delayCycles(sub_, n, clobber); }
+    Subroutine &balancedIf(Opcode skipToElse, std::function<void(Subroutine &)> thenBody, std::function<void(Subroutine &)> elseBody, uint8_t clobber = 0) {
+      return bblocks::balancedIf(sub_, skipToElse, std::move(thenBody), std::move(elseBody), clobber);
+    }
+    Subroutine &entityInit(const EntityTable &table) { return bblocks::entityInit(sub_, table); }
+    Subroutine &entitySpawn(const EntityTable &table, const Label &onFull) { return bblocks::entitySpawn(sub_, table, onFull); }
+    Subroutine &entityForEach(const EntityTable &table, std::function<void(Subroutine &)> body) {
+      return bblocks::entityForEach(sub_, table, std::move(body));
+    }
+    Subroutine &entityDespawn(const EntityTable &table) { return bblocks::entityDespawn(sub_, table); }
+    Subroutine &saveBegin(const SaveSlots &slots) { return bblocks::saveBegin(sub_, slots); }
+    Subroutine &saveStep(const SaveSlots &slots, uint8_t bytesPerCall) { return bblocks::saveStep(sub_, slots, bytesPerCall); }
+    Subroutine &saveLoad(const SaveSlots &slots, const Label &onBad) { return bblocks::saveLoad(sub_, slots, onBad); }
+    Subroutine &switchBank(Mapper mapper, uint8_t bank, const Label &bankTable = Label{ "" }, AbsAddress bankSelect = AbsAddress{ 0 }) {
+      return bblocks::switchBank(sub_, mapper, bank, bankTable, bankSelect);
+    }
+    Subroutine &switchBankA(Mapper mapper, const Label &bankTable = Label{ "" }, AbsAddress bankSelect = AbsAddress{ 0 }) {
+      return bblocks::switchBankA(sub_, mapper, bankTable, bankSelect);
+    }
+    Subroutine &switchChrBank(Mapper mapper, uint8_t bank, const Label &bankTable = Label{ "" }, AbsAddress bankSelect = AbsAddress{ 0 }) {
+      return bblocks::switchChrBank(sub_, mapper, bank, bankTable, bankSelect);
+    }
+    Subroutine &mapperInit(Mapper mapper, Mirroring mirroring, AbsAddress bankSelect = AbsAddress{ 0 }) {
+      return bblocks::mapperInit(sub_, mapper, mirroring, bankSelect);
+    }
+    Subroutine &mmc3IrqArm(uint8_t scanlines) { return bblocks::mmc3IrqArm(sub_, scanlines); }
+    Subroutine &mmc3IrqDisable() { return bblocks::mmc3IrqDisable(sub_); }
+    Subroutine &irqSplitsFrame(const IrqChain &chain) { return bblocks::irqSplitsFrame(sub_, chain); }
+    Subroutine &loadMetatileScreen(const MetatileTables &tables, const Label &screen, uint16_t nametable = 0x2000, Unroll policy = {},
+      AbsAddress shadow = AbsAddress{ 0 }) {
+      return bblocks::loadMetatileScreen(sub_, tables, screen, nametable, policy, shadow);
+    }
+    Subroutine &loadAttributeColumn(const Label &strips, AbsAddress shadow, AbsAddress column, uint16_t nametable = 0x2000) {
+      return bblocks::loadAttributeColumn(sub_, strips, shadow, column, nametable);
+    }
+    Subroutine &chrAnimationStep(const ChrAnimation &anim) { return bblocks::chrAnimationStep(sub_, anim); }
+    Subroutine &tileQueuePush(const TileQueue &queue, const Label &tiles, uint16_t srcTile, uint16_t dstTile, const Label &onFull) {
+      return bblocks::tileQueuePush(sub_, queue, tiles, srcTile, dstTile, onFull);
+    }
+    Subroutine &tileQueueFlush(const TileQueue &queue, Unroll policy = {}) { return bblocks::tileQueueFlush(sub_, queue, policy); }
   };
 
 } // namespace cppnes
\ No newline at end of file
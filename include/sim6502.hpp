@@ -0,0 +1,71 @@
+#pragma once
+
+#include "nesdefs.hpp"
+#include <array>
+#include <functional>
+#include <optional>
+
+namespace cppnes {
+
+  // Interprets Subroutine entries directly, without assembling: used to verify generated code
+  // and to count its cycles. Labels of DataBlocks are placed in memory from $C000 (see
+  // placeData), other addresses can be bound with setLabel. Taken branches are not charged the
+  // page-crossing cycle since code has no address here; indexed reads are.
+  class Simulator {
+  public:
+    struct Registers {
+      uint8_t a = 0, x = 0, y = 0;
+      uint8_t sp = 0xFD;
+      uint8_t p = 0x24; // NV-BDIZC
+    };
+    enum Flag : uint8_t { C = 0x01, Z = 0x02, I = 0x04, D = 0x08, B = 0x10, V = 0x40, N = 0x80 };
+
+    explicit Simulator(const Program *prg = nullptr);
+
+    Registers regs;
+    std::array<uint8_t, 0x10000> memory{};
+    // Called on every write; PPU/APU registers can be observed here.
+    std::function<void(uint16_t, uint8_t)> onWrite;
+    // Called on every read; returning a value overrides memory (default: PPUSTATUS reads $80).
+    std::function<std::optional<uint8_t>(uint16_t)> onRead;
+
+    void setLabel(std::string_view name, uint16_t address);
+    [[nodiscard]] uint16_t labelAddress(std::string_view nameOrExpr) const; // "Name" or "Name+12"
+    // Copies the program's data blocks to memory starting at base, honouring DataBlock::align.
+    void placeData(uint16_t base = 0xC000);
+
+    // Runs sub until its final RTS/RTI (or the end of its entries). JSR/JMP to other subroutines
+    // of the program are followed. Returns the cycles taken; throws past maxCycles.
+    uint64_t run(const Subroutine &sub, uint64_t maxCycles = 10'000'000);
+    // Same, for a code fragment (local labels only).
+    uint64_t run(const std::vector<Entry> &code, uint64_t maxCycles = 10'000'000);
+    uint64_t run(const std::vector<Instruction> &code, uint64_t maxCycles = 10'000'000);
+
+    [[nodiscard]] bool flag(Flag f) const { return (regs.p & f) != 0; }
+    [[nodiscard]] uint8_t read(uint16_t addr);
+    void write(uint16_t addr, uint8_t value);
+
+  private:
+    struct Frame {
+      const std::vector<Entry> *entries;
+      const Subroutine *sub;
+      size_t pc;
+    };
+    bool step(std::vector<Frame> &frames, uint64_t &cycles);
+    size_t findLabel(const Frame &f, const std::string &name) const;
+    const Subroutine *findSubroutine(const std::string &name) const;
+    void setNZ(uint8_t v);
+    void push(uint8_t v);
+    uint8_t pull();
+
+    const Program *prg_;
+    std::unordered_map<std::string, uint16_t> labels_;
+  };
+
+  // Runs sub for every srcBits-wide input stored little-endian at src and compares the
+  // dstBits-wide value at dst with expected(input). Returns the first mismatching input.
+  std::optional<uint32_t> verifyExhaustive(const Program *prg, const Subroutine &sub,
+    ZpAddress src, unsigned srcBits, ZpAddress dst, unsigned dstBits,
+    const std::function<uint32_t(uint32_t)> &expected);
+
+} // namespace cppnes
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "nesdefs.hpp"
+#include "analysis.hpp"
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace cppnes {
+
+  // Offline superoptimizer for short straight-line fragments, and the peephole pass that
+  // applies its results. Equivalence is established by running both sequences in the
+  // Simulator on edge-case and random states, comparing memory and the live registers.
+  namespace superopt {
+
+    struct SearchOptions {
+      size_t maxLength = 3;      // longest candidate; each extra instruction multiplies the search ~100x
+      size_t randomStates = 64;  // in addition to the edge-case states
+      uint32_t seed = 6502;
+      uint8_t liveOut = analysis::RegsAll; // analysis::RegBit mask that must match afterwards
+    };
+
+    // pattern may be replaced by replacement wherever the `dead` registers/flags are not read
+    // afterwards. Addresses in the pattern are placeholders: a match binds each to a distinct
+    // address of the same addressing mode; immediates must match exactly.
+    struct RewriteRule {
+      std::vector<Instruction> pattern;
+      std::vector<Instruction> replacement;
+      uint8_t dead = 0; // analysis::RegBit mask
+      uint32_t cyclesBefore = 0, cyclesAfter = 0;
+      uint32_t bytesBefore = 0, bytesAfter = 0;
+    };
+
+    // Finds the cheapest (cycles, then bytes) sequence equivalent to fragment, if cheaper.
+    // Supported: implied, accumulator, immediate, zero page and absolute (RAM) operands; throws
+    // std::invalid_argument for anything else (labels, branches, indexing, stack, I/O registers).
+    [[nodiscard]] std::optional<RewriteRule> superoptimize(const std::vector<Instruction> &fragment, const SearchOptions &options = {});
+    [[nodiscard]] std::optional<RewriteRule> superoptimize(const Subroutine &fragment, const SearchOptions &options = {});
+
+    // Rule cache, as JSON with instructions in assembler syntax ("LDA $10", "ADC #$01").
+    void saveRules(const std::vector<RewriteRule> &rules, const std::filesystem::path &path);
+    [[nodiscard]] std::vector<RewriteRule> loadRules(const std::filesystem::path &path);
+
+    // The peephole stage applying the rules is Program::peephole.
+
+  } // namespace superopt
+
+} // namespace cppnes
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace cppnes {
+
+  // Generators for build-time lookup tables. Feed them to DataBlock::generate() or
+  // Program::addSplitTable(); make<N>() evaluates a constexpr generator into an array.
+  namespace tables {
+
+    template<size_t N, typename T = uint8_t, typename Gen>
+    constexpr std::array<T, N> make(Gen gen) {
+      std::array<T, N> out{};
+      for (size_t i = 0; i < N; ++i)
+        out[i] = static_cast<T>(gen(i));
+      return out;
+    }
+
+    // Signed 8-bit sine, i in [0, period): round(127 * sin(2*pi*i/period)) as two's complement.
+    inline uint8_t sine(size_t i, size_t period = 256) {
+      double v = std::round(127.0 * std::sin(2.0 * 3.14159265358979323846 * static_cast<double>(i) / static_cast<double>(period)));
+      return static_cast<uint8_t>(static_cast<int8_t>(v));
+    }
+    inline uint8_t cosine(size_t i, size_t period = 256) { return sine(i + period / 4, period); }
+
+    // floor(i*i/4) for i in [0, 511]: a*b = qsquare(a+b) - qsquare(|a-b|) (see bblocks::mul8x8).
+    constexpr uint16_t quarterSquare(size_t i) { return static_cast<uint16_t>(i * i / 4); }
+
+    // 65536/i rounded down, saturated to $FFFF: x/i ~= (x * reciprocal(i)) >> 16.
+    constexpr uint16_t reciprocal(size_t i) { return i <= 1 ? 0xFFFF : static_cast<uint16_t>(65536 / i); }
+
+    constexpr uint8_t bitReverse(size_t i) {
+      uint8_t r = 0;
+      for (int b = 0; b < 8; ++b)
+        if (i & (1u << b)) r |= static_cast<uint8_t>(0x80u >> b);
+      return r;
+    }
+
+    // NES color moved steps luminance rows (negative: darker), down to black $0F and up to
+    // white $30. The blacks ($0D, $1D and columns $E/$F, as in image::nesColor) sit one row
+    // below $00; the grays $2D/$3D fade through $1D.
+    constexpr uint8_t fadeColor(uint8_t color, int steps) {
+      if (steps == 0)
+        return color;
+      const bool black = (color & 0x0E) == 0x0E || color == 0x0D || color == 0x1D;
+      const int row = (black ? -1 : color >> 4) + steps;
+      if (row < 0 || (row == 0 && (color & 0x0F) == 0x0D && !black))
+        return 0x0F;
+      if (3 < row)
+        return 0x30;
+      return static_cast<uint8_t>(row << 4 | (black ? 0 : color & 0x0F));
+    }
+
+    // Nametable address of the first tile in a row (row * 32), for rows 0..29.
+    constexpr uint16_t ppuRowAddress(size_t row, uint16_t nametable = 0x2000) {
+      return static_cast<uint16_t>(nametable + row * 32);
+    }
+
+  } // namespace tables
+
+} // namespace cppnes
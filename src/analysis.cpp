@@ -0,0 +1,361 @@
+#include "analysis.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+
+  bool isBranchOrJump(cppnes::Opcode op)
+  {
+    return op == cppnes::Opcode::JMP || cppnes::analysis::isBranch(op);
+  }
+
+  // Read-modify-write instructions take 2 extra cycles over a plain read.
+  bool isReadModifyWrite(cppnes::Opcode op)
+  {
+    using cppnes::Opcode;
+    switch (op) {
+    case Opcode::ASL: case Opcode::LSR: case Opcode::ROL: case Opcode::ROR:
+    case Opcode::INC: case Opcode::DEC:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  bool isStore(cppnes::Opcode op)
+  {
+    using cppnes::Opcode;
+    return op == Opcode::STA || op == Opcode::STX || op == Opcode::STY;
+  }
+
+} // anonymous namespace
+
+bool cppnes::analysis::isBranch(Opcode op)
+{
+  switch (op) {
+  case Opcode::BCC: case Opcode::BCS: case Opcode::BEQ: case Opcode::BMI:
+  case Opcode::BNE: case Opcode::BPL: case Opcode::BVC: case Opcode::BVS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+uint8_t cppnes::analysis::instructionBytes(const Instruction &inst)
+{
+  return std::visit([&](const auto &op) -> uint8_t {
+    using T = std::decay_t<decltype(op)>;
+    if constexpr (std::is_same_v<T, std::monostate> || std::is_same_v<T, Accumulator>)
+      return 1;
+    else if constexpr (std::is_same_v<T, Absolute> || std::is_same_v<T, AbsoluteX> ||
+      std::is_same_v<T, AbsoluteY> || std::is_same_v<T, Indirect>)
+      return 3;
+    else if constexpr (std::is_same_v<T, Label>)
+      return isBranch(inst.opcode) ? 2 : 3;
+    else
+      return 2;
+    }, inst.operand);
+}
+
+uint8_t cppnes::analysis::instructionCycles(const Instruction &inst, bool branchTaken)
+{
+  const Opcode op = inst.opcode;
+  const bool rmw = isReadModifyWrite(op);
+  return std::visit([&](const auto &operand) -> uint8_t {
+    using T = std::decay_t<decltype(operand)>;
+    if constexpr (std::is_same_v<T, std::monostate>) {
+      switch (op) {
+      case Opcode::PHA: case Opcode::PHP: return 3;
+      case Opcode::PLA: case Opcode::PLP: return 4;
+      case Opcode::RTS: case Opcode::RTI: return 6;
+      case Opcode::BRK: return 7;
+      default: return 2;
+      }
+    } else if constexpr (std::is_same_v<T, Accumulator> || std::is_same_v<T, Immediate> || std::is_same_v<T, ImmediateLabel>) {
+      return 2;
+    } else if constexpr (std::is_same_v<T, ZeroPage>) {
+      return rmw ? 5 : 3;
+    } else if constexpr (std::is_same_v<T, ZeroPageX> || std::is_same_v<T, ZeroPageY>) {
+      return rmw ? 6 : 4;
+    } else if constexpr (std::is_same_v<T, Absolute>) {
+      if (op == Opcode::JMP) return 3;
+      if (op == Opcode::JSR) return 6;
+      return rmw ? 6 : 4;
+    } else if constexpr (std::is_same_v<T, AbsoluteX> || std::is_same_v<T, AbsoluteY>) {
+      if (rmw) return 7;
+      return isStore(op) ? 5 : 4;
+    } else if constexpr (std::is_same_v<T, IndexedIndirectX>) {
+      return 6;
+    } else if constexpr (std::is_same_v<T, IndexedIndirectY>) {
+      return isStore(op) ? 6 : 5;
+    } else if constexpr (std::is_same_v<T, Indirect>) {
+      return 5;
+    } else { // Label
+      if (op == Opcode::JSR) return 6;
+      if (op == Opcode::JMP) return 3;
+      if (isBranch(op)) return branchTaken ? 3 : 2;
+      return rmw ? 6 : 4; // absolute address of a label
+    }
+    }, inst.operand);
+}
+
+uint32_t cppnes::analysis::subroutineBytes(const Subroutine &sub)
+{
+  uint32_t total = 0;
+  for (const auto &entry : sub.instructions()) {
+    if (auto inst = std::get_if<Instruction>(&entry))
+      total += instructionBytes(*inst);
+  }
+  return total;
+}
+
+std::vector<std::string> cppnes::analysis::callees(const Subroutine &sub)
+{
+  std::vector<std::string> names;
+  for (const auto &entry : sub.instructions()) {
+    auto inst = std::get_if<Instruction>(&entry);
+    if (!inst || inst->opcode != Opcode::JSR)
+      continue;
+    if (auto target = std::get_if<Label>(&inst->operand))
+      names.push_back(target->name());
+  }
+  return names;
+}
+
+std::vector<cppnes::analysis::DataPlacement> cppnes::analysis::layoutConstrainedData(const Program &prg)
+{
+  std::vector<const DataBlock *> blocks;
+  for (const auto &[name, db] : prg.dataBlocks()) {
+    if (db->isConstrained())
+      blocks.push_back(db.get());
+  }
+  // Most constrained and largest first, label as tie-break for a stable output.
+  std::sort(blocks.begin(), blocks.end(), [](const DataBlock *a, const DataBlock *b) {
+    if (a->alignment() != b->alignment()) return a->alignment() > b->alignment();
+    if (a->size() != b->size()) return a->size() > b->size();
+    return a->label() < b->label();
+    });
+
+  std::vector<DataPlacement> placed;
+  for (const DataBlock *b : blocks) {
+    const uint32_t size = static_cast<uint32_t>(b->size());
+    if (b->isNoPageCross() && 256 < size)
+      throw std::runtime_error("Data block larger than a page cannot avoid crossing: " + std::string(b->label()));
+    uint32_t off = 0;
+    for (;;) {
+      off = (off + b->alignment() - 1) / b->alignment() * b->alignment();
+      if (b->isNoPageCross() && 256 < (off & 0xFF) + size) {
+        off = (off + 0xFF) & ~0xFFu;
+        continue;
+      }
+      auto clash = std::find_if(placed.begin(), placed.end(), [&](const DataPlacement &p) {
+        uint32_t end = p.offset + static_cast<uint32_t>(p.block->size());
+        return off < end && p.offset < off + (std::max)(size, 1u);
+        });
+      if (clash == placed.end())
+        break;
+      off = clash->offset + static_cast<uint32_t>(clash->block->size());
+    }
+    placed.push_back({ b, off });
+  }
+  std::sort(placed.begin(), placed.end(), [](const DataPlacement &a, const DataPlacement &b) { return a.offset < b.offset; });
+  return placed;
+}
+
+std::vector<std::string> cppnes::analysis::pageCrossWarnings(const Program &prg)
+{
+  std::vector<std::string> warnings;
+  for (const auto &sub : prg.subroutines()) {
+    auto weights = entryWeights(*sub);
+    const auto &entries = sub->instructions();
+    for (size_t i = 0; i < entries.size(); ++i) {
+      auto inst = std::get_if<Instruction>(&entries[i]);
+      if (!inst || weights[i] <= 1)
+        continue;
+      const Label *base = nullptr;
+      if (auto ax = std::get_if<AbsoluteX>(&inst->operand))
+        base = std::get_if<Label>(&ax->base);
+      else if (auto ay = std::get_if<AbsoluteY>(&inst->operand))
+        base = std::get_if<Label>(&ay->base);
+      if (!base)
+        continue;
+      std::string name = base->name().substr(0, base->name().find('+'));
+      auto it = prg.dataBlocks().find(name);
+      if (it == prg.dataBlocks().end() || it->second->isNoPageCross() || it->second->alignment() == 256 || it->second->size() <= 1)
+        continue;
+      warnings.push_back("Indexed read of '" + name + "' in loop of " + sub->name() +
+        " may cross a page (+1 cycle); consider DataBlock::noPageCross()");
+    }
+  }
+  return warnings;
+}
+
+std::vector<uint64_t> cppnes::analysis::entryWeights(const Subroutine &sub, uint64_t loopFactor)
+{
+  const auto &entries = sub.instructions();
+  std::vector<uint64_t> weights(entries.size(), 1);
+  std::unordered_map<std::string, size_t> labelPos;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (auto ldef = std::get_if<LabelDef>(&entries[i]))
+      labelPos[ldef->label.name()] = i;
+  }
+  for (size_t j = 0; j < entries.size(); ++j) {
+    auto inst = std::get_if<Instruction>(&entries[j]);
+    if (!inst || !isBranchOrJump(inst->opcode))
+      continue;
+    auto target = std::get_if<Label>(&inst->operand);
+    if (!target)
+      continue;
+    auto it = labelPos.find(target->name());
+    if (it == labelPos.end() || j < it->second)
+      continue; // forward or external target, not a loop
+    for (size_t k = it->second; k <= j; ++k)
+      weights[k] *= loopFactor;
+  }
+  return weights;
+}
+
+cppnes::analysis::RegisterUse cppnes::analysis::registerUse(const Instruction &inst)
+{
+  RegisterUse use;
+  const bool acc = std::holds_alternative<Accumulator>(inst.operand);
+  switch (inst.opcode) {
+  case Opcode::LDA: use.writes = RegA | FlagN | FlagZ; break;
+  case Opcode::LDX: use.writes = RegX | FlagN | FlagZ; break;
+  case Opcode::LDY: use.writes = RegY | FlagN | FlagZ; break;
+  case Opcode::STA: use.reads = RegA; break;
+  case Opcode::STX: use.reads = RegX; break;
+  case Opcode::STY: use.reads = RegY; break;
+  case Opcode::ADC: case Opcode::SBC:
+    use.reads = RegA | FlagC;
+    use.writes = RegA | FlagN | FlagZ | FlagC | FlagV;
+    break;
+  case Opcode::AND: case Opcode::ORA: case Opcode::EOR:
+    use.reads = RegA;
+    use.writes = RegA | FlagN | FlagZ;
+    break;
+  case Opcode::CMP: use.reads = RegA; use.writes = FlagN | FlagZ | FlagC; break;
+  case Opcode::CPX: use.reads = RegX; use.writes = FlagN | FlagZ | FlagC; break;
+  case Opcode::CPY: use.reads = RegY; use.writes = FlagN | FlagZ | FlagC; break;
+  case Opcode::BIT: use.reads = RegA; use.writes = FlagN | FlagZ | FlagV; break;
+  case Opcode::ASL: case Opcode::LSR:
+    use.reads = acc ? RegA : 0;
+    use.writes = (acc ? RegA : 0) | FlagN | FlagZ | FlagC;
+    break;
+  case Opcode::ROL: case Opcode::ROR:
+    use.reads = (acc ? RegA : 0) | FlagC;
+    use.writes = (acc ? RegA : 0) | FlagN | FlagZ | FlagC;
+    break;
+  case Opcode::INC: case Opcode::DEC: use.writes = FlagN | FlagZ; break;
+  case Opcode::INX: case Opcode::DEX: use.reads = RegX; use.writes = RegX | FlagN | FlagZ; break;
+  case Opcode::INY: case Opcode::DEY: use.reads = RegY; use.writes = RegY | FlagN | FlagZ; break;
+  case Opcode::TAX: use.reads = RegA; use.writes = RegX | FlagN | FlagZ; break;
+  case Opcode::TAY: use.reads = RegA; use.writes = RegY | FlagN | FlagZ; break;
+  case Opcode::TXA: use.reads = RegX; use.writes = RegA | FlagN | FlagZ; break;
+  case Opcode::TYA: use.reads = RegY; use.writes = RegA | FlagN | FlagZ; break;
+  case Opcode::TSX: use.writes = RegX | FlagN | FlagZ; break;
+  case Opcode::TXS: use.reads = RegX; break;
+  case Opcode::PHA: use.reads = RegA; break;
+  case Opcode::PLA: use.writes = RegA | FlagN | FlagZ; break;
+  case Opcode::PHP: use.reads = FlagN | FlagZ | FlagC | FlagV; break;
+  case Opcode::PLP: use.writes = FlagN | FlagZ | FlagC | FlagV; break;
+  case Opcode::CLC: case Opcode::SEC: use.writes = FlagC; break;
+  case Opcode::CLV: use.writes = FlagV; break;
+  case Opcode::BCC: case Opcode::BCS: use.reads = FlagC; break;
+  case Opcode::BEQ: case Opcode::BNE: use.reads = FlagZ; break;
+  case Opcode::BMI: case Opcode::BPL: use.reads = FlagN; break;
+  case Opcode::BVC: case Opcode::BVS: use.reads = FlagV; break;
+  case Opcode::JMP: case Opcode::JSR: case Opcode::RTS: case Opcode::RTI: case Opcode::BRK:
+    use.reads = RegsAll;
+    break;
+  case Opcode::CLI: case Opcode::SEI: case Opcode::CLD: case Opcode::SED: case Opcode::NOP:
+    break;
+  }
+  std::visit([&](const auto &op) {
+    using T = std::decay_t<decltype(op)>;
+    if constexpr (std::is_same_v<T, ZeroPageX> || std::is_same_v<T, AbsoluteX> || std::is_same_v<T, IndexedIndirectX>)
+      use.reads |= RegX;
+    else if constexpr (std::is_same_v<T, ZeroPageY> || std::is_same_v<T, AbsoluteY> || std::is_same_v<T, IndexedIndirectY>)
+      use.reads |= RegY;
+    }, inst.operand);
+  return use;
+}
+
+bool cppnes::analysis::deadAfter(const Subroutine &sub, size_t after, uint8_t regs)
+{
+  const auto &entries = sub.instructions();
+  for (size_t i = after + 1; i < entries.size() && regs; ++i) {
+    if (std::holds_alternative<LabelDef>(entries[i]))
+      return false;
+    auto inst = std::get_if<Instruction>(&entries[i]);
+    if (!inst)
+      continue;
+    if (isBranch(inst->opcode))
+      return false;
+    RegisterUse use = registerUse(*inst);
+    if (use.reads & regs)
+      return false;
+    regs &= ~use.writes;
+  }
+  return regs == 0;
+}
+
+std::vector<uint32_t> cppnes::analysis::entryOffsets(const Subroutine &sub)
+{
+  const auto &entries = sub.instructions();
+  std::vector<uint32_t> offsets(entries.size() + 1, 0);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    auto inst = std::get_if<Instruction>(&entries[i]);
+    offsets[i + 1] = offsets[i] + (inst ? instructionBytes(*inst) : 0);
+  }
+  return offsets;
+}
+
+uint16_t cppnes::analysis::codeBase(const Program &prg)
+{
+  auto placements = layoutConstrainedData(prg);
+  if (placements.empty())
+    return 0x8000;
+  const auto &last = placements.back();
+  return static_cast<uint16_t>(0x8000 + last.offset + last.block->size());
+}
+
+std::unordered_map<std::string, double> cppnes::analysis::callsPerFrame(const Program &prg,
+  const std::unordered_map<std::string, double> &overrides)
+{
+  // callers[callee] = (caller, weight of the call site)
+  std::unordered_map<std::string, std::vector<std::pair<const Subroutine *, uint64_t>>> callers;
+  for (const auto &sub : prg.subroutines()) {
+    auto weights = entryWeights(*sub);
+    const auto &entries = sub->instructions();
+    for (size_t i = 0; i < entries.size(); ++i) {
+      auto inst = std::get_if<Instruction>(&entries[i]);
+      if (!inst || (inst->opcode != Opcode::JSR && inst->opcode != Opcode::JMP))
+        continue;
+      if (auto target = std::get_if<Label>(&inst->operand))
+        callers[target->name()].emplace_back(sub.get(), weights[i]);
+    }
+  }
+  std::unordered_map<std::string, double> rate;
+  std::unordered_map<std::string, bool> visiting;
+  std::function<double(const Subroutine &)> visit = [&](const Subroutine &sub) -> double {
+    const std::string name = sub.name();
+    if (auto it = rate.find(name); it != rate.end())
+      return it->second;
+    if (auto it = overrides.find(name); it != overrides.end())
+      return rate[name] = it->second;
+    if (visiting[name])
+      return 0.0; // recursion: counted once through the outer call
+    visiting[name] = true;
+    double r = &sub == prg.nmiVector() ? 1.0 : 0.0;
+    for (const auto &[caller, weight] : callers[name]) {
+      if (caller != &sub)
+        r += visit(*caller) * static_cast<double>(weight);
+    }
+    visiting[name] = false;
+    return rate[name] = r;
+  };
+  for (const auto &sub : prg.subroutines())
+    visit(*sub);
+  return rate;
+}
@@ -0,0 +1,270 @@
+#include "assets.hpp"
+#include "chr.hpp"
+#include "compression.hpp"
+#include "image.hpp"
+#include "metatiles.hpp"
+#define FMT_HEADER_ONLY
+#include "3rdparty/fmt/format.h"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+  using cppnes::assets::Bytes;
+
+  // FNV-1a, 64 bits
+  struct Hasher {
+    uint64_t value = 0xCBF29CE484222325ull;
+    Hasher &add(const void *data, size_t size) {
+      auto p = static_cast<const uint8_t *>(data);
+      for (size_t i = 0; i < size; ++i)
+        value = (value ^ p[i]) * 0x100000001B3ull;
+      return *this;
+    }
+    Hasher &add(uint64_t v) { return add(&v, sizeof v); }
+    Hasher &add(const std::string &s) { return add(s.size()).add(s.data(), s.size()); }
+  };
+
+  Bytes readFile(const std::filesystem::path &path)
+  {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+      throw std::runtime_error("Failed to open asset: " + path.string());
+    return Bytes{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+  }
+
+  const Bytes &single(const std::vector<const Bytes *> &inputs, const char *converter)
+  {
+    if (inputs.size() != 1)
+      throw std::invalid_argument(std::string(converter) + ": one input expected");
+    return *inputs[0];
+  }
+
+} // anonymous namespace
+
+cppnes::assets::Converter cppnes::assets::rle()
+{
+  return { "rle", 1, [](const auto &inputs) { return compression::rleEncode(single(inputs, "rle")); } };
+}
+
+cppnes::assets::Converter cppnes::assets::lz()
+{
+  return { "lz", 1, [](const auto &inputs) { return compression::lzEncode(single(inputs, "lz")); } };
+}
+
+cppnes::assets::Converter cppnes::assets::chrDedup(bool flips)
+{
+  return { flips ? "chrDedupFlips" : "chrDedup", 1, [flips](const auto &inputs) {
+    return chr::deduplicate(single(inputs, "chrDedup"), flips).chr;
+  } };
+}
+
+cppnes::assets::Converter cppnes::assets::metatileTables(bool strips)
+{
+  return { strips ? "metatileTablesStrips" : "metatileTables", 2, [strips](const auto &inputs) {
+    std::vector<std::pair<std::string, metatiles::Nametable>> screens;
+    for (const Bytes *input : inputs) {
+      if (input->size() != sizeof(metatiles::Nametable))
+        throw std::invalid_argument("metatileTables: nametables must be 1024 bytes");
+      screens.emplace_back(std::to_string(screens.size()), metatiles::Nametable{});
+      std::copy(input->begin(), input->end(), screens.back().second.begin());
+    }
+    const auto set = metatiles::compile(screens);
+    Bytes out{ static_cast<uint8_t>(set.metatiles.size() & 0xFF), static_cast<uint8_t>(set.metatiles.size() >> 8) };
+    for (size_t c = 0; c < 4; ++c) {
+      for (const auto &m : set.metatiles)
+        out.push_back(m.tiles[c]);
+    }
+    for (const auto &screen : set.screens) {
+      out.insert(out.end(), screen.map.begin(), screen.map.end());
+      const auto attr = metatiles::attributeTable(set, screen);
+      out.insert(out.end(), attr.begin(), attr.end());
+      if (strips) {
+        const auto columns = metatiles::attributeStrips(set, screen);
+        out.insert(out.end(), columns.begin(), columns.end());
+      }
+    }
+    return out;
+  } };
+}
+
+cppnes::assets::Converter cppnes::assets::imageChr()
+{
+  return { "imageChr", 1, [](const auto &inputs) { return image::convert(image::decode(single(inputs, "imageChr"))).chr; } };
+}
+
+cppnes::assets::Converter cppnes::assets::imageNametable()
+{
+  return { "imageNametable", 1, [](const auto &inputs) {
+    const auto nt = image::convert(image::decode(single(inputs, "imageNametable"))).nametable;
+    return Bytes(nt.begin(), nt.end());
+  } };
+}
+
+cppnes::assets::Converter cppnes::assets::imagePalettes()
+{
+  return { "imagePalettes", 1, [](const auto &inputs) {
+    const auto palettes = image::convert(image::decode(single(inputs, "imagePalettes"))).palettes;
+    return Bytes(palettes.begin(), palettes.end());
+  } };
+}
+
+cppnes::assets::Pipeline::Pipeline(std::filesystem::path cacheDir, unsigned threads)
+  : cacheDir_(std::move(cacheDir)), threads_(threads ? threads : (std::max)(1u, std::thread::hardware_concurrency()))
+{
+  if (!cacheDir_.empty())
+    std::filesystem::create_directories(cacheDir_);
+}
+
+cppnes::assets::Pipeline::Node cppnes::assets::Pipeline::addFile(const std::filesystem::path &path)
+{
+  Asset asset;
+  asset.name = path.filename().string();
+  asset.file = path;
+  assets_.push_back(std::move(asset));
+  return assets_.size() - 1;
+}
+
+cppnes::assets::Pipeline::Node cppnes::assets::Pipeline::addBytes(std::string name, Bytes bytes)
+{
+  Asset asset;
+  asset.name = std::move(name);
+  asset.hash = Hasher{}.add(bytes.data(), bytes.size()).value;
+  asset.bytes = std::move(bytes);
+  asset.ready = true;
+  assets_.push_back(std::move(asset));
+  return assets_.size() - 1;
+}
+
+cppnes::assets::Pipeline::Node cppnes::assets::Pipeline::add(std::string name, Converter converter, std::vector<Node> inputs)
+{
+  Asset asset;
+  asset.name = std::move(name);
+  for (Node input : inputs) {
+    if (assets_.size() <= input)
+      throw std::out_of_range("Pipeline::add: " + asset.name + " uses an unknown input");
+    asset.level = (std::max)(asset.level, assets_[input].level + 1);
+  }
+  asset.converter = std::move(converter);
+  asset.inputs = std::move(inputs);
+  assets_.push_back(std::move(asset));
+  return assets_.size() - 1;
+}
+
+bool cppnes::assets::Pipeline::update(Asset &asset)
+{
+  if (!asset.file.empty()) {
+    asset.bytes = readFile(asset.file);
+    asset.hash = Hasher{}.add(asset.bytes.data(), asset.bytes.size()).value;
+    asset.ready = true;
+    return false;
+  }
+  Hasher key;
+  key.add(asset.converter.name).add(asset.converter.version);
+  std::vector<const Bytes *> inputs;
+  for (Node input : asset.inputs) {
+    key.add(assets_[input].hash);
+    inputs.push_back(&assets_[input].bytes);
+  }
+  const auto cacheFile = cacheDir_.empty() ? std::filesystem::path{} : cacheDir_ / fmt::format("{:016x}.bin", key.value);
+
+  std::optional<Bytes> output;
+  {
+    std::lock_guard lock(cacheMutex_);
+    if (auto it = cache_.find(key.value); it != cache_.end())
+      output = it->second;
+  }
+  if (!output && !cacheFile.empty() && std::filesystem::exists(cacheFile))
+    output = readFile(cacheFile);
+  const bool converted = !output;
+  if (converted) {
+    output = asset.converter.convert(inputs);
+    if (!cacheFile.empty()) {
+      // written aside, then renamed: an interrupted build never leaves a truncated entry
+      auto part = cacheFile;
+      part += fmt::format(".{}.part", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+      {
+        std::ofstream file(part, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(output->data()), static_cast<std::streamsize>(output->size()));
+        if (!file)
+          throw std::runtime_error("Failed to write asset cache: " + part.string());
+      }
+      std::filesystem::rename(part, cacheFile);
+    }
+  }
+  {
+    std::lock_guard lock(cacheMutex_);
+    cache_.try_emplace(key.value, *output);
+  }
+  asset.bytes = std::move(*output);
+  asset.hash = Hasher{}.add(asset.bytes.data(), asset.bytes.size()).value;
+  asset.ready = true;
+  return converted;
+}
+
+cppnes::assets::PipelineStats cppnes::assets::Pipeline::run()
+{
+  const auto start = std::chrono::steady_clock::now();
+  std::atomic<size_t> converted{ 0 }, cached{ 0 };
+  std::vector<std::vector<Node>> levels;
+  for (Node n = 0; n < assets_.size(); ++n) {
+    if (levels.size() <= assets_[n].level)
+      levels.resize(assets_[n].level + 1);
+    if (!assets_[n].file.empty() || assets_[n].converter.convert) {
+      assets_[n].ready = false;
+      levels[assets_[n].level].push_back(n);
+    }
+  }
+  // Level by level: everything a level needs is done before it starts.
+  for (const auto &level : levels) {
+    const unsigned workers = static_cast<unsigned>((std::min)(static_cast<size_t>(threads_), level.size()));
+    std::atomic<size_t> next{ 0 };
+    std::vector<std::string> errors(workers);
+    auto worker = [&](unsigned w) {
+      for (size_t i; (i = next++) < level.size();) {
+        Asset &asset = assets_[level[i]];
+        try {
+          const bool fromFile = !asset.file.empty();
+          if (update(asset))
+            ++converted;
+          else if (!fromFile)
+            ++cached;
+        } catch (const std::exception &e) {
+          errors[w] = "asset " + asset.name + ": " + e.what();
+          next = level.size();
+        }
+      }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned w = 1; w < workers; ++w)
+      pool.emplace_back(worker, w);
+    if (0 < workers)
+      worker(0);
+    for (auto &t : pool)
+      t.join();
+    for (const auto &error : errors) {
+      if (!error.empty())
+        throw std::runtime_error(error);
+    }
+  }
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  LOG_MSG << "assets:" << converted.load() << "converted," << cached.load() << "cached, in" << ms << "ms on" << threads_ << "threads";
+  return { converted.load(), cached.load() };
+}
+
+const cppnes::assets::Bytes &cppnes::assets::Pipeline::output(Node node) const
+{
+  if (assets_.size() <= node)
+    throw std::out_of_range("Pipeline::output: unknown node");
+  if (!assets_[node].ready)
+    throw std::logic_error("Pipeline::output: " + assets_[node].name + " has not run");
+  return assets_[node].bytes;
+}
@@ -0,0 +1,342 @@
+#include "nesdefs_helper.hpp"
+#include "analysis.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <unordered_set>
+
+namespace {
+
+  using namespace cppnes;
+
+  constexpr int Unplaced = -1;
+
+  // Items (subroutines, then data blocks) that must share a bank, with the bank once known.
+  struct Groups {
+    std::vector<size_t> parent;
+    std::vector<int> place;
+    std::vector<uint32_t> bytes;
+    std::vector<double> heat; // highest calls per frame of a member
+
+    size_t find(size_t i)
+    {
+      while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+      return i;
+    }
+
+    void join(size_t a, size_t b, const std::string &why)
+    {
+      a = find(a);
+      b = find(b);
+      if (a == b)
+        return;
+      if (place[a] != Unplaced && place[b] != Unplaced && place[a] != place[b])
+        throw std::invalid_argument("packBanks: " + why + " across banks");
+      parent[b] = a;
+      place[a] = place[a] != Unplaced ? place[a] : place[b];
+      bytes[a] += bytes[b];
+      heat[a] = (std::max)(heat[a], heat[b]);
+    }
+  };
+
+  bool fallsThrough(const Subroutine &sub)
+  {
+    const auto &entries = sub.instructions();
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+      if (auto inst = std::get_if<Instruction>(&*it))
+        return inst->opcode != Opcode::RTS && inst->opcode != Opcode::RTI && inst->opcode != Opcode::JMP;
+    }
+    return true;
+  }
+
+  const Label *callTarget(const Instruction &inst)
+  {
+    return inst.opcode == Opcode::JSR || inst.opcode == Opcode::JMP ? std::get_if<Label>(&inst.operand) : nullptr;
+  }
+
+  const Label *indexedLabel(const Instruction &inst)
+  {
+    if (auto x = std::get_if<AbsoluteX>(&inst.operand))
+      return std::get_if<Label>(&x->base);
+    if (auto y = std::get_if<AbsoluteY>(&inst.operand))
+      return std::get_if<Label>(&y->base);
+    return nullptr;
+  }
+
+  struct CallSite {
+    size_t caller, callee;
+    double weight; // calls per frame, plus a little so that code run once still clusters
+  };
+
+} // anonymous namespace
+
+cppnes::BankPackReport cppnes::Program::packBanks(const BankPackOptions &options)
+{
+  if (options.banks == 0)
+    throw std::invalid_argument("packBanks: the mapper has no switchable banks");
+  for (const auto &sub : subroutines_) {
+    if (sub->name() == "farSwitch")
+      throw std::logic_error("packBanks: already run on this program");
+  }
+  auto rates = analysis::callsPerFrame(*this, options.callsPerFrame);
+
+  // Subroutines are items 0..n-1, data blocks n.. (sorted by label for a stable result).
+  const size_t subCount = subroutines_.size();
+  std::unordered_map<std::string, size_t> subIndex;
+  for (size_t i = 0; i < subCount; ++i)
+    subIndex[subroutines_[i]->name()] = i;
+  std::vector<DataBlock *> data;
+  for (auto &[name, db] : dataBlocks_)
+    data.push_back(db.get());
+  std::sort(data.begin(), data.end(), [](const auto *a, const auto *b) { return a->label() < b->label(); });
+  std::unordered_map<std::string, size_t> dataIndex;
+  for (size_t i = 0; i < data.size(); ++i)
+    dataIndex[std::string{ data[i]->label() }] = subCount + i;
+
+  const size_t count = subCount + data.size();
+  Groups groups{ std::vector<size_t>(count), std::vector<int>(count, Unplaced), std::vector<uint32_t>(count), std::vector<double>(count) };
+  std::iota(groups.parent.begin(), groups.parent.end(), size_t{ 0 });
+
+  // Pinned: vectors, whatever an interrupt may run (it must not switch banks under the main
+  // thread) and subroutines whose address is taken.
+  std::unordered_set<std::string> pinned(options.pinned.begin(), options.pinned.end());
+  std::vector<const Subroutine *> interrupt;
+  for (auto vec : { resetVector_, nmiVector_, irqVector_ }) {
+    if (vec)
+      pinned.insert(vec->name());
+  }
+  for (auto vec : { nmiVector_, irqVector_ }) {
+    if (vec)
+      interrupt.push_back(vec);
+  }
+  while (!interrupt.empty()) {
+    const Subroutine *sub = interrupt.back();
+    interrupt.pop_back();
+    for (const auto &entry : sub->instructions()) {
+      auto inst = std::get_if<Instruction>(&entry);
+      const Label *target = inst ? callTarget(*inst) : nullptr;
+      auto it = target ? subIndex.find(target->name()) : subIndex.end();
+      if (it != subIndex.end() && pinned.insert(target->name()).second)
+        interrupt.push_back(subroutines_[it->second].get());
+    }
+  }
+  std::vector<std::vector<size_t>> readers(data.size());
+  std::vector<bool> addressTaken(data.size());
+  std::vector<CallSite> sites;
+  for (size_t i = 0; i < subCount; ++i) {
+    const auto &sub = *subroutines_[i];
+    auto weights = analysis::entryWeights(sub);
+    const auto &entries = sub.instructions();
+    for (size_t e = 0; e < entries.size(); ++e) {
+      auto inst = std::get_if<Instruction>(&entries[e]);
+      if (!inst)
+        continue;
+      if (auto target = callTarget(*inst)) {
+        if (auto it = subIndex.find(target->name()); it != subIndex.end() && it->second != i)
+          sites.push_back({ i, it->second, (rates[sub.name()] + 0.001) * static_cast<double>(weights[e]) });
+      } else if (auto label = indexedLabel(*inst)) {
+        if (auto it = dataIndex.find(label->name()); it != dataIndex.end())
+          readers[it->second - subCount].push_back(i);
+      } else if (auto ptr = std::get_if<ImmediateLabel>(&inst->operand)) {
+        if (auto it = dataIndex.find(ptr->label.name()); it != dataIndex.end())
+          addressTaken[it->second - subCount] = true;
+        else if (subIndex.count(ptr->label.name()))
+          pinned.insert(ptr->label.name());
+      }
+    }
+  }
+
+  for (size_t i = 0; i < subCount; ++i) {
+    const auto &sub = *subroutines_[i];
+    groups.bytes[i] = analysis::subroutineBytes(sub);
+    groups.heat[i] = rates[sub.name()];
+    if (sub.bank() != FixedBank)
+      groups.place[i] = sub.bank();
+    else if (pinned.count(sub.name()))
+      groups.place[i] = FixedBank;
+  }
+  for (size_t d = 0; d < data.size(); ++d) {
+    groups.bytes[subCount + d] = static_cast<uint32_t>(data[d]->size());
+    if (data[d]->isConstrained() || data[d]->bank() != FixedBank)
+      groups.place[subCount + d] = data[d]->isConstrained() ? FixedBank : data[d]->bank();
+  }
+  for (size_t i = 0; i + 1 < subCount; ++i) {
+    if (fallsThrough(*subroutines_[i]))
+      groups.join(i, i + 1, subroutines_[i]->name() + " falls through into " + subroutines_[i + 1]->name());
+  }
+  // Data read only by code that is still free to move goes with it; anything else is fixed.
+  for (size_t d = 0; d < data.size(); ++d) {
+    const size_t item = subCount + d;
+    if (groups.place[item] != Unplaced)
+      continue;
+    const bool movable = !readers[d].empty() && !addressTaken[d] &&
+      std::all_of(readers[d].begin(), readers[d].end(), [&](size_t r) { return groups.place[groups.find(r)] == Unplaced; });
+    if (!movable) {
+      groups.place[item] = FixedBank;
+      continue;
+    }
+    for (size_t r : readers[d])
+      groups.join(r, item, std::string{ data[d]->label() } + " readers");
+  }
+
+  // The hottest groups fill the fixed bank, where calling them costs nothing extra.
+  std::vector<size_t> roots;
+  uint32_t fixedUsed = 0;
+  std::vector<uint32_t> fill(options.banks);
+  for (size_t i = 0; i < count; ++i) {
+    if (groups.find(i) != i)
+      continue;
+    if (groups.place[i] == FixedBank)
+      fixedUsed += groups.bytes[i];
+    else if (groups.place[i] == Unplaced)
+      roots.push_back(i);
+    else if (options.banks <= groups.place[i])
+      throw std::out_of_range("packBanks: bank " + std::to_string(groups.place[i]) + " is past the " + std::to_string(options.banks) + " switchable banks");
+    else
+      fill[groups.place[i]] += groups.bytes[i];
+  }
+  std::stable_sort(roots.begin(), roots.end(), [&](size_t a, size_t b) {
+    return groups.heat[a] != groups.heat[b] ? groups.heat[a] > groups.heat[b] : groups.bytes[a] < groups.bytes[b];
+    });
+  for (size_t r : roots) {
+    if (fixedUsed + groups.bytes[r] <= options.fixedBytes) {
+      groups.place[r] = FixedBank;
+      fixedUsed += groups.bytes[r];
+    } else if (options.bankBytes < groups.bytes[r]) {
+      throw std::out_of_range("packBanks: " + std::to_string(groups.bytes[r]) + " bytes that must share a bank do not fit in one");
+    }
+  }
+
+  // Cluster the rest along the heaviest call edges, then place each cluster, largest first,
+  // in the bank it calls (or is called from) the most.
+  std::map<std::pair<size_t, size_t>, double> edges;
+  for (const auto &site : sites) {
+    size_t a = groups.find(site.caller), b = groups.find(site.callee);
+    if (a != b && groups.place[a] == Unplaced && groups.place[b] == Unplaced)
+      edges[{ (std::min)(a, b), (std::max)(a, b) }] += site.weight;
+  }
+  std::vector<std::pair<std::pair<size_t, size_t>, double>> heaviest(edges.begin(), edges.end());
+  std::stable_sort(heaviest.begin(), heaviest.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+  for (const auto &[edge, weight] : heaviest) {
+    size_t a = groups.find(edge.first), b = groups.find(edge.second);
+    if (a != b && groups.bytes[a] + groups.bytes[b] <= options.bankBytes)
+      groups.join(a, b, "call clustering");
+  }
+  std::vector<size_t> clusters;
+  for (size_t i = 0; i < count; ++i) {
+    if (groups.find(i) == i && groups.place[i] == Unplaced)
+      clusters.push_back(i);
+  }
+  std::stable_sort(clusters.begin(), clusters.end(), [&](size_t a, size_t b) { return groups.bytes[a] > groups.bytes[b]; });
+  for (size_t c : clusters) {
+    std::vector<double> affinity(options.banks);
+    for (const auto &site : sites) {
+      size_t a = groups.find(site.caller), b = groups.find(site.callee);
+      size_t other = a == c ? b : b == c ? a : c;
+      if (other != c && 0 <= groups.place[other] && groups.place[other] < options.banks)
+        affinity[groups.place[other]] += site.weight;
+    }
+    int best = Unplaced;
+    for (int k = 0; k < options.banks; ++k) {
+      if (options.bankBytes < fill[k] + groups.bytes[c])
+        continue;
+      if (best == Unplaced || affinity[best] < affinity[k] || (affinity[best] == affinity[k] && fill[best] < fill[k]))
+        best = k;
+    }
+    if (best == Unplaced)
+      throw std::out_of_range("packBanks: " + std::to_string(groups.bytes[c]) + " more bytes do not fit in " + std::to_string(options.banks) + " banks");
+    groups.place[c] = best;
+    fill[best] += groups.bytes[c];
+  }
+
+  for (size_t i = 0; i < subCount; ++i)
+    subroutines_[i]->bank_ = static_cast<uint8_t>(groups.place[groups.find(i)]);
+  for (size_t d = 0; d < data.size(); ++d)
+    data[d]->setBank(static_cast<uint8_t>(groups.place[groups.find(subCount + d)]));
+
+  // Trampolines: save the caller's bank, map the callee's, call, map the caller's back. A, X
+  // and Y are kept in farRegs across each bank switch, in both directions.
+  BankPackReport report;
+  Label bankTable = options.bankTable;
+  if (options.mapper == Mapper::UNROM && bankTable.name().empty())
+    bankTable = addBankTable(options.banks);
+  const AbsAddress bankSelect = options.mapper == Mapper::MMC3 ? mmc3BankSelect() : AbsAddress{ 0 };
+  std::optional<AbsAddress> farBank;
+  std::optional<ZpAddress> farRegs;
+  for (size_t i = 0; i < subCount; ++i) {
+    Subroutine &sub = *subroutines_[i];
+    auto weights = analysis::entryWeights(sub);
+    for (size_t e = 0; e < sub.instructions_.size(); ++e) {
+      auto inst = std::get_if<Instruction>(&sub.instructions_[e]);
+      const Label *target = inst ? callTarget(*inst) : nullptr;
+      auto it = target ? subIndex.find(target->name()) : subIndex.end();
+      if (it == subIndex.end())
+        continue;
+      const Subroutine &callee = *subroutines_[it->second];
+      if (callee.bank() == FixedBank || callee.bank() == sub.bank())
+        continue;
+      const std::string far = callee.name() + "_far";
+      if (!farBank) {
+        farBank = declareVar("farBank");
+        farRegs = declareZpTemp("farRegs", 3);
+        auto &farSwitch = addSubroutine("farSwitch");
+        farSwitch.sta(abs(*farBank));
+        bblocks::switchBankA(farSwitch, options.mapper, bankTable, bankSelect)
+          .lda(zp(*farRegs))
+          .ldx(zp(*farRegs + 1))
+          .ldy(zp(*farRegs + 2))
+          .rts();
+      }
+      if (!std::any_of(subroutines_.begin() + subCount, subroutines_.end(), [&](const auto &s) { return s->name() == far; })) {
+        auto &trampoline = addSubroutine(far);
+        auto saveRegs = [&] { trampoline.sta(zp(*farRegs)).stx(zp(*farRegs + 1)).sty(zp(*farRegs + 2)); };
+        saveRegs();
+        trampoline
+          .lda(abs(*farBank))
+          .pha()
+          .lda(imm(callee.bank()))
+          .jsr(Label{ "farSwitch" })
+          .jsr(Label{ callee.name() });
+        saveRegs();
+        trampoline
+          .pla()
+          .jmp(Label{ "farSwitch" });
+        ++report.trampolines;
+      }
+      inst->operand = Label{ far };
+      ++report.farCalls;
+      report.farCallsPerFrame += rates[sub.name()] * static_cast<double>(weights[e]);
+    }
+  }
+  // The first trampoline called from fixed code saves farBank and maps it back on return: the
+  // reset code maps bank 0 and sets farBank to match before anything else runs.
+  if (farBank) {
+    if (!resetVector_)
+      throw std::logic_error("packBanks: far calls need a reset vector to initialize farBank");
+    Subroutine init{ "farInit" };
+    init.lda(imm(0)).sta(abs(*farBank));
+    bblocks::switchBankA(init, options.mapper, bankTable, bankSelect);
+    auto reset = std::find_if(subroutines_.begin(), subroutines_.end(), [&](const auto &s) { return s.get() == resetVector_; });
+    auto &entries = (*reset)->instructions_;
+    entries.insert(entries.begin(), init.instructions_.begin(), init.instructions_.end());
+  }
+
+  for (const auto &sub : subroutines_) {
+    if (sub->bank() == FixedBank)
+      report.fixedBytes += analysis::subroutineBytes(*sub);
+  }
+  for (const auto &[name, db] : dataBlocks_) {
+    if (db->bank() == FixedBank)
+      report.fixedBytes += static_cast<uint32_t>(db->size());
+  }
+  report.bankBytes = fill;
+  std::string fills;
+  for (size_t k = 0; k < fill.size(); ++k)
+    fills += (k ? ", " : "") + std::to_string(fill[k]);
+  LOG_MSG << "packBanks:" << report.fixedBytes << "bytes fixed, banks [" << fills << "];" << report.trampolines << "trampolines,"
+    << report.farCalls << "far call sites, ~" << report.farCallsPerFrame << "far calls/frame";
+  return report;
+}
@@ -1,9 +1,86 @@
 #include "nesdefs_helper.hpp"
+#include "analysis.hpp"
 #include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <cstdlib>
 
 namespace {
 
+  // A declareVar placeholder: named, with an offset below $100 where RAM addresses never are
+  // (RamAllocator::Min). Its value() is only the offset until resolveVariables() runs, so the
+  // bblocks read addresses through the two helpers below, never through value().
+  bool isPlaceholder(const cppnes::AbsAddress &addr)
+  {
+    return !addr.name().empty() && addr.value() < 0x100;
+  }
+
+  // lda of the low or high byte of a RAM address; a placeholder is loaded label-relative
+  // (#<var / #>var) and resolved by the assembler.
+  void ldaAddressByte(cppnes::Subroutine &sub, const cppnes::AbsAddress &addr, cppnes::ByteOf which)
+  {
+    using namespace cppnes;
+    if (isPlaceholder(addr)) {
+      const Label var{ addr.value() ? addr.name() + "+" + std::to_string(addr.value()) : addr.name() };
+      sub.lda(ImmediateLabel{ var, which });
+    } else {
+      sub.lda(imm(static_cast<uint8_t>(which == ByteOf::Low ? addr.value() & 0xFF : addr.value() >> 8)));
+    }
+  }
+
+  // An address the bblock needs now (alignment check, constant page byte).
+  uint16_t knownAddress(const cppnes::AbsAddress &addr, const char *who)
+  {
+    if (isPlaceholder(addr))
+      throw std::invalid_argument(std::string(who) + ": the address of " + addr.name()
+        + " is only known after resolveVariables(); use allocRam/allocRamAligned");
+    return addr.value();
+  }
+
+  void checkPartial(cppnes::Unroll policy, bool divides256)
+  {
+    if (policy.kind != cppnes::Unroll::Kind::Partial)
+      return;
+    if (policy.factor < 2 || 256 < policy.factor || (divides256 && 256 % policy.factor != 0))
+      throw std::invalid_argument("Unroll::by: factor must be 2..256" + std::string(divides256 ? " and divide 256" : ""));
+  }
 
+  // Shared by clearPage and clearOAMBuffer: zero 256 bytes at a page-aligned address.
+  cppnes::Subroutine &clearPageImpl(cppnes::Subroutine &sub, cppnes::AbsAddress start, const std::string &loopName, cppnes::Unroll policy)
+  {
+    using namespace cppnes;
+    checkPartial(policy, true);
+    Label loop(loopName);
+    switch (policy.kind) {
+    case Unroll::Kind::Rolled:
+      sub
+        .lda(immZero)          // A = 0
+        .ldx(immZero)          // X = 0
+        .label(loop)
+        .sta(absx(start))      // STA start,X
+        .inx()
+        .bne(loop);            // loop until X wraps to 0
+      break;
+    case Unroll::Kind::Partial: {
+      // X counts stride..1, each pass clears one byte in each of the `factor` slices
+      const uint16_t stride = 256 / policy.factor;
+      sub
+        .lda(immZero)
+        .ldx(imm(static_cast<uint8_t>(stride)))
+        .label(loop)
+        .dex();
+      for (uint16_t k = 0; k < policy.factor; ++k)
+        sub.sta(absx(start + k * stride)); // stores leave Z from DEX intact
+      sub.bne(loop);
+      break;
+    }
+    case Unroll::Kind::Full:
+      sub.lda(immZero);
+      for (uint16_t i = 0; i < 256; ++i)
+        sub.sta(abs(start + i));
+      break;
+    }
+    return sub;
+  }
 
 } // anonymous namespace
 
@@ -41,11 +118,11 @@ cppnes::Subroutine &cppnes::bblocks::clearMemory(Subroutine &sub,
   int n = clearCount++;
   Label loop("@clearLoop" + std::to_string(n));
 
+  // ptr = start
+  ldaAddressByte(sub, start, ByteOf::Low);
+  sub.sta(zp(ptr));
+  ldaAddressByte(sub, start, ByteOf::High);
   sub
-    // ptr = start
-    .lda(imm(start.value() & 0xFF))
-    .sta(zp(ptr))
-    .lda(imm((start.value() >> 8) & 0xFF))
     .sta(zp(ptr + 1))
     // count = length
     .lda(imm(length & 0xFF))
@@ -82,21 +159,12 @@ Used for:
   - Stack page if needed
   - Nametable buffers in CPU RAM
 */
-cppnes::Subroutine &cppnes::bblocks::clearPage(Subroutine &sub, AbsAddress start)
+cppnes::Subroutine &cppnes::bblocks::clearPage(Subroutine &sub, AbsAddress start, Unroll policy)
 {
-  assert((start.value() & 0x00FF) == 0 && "clearPage requires page-aligned address");
-  if ((start.value() & 0xFF) != 0)
+  if ((knownAddress(start, "clearPage") & 0xFF) != 0)
     throw std::invalid_argument("clearPage requires page-aligned address");
   static int clearCount = 0;
-  Label loop("@clearPage" + std::to_string(clearCount++));
-  sub
-    .lda(immZero)          // A = 0
-    .ldx(immZero)          // X = 0
-    .label(loop)
-    .sta(absx(start))      // STA start,X
-    .inx()
-    .bne(loop);            // loop until X wraps to 0
-  return sub;
+  return clearPageImpl(sub, start, "@clearPage" + std::to_string(clearCount++), policy);
 }
 
 /*
@@ -127,11 +195,11 @@ cppnes::Subroutine &cppnes::bblocks::memset16(Subroutine &sub,
 
   Label loop("@memset16_" + std::to_string(n));
 
+  // ptr = start
+  ldaAddressByte(sub, start, ByteOf::Low);
+  sub.sta(zp(ptr));
+  ldaAddressByte(sub, start, ByteOf::High);
   sub
-    // ptr = start
-    .lda(imm(start.value() & 0xFF))
-    .sta(zp(ptr))
-    .lda(imm((start.value() >> 8) & 0xFF))
     .sta(zp(ptr + 1))
 
     // cnt = count
@@ -179,11 +247,11 @@ cppnes::Subroutine &cppnes::bblocks::memset8(Subroutine &sub, AbsAddress start,
   Label loop("@memset8_" + std::to_string(n));
   Label incptr("@memset8_incptr_" + std::to_string(n));
 
+  // ptr = start
+  ldaAddressByte(sub, start, ByteOf::Low);
+  sub.sta(zp(ptr));
+  ldaAddressByte(sub, start, ByteOf::High);
   sub
-    // ptr = start
-    .lda(imm(start.value() & 0xFF))
-    .sta(zp(ptr))
-    .lda(imm((start.value() >> 8) & 0xFF))
     .sta(zp(ptr + 1))
 
     // cnt = count
@@ -214,22 +282,13 @@ cppnes::Subroutine &cppnes::bblocks::memset8(Subroutine &sub, AbsAddress start,
   return sub;
 }
 
-cppnes::Subroutine &cppnes::bblocks::clearOAMBuffer(Subroutine &sub, AbsAddress buffer)
+cppnes::Subroutine &cppnes::bblocks::clearOAMBuffer(Subroutine &sub, AbsAddress buffer, Unroll policy)
 {
   // OAM buffer is 256 bytes, must be page-aligned
-  assert((buffer.value() & 0xFF) == 0 && "OAM buffer must be page-aligned");
-  if ((buffer.value() & 0xFF) != 0)
+  if ((knownAddress(buffer, "clearOAMBuffer") & 0xFF) != 0)
     throw std::invalid_argument("OAM buffer must be page-aligned");
   static int clearCount = 0;
-  Label loop("@clearOAM_" + std::to_string(clearCount++));
-  sub
-    .lda(immZero)
-    .ldx(immZero)
-    .label(loop)
-    .sta(absx(buffer))
-    .inx()
-    .bne(loop); // loops until X wraps to 0 (256 bytes)
-  return sub;
+  return clearPageImpl(sub, buffer, "@clearOAM_" + std::to_string(clearCount++), policy);
 }
 
 cppnes::Subroutine &cppnes::bblocks::loadPalette(Subroutine &sub, const Label &dataLabel)
@@ -248,11 +307,48 @@ cppnes::Subroutine &cppnes::bblocks::loadPalette(Subroutine &sub, const Label &d
   return sub;
 }
 
-cppnes::Subroutine &cppnes::bblocks::loadNametable(Subroutine &sub, const Label &dataLabel, ZpAddress ptr)
+cppnes::Subroutine &cppnes::bblocks::loadPaletteStep(Subroutine &sub, const Label &table, AbsAddress step)
+{
+  static int stepCount = 0;
+  Label loop("@loadPalStepLoop" + std::to_string(stepCount++));
+  sub.comment("Load palette fade step");
+  setPPUAddr(sub, 0x3f00)
+    .lda(abs(step))
+    .asl()
+    .asl()
+    .asl()
+    .asl()
+    .asl()            // 32 bytes per step
+    .tax()
+    .ldy(imm(0x20))
+    .label(loop)
+    .lda(absx(table))
+    .sta(abs(PPUDATA))
+    .inx()
+    .dey()
+    .bne(loop);
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::loadNametable(Subroutine &sub, const Label &dataLabel, ZpAddress ptr, Unroll policy)
 {
+  checkPartial(policy, true);
   static int ntCount = 0;
   Label loop("@loadNTLoop" + std::to_string(ntCount++));
 
+  if (policy.kind == Unroll::Kind::Full) {
+    // No pointer: every byte is an absolute read from the data label.
+    sub.comment("Load nametable (unrolled)");
+    setPPUAddr(sub, 0x2000);
+    for (int i = 0; i < 1024; ++i) {
+      sub
+        .lda(Label{ dataLabel.name() + "+" + std::to_string(i) })
+        .sta(abs(PPUDATA));
+    }
+    return sub;
+  }
+  const uint16_t copies = policy.kind == Unroll::Kind::Partial ? policy.factor : 1;
+
   // ptr = &dataLabel
   sub
     .comment("Load nametable")
@@ -264,10 +360,14 @@ cppnes::Subroutine &cppnes::bblocks::loadNametable(Subroutine &sub, const Label
   setPPUAddr(sub, 0x2000)
     .ldx(imm(0x04))   // 4 pages
     .ldy(immZero)
-    .label(loop)
-    .lda(indy(ptr))   // LDA (ptr),Y
-    .sta(abs(PPUDATA))
-    .iny()
+    .label(loop);
+  for (uint16_t i = 0; i < copies; ++i) {
+    sub
+      .lda(indy(ptr))   // LDA (ptr),Y
+      .sta(abs(PPUDATA))
+      .iny();
+  }
+  sub
     .bne(loop)
     .inc(zp(ptr + 1)) // advance high byte
     .dex()
@@ -275,6 +375,220 @@ cppnes::Subroutine &cppnes::bblocks::loadNametable(Subroutine &sub, const Label
   return sub;
 }
 
+cppnes::Subroutine &cppnes::bblocks::loadNametableRle(Subroutine &sub, const Label &dataLabel, ZpAddress ptr, uint16_t nametable)
+{
+  static int rleCount = 0;
+  const std::string n = std::to_string(rleCount++);
+  Label loop("@rleLoop" + n);
+  Label run("@rleRun" + n);
+  Label fill("@rleFill" + n);
+  Label done("@rleDone" + n);
+  int next = 0;
+  // Y walks the data with the pointer's low byte kept at 0, so (ptr),Y never crosses a page.
+  auto advance = [&]() {
+    Label same("@rleSamePage" + n + "_" + std::to_string(next++));
+    sub
+      .iny()
+      .bne(same)
+      .inc(zp(ptr + 1))
+      .label(same);
+  };
+
+  sub
+    .comment("Load RLE nametable")
+    .ldy(lobyte(dataLabel))
+    .lda(immZero)
+    .sta(zp(ptr))
+    .lda(hibyte(dataLabel))
+    .sta(zp(ptr + 1));
+  setPPUAddr(sub, nametable)
+    .lda(indy(ptr))
+    .sta(zp(ptr + 2)); // tag
+  advance();
+  sub
+    .label(loop)
+    .lda(indy(ptr));
+  advance();
+  sub
+    .cmp(zp(ptr + 2))
+    .beq(run)
+    .sta(abs(PPUDATA))
+    .bne(loop) // always: A != tag
+    .label(run)
+    .lda(indy(ptr))
+    .beq(done) // tag, 0: end
+    .tax();
+  advance();
+  sub.lda(indy(ptr));
+  advance();
+  sub
+    .label(fill)
+    .sta(abs(PPUDATA))
+    .dex()
+    .bne(fill)
+    .beq(loop) // always
+    .label(done);
+  return sub;
+}
+
+namespace {
+
+  // ptr += 1, A and Y kept.
+  void incPointer(cppnes::Subroutine &sub, cppnes::ZpAddress ptr, const std::string &name)
+  {
+    cppnes::Label same(name);
+    sub
+      .inc(cppnes::zp(ptr))
+      .bne(same)
+      .inc(cppnes::zp(ptr + 1))
+      .label(same);
+  }
+
+  // ptr += Y.
+  void addYToPointer(cppnes::Subroutine &sub, cppnes::ZpAddress ptr, const std::string &name)
+  {
+    cppnes::Label same(name);
+    sub
+      .tya()
+      .clc()
+      .adc(cppnes::zp(ptr))
+      .sta(cppnes::zp(ptr))
+      .bcc(same)
+      .inc(cppnes::zp(ptr + 1))
+      .label(same);
+  }
+
+} // anonymous namespace
+
+cppnes::Subroutine &cppnes::bblocks::decompressToRam(Subroutine &sub, const Label &dataLabel, AbsAddress dst, ZpAddress ptr)
+{
+  static int id = 0;
+  const std::string n = std::to_string(id++);
+  Label token("@lzToken" + n);
+  Label literal("@lzLiteral" + n);
+  Label match("@lzMatch" + n);
+  Label copy("@lzCopy" + n);
+  Label done("@lzDone" + n);
+  const ZpAddress src = ptr, out = ptr + 2, from = ptr + 4;
+
+  sub
+    .comment("LZ decompress to RAM")
+    .lda(lobyte(dataLabel))
+    .sta(zp(src))
+    .lda(hibyte(dataLabel))
+    .sta(zp(src + 1));
+  ldaAddressByte(sub, dst, ByteOf::Low);
+  sub.sta(zp(out));
+  ldaAddressByte(sub, dst, ByteOf::High);
+  sub
+    .sta(zp(out + 1))
+    .label(token)
+    .ldy(immZero)
+    .lda(indy(src))
+    .beq(done)
+    .tax();
+  incPointer(sub, src, "@lzSrc" + n + "_0");
+  sub
+    .txa()
+    .bmi(match)
+    .label(literal)
+    .lda(indy(src))
+    .sta(indy(out))
+    .iny()
+    .dex()
+    .bne(literal);
+  addYToPointer(sub, src, "@lzSrc" + n + "_1");
+  addYToPointer(sub, out, "@lzOut" + n + "_0");
+  sub
+    .jmp(token)
+    .label(match)
+    .and_(imm(0x7F))
+    .tax()
+    .lda(zp(out)) // from = out - offset - 1
+    .clc()
+    .sbc(indy(src))
+    .sta(zp(from))
+    .lda(zp(out + 1))
+    .sbc(immZero)
+    .sta(zp(from + 1));
+  incPointer(sub, src, "@lzSrc" + n + "_2");
+  sub
+    .label(copy)
+    .lda(indy(from))
+    .sta(indy(out))
+    .iny()
+    .dex()
+    .bne(copy);
+  addYToPointer(sub, out, "@lzOut" + n + "_1");
+  sub
+    .jmp(token)
+    .label(done);
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::decompressToVram(Subroutine &sub, const Label &dataLabel, uint16_t ppuAddr, AbsAddress ring, ZpAddress ptr)
+{
+  if ((knownAddress(ring, "decompressToVram") & 0xFF) != 0)
+    throw std::invalid_argument("decompressToVram: ring must be page-aligned");
+  static int id = 0;
+  const std::string n = std::to_string(id++);
+  Label token("@lzvToken" + n);
+  Label literal("@lzvLiteral" + n);
+  Label match("@lzvMatch" + n);
+  Label copy("@lzvCopy" + n);
+  Label done("@lzvDone" + n);
+  const ZpAddress src = ptr, count = ptr + 2;
+
+  sub
+    .comment("LZ decompress to VRAM")
+    .lda(lobyte(dataLabel))
+    .sta(zp(src))
+    .lda(hibyte(dataLabel))
+    .sta(zp(src + 1));
+  setPPUAddr(sub, ppuAddr)
+    .ldx(immZero) // X: ring write index, all along
+    .label(token)
+    .ldy(immZero)
+    .lda(indy(src))
+    .beq(done)
+    .sta(zp(count));
+  incPointer(sub, src, "@lzvSrc" + n + "_0");
+  sub
+    .lda(zp(count))
+    .bmi(match)
+    .label(literal)
+    .lda(indy(src))
+    .sta(abs(PPUDATA))
+    .sta(absx(ring))
+    .inx()
+    .iny()
+    .cpy(zp(count))
+    .bne(literal);
+  addYToPointer(sub, src, "@lzvSrc" + n + "_1");
+  sub
+    .jmp(token)
+    .label(match)
+    .and_(imm(0x7F))
+    .sta(zp(count))
+    .txa() // read index = X - offset - 1
+    .clc()
+    .sbc(indy(src))
+    .tay();
+  incPointer(sub, src, "@lzvSrc" + n + "_2");
+  sub
+    .label(copy)
+    .lda(absy(ring))
+    .sta(abs(PPUDATA))
+    .sta(absx(ring))
+    .inx()
+    .iny()
+    .dec(zp(count))
+    .bne(copy)
+    .jmp(token)
+    .label(done);
+  return sub;
+}
+
 cppnes::Subroutine &cppnes::bblocks::loopX(Subroutine &sub, uint8_t count, std::function<void(Subroutine &)> body)
 {
   if (count == 0) return sub;
@@ -292,7 +606,7 @@ cppnes::Subroutine &cppnes::bblocks::uploadSprites(Subroutine &sub, AbsAddress o
 {
   return sub
     .bblocks().setAddrByte(OAMADDR, 0)
-    .bblocks().setAddrByte(OAMDMA, oamBuffer.value() >> 8); // high byte of $0200 = $02
+    .bblocks().setAddrByte(OAMDMA, knownAddress(oamBuffer, "uploadSprites") >> 8); // high byte of $0200 = $02
   ;
 }
 
@@ -434,11 +748,38 @@ cppnes::Subroutine &cppnes::bblocks::ppuWriteBytesZpPtr(Subroutine &sub, ZpAddre
 /*
 Fill VRAM with a byte
 */
-cppnes::Subroutine &cppnes::bblocks::ppuFill(Subroutine &sub, uint8_t value, uint8_t count)
+cppnes::Subroutine &cppnes::bblocks::ppuFill(Subroutine &sub, uint8_t value, uint8_t count, Unroll policy)
 {
+  checkPartial(policy, false);
   static int id = 0;
   int n = id++;
   Label loop("@ppuFill_" + std::to_string(n));
+  const uint16_t total = count == 0 ? 256 : count;
+  if (policy.kind == Unroll::Kind::Full) {
+    sub.lda(imm(value));
+    for (uint16_t i = 0; i < total; ++i)
+      sub.sta(abs(PPUDATA));
+    return sub;
+  }
+  if (policy.kind == Unroll::Kind::Partial) {
+    // `factor` stores per pass, then the remainder straight-line
+    const uint16_t passes = total / policy.factor;
+    const uint16_t rest = total % policy.factor;
+    sub.lda(imm(value));
+    if (0 < passes) {
+      sub
+        .ldx(imm(static_cast<uint8_t>(passes)))
+        .label(loop);
+      for (uint16_t i = 0; i < policy.factor; ++i)
+        sub.sta(abs(PPUDATA));
+      sub
+        .dex()
+        .bne(loop);
+    }
+    for (uint16_t i = 0; i < rest; ++i)
+      sub.sta(abs(PPUDATA));
+    return sub;
+  }
   sub
     .lda(imm(value))
     .ldx(immZero)
@@ -500,6 +841,59 @@ cppnes::Subroutine &cppnes::bblocks::memcpy(Subroutine &sub,
   return sub;
 }
 
+cppnes::BlockCost cppnes::bblocks::loadNametableCost(Unroll policy)
+{
+  checkPartial(policy, true);
+  const uint32_t ptrSetup = 10, ptrSetupBytes = 8;    // LDA #</STA/LDA #>/STA
+  const uint32_t ppuAddr = 16, ppuAddrBytes = 13;     // setPPUAddr
+  if (policy.kind == Unroll::Kind::Full)
+    return { ppuAddr + 1024 * 8, ppuAddrBytes + 1024 * 6 };
+  const uint32_t n = policy.kind == Unroll::Kind::Partial ? policy.factor : 1;
+  // per page: 256 x (LDA (zp),Y + STA abs + INY), a BNE per pass (last one not taken)
+  const uint32_t page = 256 * 11 + (256 / n) * 3 - 1;
+  // LDX/LDY, 4 pages, INC/DEX/BNE between pages (last BNE not taken)
+  const uint32_t loop = 4 + 4 * page + 4 * 10 - 1;
+  return { ptrSetup + ppuAddr + loop, ptrSetupBytes + ppuAddrBytes + 4 + 6 * n + 2 + 5 };
+}
+
+cppnes::BlockCost cppnes::bblocks::clearPageCost(Unroll policy)
+{
+  checkPartial(policy, true);
+  switch (policy.kind) {
+  case Unroll::Kind::Rolled:
+    return { 4 + 256 * 7 + 256 * 3 - 1, 10 };
+  case Unroll::Kind::Partial: {
+    const uint32_t stride = 256 / policy.factor;
+    return { 4 + stride * (2 + 5u * policy.factor) + stride * 3 - 1, 7 + 3u * policy.factor };
+  }
+  case Unroll::Kind::Full:
+  default:
+    return { 2 + 256 * 4, 2 + 256 * 3 };
+  }
+}
+
+cppnes::BlockCost cppnes::bblocks::ppuFillCost(uint8_t count, Unroll policy)
+{
+  checkPartial(policy, false);
+  const uint32_t total = count == 0 ? 256 : count;
+  switch (policy.kind) {
+  case Unroll::Kind::Rolled:
+    return { 4 + total * 8 + total * 3 - 1, 12 };
+  case Unroll::Kind::Partial: {
+    const uint32_t passes = total / policy.factor, rest = total % policy.factor;
+    BlockCost c{ 2 + 4 * rest, 2 + 3 * rest };
+    if (0 < passes) {
+      c.cycles += 2 + passes * (4u * policy.factor + 2) + passes * 3 - 1;
+      c.bytes += 2 + 3u * policy.factor + 3;
+    }
+    return c;
+  }
+  case Unroll::Kind::Full:
+  default:
+    return { 2 + 4 * total, 2 + 3 * total };
+  }
+}
+
 cppnes::Subroutine &cppnes::bblocks::enableRendering(Subroutine &sub, bool enable)
 {
   // Bits 3 & 4 = BG & sprites
@@ -585,3 +979,1201 @@ cppnes::Subroutine &cppnes::bblocks::initPadCallback(Subroutine &sub, ZpAddress
   return sub;
 }
 
+
+cppnes::Subroutine &cppnes::bblocks::lookupWord(Subroutine &sub, const SplitTable &table, ZpAddress dst)
+{
+  return sub
+    .lda(absx(table.lo))
+    .sta(zp(dst))
+    .lda(absx(table.hi))
+    .sta(zp(dst + 1));
+}
+
+/*
+Row addresses are multiples of 32, so the column (0-31) is OR-ed into the low byte.
+*/
+cppnes::Subroutine &cppnes::bblocks::setPPUAddrRowCol(Subroutine &sub, const SplitTable &rowTable)
+{
+  return sub
+    .lda(abs(PPUSTATUS)) // reset latch
+    .lda(absy(rowTable.hi))
+    .sta(abs(PPUADDR))
+    .txa()
+    .ora(absy(rowTable.lo))
+    .sta(abs(PPUADDR));
+}
+
+/*
+a*b = qsq(a+b) - qsq(|a-b|), qsq(n) = n*n/4 for n in 0..510.
+a+b can carry into bit 8: the upper halves of the tables are then read at +256.
+About 60 cycles, clobbers A/X.
+*/
+cppnes::Subroutine &cppnes::bblocks::mul8x8(Subroutine &sub, const SplitTable &qsq, ZpAddress a, ZpAddress b, ZpAddress result)
+{
+  if (qsq.count < 511)
+    throw std::invalid_argument("mul8x8: quarter-square table needs 511 entries");
+  static int id = 0;
+  int n = id++;
+  Label high("@mul8x8_hi_" + std::to_string(n));
+  Label diff("@mul8x8_diff_" + std::to_string(n));
+  Label positive("@mul8x8_pos_" + std::to_string(n));
+  sub
+    .lda(zp(a))
+    .clc()
+    .adc(zp(b))
+    .tax()
+    .bcs(high)
+    .lda(absx(qsq.lo))
+    .sta(zp(result))
+    .lda(absx(qsq.hi))
+    .sta(zp(result + 1))
+    .jmp(diff)
+    .label(high)
+    .lda(absx(Label{ qsq.lo.name() + "+256" }))
+    .sta(zp(result))
+    .lda(absx(Label{ qsq.hi.name() + "+256" }))
+    .sta(zp(result + 1))
+    .label(diff)
+    .lda(zp(a))
+    .sec()
+    .sbc(zp(b))
+    .bcs(positive)
+    .eor(imm(0xFF))        // borrow: negate, carry is clear so ADC #1 completes it
+    .adc(imm(1))
+    .label(positive)
+    .tax()
+    .lda(zp(result))
+    .sec()
+    .sbc(absx(qsq.lo))
+    .sta(zp(result))
+    .lda(zp(result + 1))
+    .sbc(absx(qsq.hi))
+    .sta(zp(result + 1));
+  return sub;
+}
+
+namespace {
+
+  // Signed-digit form of a multiplier, most significant digit first, evaluated by Horner's
+  // rule: start with +/-src, then per digit shift left and add, subtract or do nothing.
+  struct MulPlan {
+    std::vector<int8_t> digits;
+    uint32_t cycles = UINT32_MAX;
+  };
+
+  // Cheapest 8-bit plan over every signed-digit string of up to 9 digits (k is mod 256).
+  MulPlan planMul8(uint8_t k)
+  {
+    MulPlan best;
+    for (size_t len = 1; len <= 9; ++len) {
+      size_t combos = 1;
+      for (size_t i = 1; i < len; ++i) combos *= 3;
+      for (int lead : { 1, -1 }) {
+        for (size_t c = 0; c < combos; ++c) {
+          std::vector<int8_t> digits{ static_cast<int8_t>(lead) };
+          uint32_t cycles = lead == 1 ? 3 : 7; // lda src | lda #0, sec, sbc src
+          int32_t value = lead;
+          size_t rest = c;
+          for (size_t i = 1; i < len; ++i, rest /= 3) {
+            int8_t d = static_cast<int8_t>(static_cast<int>(rest % 3) - 1);
+            digits.push_back(d);
+            value = value * 2 + d;
+            cycles += 2 + (d ? 5 : 0);
+          }
+          if (static_cast<uint8_t>(value) == k && cycles < best.cycles)
+            best = { std::move(digits), cycles };
+        }
+      }
+    }
+    return best;
+  }
+
+  // Binary and non-adjacent forms of a 16-bit multiplier; the cheaper one is used.
+  std::vector<int8_t> binaryDigits(uint32_t k)
+  {
+    std::vector<int8_t> digits;
+    for (int i = 31; 0 <= i; --i) {
+      if (!digits.empty() || (k >> i & 1))
+        digits.push_back(static_cast<int8_t>(k >> i & 1));
+    }
+    return digits;
+  }
+
+  std::vector<int8_t> nafDigits(uint32_t k)
+  {
+    std::vector<int8_t> digits;
+    while (k) {
+      int8_t d = 0;
+      if (k & 1) {
+        d = static_cast<int8_t>(2 - static_cast<int>(k & 3));
+        k -= d; // d == -1 adds one
+      }
+      digits.push_back(d);
+      k >>= 1;
+    }
+    return { digits.rbegin(), digits.rend() };
+  }
+
+  uint32_t mul16Cycles(const std::vector<int8_t> &digits)
+  {
+    uint32_t cycles = 12; // copy src to dst
+    for (size_t i = 1; i < digits.size(); ++i)
+      cycles += 10 + (digits[i] ? 20 : 0);
+    return cycles;
+  }
+
+  // Unsigned division by k as floor(x * m / 2^shift), m odd, evaluated from the low bit of m:
+  // acc = x, then per higher bit acc = acc / 2 (+ x), then the remaining right shifts. Each
+  // step floors, which is exact since floor((floor(y / 2^j) + c) / 2) == floor((y + c * 2^j) / 2^(j+1)).
+  struct DivPlan {
+    uint64_t m = 0;
+    unsigned shift = 0;
+    uint32_t cycles = UINT32_MAX;
+  };
+
+  template<typename CostFn>
+  DivPlan planDiv(uint32_t k, unsigned bits, CostFn cost)
+  {
+    DivPlan best;
+    const uint64_t count = uint64_t{ 1 } << bits;
+    for (unsigned n = 0; n <= 2 * bits + 1; ++n) {
+      uint64_t m = ((uint64_t{ 1 } << n) + k - 1) / k;
+      unsigned shift = n;
+      while (m && !(m & 1) && shift) { m >>= 1; --shift; }
+      if (m == 0 || (uint64_t{ 1 } << (bits + 1)) < m)
+        continue;
+      bool exact = true;
+      for (uint64_t x = 0; x < count && exact; ++x)
+        exact = (x * m >> shift) == x / k;
+      if (!exact)
+        continue;
+      uint32_t c = cost(m, shift);
+      if (c < best.cycles)
+        best = { m, shift, c };
+    }
+    return best;
+  }
+
+  unsigned bitLength(uint64_t v)
+  {
+    unsigned n = 0;
+    for (; v; v >>= 1) ++n;
+    return n;
+  }
+
+  uint32_t div8Cycles(uint64_t m, unsigned shift)
+  {
+    unsigned steps = bitLength(m) - 1;
+    uint32_t cycles = 3; // lda src
+    for (unsigned i = 1; i <= steps; ++i)
+      cycles += 2 + ((m >> i & 1) ? 5 : 0);
+    return cycles + 2 * (shift - steps);
+  }
+
+  uint32_t div16Cycles(uint64_t m, unsigned shift)
+  {
+    unsigned steps = bitLength(m) - 1;
+    uint32_t cycles = 12; // copy src to dst
+    for (unsigned i = 1; i <= steps; ++i)
+      cycles += 10 + ((m >> i & 1) ? 20 : 0);
+    const bool carry = 0 < steps; // the top bit of m was just added
+    unsigned rest = shift - steps;
+    if (rest && 8 < rest + (carry ? 0 : 1)) // one ror for the carry, then move the high byte down
+      return cycles + (carry ? 10 : 0) + 11 + 5 * (rest - 8 - (carry ? 1 : 0));
+    return cycles + 10 * rest;
+  }
+
+  // 256-byte lookup table shared by all call sites with the same function and constant.
+  cppnes::Label byteTable(cppnes::Program &prg, const std::string &name, const std::function<uint8_t(size_t)> &gen)
+  {
+    cppnes::Label label{ name };
+    auto &db = prg.addDataBlock(label);
+    if (db.size() == 0)
+      db.generate(256, gen, name).noPageCross();
+    return label;
+  }
+
+} // anonymous namespace
+
+cppnes::Subroutine &cppnes::bblocks::mulConst(Subroutine &sub, ZpAddress dst, ZpAddress src, uint8_t k, Program *tables)
+{
+  MulPlan plan = k ? planMul8(k) : MulPlan{ {}, 2 };
+  // ldx src, lda tbl,x: 7 cycles, never crosses a page
+  if (tables && 7 < plan.cycles) {
+    Label tbl = byteTable(*tables, "MulConst" + std::to_string(k), [k](size_t x) { return static_cast<uint8_t>(x * k); });
+    sub.ldx(zp(src)).lda(absx(tbl)).sta(zp(dst)).commentPrev("x" + std::to_string(k) + " by table");
+    return sub;
+  }
+  if (plan.digits.empty()) {
+    sub.lda(immZero);
+  } else if (plan.digits[0] == 1) {
+    sub.lda(zp(src));
+  } else {
+    sub.lda(immZero).sec().sbc(zp(src));
+  }
+  for (size_t i = 1; i < plan.digits.size(); ++i) {
+    sub.asl();
+    if (plan.digits[i] == 1)
+      sub.clc().adc(zp(src));
+    else if (plan.digits[i] == -1)
+      sub.sec().sbc(zp(src));
+  }
+  sub.sta(zp(dst)).commentPrev("x" + std::to_string(k));
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::mulConst16(Subroutine &sub, ZpAddress dst, ZpAddress src, uint16_t k)
+{
+  if (std::abs(static_cast<int>(dst.value()) - static_cast<int>(src.value())) < 2)
+    throw std::invalid_argument("mulConst16: dst and src must not overlap");
+  if (k == 0) {
+    sub.lda(immZero).sta(zp(dst)).sta(zp(dst + 1));
+    return sub;
+  }
+  if ((k & 0xFF) == 0) {
+    // the low byte of the product is zero and the high byte only depends on src's low byte
+    mulConst(sub, dst + 1, src, static_cast<uint8_t>(k >> 8));
+    sub.lda(immZero).sta(zp(dst));
+    return sub;
+  }
+  auto digits = binaryDigits(k);
+  auto naf = nafDigits(k);
+  if (mul16Cycles(naf) < mul16Cycles(digits))
+    digits = naf;
+  sub
+    .lda(zp(src))
+    .sta(zp(dst))
+    .lda(zp(src + 1))
+    .sta(zp(dst + 1));
+  for (size_t i = 1; i < digits.size(); ++i) {
+    sub.asl(zp(dst)).rol(zp(dst + 1));
+    if (digits[i] == 0)
+      continue;
+    const bool add = digits[i] == 1;
+    (add ? sub.clc() : sub.sec()).lda(zp(dst));
+    add ? sub.adc(zp(src)) : sub.sbc(zp(src));
+    sub.sta(zp(dst)).lda(zp(dst + 1));
+    add ? sub.adc(zp(src + 1)) : sub.sbc(zp(src + 1));
+    sub.sta(zp(dst + 1));
+  }
+  sub.commentPrev("x" + std::to_string(k));
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::divConst(Subroutine &sub, ZpAddress dst, ZpAddress src, uint8_t k, Program *tables)
+{
+  if (k == 0)
+    throw std::invalid_argument("divConst: division by zero");
+  DivPlan plan = planDiv(k, 8, div8Cycles);
+  const uint32_t compareCycles = 9; // k >= 128: quotient is the carry of src >= k
+  if (tables && 7 < (std::min)(plan.cycles, 128 <= k ? compareCycles : UINT32_MAX)) {
+    Label tbl = byteTable(*tables, "DivConst" + std::to_string(k), [k](size_t x) { return static_cast<uint8_t>(x / k); });
+    sub.ldx(zp(src)).lda(absx(tbl)).sta(zp(dst)).commentPrev("/" + std::to_string(k) + " by table");
+    return sub;
+  }
+  if (128 <= k && compareCycles < plan.cycles) {
+    sub.lda(zp(src)).cmp(imm(k)).lda(immZero).rol().sta(zp(dst)).commentPrev("/" + std::to_string(k));
+    return sub;
+  }
+  assert(plan.m);
+  const unsigned steps = bitLength(plan.m) - 1;
+  sub.lda(zp(src));
+  bool carry = false; // bit 8 of the accumulator is pending in C
+  for (unsigned i = 1; i <= steps; ++i) {
+    carry ? sub.ror() : sub.lsr();
+    carry = plan.m >> i & 1;
+    if (carry)
+      sub.clc().adc(zp(src));
+  }
+  for (unsigned i = steps; i < plan.shift; ++i) {
+    carry ? sub.ror() : sub.lsr();
+    carry = false;
+  }
+  sub.sta(zp(dst)).commentPrev("/" + std::to_string(k));
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::divConst16(Subroutine &sub, ZpAddress dst, ZpAddress src, uint16_t k)
+{
+  if (k == 0)
+    throw std::invalid_argument("divConst16: division by zero");
+  if (std::abs(static_cast<int>(dst.value()) - static_cast<int>(src.value())) < 2)
+    throw std::invalid_argument("divConst16: dst and src must not overlap");
+  if (0x8000 <= k) {
+    // quotient is 0 or 1: the carry of the 16-bit compare src >= k
+    sub
+      .lda(zp(src))
+      .cmp(imm(static_cast<uint8_t>(k & 0xFF)))
+      .lda(zp(src + 1))
+      .sbc(imm(static_cast<uint8_t>(k >> 8)))
+      .lda(immZero)
+      .sta(zp(dst + 1))
+      .rol()
+      .sta(zp(dst))
+      .commentPrev("/" + std::to_string(k));
+    return sub;
+  }
+  DivPlan plan = planDiv(k, 16, div16Cycles);
+  assert(plan.m);
+  const unsigned steps = bitLength(plan.m) - 1;
+  sub
+    .lda(zp(src))
+    .sta(zp(dst))
+    .lda(zp(src + 1))
+    .sta(zp(dst + 1));
+  bool carry = false; // bit 16 of the accumulator is pending in C
+  for (unsigned i = 1; i <= steps; ++i) {
+    (carry ? sub.ror(zp(dst + 1)) : sub.lsr(zp(dst + 1))).ror(zp(dst));
+    carry = plan.m >> i & 1;
+    if (carry) {
+      sub
+        .clc()
+        .lda(zp(dst))
+        .adc(zp(src))
+        .sta(zp(dst))
+        .lda(zp(dst + 1))
+        .adc(zp(src + 1))
+        .sta(zp(dst + 1));
+    }
+  }
+  unsigned rest = plan.shift - steps;
+  if (rest && 8 < rest + (carry ? 0 : 1)) {
+    if (carry) {
+      sub.ror(zp(dst + 1)).ror(zp(dst));
+      --rest;
+    }
+    sub.lda(zp(dst + 1)).sta(zp(dst)).lda(immZero).sta(zp(dst + 1));
+    for (rest -= 8; rest; --rest)
+      sub.lsr(zp(dst));
+  } else {
+    for (; rest; --rest) {
+      (carry ? sub.ror(zp(dst + 1)) : sub.lsr(zp(dst + 1))).ror(zp(dst));
+      carry = false;
+    }
+  }
+  sub.commentPrev("/" + std::to_string(k));
+  return sub;
+}
+
+namespace {
+
+  using cppnes::analysis::RegA;
+  using cppnes::analysis::RegX;
+  using cppnes::analysis::RegY;
+  using cppnes::analysis::FlagN;
+  using cppnes::analysis::FlagZ;
+  using cppnes::analysis::FlagC;
+  using cppnes::analysis::FlagV;
+
+  // One way to burn a fixed number of cycles.
+  struct DelayItem {
+    uint32_t cycles;
+    uint32_t bytes;
+    std::function<void(cppnes::Subroutine &)> emit;
+  };
+
+  std::string delayLabel()
+  {
+    static int delayCount = 0;
+    return "@delay" + std::to_string(delayCount++);
+  }
+
+  // Countdown loop on X or Y: ld? #k / dex|dey / bne = 5k+1 cycles in 5 bytes (k = 1..256).
+  void indexLoop(cppnes::Subroutine &sub, bool useY, uint32_t k)
+  {
+    using namespace cppnes;
+    Label loop(delayLabel());
+    const Immediate count = imm(static_cast<uint8_t>(k & 0xFF));
+    useY ? sub.ldy(count) : sub.ldx(count);
+    sub.label(loop);
+    useY ? sub.dey() : sub.dex();
+    sub.bne(loop);
+  }
+
+  std::vector<DelayItem> delayItems(uint8_t clobber)
+  {
+    using namespace cppnes;
+    auto has = [clobber](uint8_t bits) { return (clobber & bits) == bits; };
+    const ZpAddress zero{ 0x00 };
+    std::vector<DelayItem> items;
+    items.push_back({ 2, 1, [](Subroutine &s) { s.nop(); } });
+    items.push_back({ 3, 3, [](Subroutine &s) { Label next(delayLabel()); s.jmp(next).label(next); } });
+    items.push_back({ 7, 2, [](Subroutine &s) { s.php().plp(); } });
+    if (has(FlagN | FlagZ | FlagV))
+      items.push_back({ 3, 2, [zero](Subroutine &s) { s.bit(zp(zero)); } });
+    if (has(RegA | FlagN | FlagZ)) {
+      items.push_back({ 3, 2, [zero](Subroutine &s) { s.lda(zp(zero)); } });
+      items.push_back({ 4, 2, [zero](Subroutine &s) { s.lda(zpx(zero)); } });
+    }
+    if (has(RegX | FlagN | FlagZ))
+      items.push_back({ 4, 2, [zero](Subroutine &s) { s.ldx(zpy(zero)); } });
+    if (has(RegY | FlagN | FlagZ))
+      items.push_back({ 4, 2, [zero](Subroutine &s) { s.ldy(zpx(zero)); } });
+    for (bool useY : { false, true }) {
+      if (!has((useY ? RegY : RegX) | FlagN | FlagZ))
+        continue;
+      for (uint32_t k = 1; k <= 256; ++k)
+        items.push_back({ 5 * k + 1, 5, [useY, k](Subroutine &s) { indexLoop(s, useY, k); } });
+      break; // X and Y loops are interchangeable
+    }
+    if (has(RegA | FlagN | FlagZ | FlagC | FlagV)) {
+      // lda #k / sec / sbc #1 / bne = 7k+1 cycles in 7 bytes
+      for (uint32_t k = 1; k <= 256; ++k) {
+        items.push_back({ 7 * k + 1, 7, [k](Subroutine &s) {
+          Label loop(delayLabel());
+          s.lda(imm(static_cast<uint8_t>(k & 0xFF))).label(loop).sec().sbc(imm(1)).bne(loop);
+          } });
+      }
+    }
+    return items;
+  }
+
+  // Fewest-bytes combination of items for every cycle count up to limit.
+  struct DelayTable {
+    std::vector<uint32_t> bytes;  // UINT32_MAX: unreachable
+    std::vector<uint16_t> choice;
+  };
+
+  DelayTable delayTable(const std::vector<DelayItem> &items, uint32_t limit)
+  {
+    DelayTable t{ std::vector<uint32_t>(limit + 1, UINT32_MAX), std::vector<uint16_t>(limit + 1, 0) };
+    t.bytes[0] = 0;
+    for (uint32_t m = 2; m <= limit; ++m) {
+      for (size_t i = 0; i < items.size(); ++i) {
+        const auto &it = items[i];
+        if (m < it.cycles || t.bytes[m - it.cycles] == UINT32_MAX)
+          continue;
+        if (t.bytes[m - it.cycles] + it.bytes < t.bytes[m]) {
+          t.bytes[m] = t.bytes[m - it.cycles] + it.bytes;
+          t.choice[m] = static_cast<uint16_t>(i);
+        }
+      }
+    }
+    return t;
+  }
+
+  uint32_t straightCycles(const std::vector<cppnes::Entry> &entries)
+  {
+    using namespace cppnes;
+    uint32_t cycles = 0;
+    for (const auto &e : entries) {
+      if (std::holds_alternative<LabelDef>(e))
+        throw std::invalid_argument("balancedIf: bodies must be straight-line code");
+      if (auto inst = std::get_if<Instruction>(&e)) {
+        if (analysis::isBranch(inst->opcode) || inst->opcode == Opcode::JMP || inst->opcode == Opcode::JSR ||
+          inst->opcode == Opcode::RTS || inst->opcode == Opcode::RTI || inst->opcode == Opcode::BRK)
+          throw std::invalid_argument("balancedIf: bodies must be straight-line code");
+        cycles += analysis::instructionCycles(*inst);
+      }
+    }
+    return cycles;
+  }
+
+} // anonymous namespace
+
+cppnes::Subroutine &cppnes::bblocks::delayCycles(Subroutine &sub, uint32_t n, uint8_t clobber)
+{
+  if (n == 1)
+    throw std::invalid_argument("delayCycles: no 6502 sequence takes exactly 1 cycle");
+  const auto items = delayItems(clobber);
+  const bool loops = items.back().cycles > 7;
+  const uint32_t tableLimit = loops ? 4096 : n;
+  const bool nested = (clobber & (RegX | RegY | FlagN | FlagZ)) == (RegX | RegY | FlagN | FlagZ);
+  const std::string note = "delay " + std::to_string(n) + " cycles";
+  uint32_t rest = n;
+
+  if (loops && nested) {
+    // ldy #j / ldx #k / dex / bne / dey / bne = j(5k+6)+1 cycles in 10 bytes
+    const uint32_t maxNested = 256 * (5 * 256 + 6) + 1;
+    auto table = delayTable(items, tableLimit);
+    auto emitNested = [&](uint32_t j, uint32_t k) {
+      Label outer(delayLabel());
+      sub.ldy(imm(static_cast<uint8_t>(j & 0xFF))).label(outer);
+      indexLoop(sub, false, k);
+      sub.dey().bne(outer);
+    };
+    while (tableLimit + maxNested < rest) {
+      emitNested(256, 256);
+      rest -= maxNested;
+    }
+    if (tableLimit < rest || table.bytes[rest] > 10) {
+      uint32_t bestJ = 0, bestK = 0, bestBytes = rest <= tableLimit ? table.bytes[rest] : UINT32_MAX;
+      for (uint32_t j = 1; j <= 256; ++j) {
+        for (uint32_t k = 1; k <= 256; ++k) {
+          uint32_t c = j * (5 * k + 6) + 1;
+          if (rest < c || tableLimit < rest - c || table.bytes[rest - c] == UINT32_MAX)
+            continue;
+          if (10 + table.bytes[rest - c] < bestBytes) {
+            bestBytes = 10 + table.bytes[rest - c];
+            bestJ = j;
+            bestK = k;
+          }
+        }
+      }
+      if (bestJ) {
+        emitNested(bestJ, bestK);
+        rest -= bestJ * (5 * bestK + 6) + 1;
+      }
+    }
+    for (; rest; rest -= items[table.choice[rest]].cycles)
+      items[table.choice[rest]].emit(sub);
+  } else {
+    // without nesting, the largest loop covers what the table does not
+    const DelayItem &biggest = *std::max_element(items.begin(), items.end(),
+      [](const DelayItem &a, const DelayItem &b) { return a.cycles < b.cycles; });
+    for (; tableLimit < rest; rest -= biggest.cycles)
+      biggest.emit(sub);
+    auto table = delayTable(items, rest);
+    for (; rest; rest -= items[table.choice[rest]].cycles)
+      items[table.choice[rest]].emit(sub);
+  }
+  if (n)
+    sub.commentPrev(note);
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::balancedIf(Subroutine &sub, Opcode skipToElse, std::function<void(Subroutine &)> thenBody,
+  std::function<void(Subroutine &)> elseBody, uint8_t clobber)
+{
+  if (!analysis::isBranch(skipToElse))
+    throw std::invalid_argument("balancedIf: skipToElse must be a branch opcode");
+  // Bodies are built aside to measure them before the padding goes in.
+  MemoryMap scratchMem;
+  Program scratch(scratchMem);
+  auto &thenCode = scratch.addSubroutine("then");
+  auto &elseCode = scratch.addSubroutine("else");
+  if (thenBody) thenBody(thenCode);
+  if (elseBody) elseBody(elseCode);
+  // then: branch not taken (2) + body + JMP (3); else: branch taken (3) + body
+  const int32_t thenCycles = 5 + static_cast<int32_t>(straightCycles(thenCode.instructions()));
+  const int32_t elseCycles = 3 + static_cast<int32_t>(straightCycles(elseCode.instructions()));
+  int32_t padThen = 0, padElse = 0;
+  if (thenCycles < elseCycles)
+    padThen = elseCycles - thenCycles;
+  else
+    padElse = thenCycles - elseCycles;
+  if (padThen == 1 || padElse == 1) { // no 1-cycle delay: pad both sides
+    padThen += 2;
+    padElse += 2;
+  }
+
+  static int ifCount = 0;
+  const int id = ifCount++;
+  Label elseLabel("@else" + std::to_string(id));
+  Label endLabel("@endif" + std::to_string(id));
+  switch (skipToElse) {
+  case Opcode::BCC: sub.bcc(elseLabel); break;
+  case Opcode::BCS: sub.bcs(elseLabel); break;
+  case Opcode::BEQ: sub.beq(elseLabel); break;
+  case Opcode::BNE: sub.bne(elseLabel); break;
+  case Opcode::BMI: sub.bmi(elseLabel); break;
+  case Opcode::BPL: sub.bpl(elseLabel); break;
+  case Opcode::BVC: sub.bvc(elseLabel); break;
+  default: sub.bvs(elseLabel); break;
+  }
+  sub.append(thenCode.instructions());
+  delayCycles(sub, static_cast<uint32_t>(padThen), clobber);
+  sub.jmp(endLabel).label(elseLabel);
+  sub.append(elseCode.instructions());
+  delayCycles(sub, static_cast<uint32_t>(padElse), clobber);
+  sub.label(endLabel);
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::entityInit(Subroutine &sub, const EntityTable &table)
+{
+  static int initCount = 0;
+  Label loop("@entityInit" + std::to_string(initCount++));
+  // next[i] = i + 1, next[capacity - 1] = $FF
+  sub.ldx(imm(table.capacity - 1))
+    .lda(imm(0xFF))
+    .label(loop)
+    .sta(absx(table.next))
+    .txa()
+    .dex()
+    .bpl(loop)
+    .stx(abs(table.liveHead)) // X = $FF
+    .inx()
+    .stx(abs(table.freeHead));
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::entitySpawn(Subroutine &sub, const EntityTable &table, const Label &onFull)
+{
+  sub.ldx(abs(table.freeHead))
+    .bmi(onFull)
+    .lda(absx(table.next))
+    .sta(abs(table.freeHead))
+    .lda(abs(table.liveHead))
+    .sta(absx(table.next))
+    .stx(abs(table.liveHead));
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::entityForEach(Subroutine &sub, const EntityTable &table, std::function<void(Subroutine &)> body)
+{
+  // The body is built aside so its size picks short or long branches around the loop.
+  MemoryMap scratchMem;
+  Program scratch(scratchMem);
+  auto &bodyCode = scratch.addSubroutine("body");
+  if (body) body(bodyCode);
+  uint32_t bodyBytes = 0;
+  for (const auto &e : bodyCode.instructions()) {
+    if (auto inst = std::get_if<Instruction>(&e))
+      bodyBytes += analysis::instructionBytes(*inst);
+  }
+  const bool near = bodyBytes <= 113; // loop = 14 bytes + body within a branch's reach
+
+  static int eachCount = 0;
+  const int id = eachCount++;
+  Label loop("@entityEach" + std::to_string(id));
+  Label done("@entityEachDone" + std::to_string(id));
+  sub.lda(imm(0xFF))
+    .sta(abs(table.prev))
+    .ldx(abs(table.liveHead));
+  if (near)
+    sub.bmi(done);
+  else
+    sub.bpl(loop).jmp(done);
+  // The successor is read first: the body may despawn X.
+  sub.label(loop)
+    .lda(absx(table.next))
+    .sta(abs(table.cursor))
+    .append(bodyCode.instructions())
+    .stx(abs(table.prev)) // entityDespawn leaves X = prev
+    .ldx(abs(table.cursor));
+  if (near)
+    sub.bpl(loop);
+  else
+    sub.bmi(done).jmp(loop);
+  sub.label(done);
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::entityDespawn(Subroutine &sub, const EntityTable &table)
+{
+  static int despawnCount = 0;
+  const int id = despawnCount++;
+  Label middle("@entityDespawn" + std::to_string(id));
+  Label linked("@entityDespawnLinked" + std::to_string(id));
+  // Unlink X from the live list, push it onto the free list.
+  sub.lda(absx(table.next))
+    .ldy(abs(table.prev))
+    .bpl(middle)
+    .sta(abs(table.liveHead))
+    .bmi(linked) // N still set by LDY: always taken
+    .label(middle)
+    .sta(absy(table.next))
+    .label(linked)
+    .lda(abs(table.freeHead))
+    .sta(absx(table.next))
+    .stx(abs(table.freeHead))
+    .ldx(abs(table.prev));
+  return sub;
+}
+
+namespace {
+  // Checksum seeds, so that a slot of zeros (erased or never written) does not verify.
+  constexpr uint8_t SaveSumSeed = 0x5A;
+  constexpr uint8_t SaveEorSeed = 0xA5;
+}
+
+cppnes::Subroutine &cppnes::bblocks::saveBegin(Subroutine &sub, const SaveSlots &slots)
+{
+  lookupWord(sub, slots.slotAddress, slots.ptr);
+  return sub
+    .lda(imm(0))
+    .sta(abs(slots.pos))
+    .lda(imm(SaveSumSeed))
+    .sta(abs(slots.sum))
+    .lda(imm(SaveEorSeed))
+    .sta(abs(slots.eor))
+    .sta(abs(slots.busy)); // non-zero
+}
+
+cppnes::Subroutine &cppnes::bblocks::saveStep(Subroutine &sub, const SaveSlots &slots, uint8_t bytesPerCall)
+{
+  if (bytesPerCall == 0)
+    throw std::invalid_argument("saveStep: bytesPerCall must be > 0");
+  static int stepCount = 0;
+  const std::string id = std::to_string(stepCount++);
+  Label loop("@saveStep" + id);
+  Label finish("@saveFinish" + id);
+  Label done("@saveDone" + id);
+  return sub
+    .lda(abs(slots.busy))
+    .beq(done)
+    .ldy(abs(slots.pos))
+    .ldx(imm(bytesPerCall))
+    .label(loop)
+    .cpy(imm(slots.slotSize))
+    .beq(finish)
+    .lda(absy(slots.buffer))
+    .sta(indy(slots.ptr))
+    .eor(abs(slots.eor))
+    .sta(abs(slots.eor))
+    .lda(absy(slots.buffer))
+    .clc()
+    .adc(abs(slots.sum))
+    .sta(abs(slots.sum))
+    .iny()
+    .dex()
+    .bne(loop)
+    .sty(abs(slots.pos))
+    .beq(done) // Z still set by DEX: always taken
+    .label(finish)
+    // the checksum goes last: a save cut short leaves the slot invalid
+    .lda(abs(slots.sum))
+    .sta(indy(slots.ptr))
+    .iny()
+    .lda(abs(slots.eor))
+    .sta(indy(slots.ptr))
+    .lda(imm(0))
+    .sta(abs(slots.busy))
+    .label(done);
+}
+
+cppnes::Subroutine &cppnes::bblocks::saveLoad(Subroutine &sub, const SaveSlots &slots, const Label &onBad)
+{
+  static int loadCount = 0;
+  Label loop("@saveLoad" + std::to_string(loadCount++));
+  lookupWord(sub, slots.slotAddress, slots.ptr);
+  return sub
+    .lda(imm(SaveSumSeed))
+    .sta(abs(slots.sum))
+    .lda(imm(SaveEorSeed))
+    .sta(abs(slots.eor))
+    .ldy(imm(0))
+    .label(loop)
+    .lda(indy(slots.ptr))
+    .sta(absy(slots.buffer))
+    .eor(abs(slots.eor))
+    .sta(abs(slots.eor))
+    .lda(absy(slots.buffer))
+    .clc()
+    .adc(abs(slots.sum))
+    .sta(abs(slots.sum))
+    .iny()
+    .cpy(imm(slots.slotSize))
+    .bne(loop)
+    .lda(indy(slots.ptr))
+    .cmp(abs(slots.sum))
+    .bne(onBad)
+    .iny()
+    .lda(indy(slots.ptr))
+    .cmp(abs(slots.eor))
+    .bne(onBad);
+}
+
+
+namespace {
+
+  constexpr uint16_t Mmc1Control = 0x8000;
+  constexpr uint16_t Mmc1Chr0 = 0xA000;
+  constexpr uint16_t Mmc1Prg = 0xE000;
+  constexpr uint16_t Mmc3BankSelect = 0x8000;
+  constexpr uint16_t Mmc3BankData = 0x8001;
+  constexpr uint16_t Mmc3Mirroring = 0xA000;
+  constexpr uint16_t Mmc3PrgRam = 0xA001;
+  constexpr uint16_t Mmc3IrqLatch = 0xC000;
+  constexpr uint16_t Mmc3IrqReload = 0xC001;
+  constexpr uint16_t Mmc3IrqDisable = 0xE000;
+  constexpr uint16_t Mmc3IrqEnable = 0xE001;
+
+  // MMC1 registers load serially: five writes of bit 0, lowest bit first.
+  cppnes::Subroutine &mmc1Write(cppnes::Subroutine &sub, uint16_t reg)
+  {
+    using namespace cppnes;
+    for (int i = 0; i < 4; ++i)
+      sub.sta(cppnes::abs(reg)).lsr();
+    return sub.sta(cppnes::abs(reg));
+  }
+
+  // Latch mappers with bus conflicts: write A = Y to bankTable+Y.
+  cppnes::Subroutine &latchWrite(cppnes::Subroutine &sub, const cppnes::Label &bankTable, const char *what)
+  {
+    using namespace cppnes;
+    if (bankTable.name().empty())
+      throw std::invalid_argument(std::string(what) + ": this mapper needs Program::addBankTable");
+    return sub.sta(absy(bankTable));
+  }
+
+  // The bank select shadow is an explicit address or a declared (still unresolved) variable.
+  const cppnes::AbsAddress &mmc3Shadow(const cppnes::AbsAddress &bankSelect, const char *what)
+  {
+    if (bankSelect.value() == 0 && bankSelect.name().empty())
+      throw std::invalid_argument(std::string(what) + ": MMC3 needs the bank select shadow, Program::mmc3BankSelect()");
+    return bankSelect;
+  }
+
+  cppnes::Subroutine &mmc3Select(cppnes::Subroutine &sub, uint8_t reg, uint8_t bank, const cppnes::AbsAddress &bankSelect)
+  {
+    using namespace cppnes;
+    return sub
+      .lda(imm(reg))
+      .sta(cppnes::abs(bankSelect))
+      .sta(cppnes::abs(Mmc3BankSelect))
+      .lda(imm(bank))
+      .sta(cppnes::abs(Mmc3BankData));
+  }
+
+} // anonymous namespace
+
+cppnes::Subroutine &cppnes::bblocks::switchBank(Subroutine &sub, Mapper mapper, uint8_t bank, const Label &bankTable, AbsAddress bankSelect)
+{
+  switch (mapper) {
+  case Mapper::UNROM:
+    sub.ldy(imm(bank)).tya();
+    return latchWrite(sub, bankTable, "switchBank");
+  case Mapper::MMC1:
+    sub.lda(imm(bank));
+    return mmc1Write(sub, Mmc1Prg);
+  case Mapper::MMC3:
+    // 8KB banks: R6 at $8000, R7 at $A000
+    if (0x7F < bank)
+      throw std::invalid_argument("switchBank: MMC3 bank must be < 128");
+    mmc3Select(sub, 6, static_cast<uint8_t>(bank * 2), mmc3Shadow(bankSelect, "switchBank"));
+    return mmc3Select(sub, 7, static_cast<uint8_t>(bank * 2 + 1), bankSelect);
+  default:
+    throw std::invalid_argument("switchBank: mapper has no switchable PRG banks");
+  }
+}
+
+cppnes::Subroutine &cppnes::bblocks::switchBankA(Subroutine &sub, Mapper mapper, const Label &bankTable, AbsAddress bankSelect)
+{
+  switch (mapper) {
+  case Mapper::UNROM:
+    sub.tay();
+    return latchWrite(sub, bankTable, "switchBankA");
+  case Mapper::MMC1:
+    return mmc1Write(sub, Mmc1Prg);
+  case Mapper::MMC3:
+    mmc3Shadow(bankSelect, "switchBankA");
+    return sub
+      .asl()
+      .tax()
+      .lda(imm(6))
+      .sta(abs(bankSelect))
+      .sta(abs(Mmc3BankSelect))
+      .stx(abs(Mmc3BankData))
+      .inx()
+      .lda(imm(7))
+      .sta(abs(bankSelect))
+      .sta(abs(Mmc3BankSelect))
+      .stx(abs(Mmc3BankData));
+  default:
+    throw std::invalid_argument("switchBankA: mapper has no switchable PRG banks");
+  }
+}
+
+cppnes::Subroutine &cppnes::bblocks::switchChrBank(Subroutine &sub, Mapper mapper, uint8_t bank, const Label &bankTable, AbsAddress bankSelect)
+{
+  switch (mapper) {
+  case Mapper::CNROM:
+    sub.ldy(imm(bank)).tya();
+    return latchWrite(sub, bankTable, "switchChrBank");
+  case Mapper::MMC1:
+    // 8KB mode ignores bit 0 of the 4KB bank number
+    if (0x0F < bank)
+      throw std::invalid_argument("switchChrBank: MMC1 bank must be < 16");
+    sub.lda(imm(static_cast<uint8_t>(bank << 1)));
+    return mmc1Write(sub, Mmc1Chr0);
+  case Mapper::MMC3: {
+    // R0/R1 are 2KB at $0000/$0800, R2-R5 1KB at $1000-$1C00; numbers are in 1KB units
+    if (0x1F < bank)
+      throw std::invalid_argument("switchChrBank: MMC3 bank must be < 32");
+    const uint8_t base = static_cast<uint8_t>(bank * 8);
+    mmc3Select(sub, 0, base, mmc3Shadow(bankSelect, "switchChrBank"));
+    mmc3Select(sub, 1, static_cast<uint8_t>(base + 2), bankSelect);
+    for (uint8_t r = 2; r < 6; ++r)
+      mmc3Select(sub, r, static_cast<uint8_t>(base + 2 + r), bankSelect);
+    return sub;
+  }
+  default:
+    throw std::invalid_argument("switchChrBank: mapper has no switchable CHR banks");
+  }
+}
+
+cppnes::Subroutine &cppnes::bblocks::mapperInit(Subroutine &sub, Mapper mapper, Mirroring mirroring, AbsAddress bankSelect)
+{
+  switch (mapper) {
+  case Mapper::MMC1: {
+    // control: 16KB PRG at $8000 with $C000 fixed (3 << 2), 8KB CHR (bit 4 clear)
+    const uint8_t mirror = mirroring == Mirroring::Vertical ? 2 : mirroring == Mirroring::Horizontal ? 3 : 0;
+    sub
+      .lda(imm(0x80)) // reset the shift register
+      .sta(abs(Mmc1Control))
+      .lda(imm(0x0C | mirror));
+    return mmc1Write(sub, Mmc1Control);
+  }
+  case Mapper::MMC3:
+    sub
+      .lda(imm(mirroring == Mirroring::Horizontal ? 1 : 0))
+      .sta(abs(Mmc3Mirroring))
+      .sta(abs(Mmc3IrqDisable))
+      .lda(imm(0x80))
+      .sta(abs(Mmc3PrgRam));
+    return switchBank(sub, mapper, 0, Label{ "" }, bankSelect);
+  default:
+    return sub;
+  }
+}
+
+cppnes::Subroutine &cppnes::bblocks::mmc3IrqArm(Subroutine &sub, uint8_t scanlines)
+{
+  // a latch of 0 fires on every scanline on some MMC3 revisions and never on others
+  if (scanlines == 0)
+    throw std::invalid_argument("mmc3IrqArm: scanlines must be > 0");
+  return sub
+    .lda(imm(scanlines))
+    .sta(abs(Mmc3IrqLatch))
+    .sta(abs(Mmc3IrqReload)) // reload on the next counted scanline
+    .sta(abs(Mmc3IrqEnable));
+}
+
+cppnes::Subroutine &cppnes::bblocks::mmc3IrqDisable(Subroutine &sub)
+{
+  return sub.sta(abs(Mmc3IrqDisable));
+}
+
+cppnes::Subroutine &cppnes::bblocks::irqSplitsFrame(Subroutine &sub, const IrqChain &chain)
+{
+  sub
+    .lda(lobyte(Label{ chain.handlers.front() }))
+    .sta(abs(chain.target))
+    .lda(hibyte(Label{ chain.handlers.front() }))
+    .sta(abs(chain.target + 1));
+  return mmc3IrqArm(sub, chain.firstLatch);
+}
+
+cppnes::Subroutine &cppnes::bblocks::chrAnimationStep(Subroutine &sub, const ChrAnimation &anim)
+{
+  static int id = 0;
+  const std::string n = std::to_string(id++);
+  Label done("@chrAnimDone" + n);
+  Label keep("@chrAnimKeep" + n);
+  sub
+    .dec(abs(anim.timer))
+    .bpl(done)
+    .lda(imm(anim.frameDelay - 1))
+    .sta(abs(anim.timer))
+    .ldx(abs(anim.index))
+    .lda(absx(anim.sequence))
+    .inx()
+    .cpx(imm(anim.count))
+    .bcc(keep)
+    .ldx(immZero)
+    .label(keep)
+    .stx(abs(anim.index));
+  if (anim.mapper == Mapper::CNROM) {
+    sub.tay();
+    latchWrite(sub, anim.bankTable, "chrAnimationStep");
+  } else {
+    // The main thread may be between its select and data writes: put its select back.
+    sub
+      .ldy(imm(anim.reg))
+      .sty(abs(Mmc3BankSelect))
+      .sta(abs(Mmc3BankData))
+      .lda(abs(mmc3Shadow(anim.bankSelect, "chrAnimationStep")))
+      .sta(abs(Mmc3BankSelect));
+  }
+  return sub.label(done);
+}
+
+cppnes::Subroutine &cppnes::bblocks::tileQueuePush(Subroutine &sub, const TileQueue &queue, const Label &tiles, uint16_t srcTile,
+  uint16_t dstTile, const Label &onFull)
+{
+  if (511 < dstTile)
+    throw std::invalid_argument("tileQueuePush: dstTile must be 0..511");
+  const Label src{ srcTile ? tiles.name() + "+" + std::to_string(srcTile * 16) : tiles.name() };
+  return sub
+    .ldx(abs(queue.tail))
+    .lda(lobyte(src))
+    .sta(absx(queue.srcLo))
+    .lda(hibyte(src))
+    .sta(absx(queue.srcHi))
+    .lda(imm(static_cast<uint8_t>(dstTile << 4)))
+    .sta(absx(queue.dstLo))
+    .lda(imm(static_cast<uint8_t>(dstTile >> 4)))
+    .sta(absx(queue.dstHi))
+    .inx()
+    .txa()
+    .and_(imm(queue.capacity - 1))
+    .cmp(abs(queue.head))
+    .beq(onFull)
+    .sta(abs(queue.tail)); // publish last: the NMI only reads head..tail
+}
+
+cppnes::Subroutine &cppnes::bblocks::tileQueueFlush(Subroutine &sub, const TileQueue &queue, Unroll policy)
+{
+  if (policy.kind == Unroll::Kind::Partial && (policy.factor < 2 || 16 % policy.factor != 0))
+    throw std::invalid_argument("tileQueueFlush: Unroll::by factor must divide 16");
+  static int id = 0;
+  const std::string n = std::to_string(id++);
+  Label next("@tileQueueNext" + n);
+  Label copy("@tileQueueCopy" + n);
+  Label body("@tileQueueBody" + n);
+  Label done("@tileQueueDone" + n);
+  // the fully unrolled copy puts the loop ends out of branch range
+  const bool far = policy.kind == Unroll::Kind::Full;
+  sub
+    .lda(imm(queue.tilesPerFrame))
+    .sta(abs(queue.budget))
+    .label(next)
+    .ldx(abs(queue.head))
+    .cpx(abs(queue.tail));
+  if (far)
+    sub.bne(body).jmp(done).label(body);
+  else
+    sub.beq(done);
+  sub
+    .lda(absx(queue.dstHi))
+    .sta(abs(PPUADDR))
+    .lda(absx(queue.dstLo))
+    .sta(abs(PPUADDR))
+    .lda(absx(queue.srcLo))
+    .sta(zp(queue.ptr))
+    .lda(absx(queue.srcHi))
+    .sta(zp(queue.ptr + 1))
+    .ldy(immZero);
+  if (policy.kind == Unroll::Kind::Full) {
+    for (int i = 0; i < 16; ++i) {
+      sub.lda(indy(queue.ptr)).sta(abs(PPUDATA));
+      if (i < 15)
+        sub.iny();
+    }
+  } else {
+    const int factor = policy.kind == Unroll::Kind::Partial ? policy.factor : 1;
+    sub.label(copy);
+    for (int i = 0; i < factor; ++i)
+      sub.lda(indy(queue.ptr)).sta(abs(PPUDATA)).iny();
+    sub
+      .cpy(imm(16))
+      .bne(copy);
+  }
+  sub
+    .inx()
+    .txa()
+    .and_(imm(queue.capacity - 1))
+    .sta(abs(queue.head))
+    .dec(abs(queue.budget));
+  if (far)
+    sub.beq(done).jmp(next);
+  else
+    sub.bne(next);
+  return sub.label(done);
+}
+
+cppnes::Subroutine &cppnes::bblocks::loadMetatileScreen(Subroutine &sub, const MetatileTables &tables, const Label &screen,
+  uint16_t nametable, Unroll policy, AbsAddress shadow)
+{
+  if (nametable < 0x2000 || 0x2C00 < nametable || (nametable & 0x03FF) != 0)
+    throw std::invalid_argument("loadMetatileScreen: nametable must be $2000, $2400, $2800 or $2C00");
+  const int factor = policy.kind == Unroll::Kind::Full ? 16 : policy.kind == Unroll::Kind::Partial ? policy.factor : 1;
+  if (factor == 0 || 16 % factor != 0)
+    throw std::invalid_argument("loadMetatileScreen: Unroll::by factor must divide 16");
+  static int id = 0;
+  const std::string n = std::to_string(id++);
+  Label row("@metaRow" + n);
+  Label attrs("@metaAttrs" + n);
+  Label attr("@metaAttr" + n);
+  const AbsAddress scratch = tables.scratch;
+  const ZpAddress ptr = tables.ptr;
+
+  sub
+    .comment("Load metatile screen")
+    .lda(lobyte(screen))
+    .sta(zp(ptr))
+    .lda(hibyte(screen))
+    .sta(zp(ptr + 1));
+  setPPUAddr(sub, nametable)
+    .ldy(immZero)
+    .label(row)
+    .sty(abs(scratch)); // row start
+  // One tile row of the 16 metatiles from Y: the top (tl, tr) or bottom (bl, br) halves.
+  auto tileRow = [&](const Label &left, const Label &right, const std::string &loopName) {
+    Label loop(loopName + n);
+    sub.label(loop);
+    for (int i = 0; i < factor; ++i) {
+      sub
+        .lda(indy(ptr))
+        .tax()
+        .lda(absx(left))
+        .sta(abs(PPUDATA))
+        .lda(absx(right))
+        .sta(abs(PPUDATA))
+        .iny();
+    }
+    if (factor < 16)
+      sub.tya().and_(imm(0x0F)).bne(loop);
+  };
+  tileRow(tables.tl, tables.tr, "@metaTop");
+  sub.ldy(abs(scratch));
+  tileRow(tables.bl, tables.br, "@metaBottom");
+  sub
+    .cpy(imm(240))
+    .beq(attrs)
+    .jmp(row);
+
+  // Attribute table: packed at build time.
+  const Label attrTable{ screen.name() + "_attr" };
+  sub
+    .label(attrs)
+    .ldx(immZero)
+    .label(attr)
+    .lda(absx(attrTable))
+    .sta(abs(PPUDATA));
+  if (shadow.value() != 0 || !shadow.name().empty()) // fixed address or declareVar placeholder
+    sub.sta(absx(shadow));
+  sub
+    .inx()
+    .cpx(imm(64))
+    .bne(attr);
+  return sub;
+}
+
+cppnes::Subroutine &cppnes::bblocks::loadAttributeColumn(Subroutine &sub, const Label &strips, AbsAddress shadow, AbsAddress column, uint16_t nametable)
+{
+  if (nametable < 0x2000 || 0x2C00 < nametable || (nametable & 0x03FF) != 0)
+    throw std::invalid_argument("loadAttributeColumn: nametable must be $2000, $2400, $2800 or $2C00");
+  static int id = 0;
+  const std::string n = std::to_string(id++);
+  Label odd("@attrColOdd" + n);
+  Label done("@attrColDone" + n);
+  const uint16_t attributes = static_cast<uint16_t>(nametable + 0x3C0);
+
+  sub
+    .comment("Load attribute column")
+    .lda(abs(column))
+    .asl()
+    .asl()
+    .asl()
+    .tay() // strip of metatile column m: m * 8
+    .lda(abs(column))
+    .lsr()
+    .tax() // attribute column: m / 2
+    .bcs(odd);
+  // Keep the quadrants of the other metatile column, take this one's from the strip.
+  auto rows = [&](uint8_t keep) {
+    for (uint16_t r = 0; r < 8; ++r) {
+      sub
+        .lda(imm(attributes >> 8))
+        .sta(abs(PPUADDR))
+        .txa()
+        .ora(imm((attributes & 0xFF) + r * 8))
+        .sta(abs(PPUADDR))
+        .lda(absx(shadow + static_cast<uint16_t>(r * 8)))
+        .and_(imm(keep))
+        .ora(absy(Label{ strips.name() + "+" + std::to_string(r) }))
+        .sta(absx(shadow + static_cast<uint16_t>(r * 8)))
+        .sta(abs(PPUDATA));
+    }
+  };
+  rows(0xCC);
+  sub
+    .jmp(done)
+    .label(odd);
+  rows(0x33);
+  sub.label(done);
+  return sub;
+}
@@ -0,0 +1,87 @@
+#include "chr.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+cppnes::chr::Tile cppnes::chr::flip(const Tile &tile, uint8_t flips)
+{
+  Tile result;
+  for (size_t plane = 0; plane < 16; plane += 8) {
+    for (size_t row = 0; row < 8; ++row) {
+      uint8_t b = tile[plane + ((flips & FlipV) ? 7 - row : row)];
+      if (flips & FlipH) {
+        b = static_cast<uint8_t>((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+        b = static_cast<uint8_t>((b & 0xCC) >> 2 | (b & 0x33) << 2);
+        b = static_cast<uint8_t>((b & 0xAA) >> 1 | (b & 0x55) << 1);
+      }
+      result[plane + row] = b;
+    }
+  }
+  return result;
+}
+
+cppnes::chr::Dedup cppnes::chr::deduplicate(const std::vector<uint8_t> &table, bool flips)
+{
+  if (table.size() % 16 != 0 || 256 * 16 < table.size())
+    throw std::invalid_argument("chr::deduplicate: a pattern table is up to 256 tiles of 16 bytes");
+  Dedup dedup;
+  std::map<Tile, uint8_t> survivors;
+  for (size_t t = 0; t < table.size() / 16; ++t) {
+    Tile tile;
+    std::copy_n(table.begin() + t * 16, 16, tile.begin());
+    // flip(survivor) == tile <=> flip(tile) == survivor
+    TileRef ref;
+    bool found = false;
+    for (uint8_t f : { uint8_t{ 0 }, FlipH, FlipV, static_cast<uint8_t>(FlipH | FlipV) }) {
+      if (f && !flips)
+        break;
+      auto it = survivors.find(flip(tile, f));
+      if (it != survivors.end()) {
+        ref = { it->second, f };
+        found = true;
+        break;
+      }
+    }
+    if (found) {
+      dedup.freed.push_back(static_cast<uint8_t>(t));
+      ++(ref.flip ? dedup.flipped : dedup.duplicates);
+    } else {
+      ref.tile = static_cast<uint8_t>(survivors.size());
+      survivors.emplace(tile, ref.tile);
+      dedup.chr.insert(dedup.chr.end(), tile.begin(), tile.end());
+    }
+    dedup.remap.push_back(ref);
+  }
+  LOG_MSG << "chr::deduplicate:" << dedup.remap.size() << "tiles ->" << survivors.size() << "," << dedup.freed.size()
+    << "freed (" << dedup.duplicates << "duplicates," << dedup.flipped << "flips)";
+  return dedup;
+}
+
+void cppnes::chr::remap(metatiles::Nametable &nametable, const Dedup &dedup)
+{
+  for (size_t i = 0; i < 960; ++i) {
+    const TileRef &ref = dedup.remap.at(nametable[i]);
+    if (ref.flip)
+      throw std::logic_error("chr::remap: nametable tile " + std::to_string(nametable[i]) + " was merged as a flip");
+    nametable[i] = ref.tile;
+  }
+}
+
+void cppnes::chr::remap(std::vector<SpriteTile> &metasprite, const Dedup &dedup)
+{
+  for (auto &sprite : metasprite) {
+    const TileRef &ref = dedup.remap.at(sprite.tile);
+    sprite.tile = ref.tile;
+    sprite.attributes ^= ref.flip;
+  }
+}
+
+std::vector<uint8_t> cppnes::chr::patternTables(const Dedup &background, const Dedup &sprites)
+{
+  std::vector<uint8_t> chr(0x2000, 0);
+  std::copy(background.chr.begin(), background.chr.end(), chr.begin());
+  std::copy(sprites.chr.begin(), sprites.chr.end(), chr.begin() + 0x1000);
+  return chr;
+}
@@ -0,0 +1,210 @@
+#include "compression.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+  // A run this long is cheaper as tag, n, b than as literals: 3 bytes, 42 + 9n cycles.
+  constexpr size_t MinRun = 4;
+
+  struct RleToken {
+    bool run;
+    uint8_t count;
+  };
+
+  // Walks packed (without its tag byte), calling token() for each literal or run.
+  template<class F>
+  void forEachRleToken(const std::vector<uint8_t> &packed, F token)
+  {
+    if (packed.empty())
+      throw std::invalid_argument("rle: empty input");
+    const uint8_t tag = packed[0];
+    for (size_t i = 1;;) {
+      if (packed.size() <= i)
+        throw std::invalid_argument("rle: missing end marker");
+      if (packed[i] != tag) {
+        token(RleToken{ false, 1 }, packed[i]);
+        ++i;
+        continue;
+      }
+      if (packed.size() <= i + 1)
+        throw std::invalid_argument("rle: truncated run");
+      const uint8_t n = packed[i + 1];
+      if (n == 0)
+        return;
+      if (packed.size() <= i + 2)
+        throw std::invalid_argument("rle: truncated run");
+      token(RleToken{ true, n }, packed[i + 2]);
+      i += 3;
+    }
+  }
+
+  constexpr size_t LzMinMatch = 3;
+  constexpr size_t LzMaxLength = 127;
+  constexpr size_t LzWindow = 256;
+
+  // Longest match at each position and its distance (the nearest on ties).
+  std::vector<std::pair<uint8_t, uint16_t>> lzMatches(const std::vector<uint8_t> &data)
+  {
+    const size_t n = data.size();
+    std::vector<std::pair<uint8_t, uint16_t>> best(n, { 0, 0 });
+    std::vector<uint8_t> run(n + 1);
+    for (size_t d = 1; d <= LzWindow && d < n; ++d) {
+      // run[i]: how many bytes from i on equal those d bytes earlier, capped
+      run[n] = 0;
+      for (size_t i = n; d < i--;) {
+        run[i] = data[i] == data[i - d] ? static_cast<uint8_t>((std::min)(LzMaxLength, run[i + 1] + size_t{ 1 })) : 0;
+        if (best[i].first < run[i])
+          best[i] = { run[i], static_cast<uint16_t>(d) };
+      }
+    }
+    return best;
+  }
+
+} // anonymous namespace
+
+std::vector<uint8_t> cppnes::compression::rleEncode(const std::vector<uint8_t> &data)
+{
+  std::array<size_t, 256> counts{};
+  for (uint8_t b : data)
+    ++counts[b];
+  const uint8_t tag = static_cast<uint8_t>(std::min_element(counts.begin(), counts.end()) - counts.begin());
+
+  std::vector<uint8_t> packed{ tag };
+  for (size_t i = 0; i < data.size();) {
+    const uint8_t b = data[i];
+    size_t n = 1;
+    while (i + n < data.size() && data[i + n] == b && n < 255)
+      ++n;
+    if (MinRun <= n || b == tag) {
+      packed.insert(packed.end(), { tag, static_cast<uint8_t>(n), b });
+      i += n;
+    } else {
+      packed.push_back(b);
+      ++i;
+    }
+  }
+  packed.insert(packed.end(), { tag, 0 });
+  return packed;
+}
+
+std::vector<uint8_t> cppnes::compression::rleDecode(const std::vector<uint8_t> &packed)
+{
+  std::vector<uint8_t> data;
+  forEachRleToken(packed, [&](RleToken t, uint8_t b) { data.insert(data.end(), t.count, b); });
+  return data;
+}
+
+uint32_t cppnes::compression::rleDecodeCycles(const std::vector<uint8_t> &packed)
+{
+  // setup 41, literal 22, run 42 + 9n, end 24, +4 each time Y wraps to the next page
+  uint32_t cycles = 41 + 24 + 4 * static_cast<uint32_t>((packed.size() - 1) / 256);
+  forEachRleToken(packed, [&](RleToken t, uint8_t) { cycles += t.run ? 42 + 9 * t.count : 22; });
+  return cycles;
+}
+
+std::vector<uint8_t> cppnes::compression::lzEncode(const std::vector<uint8_t> &data)
+{
+  const size_t n = data.size();
+  const auto matches = lzMatches(data);
+  // cost[i]: smallest (bytes, tokens) for data[i..]; step[i]: the token starting there, as a
+  // length, negative for literals
+  std::vector<std::pair<size_t, size_t>> cost(n + 1, { SIZE_MAX, SIZE_MAX });
+  std::vector<int> step(n + 1, 0);
+  cost[n] = { 0, 0 };
+  for (size_t i = n; i-- > 0;) {
+    for (size_t k = 1; k <= LzMaxLength && i + k <= n; ++k) {
+      std::pair<size_t, size_t> c{ cost[i + k].first + 1 + k, cost[i + k].second + 1 };
+      if (c < cost[i]) {
+        cost[i] = c;
+        step[i] = -static_cast<int>(k);
+      }
+    }
+    for (size_t len = LzMinMatch; len <= matches[i].first; ++len) {
+      std::pair<size_t, size_t> c{ cost[i + len].first + 2, cost[i + len].second + 1 };
+      if (c < cost[i]) {
+        cost[i] = c;
+        step[i] = static_cast<int>(len);
+      }
+    }
+  }
+  std::vector<uint8_t> packed;
+  packed.reserve(cost[0].first + 1);
+  for (size_t i = 0; i < n;) {
+    if (step[i] < 0) {
+      const size_t k = static_cast<size_t>(-step[i]);
+      packed.push_back(static_cast<uint8_t>(k));
+      packed.insert(packed.end(), data.begin() + i, data.begin() + i + k);
+      i += k;
+    } else {
+      packed.push_back(static_cast<uint8_t>(0x80 | step[i]));
+      packed.push_back(static_cast<uint8_t>(matches[i].second - 1));
+      i += static_cast<size_t>(step[i]);
+    }
+  }
+  packed.push_back(0);
+  return packed;
+}
+
+std::vector<uint8_t> cppnes::compression::lzDecode(const std::vector<uint8_t> &packed)
+{
+  std::vector<uint8_t> data;
+  for (size_t i = 0;;) {
+    if (packed.size() <= i)
+      throw std::invalid_argument("lz: missing end marker");
+    const uint8_t token = packed[i++];
+    if (token == 0)
+      return data;
+    const size_t n = token & 0x7F;
+    if (token < 0x80) {
+      if (packed.size() < i + n)
+        throw std::invalid_argument("lz: truncated literals");
+      data.insert(data.end(), packed.begin() + i, packed.begin() + i + n);
+      i += n;
+      continue;
+    }
+    if (packed.size() <= i)
+      throw std::invalid_argument("lz: truncated match");
+    const size_t distance = packed[i++] + size_t{ 1 };
+    if (n < LzMinMatch || data.size() < distance)
+      throw std::invalid_argument("lz: match before the start of the data");
+    for (size_t k = 0; k < n; ++k)
+      data.push_back(data[data.size() - distance]);
+  }
+}
+
+std::vector<std::vector<uint8_t>> cppnes::compression::lzEncodeAll(const std::vector<std::vector<uint8_t>> &assets, unsigned threads)
+{
+  if (assets.empty())
+    return {};
+  if (threads == 0)
+    threads = (std::max)(1u, std::thread::hardware_concurrency());
+  threads = static_cast<unsigned>((std::min)(static_cast<size_t>(threads), assets.size()));
+  std::vector<std::vector<uint8_t>> packed(assets.size());
+  std::atomic<size_t> next{ 0 };
+  std::vector<std::exception_ptr> errors(threads);
+  auto worker = [&](unsigned t) {
+    try {
+      for (size_t i; (i = next++) < assets.size();)
+        packed[i] = lzEncode(assets[i]);
+    } catch (...) {
+      errors[t] = std::current_exception();
+      next = assets.size();
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < threads; ++t)
+    pool.emplace_back(worker, t);
+  worker(0);
+  for (auto &t : pool)
+    t.join();
+  for (const auto &e : errors) {
+    if (e)
+      std::rethrow_exception(e);
+  }
+  return packed;
+}
@@ -1,9 +1,11 @@
 #include "nesdefs.hpp"
 #include "asmemitter.hpp"
+#include "analysis.hpp"
 #define FMT_HEADER_ONLY
 #include "3rdparty/fmt/format.h"
 #include "3rdparty/utils_log/logger.hpp"
 #include <cassert>
+#include <set>
 #include <unordered_map>
 
 namespace cppnes {
@@ -19,7 +21,11 @@ namespace cppnes {
       std::string operator()(Immediate i) const { return fmt::format("#${:02X}", i.value); }
       std::string operator()(ImmediateLabel il) const { 
         char prefix = (il.which == ByteOf::Low) ? '<' : '>';
-        return "#" + std::string(1, prefix) + il.label.name();
+        const std::string name = il.label.name();
+        // "label+offset": < and > must apply to the whole expression
+        if (name.find_first_of("+-") != std::string::npos)
+          return "#" + std::string(1, prefix) + "(" + name + ")";
+        return "#" + std::string(1, prefix) + name;
       }
 
       std::string operator()(ZeroPage zp) const {
@@ -139,6 +145,7 @@ cppnes::AsmEmitter::~AsmEmitter()
 }
 
 void cppnes::AsmEmitter::emitPrgAsm(const Program &program, std::ostream &out) const {
+  program.checkLayout();
 
   std::ostringstream to;
 
@@ -147,6 +154,10 @@ void cppnes::AsmEmitter::emitPrgAsm(const Program &program, std::ostream &out) c
   to << "_REPLACE_WITH_CONSTANTS_";
 
   for (const auto &sub : program.subroutines()) {
+    if (sub->bank() != FixedBank)
+      to << ".segment \"BANK" << static_cast<int>(sub->bank()) << "\"\n";
+    if (sub->padBefore())
+      to << ".res " << sub->padBefore() << ", $EA ; layout padding\n";
     to << ".proc " << sub->name() << "\n";
     std::string lastLine;
     enum class LastType { None, LabelDef, Instruction, Other };
@@ -181,34 +192,21 @@ void cppnes::AsmEmitter::emitPrgAsm(const Program &program, std::ostream &out) c
       to << lastLine << "\n";
     }
     to << ".endproc ;" << sub->name() << "\n\n";
+    if (sub->bank() != FixedBank)
+      to << ".segment \"CODE\"\n\n";
   }
 
   for (const auto &[name, db] : program.dataBlocks()) {
-    to << db->label() << ":\n";
-    for (const auto &entry : db->entries()) {
-      std::visit([&](const auto &e) {
-        using T = std::decay_t<decltype(e)>;
-        if constexpr (std::is_same_v<T, DataBlock::ByteEntry>) {
-          to << "  .byte ";
-          for (size_t i = 0; i < e.data.size(); ++i) {
-            to << fmt::format("${:02X}", e.data[i]);
-            if (i < e.data.size() - 1) to << ",";
-          }
-          if (!e.comment.empty()) to << " ;" << e.comment;
-          to << "\n";
-        } else { // WordEntry
-          to << "  .word ";
-          for (size_t i = 0; i < e.data.size(); ++i) {
-            to << fmt::format("${:04X}", e.data[i]);
-            if (i < e.data.size() - 1) to << ",";
-          }
-          if (!e.comment.empty()) to << "  ;" << e.comment;
-          to << "\n";
-        }
-        }, entry);
-    }
-    to << "\n";
+    if (db->isConstrained())
+      continue;
+    if (db->bank() != FixedBank)
+      to << ".segment \"BANK" << static_cast<int>(db->bank()) << "\"\n" << formatDataBlock(*db) << ".segment \"CODE\"\n";
+    else
+      to << formatDataBlock(*db);
   }
+  to << formatAlignedData(program);
+  for (const auto &w : analysis::pageCrossWarnings(program))
+    LOG_MSG << "Warning:" << w;
   to << formatOAM(program);
   to << formatVectors(program);
   to << "\n";
@@ -236,6 +234,21 @@ void cppnes::AsmEmitter::emitPrgAsm(const Program &program, std::ostream &out) c
       constOut << fmt::format("{} = ${:04X}\n", name, value);
     }
   } 
+  // Variables referenced label-relative (#<var, #>var+n): their resolved addresses.
+  std::set<std::string> referenced;
+  for (const auto &sub : program.subroutines()) {
+    for (const auto &e : sub->instructions()) {
+      auto inst = std::get_if<Instruction>(&e);
+      auto il = inst ? std::get_if<ImmediateLabel>(&inst->operand) : nullptr;
+      if (il)
+        referenced.insert(il->label.name().substr(0, il->label.name().find('+')));
+    }
+  }
+  for (const auto &v : program.variables()) {
+    if (!v.resolved || !referenced.count(v.name) || imp->formatter_.zpConstants_.count(v.name) || imp->formatter_.absConstants_.count(v.name))
+      continue;
+    constOut << (v.zeroPage ? fmt::format("{} = ${:02X}\n", v.name, v.address) : fmt::format("{} = ${:04X}\n", v.name, v.address));
+  }
   if (constOut.str().empty()) {
     str.erase(str.find("_REPLACE_WITH_CONSTANTS_"), std::string("_REPLACE_WITH_CONSTANTS_").length());
   } else {
@@ -247,23 +260,53 @@ void cppnes::AsmEmitter::emitPrgAsm(const Program &program, std::ostream &out) c
   out << str;
 }
 
-void cppnes::AsmEmitter::emitLinkerConfig(std::ostream &out) const {
+void cppnes::AsmEmitter::emitLinkerConfig(const Rom &rom, std::ostream &out) const {
+  // Constrained data goes first, at the page-aligned start of PRG; CODE follows it.
+  const bool aligned = rom.program() && !analysis::layoutConstrainedData(*rom.program()).empty();
+  const bool sram = rom.program() && rom.program()->memoryMap().sram.inUse();
+  const uint8_t banks = rom.switchableBanks();
+  if (!banks && (rom.prgBanks() < 1 || 2 < rom.prgBanks()))
+    throw std::runtime_error("emitLinkerConfig: NROM/CNROM have 1 or 2 PRG banks");
+  if (banks && rom.program()) {
+    for (const auto &sub : rom.program()->subroutines()) {
+      if (sub->bank() != FixedBank && banks <= sub->bank())
+        throw std::runtime_error(fmt::format("emitLinkerConfig: {} is in bank {}, only {} switchable", sub->name(), sub->bank(), banks));
+    }
+    for (const auto &[name, db] : rom.program()->dataBlocks()) {
+      if (db->bank() != FixedBank && banks <= db->bank())
+        throw std::runtime_error(fmt::format("emitLinkerConfig: {} is in bank {}, only {} switchable", name, db->bank(), banks));
+    }
+  } else if (rom.program()) {
+    for (const auto &sub : rom.program()->subroutines()) {
+      if (sub->bank() != FixedBank)
+        throw std::runtime_error("emitLinkerConfig: " + sub->name() + " is banked but the mapper has no PRG banks");
+    }
+  }
+  // Switchable banks (at $8000) come first in the file, the fixed PRG area last.
+  const uint16_t fixedBase = banks || rom.prgBanks() == 1 ? 0xC000 : 0x8000;
+  std::string bankMemory, bankSegments;
+  for (uint8_t b = 0; b < banks; ++b) {
+    bankMemory += fmt::format("  PRG{}:{:<{}}start = $8000,  size = $4000, fill = yes, fillval = $FF;\n", b, "", b < 10 ? 5 : 4);
+    bankSegments += fmt::format("  BANK{}:{:<{}}load = PRG{},{:<{}}type = ro,    optional = yes;\n", b, "", b < 10 ? 4 : 3, b, "", b < 10 ? 4 : 3);
+  }
+  const std::string codeSegments = bankSegments + (aligned ?
+    fmt::format("  ALIGNED:  load = PRG,     type = ro,    start = ${:04X};\n", fixedBase) +
+    "  CODE:     load = PRG,     type = ro;\n" :
+    fmt::format("  CODE:     load = PRG,     type = ro,    start = ${:04X};\n", fixedBase));
   out <<
     R"(MEMORY {
   HEADER:   start = $0000,  size = $0010, fill = yes;
-  PRG:      start = $8000,  size = $8000, fill = yes, fillval = $FF;
-  CHR:      start = $0000,  size = $2000, fill = yes, fillval = $00;
-  RAM:      start = $0300,  size = $0600, type = rw;
+)" << bankMemory << fmt::format("  PRG:      start = ${:04X},  size = ${:04X}, fill = yes, fillval = $FF;\n", fixedBase, 0x10000 - fixedBase)
+    << (rom.chrBanks() ? fmt::format("  CHR:      start = $0000,  size = ${:04X}, fill = yes, fillval = $00;\n", 0x2000 * rom.chrBanks()) : "")
+    << R"(  RAM:      start = $0300,  size = $0600, type = rw;
   OAMBUF:   start = $0200,  size = $0100, type = rw;
-}
+)" << (sram ? "  SRAM:     start = $6000,  size = $2000, type = rw;\n" : "") << R"(}
 
 SEGMENTS {
   HEADER:   load = HEADER,  type = ro;
-  CODE:     load = PRG,     type = ro,    start = $8000;
-  RODATA:   load = PRG,     type = ro;
+)" << codeSegments << R"(  RODATA:   load = PRG,     type = ro;
   VECTORS:  load = PRG,     type = ro,    start = $FFFA;
-  CHARS:    load = CHR,     type = ro;
-  OAM:      load = OAMBUF,  type = bss;
+)" << (rom.chrBanks() ? "  CHARS:    load = CHR,     type = ro;\n" : "") << R"(  OAM:      load = OAMBUF,  type = bss;
   BSS:      load = RAM,     type = bss;
 }
 )";
@@ -274,55 +317,74 @@ void cppnes::AsmEmitter::emitInesHeader(const Rom &rom, std::ostream &out) const
   // ca65 emits this as part of the HEADER segment
   out << "; Generated by cpp-nes-6502\n"
     << "; --------------------------\n\n";
+  const bool battery = rom.program() && rom.program()->memoryMap().sram.battery();
   out << ".segment \"HEADER\"\n"
     << fmt::format("  .byte $4E, $45, $53, $1A  ; 'NES' + MS-DOS EOF\n")
-    << fmt::format("  .byte $02                  ; PRG-ROM size (2 x 16KB)\n")
-    << fmt::format("  .byte $01                  ; CHR-ROM size (1 x 8KB)\n")
-    << fmt::format("  .byte ${:02X}                  ; Mapper low / mirroring\n",
-      rom.mirroringByte())
-    << fmt::format("  .byte $00                  ; Mapper high\n")
+    << fmt::format("  .byte ${:02X}                  ; PRG-ROM size ({} x 16KB)\n", rom.prgBanks(), rom.prgBanks())
+    << fmt::format("  .byte ${:02X}                  ; CHR-ROM size ({} x 8KB)\n", rom.chrBanks(), rom.chrBanks())
+    << fmt::format("  .byte ${:02X}                  ; Mapper low / mirroring{}\n",
+      ((rom.mapperNumber() & 0x0F) << 4) | rom.mirroringByte() | (battery ? 0x02 : 0x00), battery ? " / battery" : "")
+    << fmt::format("  .byte ${:02X}                  ; Mapper high\n", rom.mapperNumber() & 0xF0)
     << "  .byte $00, $00, $00, $00, $00, $00, $00, $00  ; padding\n; Header is total 16 bytes.\n\n";
 }
 
-void cppnes::AsmEmitter::emitChars(const Resources &rc, std::ostream &out) const
+void cppnes::AsmEmitter::emitChars(const Resources &rc, std::ostream &out, bool chrRom) const
 {
   const auto &chr = rc.chrData();
-  out << ".segment \"CHARS\"\n";
-
-  if (chr.empty()) {
-    out << "; WARNING: No CHR data loaded\n";
-    out << ".res 8192 ; Reserving 8192 bytes of blank space\n";
-    out << "\n";
-    return;
+  if (chrRom) {
+    out << ".segment \"CHARS\"\n";
+    if (chr.empty()) {
+      out << "; WARNING: No CHR data loaded\n";
+      out << ".res 8192 ; Reserving 8192 bytes of blank space\n";
+      out << "\n";
+      return;
+    }
+  } else if (!chr.empty()) {
+    // CHR-RAM: tiles are uploaded from PRG
+    out << ".segment \"RODATA\"\nchrTiles:\n";
   }
-  if (rc.chrUseFilename()) {
-    out << fmt::format("; CHR data loaded from file: {}\n", rc.chrPath());
-    out << fmt::format(".incbin \"{}\"\n", rc.chrPath());
-  } else {
-    constexpr size_t bytesPerLine = 16;
-    for (size_t i = 0; i < chr.size(); i += bytesPerLine) {
-      out << "  .byte ";
-      size_t lineEnd = (std::min)(i + bytesPerLine, chr.size());
-      for (size_t j = i; j < lineEnd; ++j) {
-        out << fmt::format("${:02X}", chr[j]);
-        if (j < lineEnd - 1) out << ", ";
-      }
-      // Comment: byte offset, useful for debugging tile boundaries
-      if (imp->options_.emitComments) {
-        size_t tile = i / 16;
-        out << fmt::format("  ; tile {:03d} offset ${:04X}", tile, i);
+  if (!chr.empty()) {
+    if (rc.chrUseFilename()) {
+      out << fmt::format("; CHR data loaded from file: {}\n", rc.chrPath());
+      out << fmt::format(".incbin \"{}\"\n", rc.chrPath());
+    } else {
+      constexpr size_t bytesPerLine = 16;
+      for (size_t i = 0; i < chr.size(); i += bytesPerLine) {
+        out << "  .byte ";
+        size_t lineEnd = (std::min)(i + bytesPerLine, chr.size());
+        for (size_t j = i; j < lineEnd; ++j) {
+          out << fmt::format("${:02X}", chr[j]);
+          if (j < lineEnd - 1) out << ", ";
+        }
+        // Comment: byte offset, useful for debugging tile boundaries
+        if (imp->options_.emitComments) {
+          size_t tile = i / 16;
+          out << fmt::format("  ; tile {:03d} offset ${:04X}", tile, i);
+        }
+        out << "\n";
       }
-      out << "\n";
     }
+    out << "\n";
   }
-  out << "\n";
 
-  if (!rc.nametables().empty()) {
+  if (!rc.nametables().empty() || !rc.packedNametables().empty()) {
     out << ".segment \"RODATA\"\n";
     for (const auto &[label, filename] : rc.nametables()) {
       out << label << ":\n";
       out << fmt::format("  .incbin \"{}\"\n", filename);
     }
+    for (const auto &[label, packed] : rc.packedNametables()) {
+      out << label << ":";
+      if (imp->options_.emitComments)
+        out << fmt::format(" ; packed, {} bytes", packed.size());
+      out << "\n";
+      for (size_t i = 0; i < packed.size(); i += 16) {
+        out << "  .byte ";
+        for (size_t j = i; j < (std::min)(i + 16, packed.size()); ++j)
+          out << fmt::format("{}${:02X}", j == i ? "" : ", ", packed[j]);
+        out << "\n";
+      }
+    }
   }
 
   out << "\n";
@@ -388,6 +450,56 @@ std::string cppnes::AsmEmitter::formatVectors(const Program &prg) const
     (prg.irqVector() ? vec(prg.irqVector()) : std::string{"0"}));
 }
 
+std::string cppnes::AsmEmitter::formatDataBlock(const DataBlock &db) const
+{
+  std::ostringstream to;
+  to << db.label() << ":\n";
+  for (const auto &entry : db.entries()) {
+    std::visit([&](const auto &e) {
+      using T = std::decay_t<decltype(e)>;
+      if constexpr (std::is_same_v<T, DataBlock::ByteEntry>) {
+        to << "  .byte ";
+        for (size_t i = 0; i < e.data.size(); ++i) {
+          to << fmt::format("${:02X}", e.data[i]);
+          if (i < e.data.size() - 1) to << ",";
+        }
+        if (!e.comment.empty()) to << " ;" << e.comment;
+        to << "\n";
+      } else { // WordEntry
+        to << "  .word ";
+        for (size_t i = 0; i < e.data.size(); ++i) {
+          to << fmt::format("${:04X}", e.data[i]);
+          if (i < e.data.size() - 1) to << ",";
+        }
+        if (!e.comment.empty()) to << "  ;" << e.comment;
+        to << "\n";
+      }
+      }, entry);
+  }
+  to << "\n";
+  return to.str();
+}
+
+std::string cppnes::AsmEmitter::formatAlignedData(const Program &prg) const
+{
+  auto placements = analysis::layoutConstrainedData(prg);
+  if (placements.empty())
+    return "";
+  std::ostringstream to;
+  to << ".segment \"ALIGNED\"\n\n";
+  uint32_t cur = 0;
+  for (const auto &p : placements) {
+    if (cur < p.offset)
+      to << fmt::format("  .res {}, $FF ; padding\n\n", p.offset - cur);
+    if (imp->options_.emitComments)
+      to << fmt::format("; offset ${:04X}, {} bytes\n", p.offset, p.block->size());
+    to << formatDataBlock(*p.block);
+    cur = p.offset + static_cast<uint32_t>(p.block->size());
+  }
+  to << ".segment \"CODE\"\n\n";
+  return to.str();
+}
+
 std::string cppnes::AsmEmitter::formatOAM(const Program &) const
 {
   return fmt::format(
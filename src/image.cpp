@@ -0,0 +1,277 @@
+#include "image.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+  // The usual 2C02 palette, as 0xRRGGBB.
+  constexpr uint32_t NesPalette[64] = {
+    0x7C7C7C, 0x0000FC, 0x0000BC, 0x4428BC, 0x940084, 0xA80020, 0xA81000, 0x881400,
+    0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000, 0x000000, 0x000000,
+    0xBCBCBC, 0x0078F8, 0x0058F8, 0x6844FC, 0xD800CC, 0xE40058, 0xF83800, 0xE45C10,
+    0xAC7C00, 0x00B800, 0x00A800, 0x00A844, 0x008888, 0x000000, 0x000000, 0x000000,
+    0xF8F8F8, 0x3CBCFC, 0x6888FC, 0x9878F8, 0xF878F8, 0xF85898, 0xF87858, 0xFCA044,
+    0xF8B800, 0xB8F818, 0x58D854, 0x58F898, 0x00E8D8, 0x787878, 0x000000, 0x000000,
+    0xFCFCFC, 0xA4E4FC, 0xB8B8F8, 0xD8B8F8, 0xF8B8F8, 0xF8A4C0, 0xF0D0B0, 0xFCE0A8,
+    0xF8D878, 0xD8F878, 0xB8F8B8, 0xB8F8D8, 0x00FCFC, 0xF8D8F8, 0x000000, 0x000000,
+  };
+
+  uint32_t readLe(const std::vector<uint8_t> &bytes, size_t at, size_t size)
+  {
+    if (bytes.size() < at + size)
+      throw std::runtime_error("image: truncated BMP");
+    uint32_t v = 0;
+    for (size_t i = 0; i < size; ++i)
+      v |= static_cast<uint32_t>(bytes[at + i]) << (8 * i);
+    return v;
+  }
+
+  cppnes::image::Image decodeNetpbm(const std::vector<uint8_t> &bytes)
+  {
+    size_t at = 2;
+    auto number = [&]() {
+      while (at < bytes.size() && (std::isspace(bytes[at]) || bytes[at] == '#')) {
+        if (bytes[at] == '#')
+          while (at < bytes.size() && bytes[at] != '\n')
+            ++at;
+        else
+          ++at;
+      }
+      size_t value = 0, digits = 0;
+      for (; at < bytes.size() && std::isdigit(bytes[at]); ++at, ++digits)
+        value = value * 10 + (bytes[at] - '0');
+      if (digits == 0)
+        throw std::runtime_error("image: bad PGM/PPM header");
+      return value;
+    };
+    const bool rgb = bytes[1] == '6';
+    cppnes::image::Image img;
+    img.width = number();
+    img.height = number();
+    const size_t maxval = number();
+    ++at; // the single whitespace before the raster
+    if (maxval == 0 || 255 < maxval)
+      throw std::runtime_error("image: only 8-bit PGM/PPM is supported");
+    const size_t channels = rgb ? 3 : 1;
+    if (bytes.size() < at + img.width * img.height * channels)
+      throw std::runtime_error("image: truncated PGM/PPM");
+    img.pixels.resize(img.width * img.height);
+    for (size_t i = 0; i < img.pixels.size(); ++i) {
+      const uint8_t *p = &bytes[at + i * channels];
+      if (!rgb) {
+        if (0x3F < p[0])
+          throw std::runtime_error("image: PGM values are NES colors, $00-$3F");
+        img.pixels[i] = p[0];
+        continue;
+      }
+      auto scale = [&](uint8_t c) { return static_cast<uint8_t>(c * 255 / maxval); };
+      img.pixels[i] = cppnes::image::nesColor(scale(p[0]), scale(p[1]), scale(p[2]));
+    }
+    return img;
+  }
+
+  cppnes::image::Image decodeBmp(const std::vector<uint8_t> &bytes)
+  {
+    const uint32_t dataOffset = readLe(bytes, 10, 4);
+    const uint32_t infoSize = readLe(bytes, 14, 4);
+    const int32_t width = static_cast<int32_t>(readLe(bytes, 18, 4));
+    const int32_t height = static_cast<int32_t>(readLe(bytes, 22, 4));
+    const uint32_t bpp = readLe(bytes, 28, 2);
+    if (readLe(bytes, 30, 4) != 0)
+      throw std::runtime_error("image: compressed BMP is not supported");
+    if (bpp != 4 && bpp != 8 && bpp != 24)
+      throw std::runtime_error("image: BMP must be 4, 8 or 24 bits per pixel");
+    if (width <= 0 || height == 0)
+      throw std::runtime_error("image: bad BMP size");
+    std::vector<uint8_t> palette; // NES color of each BMP palette entry
+    if (bpp != 24) {
+      const uint32_t used = readLe(bytes, 46, 4);
+      const uint32_t count = used ? used : 1u << bpp;
+      for (uint32_t i = 0; i < count; ++i) {
+        const size_t at = 14 + infoSize + i * 4; // B, G, R, reserved
+        readLe(bytes, at, 4);
+        palette.push_back(cppnes::image::nesColor(bytes[at + 2], bytes[at + 1], bytes[at]));
+      }
+    }
+    cppnes::image::Image img;
+    img.width = static_cast<size_t>(width);
+    img.height = static_cast<size_t>(height < 0 ? -height : height);
+    img.pixels.resize(img.width * img.height);
+    const size_t stride = (img.width * bpp + 31) / 32 * 4;
+    readLe(bytes, dataOffset + stride * img.height - 1, 1);
+    for (size_t y = 0; y < img.height; ++y) {
+      const uint8_t *row = &bytes[dataOffset + stride * (height < 0 ? y : img.height - 1 - y)]; // bottom-up unless height < 0
+      for (size_t x = 0; x < img.width; ++x) {
+        uint8_t &out = img.pixels[y * img.width + x];
+        if (bpp == 24) {
+          out = cppnes::image::nesColor(row[x * 3 + 2], row[x * 3 + 1], row[x * 3]);
+          continue;
+        }
+        const size_t index = bpp == 8 ? row[x] : (row[x / 2] >> (x % 2 ? 0 : 4)) & 0x0F;
+        if (palette.size() <= index)
+          throw std::runtime_error("image: BMP pixel outside its palette");
+        out = palette[index];
+      }
+    }
+    return img;
+  }
+
+  // Bit 0 of each of the 8 bytes of x, first byte in bit 7: every byte lands on its own bit
+  // of the top byte and the partial products never overlap, so one multiply packs a bitplane row.
+  uint8_t gatherBits(uint64_t x)
+  {
+    return static_cast<uint8_t>(((x & 0x0101010101010101ull) * 0x8040201008040201ull) >> 56);
+  }
+
+  struct TileKey {
+    uint64_t plane0, plane1; // 8 rows each, row 0 in the low byte
+    bool operator==(const TileKey &) const = default;
+  };
+
+  struct TileKeyHash {
+    size_t operator()(const TileKey &k) const {
+      return static_cast<size_t>((k.plane0 * 0x9E3779B97F4A7C15ull) ^ k.plane1);
+    }
+  };
+
+} // anonymous namespace
+
+uint8_t cppnes::image::nesColor(uint8_t r, uint8_t g, uint8_t b)
+{
+  uint8_t best = 0x0F;
+  uint32_t bestDistance = UINT32_MAX;
+  for (uint8_t i = 0; i < 64; ++i) {
+    // one black ($0F): not $0D (blacker than black) nor the mirrors in columns $E/$F and $1D
+    if (((i & 0x0E) == 0x0E && i != 0x0F) || i == 0x0D || i == 0x1D)
+      continue;
+    const int dr = static_cast<int>(NesPalette[i] >> 16) - r;
+    const int dg = static_cast<int>((NesPalette[i] >> 8) & 0xFF) - g;
+    const int db = static_cast<int>(NesPalette[i] & 0xFF) - b;
+    const uint32_t distance = static_cast<uint32_t>(dr * dr + dg * dg + db * db);
+    if (distance < bestDistance || (distance == bestDistance && i == 0x0F)) {
+      best = i;
+      bestDistance = distance;
+    }
+  }
+  return best;
+}
+
+cppnes::image::Image cppnes::image::decode(const std::vector<uint8_t> &bytes)
+{
+  if (2 <= bytes.size() && bytes[0] == 'P' && (bytes[1] == '5' || bytes[1] == '6'))
+    return decodeNetpbm(bytes);
+  if (2 <= bytes.size() && bytes[0] == 'B' && bytes[1] == 'M')
+    return decodeBmp(bytes);
+  throw std::runtime_error("image: not a binary PGM/PPM or BMP file");
+}
+
+cppnes::image::Image cppnes::image::load(const std::filesystem::path &path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open image: " + path.string());
+  return decode(std::vector<uint8_t>{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() });
+}
+
+cppnes::image::Screen cppnes::image::convert(const Image &image)
+{
+  const auto start = std::chrono::steady_clock::now();
+  if (image.width != 256 || image.height != 240 || image.pixels.size() != 256 * 240)
+    throw std::invalid_argument("image::convert: a screen is 256x240");
+
+  // Colors: the most used one is the background, each 16x16 area needs at most 3 more.
+  std::array<size_t, 64> counts{};
+  std::array<uint64_t, 240> areas{}; // color masks
+  for (size_t y = 0; y < 240; ++y) {
+    for (size_t x = 0; x < 256; ++x) {
+      const uint8_t c = image.pixels[y * 256 + x];
+      if (0x3F < c)
+        throw std::invalid_argument("image::convert: pixels must be NES colors");
+      ++counts[c];
+      areas[(y / 16) * 16 + x / 16] |= uint64_t{ 1 } << c;
+    }
+  }
+  const uint8_t bg = static_cast<uint8_t>(std::max_element(counts.begin(), counts.end()) - counts.begin());
+  std::vector<uint64_t> sets;
+  for (size_t a = 0; a < areas.size(); ++a) {
+    areas[a] &= ~(uint64_t{ 1 } << bg);
+    if (3 < std::popcount(areas[a]))
+      throw std::invalid_argument("image::convert: the 16x16 area at " + std::to_string(a % 16 * 16) + "," +
+        std::to_string(a / 16 * 16) + " has more than 4 colors");
+    sets.push_back(areas[a]);
+  }
+  // Fit the 4 palettes: largest color sets first, each into the palette that grows least.
+  std::sort(sets.begin(), sets.end(), [](uint64_t a, uint64_t b) { return std::popcount(a) > std::popcount(b) || (std::popcount(a) == std::popcount(b) && a < b); });
+  sets.erase(std::unique(sets.begin(), sets.end()), sets.end());
+  std::vector<uint64_t> palettes;
+  for (uint64_t set : sets) {
+    uint64_t *best = nullptr;
+    for (auto &p : palettes) {
+      if (std::popcount(p | set) <= 3 && (!best || std::popcount(p | set) - std::popcount(p) < std::popcount(*best | set) - std::popcount(*best)))
+        best = &p;
+    }
+    if (best)
+      *best |= set;
+    else if (palettes.size() < 4)
+      palettes.push_back(set);
+    else
+      throw std::invalid_argument("image::convert: the 16x16 areas need more than 4 palettes");
+  }
+
+  Screen screen;
+  std::array<std::array<uint8_t, 64>, 4> slots{}; // palette -> color -> 0-3
+  for (size_t k = 0; k < 4; ++k) {
+    std::fill(screen.palettes.begin() + k * 4, screen.palettes.begin() + k * 4 + 4, bg);
+    uint8_t slot = 1;
+    for (uint8_t c = 0; k < palettes.size() && c < 64; ++c) {
+      if (palettes[k] >> c & 1) {
+        screen.palettes[k * 4 + slot] = c;
+        slots[k][c] = slot++;
+      }
+    }
+  }
+  std::array<uint8_t, 240> areaPalette{};
+  for (size_t a = 0; a < areas.size(); ++a) {
+    const uint8_t k = static_cast<uint8_t>(std::find_if(palettes.begin(), palettes.end(), [&](uint64_t p) { return (p & areas[a]) == areas[a]; }) - palettes.begin());
+    areaPalette[a] = palettes.empty() ? 0 : k;
+    screen.nametable[960 + (a / 32) * 8 + (a % 16) / 2] |= static_cast<uint8_t>(areaPalette[a] << ((((a / 16) & 1) * 2 + (a & 1)) * 2));
+  }
+
+  // Tiles: each row of 8 pixels -> 8 slot bytes -> one byte per bitplane.
+  std::unordered_map<TileKey, uint8_t, TileKeyHash> ids;
+  for (size_t ty = 0; ty < 30; ++ty) {
+    for (size_t tx = 0; tx < 32; ++tx) {
+      const auto &slot = slots[areaPalette[(ty / 2) * 16 + tx / 2]];
+      TileKey key{ 0, 0 };
+      for (size_t row = 0; row < 8; ++row) {
+        const uint8_t *p = &image.pixels[(ty * 8 + row) * 256 + tx * 8];
+        uint64_t x = 0;
+        for (size_t i = 0; i < 8; ++i)
+          x |= static_cast<uint64_t>(slot[p[i]]) << (8 * i);
+        key.plane0 |= static_cast<uint64_t>(gatherBits(x)) << (8 * row);
+        key.plane1 |= static_cast<uint64_t>(gatherBits(x >> 1)) << (8 * row);
+      }
+      auto [it, added] = ids.try_emplace(key, static_cast<uint8_t>(ids.size()));
+      if (added) {
+        if (ids.size() > 256)
+          throw std::out_of_range("image::convert: more than 256 distinct tiles");
+        for (uint64_t plane : { key.plane0, key.plane1 }) {
+          for (size_t row = 0; row < 8; ++row)
+            screen.chr.push_back(static_cast<uint8_t>(plane >> (8 * row)));
+        }
+      }
+      screen.nametable[ty * 32 + tx] = it->second;
+    }
+  }
+  const auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  LOG_MSG << "image::convert:" << ids.size() << "tiles," << palettes.size() << "palettes, in" << us << "us";
+  return screen;
+}
@@ -0,0 +1,270 @@
+#include "nesdefs.hpp"
+#include "analysis.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <unordered_set>
+
+namespace {
+
+  struct Candidate {
+    cppnes::Subroutine *callee = nullptr;
+    int calls = 0;
+    bool otherRefs = false;    // referenced by something other than JSR (JMP, address-of, ...)
+    uint64_t weightedCalls = 0;
+    int32_t bodyBytes = 0;     // without the trailing RTS
+    int32_t growth = 0;
+  };
+
+  bool isReturn(const cppnes::Entry &e, cppnes::Opcode op)
+  {
+    auto inst = std::get_if<cppnes::Instruction>(&e);
+    return inst && inst->opcode == op;
+  }
+
+  const cppnes::Instruction *lastInstruction(const cppnes::Subroutine &sub)
+  {
+    const auto &entries = sub.instructions();
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+      if (auto inst = std::get_if<cppnes::Instruction>(&*it))
+        return inst;
+    }
+    return nullptr;
+  }
+
+  // Control never falls out of the end into the next subroutine.
+  bool endsWithTransfer(const cppnes::Subroutine &sub)
+  {
+    auto last = lastInstruction(sub);
+    return last && (last->opcode == cppnes::Opcode::RTS || last->opcode == cppnes::Opcode::RTI || last->opcode == cppnes::Opcode::JMP);
+  }
+
+  // Every relative branch to a label of the subroutine still reaches it (-128..127 bytes).
+  bool branchesInRange(const cppnes::Subroutine &sub)
+  {
+    using namespace cppnes;
+    const auto &entries = sub.instructions();
+    auto offsets = analysis::entryOffsets(sub);
+    std::unordered_map<std::string, uint32_t> labels;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (auto ldef = std::get_if<LabelDef>(&entries[i]))
+        labels.emplace(ldef->label.name(), offsets[i]);
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+      auto inst = std::get_if<Instruction>(&entries[i]);
+      auto target = inst && analysis::isBranch(inst->opcode) ? std::get_if<Label>(&inst->operand) : nullptr;
+      auto it = target ? labels.find(target->name()) : labels.end();
+      if (it == labels.end())
+        continue;
+      const int64_t disp = static_cast<int64_t>(it->second) - static_cast<int64_t>(offsets[i] + 2);
+      if (disp < -128 || 127 < disp)
+        return false;
+    }
+    return true;
+  }
+
+  // Calls fn(name) for every label referenced by the instruction operand, allowing rename.
+  template<typename Fn>
+  void forEachLabelRef(cppnes::Instruction &inst, Fn fn)
+  {
+    using namespace cppnes;
+    std::visit([&](auto &op) {
+      using T = std::decay_t<decltype(op)>;
+      if constexpr (std::is_same_v<T, Label>)
+        fn(op);
+      else if constexpr (std::is_same_v<T, ImmediateLabel>)
+        fn(op.label);
+      else if constexpr (std::is_same_v<T, AbsoluteX> || std::is_same_v<T, AbsoluteY> ||
+        std::is_same_v<T, ZeroPageX> || std::is_same_v<T, ZeroPageY>) {
+        if (auto l = std::get_if<Label>(&op.base))
+          fn(*l);
+      }
+      }, inst.operand);
+  }
+
+  // Callee body with labels renamed and inner returns turned into jumps to the end.
+  std::vector<cppnes::Entry> instantiate(const cppnes::Subroutine &callee, int id)
+  {
+    using namespace cppnes;
+    const auto &src = callee.instructions();
+    std::unordered_set<std::string> defined;
+    for (const auto &e : src) {
+      if (auto ldef = std::get_if<LabelDef>(&e))
+        defined.insert(ldef->label.name());
+    }
+    auto rename = [&](const std::string &name) {
+      std::string base = name[0] == '@' ? name.substr(1) : name;
+      return "@" + callee.name() + "_" + base + "_" + std::to_string(id);
+    };
+    const Label endLabel{ "@" + callee.name() + "_end_" + std::to_string(id) };
+
+    // The trailing RTS is dropped; every other one becomes a JMP to the end label.
+    size_t lastRts = src.size();
+    for (size_t i = src.size(); 0 < i; --i) {
+      if (isReturn(src[i - 1], Opcode::RTS)) { lastRts = i - 1; break; }
+    }
+
+    std::vector<Entry> out;
+    out.push_back(LineComment{ "inlined " + callee.name() });
+    bool needsEnd = false;
+    for (size_t i = 0; i < src.size(); ++i) {
+      if (i == lastRts)
+        continue;
+      Entry e = src[i];
+      if (auto ldef = std::get_if<LabelDef>(&e)) {
+        ldef->label = Label{ rename(ldef->label.name()) };
+      } else if (auto inst = std::get_if<Instruction>(&e)) {
+        if (inst->opcode == Opcode::RTS) {
+          *inst = Instruction{ Opcode::JMP, endLabel };
+          needsEnd = true;
+        } else {
+          forEachLabelRef(*inst, [&](Label &l) {
+            if (defined.count(l.name())) l = Label{ rename(l.name()) };
+            });
+        }
+      }
+      out.push_back(std::move(e));
+    }
+    if (needsEnd)
+      out.push_back(LabelDef{ endLabel });
+    return out;
+  }
+
+} // anonymous namespace
+
+int cppnes::Program::inlineSubroutines(const InlineOptions &options)
+{
+  std::unordered_map<std::string, Candidate> cands;
+  for (auto &sub : subroutines_) {
+    if (sub->inlineHint() == InlineHint::Never)
+      continue;
+    if (sub.get() == resetVector_ || sub.get() == nmiVector_ || sub.get() == irqVector_)
+      continue;
+    auto last = lastInstruction(*sub);
+    if (!last || last->opcode != Opcode::RTS)
+      continue; // falls through or ends with JMP/RTI: not a plain leaf body
+    const auto &entries = sub->instructions();
+    if (std::any_of(entries.begin(), entries.end(), [](const Entry &e) { return isReturn(e, Opcode::RTI); }))
+      continue;
+    auto calls = analysis::callees(*sub);
+    if (std::find(calls.begin(), calls.end(), sub->name()) != calls.end())
+      continue; // recursive
+    Candidate c;
+    c.callee = sub.get();
+    int innerReturns = static_cast<int>(std::count_if(entries.begin(), entries.end(),
+      [](const Entry &e) { return isReturn(e, Opcode::RTS); })) - 1;
+    c.bodyBytes = static_cast<int32_t>(analysis::subroutineBytes(*sub)) - 1 + 2 * innerReturns;
+    cands.emplace(sub->name(), c);
+  }
+
+  // Count call sites and other references.
+  for (auto &sub : subroutines_) {
+    auto weights = analysis::entryWeights(*sub);
+    for (size_t i = 0; i < sub->instructions_.size(); ++i) {
+      auto inst = std::get_if<Instruction>(&sub->instructions_[i]);
+      if (!inst)
+        continue;
+      forEachLabelRef(*inst, [&](Label &l) {
+        auto it = cands.find(l.name());
+        if (it == cands.end())
+          return;
+        if (inst->opcode == Opcode::JSR && std::holds_alternative<Label>(inst->operand) && it->second.callee != sub.get()) {
+          ++it->second.calls;
+          it->second.weightedCalls += weights[i];
+        } else {
+          it->second.otherRefs = true;
+        }
+        });
+    }
+  }
+
+  // Decide per the cost model.
+  std::vector<Candidate *> autos;
+  std::unordered_set<std::string> accepted;
+  int32_t growth = 0;
+  for (auto &[name, c] : cands) {
+    if (c.calls == 0)
+      continue;
+    int32_t removed = c.otherRefs ? 0 : c.bodyBytes + 1;
+    c.growth = c.calls * c.bodyBytes - 3 * c.calls - removed;
+    if (c.callee->inlineHint() == InlineHint::Always) {
+      accepted.insert(name);
+      growth += c.growth;
+    } else {
+      autos.push_back(&c);
+    }
+  }
+  std::sort(autos.begin(), autos.end(), [](const Candidate *a, const Candidate *b) {
+    double ba = 12.0 * a->weightedCalls / (std::max)(a->growth, 1);
+    double bb = 12.0 * b->weightedCalls / (std::max)(b->growth, 1);
+    if (ba != bb) return ba > bb;
+    return a->callee->name() < b->callee->name();
+    });
+  for (auto *c : autos) {
+    bool small = c->calls == 1 || c->bodyBytes <= static_cast<int32_t>(options.maxCalleeBytes);
+    if (!small || options.romBudget < growth + c->growth)
+      continue;
+    accepted.insert(c->callee->name());
+    growth += c->growth;
+  }
+
+  // Expand leaves first so nested inlines carry through. A call site is skipped when the
+  // body would push a branch of the caller out of range (there is no branch relaxation).
+  int inlined = 0;
+  std::unordered_set<std::string> done, kept;
+  while (done.size() < accepted.size()) {
+    std::string next;
+    for (const auto &name : accepted) {
+      if (done.count(name))
+        continue;
+      auto calls = analysis::callees(*cands[name].callee);
+      bool leaf = std::none_of(calls.begin(), calls.end(), [&](const std::string &n) {
+        return accepted.count(n) && !done.count(n) && n != name;
+        });
+      if (leaf && (next.empty() || name < next))
+        next = name;
+    }
+    if (next.empty())
+      break; // mutual recursion among the remaining ones
+    done.insert(next);
+    Candidate &c = cands[next];
+    int sites = 0;
+    for (auto &sub : subroutines_) {
+      if (sub.get() == c.callee)
+        continue;
+      auto &entries = sub->instructions_;
+      for (size_t i = 0; i < entries.size(); ++i) {
+        auto inst = std::get_if<Instruction>(&entries[i]);
+        if (!inst || inst->opcode != Opcode::JSR)
+          continue;
+        auto target = std::get_if<Label>(&inst->operand);
+        if (!target || target->name() != next)
+          continue;
+        auto body = instantiate(*c.callee, inlineCount_++);
+        const Entry call = entries[i];
+        entries.erase(entries.begin() + i);
+        entries.insert(entries.begin() + i, body.begin(), body.end());
+        if (!branchesInRange(*sub)) {
+          entries.erase(entries.begin() + i, entries.begin() + i + body.size());
+          entries.insert(entries.begin() + i, call);
+          kept.insert(next);
+          continue;
+        }
+        i += body.size() - 1;
+        ++inlined;
+        ++sites;
+      }
+    }
+    LOG_MSG << "inlineSubroutines:" << next << "inlined at" << sites << "of" << c.calls << "call site(s)";
+  }
+
+  // Drop callees that are no longer referenced, unless the previous subroutine falls into them.
+  for (size_t k = 1; k < subroutines_.size(); ++k) {
+    if (!endsWithTransfer(*subroutines_[k - 1]))
+      kept.insert(subroutines_[k]->name());
+  }
+  subroutines_.erase(std::remove_if(subroutines_.begin(), subroutines_.end(), [&](const std::unique_ptr<Subroutine> &sub) {
+    auto it = cands.find(sub->name());
+    return it != cands.end() && done.count(sub->name()) && !it->second.otherRefs && !kept.count(sub->name());
+    }), subroutines_.end());
+  return inlined;
+}
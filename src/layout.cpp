@@ -0,0 +1,229 @@
+#include "nesdefs.hpp"
+#include "analysis.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include "3rdparty/fmt/format.h"
+#include <algorithm>
+#include <map>
+
+namespace {
+
+  using namespace cppnes;
+
+  Opcode inverse(Opcode op)
+  {
+    switch (op) {
+    case Opcode::BCC: return Opcode::BCS;
+    case Opcode::BCS: return Opcode::BCC;
+    case Opcode::BEQ: return Opcode::BNE;
+    case Opcode::BNE: return Opcode::BEQ;
+    case Opcode::BMI: return Opcode::BPL;
+    case Opcode::BPL: return Opcode::BMI;
+    case Opcode::BVC: return Opcode::BVS;
+    default: return Opcode::BVC;
+    }
+  }
+
+  // First entry at or after i that is not a comment.
+  size_t nextCode(const std::vector<Entry> &entries, size_t i)
+  {
+    while (i < entries.size() && !std::holds_alternative<Instruction>(entries[i]) && !std::holds_alternative<LabelDef>(entries[i]))
+      ++i;
+    return i;
+  }
+
+  const Instruction *instructionAt(const std::vector<Entry> &entries, size_t i)
+  {
+    return i < entries.size() ? std::get_if<Instruction>(&entries[i]) : nullptr;
+  }
+
+  const Label *labelTarget(const Instruction *inst)
+  {
+    return inst ? std::get_if<Label>(&inst->operand) : nullptr;
+  }
+
+  // True if one of the labels defined from i on (before the next instruction) is name.
+  bool labelFollows(const std::vector<Entry> &entries, size_t i, const std::string &name)
+  {
+    for (; i < entries.size() && !std::holds_alternative<Instruction>(entries[i]); ++i) {
+      auto ldef = std::get_if<LabelDef>(&entries[i]);
+      if (ldef && ldef->label.name() == name)
+        return true;
+    }
+    return false;
+  }
+
+  size_t findLabel(const std::vector<Entry> &entries, const std::string &name)
+  {
+    for (size_t i = 0; i < entries.size(); ++i) {
+      auto ldef = std::get_if<LabelDef>(&entries[i]);
+      if (ldef && ldef->label.name() == name)
+        return i;
+    }
+    return entries.size();
+  }
+
+  // Control never falls out of the end: filler may follow.
+  bool endsWithTransfer(const Subroutine &sub)
+  {
+    const auto &entries = sub.instructions();
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+      if (auto inst = std::get_if<Instruction>(&*it))
+        return inst->opcode == Opcode::RTS || inst->opcode == Opcode::RTI || inst->opcode == Opcode::JMP;
+    }
+    return false;
+  }
+
+  struct Loop {
+    uint32_t labelOffset;
+    uint32_t branchEnd; // offset of the instruction after the branch
+    double taken;       // estimated taken branches per run of the subroutine
+  };
+
+} // anonymous namespace
+
+cppnes::LayoutReport cppnes::Program::optimizeLayout(const LayoutOptions &options)
+{
+  resolveVariables();
+  layoutBase_ = analysis::codeBase(*this);
+  LayoutReport report;
+  auto rates = analysis::callsPerFrame(*this, options.callsPerFrame);
+  auto credit = [&](const Subroutine &sub, double executions, double cycles) {
+    double rate = rates[sub.name()];
+    if (0 < rate)
+      report.cyclesSavedPerFrame += rate * executions * cycles;
+    else
+      report.cyclesSavedOnce += static_cast<uint64_t>(executions * cycles);
+  };
+
+  // 1. Fall-through path: no jumps where the code can simply continue.
+  for (auto &sub : subroutines_) {
+    auto &entries = sub->instructions_;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      auto weights = analysis::entryWeights(*sub);
+      for (size_t i = 0; i < entries.size() && !changed; ++i) {
+        auto inst = std::get_if<Instruction>(&entries[i]);
+        if (!inst)
+          continue;
+        const size_t j = nextCode(entries, i + 1);
+        const Instruction *next = instructionAt(entries, j);
+        if (inst->opcode == Opcode::JSR && labelTarget(inst) && next && next->opcode == Opcode::RTS) {
+          // JSR x / RTS: the callee's RTS returns for us
+          credit(*sub, static_cast<double>(weights[i]), 9);
+          inst->opcode = Opcode::JMP;
+          entries.erase(entries.begin() + j);
+          ++report.tailCalls;
+          changed = true;
+        } else if (inst->opcode == Opcode::JMP && labelTarget(inst) && labelFollows(entries, i + 1, labelTarget(inst)->name())) {
+          credit(*sub, static_cast<double>(weights[i]), 3);
+          entries.erase(entries.begin() + i);
+          ++report.jumpsRemoved;
+          changed = true;
+        } else if (analysis::isBranch(inst->opcode) && labelTarget(inst) && next && next->opcode == Opcode::JMP &&
+          labelTarget(next) && labelFollows(entries, j + 1, labelTarget(inst)->name())) {
+          // Bcc over / JMP far / over: -> B!cc far, if far is within branch range once the JMP is gone
+          const std::string far = labelTarget(next)->name();
+          const size_t farPos = findLabel(entries, far);
+          if (farPos == entries.size())
+            continue;
+          auto offsets = analysis::entryOffsets(*sub);
+          const int32_t target = static_cast<int32_t>(offsets[farPos]) - (j < farPos ? 3 : 0);
+          const int32_t disp = target - static_cast<int32_t>(offsets[i] + 2);
+          if (disp < -128 || 127 < disp)
+            continue;
+          // taken either way half of the time: 2 cycles saved on the JMP path, 1 on the other
+          credit(*sub, static_cast<double>(weights[i]), 1.5);
+          *inst = Instruction{ inverse(inst->opcode), Label{ far } };
+          entries.erase(entries.begin() + j);
+          ++report.branchesInverted;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  // 2. Hottest subroutines first, unless some subroutine falls into the next one.
+  if (std::all_of(subroutines_.begin(), subroutines_.end(), [](const auto &sub) { return endsWithTransfer(*sub); })) {
+    std::stable_sort(subroutines_.begin(), subroutines_.end(), [&](const auto &a, const auto &b) {
+      return rates[a->name()] > rates[b->name()];
+      });
+  }
+
+  // 3. Pad before subroutines whose loops would take a branch across a page. Each PRG bank is
+  // its own segment, so each keeps its own address and predecessor.
+  struct Cursor {
+    uint32_t address;
+    const Subroutine *prev = nullptr;
+  };
+  std::map<uint8_t, Cursor> cursors;
+  uint32_t budget = options.paddingBudget;
+  for (auto &sub : subroutines_) {
+    sub->padBefore_ = 0;
+    auto &cursor = cursors.try_emplace(sub->bank(), Cursor{ sub->bank() == FixedBank ? analysis::codeBase(*this) : 0x8000u }).first->second;
+    uint32_t &address = cursor.address;
+    const Subroutine *&prev = cursor.prev;
+    const auto &entries = sub->instructions_;
+    auto offsets = analysis::entryOffsets(*sub);
+    auto weights = analysis::entryWeights(*sub);
+    const double rate = rates[sub->name()];
+    std::vector<Loop> loops;
+    for (size_t b = 0; b < entries.size(); ++b) {
+      auto inst = std::get_if<Instruction>(&entries[b]);
+      if (!inst || !analysis::isBranch(inst->opcode) || !labelTarget(inst))
+        continue;
+      size_t l = findLabel(entries, labelTarget(inst)->name());
+      if (l <= b)
+        loops.push_back({ offsets[l], offsets[b] + 2, static_cast<double>(weights[b]) });
+    }
+    // penalty cycles per run for a given padding: per frame, then once
+    auto penalty = [&](uint32_t pad) {
+      std::pair<double, double> p{ 0, 0 };
+      int crossing = 0;
+      for (const auto &loop : loops) {
+        if ((address + pad + loop.labelOffset) >> 8 == (address + pad + loop.branchEnd) >> 8)
+          continue;
+        ++crossing;
+        (0 < rate ? p.first += rate * loop.taken : p.second += loop.taken);
+      }
+      return std::make_pair(p, crossing);
+    };
+    const bool canPad = !prev || endsWithTransfer(*prev);
+    auto [base, baseCrossing] = penalty(0);
+    if (canPad && 0 < baseCrossing) {
+      uint32_t bestPad = 0;
+      auto best = base;
+      int bestCrossing = baseCrossing;
+      for (uint32_t pad = 1; pad <= (std::min)(255u, budget); ++pad) {
+        auto [p, crossing] = penalty(pad);
+        if (p < best) {
+          best = p;
+          bestPad = pad;
+          bestCrossing = crossing;
+        }
+      }
+      if (bestPad) {
+        sub->padBefore_ = static_cast<uint16_t>(bestPad);
+        budget -= bestPad;
+        report.paddingBytes += bestPad;
+        report.loopsAligned += baseCrossing - bestCrossing;
+        report.cyclesSavedPerFrame += base.first - best.first;
+        report.cyclesSavedOnce += static_cast<uint64_t>(base.second - best.second);
+      }
+    }
+    address += sub->padBefore_ + offsets.back();
+    prev = sub.get();
+  }
+
+  LOG_MSG << "optimizeLayout: ~" << report.cyclesSavedPerFrame << "cycles/frame saved," << report.cyclesSavedOnce << "once;"
+    << report.tailCalls << "tail calls," << report.jumpsRemoved << "jumps removed," << report.branchesInverted << "branches inverted,"
+    << report.loopsAligned << "loops aligned with" << report.paddingBytes << "padding bytes";
+  return report;
+}
+
+void cppnes::Program::checkLayout() const
+{
+  if (layoutBase_ && layoutBase_ != analysis::codeBase(*this))
+    throw std::runtime_error(fmt::format("optimizeLayout: the code base moved from ${:04X} to ${:04X} since the padding was "
+      "chosen; add the data blocks before optimizeLayout", layoutBase_, analysis::codeBase(*this)));
+}
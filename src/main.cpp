@@ -62,30 +62,31 @@ int main(int argc, char *argv[]) {
   rom.setProgram(prg);
   rom.setResources(rc);
   rom.setMirroring(Mirroring::None);
-           
-  const Label paletteLabel{ "PaletteData" };
-  auto &block = prg.addDataBlock(paletteLabel);
-  block.addBytes({ clr::Black, 0x2d, clr::PaleBlue, clr::White }, "Background palette 0");
-  block.addBytes({ clr::Black, 0x0c, 0x21, 0x32 }, "Background palette 1");
-  block.addBytes({ clr::Black, 0x05, 0x25, 0x25 }, "Background palette 2");
-  block.addBytes({ clr::Black, 0x0b, 0x1a, 0x29 }, "Background palette 3");
-  block.addBytes({ clr::Black, clr::DarkGray, clr::MediumGray, clr::White}, "Foreground palette 0");
-  block.addBytes({ clr::Black, clr::BrightYellow, clr::Aqua, clr::DarkRed }, "Foreground palette 1");
-  block.addBytes({ clr::Black, clr::BrightGreen, clr::DarkerBlue, clr::DarkRed }, "Foreground palette 2");
-  block.addBytes({ clr::Black, clr::BlueViolet, clr::BrightPink, clr::DarkRed }, "Foreground palette 3");
-
-  auto playerX = prg.allocZp("playerX", true);
-  auto playerY = prg.allocZp("playerY", true);
+
+  // Emitted by the Rom as Resources::paletteLabel()
+  rc.setPalettes(
+    { clr::Black, 0x2d, clr::PaleBlue, clr::White,
+      clr::Black, 0x0c, 0x21, 0x32,
+      clr::Black, 0x05, 0x25, 0x25,
+      clr::Black, 0x0b, 0x1a, 0x29 },
+    { clr::Black, clr::DarkGray, clr::MediumGray, clr::White,
+      clr::Black, clr::BrightYellow, clr::Aqua, clr::DarkRed,
+      clr::Black, clr::BrightGreen, clr::DarkerBlue, clr::DarkRed,
+      clr::Black, clr::BlueViolet, clr::BrightPink, clr::DarkRed });
+
+  // Placed at build time: zero page or RAM depending on how hot they are.
+  auto playerX = prg.declareVar("playerX");
+  auto playerY = prg.declareVar("playerY");
 
   auto buttons = prg.allocZp("buttons", true);
   auto buttonsPrev = prg.allocZp("buttonsPrev", true);
   auto buttonsPressed = prg.allocZp("buttonsPressed", true); // newly pressed this frame
   auto buttonsReleased = prg.allocZp("buttonsReleased", true); // released this frame
-  auto namPtr = prg.allocZp("namPtr", 2, true);
+  auto namPtr = prg.declareZpTemp("namPtr"); // only needed while the title screen is loaded
 
   reset
     .bblocks().setAddrByte(namPtr, 0x16).commentPrev("2 bytes")
-    .bblocks().loadPalette(paletteLabel)
+    .bblocks().loadPalette(Resources::paletteLabel())
     .bblocks().loadNametable(titleNamLabel, namPtr)
     .bblocks().enableRendering(true)
     //.bblocks().setAddrByte(colorIndex, 0)
@@ -122,16 +123,16 @@ int main(int argc, char *argv[]) {
       {
         switch (btn) {
         case BTN_UP: break;
-          sub.dec(zp(playerY));
+          sub.dec(abs(playerY));
           break;
         case BTN_DOWN: break;
-          sub.inc(zp(playerY));
+          sub.inc(abs(playerY));
           break;
         case BTN_LEFT: 
-          sub.dec(zp(playerX));
+          sub.dec(abs(playerX));
           break;
         case BTN_RIGHT: 
-          sub.inc(zp(playerX));
+          sub.inc(abs(playerX));
           break;
         case BTN_A: break;
         case BTN_B: break;
@@ -143,6 +144,13 @@ int main(int argc, char *argv[]) {
     )
     .rts();
 
+  // readInput/updatePlayer1 are called once per frame from nmi_handler: no need for JSR/RTS.
+  prg.inlineSubroutines();
+  // Last pass: tail calls, fall-through jumps, loops kept within a page. The palette blocks are
+  // aligned, so they go in first: the padding depends on where the code starts.
+  rc.addDataBlocks(prg);
+  prg.optimizeLayout();
+
   rom.setToolchain(toolchain);
   rom.build(outDir, intermediateDir);
   return 0;
@@ -1,22 +1,115 @@
 #include "nesdefs.hpp"
+#define FMT_HEADER_ONLY
+#include "3rdparty/fmt/format.h"
+#include "3rdparty/nlohmann/json.hpp"
 #include <stdexcept>
 #include <cassert>
+#include <algorithm>
+#include <fstream>
 
-cppnes::ZpAddress cppnes::ZeroPageAllocator::alloc(std::string_view name, bool constant)
+uint16_t cppnes::IntervalAllocator::allocate(std::string_view name, uint16_t size, uint16_t align)
 {
-  return allocBlock(name, 1, constant);
+  assert(0 < size && 0 < align && (align & (align - 1)) == 0);
+  if (size == 0)
+    throw std::logic_error("allocBlock: size must be > 0");
+  if (align == 0 || (align & (align - 1)) != 0)
+    throw std::invalid_argument("allocBlock: alignment must be a power of two");
+
+  // Best fit: the smallest gap that holds the aligned block, lowest address on ties.
+  uint32_t best = 0, bestGap = UINT32_MAX;
+  for (const auto &gap : freeGaps()) {
+    uint32_t start = (static_cast<uint32_t>(gap.address) + align - 1) & ~static_cast<uint32_t>(align - 1);
+    if (start + size <= static_cast<uint32_t>(gap.address) + gap.size && gap.size < bestGap) {
+      best = start;
+      bestGap = gap.size;
+    }
+  }
+  if (bestGap == UINT32_MAX)
+    throw std::out_of_range(fmt::format("allocBlock: no free {} byte block for {} (${:04X}-${:04X}, {} bytes free)",
+      size, name, min_, max_, available()));
+  return allocateAt(name, static_cast<uint16_t>(best), size);
 }
 
-cppnes::ZpAddress cppnes::ZeroPageAllocator::allocBlock(std::string_view name, uint8_t size, bool constant)
+uint16_t cppnes::IntervalAllocator::allocateAt(std::string_view name, uint16_t address, uint16_t size)
 {
   assert(0 < size);
   if (size == 0)
     throw std::logic_error("allocBlock: size must be > 0");
-  if (Max < next_ || Max - next_ + 1 < size)
-    throw std::out_of_range("ZeroPageAllocator: zero page exhausted");
-  uint16_t addr = next_;
-  next_ += size;
-  return ZpAddress::fromValue(addr, name, constant);
+  const uint32_t end = static_cast<uint32_t>(address) + size; // exclusive
+  if (address < min_ || max_ < address)
+    throw std::out_of_range("allocBlock: baseAddress outside " + fmt::format("${:04X}-${:04X}", min_, max_));
+  if (static_cast<uint32_t>(max_) + 1 < end)
+    throw std::out_of_range("allocBlock: block exceeds " + fmt::format("${:04X}-${:04X}", min_, max_));
+
+  // Only the nearest block below and the first one at/after address can overlap.
+  auto next = blocks_.lower_bound(address);
+  if (next != blocks_.end() && next->first < end)
+    throw std::invalid_argument(fmt::format("allocBlock: {} at ${:04X} overlaps {} at ${:04X}", name, address, next->second.name, next->first));
+  if (next != blocks_.begin()) {
+    auto prev = std::prev(next);
+    if (address < static_cast<uint32_t>(prev->first) + prev->second.size)
+      throw std::invalid_argument(fmt::format("allocBlock: {} at ${:04X} overlaps {} at ${:04X}", name, address, prev->second.name, prev->first));
+  }
+  blocks_.emplace(address, Block{ address, size, std::string{ name } });
+  used_ += size;
+  peak_ = (std::max)(peak_, used_);
+  return address;
+}
+
+void cppnes::IntervalAllocator::free(uint16_t address)
+{
+  auto it = blocks_.find(address);
+  if (it == blocks_.end())
+    throw std::invalid_argument(fmt::format("free: no block starts at ${:04X}", address));
+  used_ -= it->second.size;
+  blocks_.erase(it);
+}
+
+uint16_t cppnes::IntervalAllocator::largestFree() const
+{
+  uint16_t largest = 0;
+  for (const auto &gap : freeGaps())
+    largest = (std::max)(largest, gap.size);
+  return largest;
+}
+
+double cppnes::IntervalAllocator::fragmentation() const
+{
+  return available() ? 1.0 - static_cast<double>(largestFree()) / available() : 0.0;
+}
+
+std::vector<cppnes::IntervalAllocator::Block> cppnes::IntervalAllocator::blocks() const
+{
+  std::vector<Block> result;
+  result.reserve(blocks_.size());
+  for (const auto &[address, block] : blocks_)
+    result.push_back(block);
+  return result;
+}
+
+std::vector<cppnes::IntervalAllocator::Block> cppnes::IntervalAllocator::freeGaps() const
+{
+  std::vector<Block> gaps;
+  uint32_t cursor = min_;
+  for (const auto &[address, block] : blocks_) {
+    if (cursor < address)
+      gaps.push_back({ static_cast<uint16_t>(cursor), static_cast<uint16_t>(address - cursor), "" });
+    cursor = static_cast<uint32_t>(address) + block.size;
+  }
+  if (cursor <= max_)
+    gaps.push_back({ static_cast<uint16_t>(cursor), static_cast<uint16_t>(max_ + 1 - cursor), "" });
+  return gaps;
+}
+
+
+cppnes::ZpAddress cppnes::ZeroPageAllocator::alloc(std::string_view name, bool constant)
+{
+  return allocBlock(name, 1, constant);
+}
+
+cppnes::ZpAddress cppnes::ZeroPageAllocator::allocBlock(std::string_view name, uint8_t size, bool constant)
+{
+  return ZpAddress::fromValue(space_.allocate(name, size), name, constant);
 }
 
 
@@ -27,29 +120,93 @@ cppnes::AbsAddress cppnes::RamAllocator::alloc(std::string_view name, bool const
 
 cppnes::AbsAddress cppnes::RamAllocator::allocBlock(std::string_view name, uint16_t size, uint16_t baseAddress, bool constant)
 {
-  assert(0 < size);
-  if (size == 0)
-    throw std::logic_error("allocBlock: size must be > 0");
+  uint16_t base = baseAddress != 0 ? space_.allocateAt(name, baseAddress, size) : space_.allocate(name, size);
+  return AbsAddress{ base, name, constant };
+}
+
+cppnes::AbsAddress cppnes::RamAllocator::allocAligned(std::string_view name, uint16_t size, uint16_t align, bool constant)
+{
+  return AbsAddress{ space_.allocate(name, size, align), name, constant };
+}
+
+cppnes::AbsAddress cppnes::SramAllocator::allocBlock(std::string_view name, uint16_t size, uint16_t baseAddress, bool constant)
+{
+  uint16_t base = baseAddress != 0 ? space_.allocateAt(name, baseAddress, size) : space_.allocate(name, size);
+  return AbsAddress{ base, name, constant };
+}
 
-  uint16_t base;
+cppnes::AbsAddress cppnes::SramAllocator::allocAligned(std::string_view name, uint16_t size, uint16_t align, bool constant)
+{
+  return AbsAddress{ space_.allocate(name, size, align), name, constant };
+}
 
-  if (baseAddress != 0) {
-    // Explicit placement
-    if (baseAddress < Min || Max < baseAddress)
-      throw std::out_of_range("allocBlock: baseAddress outside RAM");
 
-    if (Max < baseAddress + size - 1)
-      throw std::out_of_range("allocBlock: block exceeds RAM");
+namespace {
 
-    base = baseAddress;
-  } else {
-    // Automatic placement
-    if (Max < next_ + size - 1)
-      throw std::out_of_range("allocBlock: RAM exhausted");
+  void reportArea(std::string &out, std::string_view title, const cppnes::IntervalAllocator &space)
+  {
+    out += fmt::format("{} ${:04X}-${:04X}: {} used, {} free (largest {}), peak {}, fragmentation {:.1f}%\n",
+      title, space.minAddress(), space.maxAddress(), space.used(), space.available(), space.largestFree(),
+      space.peak(), space.fragmentation() * 100);
+    auto blocks = space.blocks();
+    auto gaps = space.freeGaps();
+    blocks.insert(blocks.end(), gaps.begin(), gaps.end());
+    std::sort(blocks.begin(), blocks.end(), [](const auto &a, const auto &b) { return a.address < b.address; });
+    for (const auto &b : blocks) {
+      out += fmt::format("  ${:04X}-${:04X} {:5}  {}\n", b.address, b.address + b.size - 1, b.size,
+        b.name.empty() ? "(free)" : b.name);
+    }
+  }
 
-    base = next_;
-    next_ += size;
+  nlohmann::json areaJson(const cppnes::IntervalAllocator &space)
+  {
+    nlohmann::json j;
+    j["min"] = space.minAddress();
+    j["max"] = space.maxAddress();
+    j["used"] = space.used();
+    j["free"] = space.available();
+    j["largestFree"] = space.largestFree();
+    j["peak"] = space.peak();
+    j["fragmentation"] = space.fragmentation();
+    j["blocks"] = nlohmann::json::array();
+    for (const auto &b : space.blocks())
+      j["blocks"].push_back({ { "name", b.name }, { "address", b.address }, { "size", b.size } });
+    j["freeGaps"] = nlohmann::json::array();
+    for (const auto &g : space.freeGaps())
+      j["freeGaps"].push_back({ { "address", g.address }, { "size", g.size } });
+    return j;
   }
 
-  return AbsAddress{ base, name, constant };
-}
\ No newline at end of file
+} // anonymous namespace
+
+std::string cppnes::MemoryMap::reportText() const
+{
+  std::string out;
+  reportArea(out, "Zero page", zeroPage.space());
+  reportArea(out, "RAM", ram.space());
+  if (sram.inUse())
+    reportArea(out, sram.battery() ? "SRAM (battery)" : "SRAM", sram.space());
+  return out;
+}
+
+std::string cppnes::MemoryMap::reportJson() const
+{
+  nlohmann::json j;
+  j["zeroPage"] = areaJson(zeroPage.space());
+  j["ram"] = areaJson(ram.space());
+  if (sram.inUse()) {
+    j["sram"] = areaJson(sram.space());
+    j["sram"]["battery"] = sram.battery();
+  }
+  return j.dump(2);
+}
+
+void cppnes::MemoryMap::writeReport(const std::filesystem::path &dir) const
+{
+  std::ofstream txt{ dir / "memorymap.txt" };
+  std::ofstream json{ dir / "memorymap.json" };
+  if (!txt.is_open() || !json.is_open())
+    throw std::runtime_error("Failed to write memory map to " + dir.string());
+  txt << reportText();
+  json << reportJson() << "\n";
+}
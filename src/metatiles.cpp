@@ -0,0 +1,130 @@
+#include "metatiles.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+namespace {
+
+  uint8_t paletteAt(const cppnes::metatiles::Nametable &nt, size_t mx, size_t my)
+  {
+    const uint8_t attr = nt[960 + (my / 2) * 8 + mx / 2];
+    return static_cast<uint8_t>((attr >> (((my & 1) * 2 + (mx & 1)) * 2)) & 0x03);
+  }
+
+} // anonymous namespace
+
+cppnes::metatiles::Nametable cppnes::metatiles::loadNametable(const std::string &path)
+{
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open nametable: " + path);
+  if (file.tellg() != static_cast<std::streamoff>(sizeof(Nametable)))
+    throw std::runtime_error("Nametable must be 1024 bytes: " + path);
+  Nametable nt;
+  file.seekg(0, std::ios::beg);
+  file.read(reinterpret_cast<char *>(nt.data()), nt.size());
+  if (!file)
+    throw std::runtime_error("Failed to read nametable: " + path);
+  return nt;
+}
+
+cppnes::metatiles::MetatileSet cppnes::metatiles::compile(const std::vector<std::pair<std::string, Nametable>> &screens)
+{
+  MetatileSet set;
+  std::map<std::pair<std::array<uint8_t, 4>, uint8_t>, uint8_t> ids;
+  for (const auto &[label, nt] : screens) {
+    Screen screen{ label, {} };
+    for (size_t my = 0; my < 15; ++my) {
+      for (size_t mx = 0; mx < 16; ++mx) {
+        const size_t t = my * 64 + mx * 2; // top-left tile: row 2*my, column 2*mx
+        Metatile m{ { nt[t], nt[t + 1], nt[t + 32], nt[t + 33] }, paletteAt(nt, mx, my) };
+        auto [it, added] = ids.try_emplace({ m.tiles, m.palette }, static_cast<uint8_t>(set.metatiles.size()));
+        if (added) {
+          if (set.metatiles.size() == 256)
+            throw std::out_of_range("metatiles::compile: more than 256 distinct metatiles (at " + label + ")");
+          set.metatiles.push_back(m);
+        }
+        screen.map[my * 16 + mx] = it->second;
+      }
+    }
+    set.screens.push_back(std::move(screen));
+  }
+  LOG_MSG << "metatiles::compile:" << set.screens.size() << "screens," << set.metatiles.size() << "metatiles";
+  return set;
+}
+
+cppnes::metatiles::Nametable cppnes::metatiles::expand(const MetatileSet &set, const Screen &screen)
+{
+  Nametable nt{};
+  for (size_t my = 0; my < 15; ++my) {
+    for (size_t mx = 0; mx < 16; ++mx) {
+      const Metatile &m = set.metatiles.at(screen.map[my * 16 + mx]);
+      const size_t t = my * 64 + mx * 2;
+      nt[t] = m.tiles[0];
+      nt[t + 1] = m.tiles[1];
+      nt[t + 32] = m.tiles[2];
+      nt[t + 33] = m.tiles[3];
+    }
+  }
+  const auto attr = attributeTable(set, screen);
+  std::copy(attr.begin(), attr.end(), nt.begin() + 960);
+  return nt;
+}
+
+std::array<uint8_t, 64> cppnes::metatiles::attributeTable(const MetatileSet &set, const Screen &screen)
+{
+  std::array<uint8_t, 64> attr{};
+  for (size_t my = 0; my < 15; ++my) {
+    for (size_t mx = 0; mx < 16; ++mx) {
+      const uint8_t palette = set.metatiles.at(screen.map[my * 16 + mx]).palette;
+      attr[(my / 2) * 8 + mx / 2] |= static_cast<uint8_t>(palette << (((my & 1) * 2 + (mx & 1)) * 2));
+    }
+  }
+  return attr;
+}
+
+std::array<uint8_t, 128> cppnes::metatiles::attributeStrips(const MetatileSet &set, const Screen &screen)
+{
+  const auto attr = attributeTable(set, screen);
+  std::array<uint8_t, 128> strips{};
+  for (size_t m = 0; m < 16; ++m) {
+    const uint8_t keep = (m & 1) ? 0xCC : 0x33;
+    for (size_t r = 0; r < 8; ++r)
+      strips[m * 8 + r] = attr[r * 8 + m / 2] & keep;
+  }
+  return strips;
+}
+
+cppnes::MetatileTables cppnes::metatiles::addDataBlocks(Program &prg, std::string_view name, const MetatileSet &set, bool strips)
+{
+  const std::string prefix = std::string(name) + "_";
+  MetatileTables tables;
+  tables.tl = Label{ prefix + "tl" };
+  tables.tr = Label{ prefix + "tr" };
+  tables.bl = Label{ prefix + "bl" };
+  tables.br = Label{ prefix + "br" };
+  const Label *corners[] = { &tables.tl, &tables.tr, &tables.bl, &tables.br };
+  for (size_t c = 0; c < 4; ++c) {
+    prg.addDataBlock(*corners[c]).noPageCross()
+      .generate(set.metatiles.size(), [&](size_t i) { return set.metatiles[i].tiles[c]; });
+  }
+  for (const auto &screen : set.screens) {
+    prg.addDataBlock(Label{ screen.label }).generate(screen.map.size(), [&](size_t i) { return screen.map[i]; }, "metatile map");
+    const auto attr = attributeTable(set, screen);
+    prg.addDataBlock(Label{ screen.label + "_attr" }).noPageCross()
+      .generate(attr.size(), [&](size_t i) { return attr[i]; }, "attribute table");
+    if (strips) {
+      const auto columns = attributeStrips(set, screen);
+      prg.addDataBlock(Label{ screen.label + "_attrStrips" }).noPageCross()
+        .generate(columns.size(), [&](size_t i) { return columns[i]; }, "attribute column strips");
+    }
+  }
+  // 4 corner bytes per metatile; per screen its map, attribute table and optional strips.
+  const size_t bytes = set.metatiles.size() * 4 + set.screens.size() * (240 + 64 + (strips ? 128 : 0));
+  LOG_MSG << "metatiles::addDataBlocks:" << std::string(name) + ":" << bytes << "bytes instead of" << set.screens.size() * 1024;
+  tables.scratch = prg.declareTemp(prefix + "tmp");
+  tables.ptr = prg.declareZpTemp(prefix + "ptr");
+  return tables;
+}
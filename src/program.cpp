@@ -1,5 +1,251 @@
 #include "nesdefs.hpp"
 #include "nesdefs_helper.hpp"
+#include "analysis.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+
+  // Opcodes that have a zp,X form (LDX/STX only have zp,Y).
+  bool hasZeroPageX(cppnes::Opcode op)
+  {
+    using cppnes::Opcode;
+    switch (op) {
+    case Opcode::LDA: case Opcode::STA: case Opcode::LDY: case Opcode::STY:
+    case Opcode::ADC: case Opcode::SBC: case Opcode::AND: case Opcode::ORA:
+    case Opcode::EOR: case Opcode::CMP: case Opcode::INC: case Opcode::DEC:
+    case Opcode::ASL: case Opcode::LSR: case Opcode::ROL: case Opcode::ROR:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Returns the symbolic variable an address refers to, or nullptr.
+  cppnes::SymbolicVar *findVar(std::vector<cppnes::SymbolicVar> &vars, const cppnes::AbsAddress &addr)
+  {
+    if (addr.name().empty())
+      return nullptr;
+    for (auto &v : vars) {
+      if (v.resolved || v.name != addr.name())
+        continue;
+      if (v.size <= addr.value())
+        throw std::out_of_range("Access past the end of variable: " + v.name);
+      return &v;
+    }
+    return nullptr;
+  }
+
+  // Same for the ZpAddress placeholders of declareZpTemp.
+  cppnes::SymbolicVar *findVar(std::vector<cppnes::SymbolicVar> &vars, const cppnes::ZpAddress &addr)
+  {
+    if (addr.name().empty())
+      return nullptr;
+    for (auto &v : vars) {
+      if (v.resolved || !v.zeroPageOnly || v.name != addr.name())
+        continue;
+      if (v.size <= addr.value())
+        throw std::out_of_range("Access past the end of variable: " + v.name);
+      return &v;
+    }
+    return nullptr;
+  }
+
+  // Visits every operand that points into an unresolved symbolic variable.
+  template<typename Fn>
+  void forEachVarOperand(cppnes::Instruction &inst, std::vector<cppnes::SymbolicVar> &vars, Fn fn)
+  {
+    using namespace cppnes;
+    auto visitZp = [&](const std::variant<ZpAddress, Label> &base) {
+      if (auto zp = std::get_if<ZpAddress>(&base))
+        if (auto v = findVar(vars, *zp)) fn(*v, zp->value());
+      };
+    if (auto z = std::get_if<ZeroPage>(&inst.operand)) {
+      if (auto v = findVar(vars, z->addr)) fn(*v, z->addr.value());
+    } else if (auto zx = std::get_if<ZeroPageX>(&inst.operand)) {
+      visitZp(zx->base);
+    } else if (auto zy = std::get_if<ZeroPageY>(&inst.operand)) {
+      visitZp(zy->base);
+    } else if (auto ix = std::get_if<IndexedIndirectX>(&inst.operand)) {
+      if (auto v = findVar(vars, ix->addr)) fn(*v, ix->addr.value());
+    } else if (auto iy = std::get_if<IndexedIndirectY>(&inst.operand)) {
+      if (auto v = findVar(vars, iy->addr)) fn(*v, iy->addr.value());
+    } else if (auto a = std::get_if<Absolute>(&inst.operand)) {
+      if (auto v = findVar(vars, a->addr)) fn(*v, a->addr.value());
+    } else if (auto ax = std::get_if<AbsoluteX>(&inst.operand)) {
+      if (auto base = std::get_if<AbsAddress>(&ax->base))
+        if (auto v = findVar(vars, *base)) fn(*v, base->value());
+    } else if (auto ay = std::get_if<AbsoluteY>(&inst.operand)) {
+      if (auto base = std::get_if<AbsAddress>(&ay->base))
+        if (auto v = findVar(vars, *base)) fn(*v, base->value());
+    } else if (auto ind = std::get_if<Indirect>(&inst.operand)) {
+      if (auto v = findVar(vars, ind->addr)) fn(*v, ind->addr.value());
+    }
+  }
+
+  // Where a temporary is live: per referencing subroutine an entry range, the subroutines
+  // called (transitively) from within those ranges, and the entry points it runs under.
+  struct TempLiveness {
+    std::unordered_map<const cppnes::Subroutine *, std::pair<size_t, size_t>> ranges;
+    std::unordered_set<const cppnes::Subroutine *> active;
+    unsigned contexts = 0; // bit 0: reset/main, 1: NMI, 2: IRQ
+  };
+
+  bool interferes(const TempLiveness &a, const TempLiveness &b)
+  {
+    if (a.ranges.empty() || b.ranges.empty())
+      return false;
+    // An interrupt may fire anywhere in the main code (or in another handler).
+    if ((a.contexts | b.contexts) & ((a.contexts | b.contexts) - 1))
+      return true;
+    for (const auto &[sub, range] : a.ranges) {
+      if (b.active.count(sub))
+        return true;
+      auto it = b.ranges.find(sub);
+      if (it != b.ranges.end() && range.first <= it->second.second && it->second.first <= range.second)
+        return true;
+    }
+    return std::any_of(b.ranges.begin(), b.ranges.end(), [&](const auto &r) { return a.active.count(r.first) != 0; });
+  }
+
+  // Shared area for temporaries: first fit below every interfering temporary already placed.
+  struct TempPool {
+    std::vector<std::pair<cppnes::SymbolicVar *, const TempLiveness *>> placed;
+    uint16_t peak = 0;
+
+    uint16_t fit(const cppnes::SymbolicVar &v, const TempLiveness &live) const
+    {
+      uint16_t offset = 0;
+      for (bool moved = true; moved; ) {
+        moved = false;
+        for (const auto &[other, otherLive] : placed) {
+          if (offset < other->address + other->size && other->address < offset + v.size && interferes(live, *otherLive)) {
+            offset = static_cast<uint16_t>(other->address + other->size);
+            moved = true;
+          }
+        }
+      }
+      return offset;
+    }
+    void place(cppnes::SymbolicVar &v, const TempLiveness &live, uint16_t offset)
+    {
+      v.address = offset;
+      placed.push_back({ &v, &live });
+      peak = (std::max)(peak, static_cast<uint16_t>(offset + v.size));
+    }
+  };
+
+  std::unordered_map<cppnes::SymbolicVar *, TempLiveness> temporaryLiveness(const cppnes::Program &prg, std::vector<cppnes::SymbolicVar> &vars)
+  {
+    using namespace cppnes;
+    std::unordered_map<SymbolicVar *, TempLiveness> live;
+    if (std::none_of(vars.begin(), vars.end(), [](const SymbolicVar &v) { return v.temporary && !v.resolved; }))
+      return live;
+
+    // Call graph (JSR/JMP to another subroutine) and loops (back edges to a local label).
+    struct SubInfo {
+      std::vector<std::pair<size_t, const Subroutine *>> calls;
+      std::vector<std::pair<size_t, size_t>> loops;
+      std::unordered_set<const Subroutine *> reach; // itself and everything it may call
+    };
+    std::unordered_map<std::string, const Subroutine *> byName;
+    for (const auto &sub : prg.subroutines())
+      byName[sub->name()] = sub.get();
+    std::unordered_map<const Subroutine *, SubInfo> info;
+    for (const auto &sub : prg.subroutines()) {
+      auto &si = info[sub.get()];
+      std::unordered_map<std::string, size_t> labels;
+      const auto &entries = sub->instructions();
+      for (size_t i = 0; i < entries.size(); ++i) {
+        if (auto ldef = std::get_if<LabelDef>(&entries[i]))
+          labels[ldef->label.name()] = i;
+        auto inst = std::get_if<Instruction>(&entries[i]);
+        auto target = inst ? std::get_if<Label>(&inst->operand) : nullptr;
+        if (!target)
+          continue;
+        if (auto local = labels.find(target->name()); local != labels.end())
+          si.loops.push_back({ local->second, i });
+        else if (auto callee = byName.find(target->name()); callee != byName.end() && (inst->opcode == Opcode::JSR || inst->opcode == Opcode::JMP))
+          si.calls.push_back({ i, callee->second });
+      }
+    }
+    for (auto &[sub, si] : info) {
+      std::vector<const Subroutine *> stack{ sub };
+      while (!stack.empty()) {
+        auto s = stack.back();
+        stack.pop_back();
+        if (si.reach.insert(s).second) {
+          for (const auto &call : info.at(s).calls)
+            stack.push_back(call.second);
+        }
+      }
+    }
+    const Subroutine *roots[] = { prg.resetVector(), prg.nmiVector(), prg.irqVector() };
+    auto contextsOf = [&](const Subroutine *sub) {
+      unsigned contexts = 0;
+      for (unsigned r = 0; r < 3; ++r) {
+        if (roots[r] && info.count(roots[r]) && info.at(roots[r]).reach.count(sub))
+          contexts |= 1u << r;
+      }
+      return contexts ? contexts : 1u; // unreachable code counts as main code
+    };
+
+    // References: first and last entry per subroutine.
+    for (const auto &sub : prg.subroutines()) {
+      const auto &entries = sub->instructions();
+      for (size_t i = 0; i < entries.size(); ++i) {
+        auto inst = std::get_if<Instruction>(&entries[i]);
+        if (!inst)
+          continue;
+        Instruction copy = *inst;
+        forEachVarOperand(copy, vars, [&](SymbolicVar &v, uint16_t) {
+          if (!v.temporary)
+            return;
+          auto [it, inserted] = live[&v].ranges.try_emplace(sub.get(), i, i);
+          it->second.first = (std::min)(it->second.first, i);
+          it->second.second = (std::max)(it->second.second, i);
+          });
+      }
+    }
+
+    // Grow each range over the loops it overlaps and the calls into code using the same
+    // temporary (arguments and results), then collect what is called while it is live.
+    for (auto &[v, l] : live) {
+      auto usedBelow = [&](const Subroutine *callee) {
+        const auto &reach = info.at(callee).reach;
+        return std::any_of(l.ranges.begin(), l.ranges.end(), [&](const auto &r) { return reach.count(r.first) != 0; });
+        };
+      for (auto &[sub, range] : l.ranges) {
+        const auto &si = info.at(sub);
+        for (bool grown = true; grown; ) {
+          grown = false;
+          for (auto [begin, end] : si.loops) {
+            if (begin <= range.second && range.first <= end && (begin < range.first || range.second < end)) {
+              range = { (std::min)(range.first, begin), (std::max)(range.second, end) };
+              grown = true;
+            }
+          }
+          for (auto [i, callee] : si.calls) {
+            if ((i < range.first || range.second < i) && usedBelow(callee)) {
+              range = { (std::min)(range.first, i), (std::max)(range.second, i) };
+              grown = true;
+            }
+          }
+        }
+        for (auto [i, callee] : si.calls) {
+          if (range.first <= i && i <= range.second)
+            l.active.insert(info.at(callee).reach.begin(), info.at(callee).reach.end());
+        }
+        l.contexts |= contextsOf(sub);
+      }
+    }
+    return live;
+  }
+
+} // anonymous namespace
 
 cppnes::Program::Program(MemoryMap &mmap) : mmap_(mmap)
 {
@@ -22,6 +268,8 @@ void cppnes::Program::setIRQVector(const Subroutine &handler)
 
 cppnes::Subroutine &cppnes::Program::addSubroutine(std::string_view name)
 {
+  if (std::any_of(vars_.begin(), vars_.end(), [&](const SymbolicVar &v) { return v.name == name; }))
+    throw std::logic_error("addSubroutine: " + std::string(name) + " is a variable name");
   std::unique_ptr<Subroutine> ptr(new Subroutine(name));
   subroutines_.push_back(std::move(ptr));
   return *subroutines_.back();
@@ -50,12 +298,264 @@ cppnes::DataBlock &cppnes::Program::addDataBlock(const Label &label)
   auto it = dataBlocks_.find(label.name());
   if (it != dataBlocks_.end())
     return *it->second;
+  if (std::any_of(vars_.begin(), vars_.end(), [&](const SymbolicVar &v) { return v.name == label.name(); }))
+    throw std::logic_error("addDataBlock: " + label.name() + " is a variable name");
   auto db = std::make_unique<DataBlock>(label.name());
   auto &ref = *db;
   dataBlocks_.emplace(label.name(), std::move(db));
   return ref;
 }
 
+cppnes::SplitTable cppnes::Program::addSplitTable(const Label &label, size_t count, const std::function<uint16_t(size_t)> &gen)
+{
+  assert(0 < count);
+  SplitTable t{ Label{ label.name() + "_lo" }, Label{ label.name() + "_hi" }, count };
+  auto &lo = addDataBlock(t.lo);
+  auto &hi = addDataBlock(t.hi);
+  lo.clear();
+  hi.clear();
+  lo.generate(count, [&](size_t i) { return static_cast<uint8_t>(gen(i) & 0xFF); }, label.name() + " low bytes");
+  hi.generate(count, [&](size_t i) { return static_cast<uint8_t>(gen(i) >> 8); }, label.name() + " high bytes");
+  if (count <= 256) {
+    lo.noPageCross();
+    hi.noPageCross();
+  } else {
+    lo.align(256);
+    hi.align(256);
+  }
+  return t;
+}
+
+cppnes::AbsAddress cppnes::EntityTable::field(std::string_view fieldName) const
+{
+  for (const auto &[n, addr] : fields) {
+    if (n == fieldName)
+      return addr;
+  }
+  throw std::invalid_argument("EntityTable " + name + " has no field " + std::string(fieldName));
+}
+
+cppnes::EntityTable cppnes::Program::addEntityTable(std::string_view name, uint8_t capacity, const std::vector<std::string> &fields)
+{
+  // $FF ends a list and the walk tests it with BMI, so indexes must stay below $80.
+  if (capacity == 0 || 128 < capacity)
+    throw std::invalid_argument("addEntityTable: capacity must be 1..128");
+  uint16_t align = 1;
+  while (align < capacity)
+    align <<= 1;
+  EntityTable t;
+  t.name = name;
+  t.capacity = capacity;
+  const std::string prefix = std::string(name) + "_";
+  for (const auto &f : fields) {
+    if (std::any_of(t.fields.begin(), t.fields.end(), [&](const auto &p) { return p.first == f; }))
+      throw std::invalid_argument("addEntityTable: duplicate field " + f);
+    t.fields.push_back({ f, mmap_.ram.allocAligned(prefix + f, capacity, align, true) });
+  }
+  t.next = mmap_.ram.allocAligned(prefix + "next", capacity, align, true);
+  t.liveHead = declareVar(prefix + "live");
+  t.freeHead = declareVar(prefix + "free");
+  t.prev = declareTemp(prefix + "prev");
+  t.cursor = declareTemp(prefix + "cursor");
+  return t;
+}
+
+cppnes::Label cppnes::Program::addBankTable(uint8_t count)
+{
+  // one table per caller: a later call must not resize a table already referenced
+  std::string name{ "bankTable" };
+  for (int n = 1; dataBlocks_.count(name); ++n)
+    name = "bankTable" + std::to_string(n);
+  Label label{ name };
+  auto &table = addDataBlock(label);
+  table.generate(count, [](size_t i) { return static_cast<uint8_t>(i); }, "bank numbers, written to avoid bus conflicts");
+  return label;
+}
+
+cppnes::SaveSlots cppnes::Program::addSaveSlots(std::string_view name, uint8_t slotSize, uint8_t count)
+{
+  if (slotSize == 0 || 254 < slotSize || count == 0)
+    throw std::invalid_argument("addSaveSlots: slotSize must be 1..254 and count > 0");
+  const std::string prefix = std::string(name) + "_";
+  const uint16_t stride = slotSize + 2;
+  SaveSlots s;
+  s.name = name;
+  s.slotSize = slotSize;
+  s.count = count;
+  s.sram = mmap_.sram.allocBlock(prefix + "slots", static_cast<uint16_t>(stride * count), 0, true);
+  mmap_.sram.setBattery(true);
+  s.buffer = mmap_.ram.allocBlock(prefix + "buffer", slotSize, 0, true);
+  const uint16_t base = s.sram.value();
+  s.slotAddress = addSplitTable(Label{ prefix + "slotAddress" }, count, [&](size_t i) { return static_cast<uint16_t>(base + i * stride); });
+  s.ptr = mmap_.zeroPage.allocBlock(prefix + "ptr", 2, true);
+  s.busy = declareVar(prefix + "busy");
+  s.pos = declareVar(prefix + "pos");
+  s.sum = declareVar(prefix + "sum");
+  s.eor = declareVar(prefix + "eor");
+  return s;
+}
+
+cppnes::IrqChain cppnes::Program::addIrqSplits(std::string_view name, const std::vector<RasterSplit> &splits)
+{
+  constexpr uint32_t CyclesPerScanline = 113; // 341 PPU dots / 3, rounded down
+  constexpr uint32_t IrqEntry = 7 + 5;        // IRQ sequence, then jmp (target)
+  if (splits.empty())
+    throw std::invalid_argument("addIrqSplits: no splits");
+  for (size_t i = 0; i < splits.size(); ++i) {
+    if (splits[i].scanline < 1 || 239 < splits[i].scanline || splits[i].writes.empty())
+      throw std::invalid_argument("addIrqSplits: splits need a scanline 1..239 and register writes");
+    if (i && splits[i].scanline < splits[i - 1].scanline + 2)
+      throw std::invalid_argument("addIrqSplits: splits must be ascending and at least 2 scanlines apart");
+  }
+  IrqChain chain;
+  chain.name = name;
+  chain.firstLatch = splits.front().scanline;
+  chain.target = allocRamAligned(std::string(name) + "Target", 2, 2); // never at $xxFF (JMP indirect bug)
+  for (size_t i = 0; i < splits.size(); ++i)
+    chain.handlers.push_back(std::string(name) + "_" + std::to_string(i));
+
+  auto &dispatch = addSubroutine(name);
+  dispatch.jmp(ind(chain.target));
+  setIRQVector(dispatch);
+
+  auto value = [](const RegisterWrite &w) -> Operand {
+    if (auto v = std::get_if<uint8_t>(&w.value))
+      return Immediate{ *v };
+    return Absolute{ std::get<AbsAddress>(w.value) };
+  };
+  static const Opcode loads[] = { Opcode::LDA, Opcode::LDX, Opcode::LDY };
+  static const Opcode stores[] = { Opcode::STA, Opcode::STX, Opcode::STY };
+  for (size_t i = 0; i < splits.size(); ++i) {
+    const auto &writes = splits[i].writes;
+    const size_t critical = (std::min)(writes.size(), size_t{ 3 });
+    auto &h = addSubroutine(chain.handlers[i]);
+    h.pha();
+    if (1 < critical)
+      h.txa().pha();
+    if (2 < critical)
+      h.tya().pha();
+    const size_t firstStore = h.instructions().size() + critical;
+    std::vector<Entry> code;
+    for (size_t w = 0; w < critical; ++w)
+      code.push_back(Instruction{ loads[w], value(writes[w]) });
+    for (size_t w = 0; w < critical; ++w)
+      code.push_back(Instruction{ stores[w], Absolute{ AbsAddress::fromValue(writes[w].reg) } });
+    h.append(code);
+    bblocks::mmc3IrqDisable(h); // acknowledge
+    // Re-arm before the other writes: the latch counts from the A12 rise of the current
+    // scanline, ~113 cycles after the IRQ, so a later reload would delay every following split.
+    size_t reload = 0;
+    if (i + 1 < splits.size()) {
+      reload = h.instructions().size() + 2; // lda #n, sta $C000, sta $C001
+      bblocks::mmc3IrqArm(h, static_cast<uint8_t>(splits[i + 1].scanline - splits[i].scanline - 1));
+    }
+    code.clear();
+    for (size_t w = critical; w < writes.size(); ++w) {
+      code.push_back(Instruction{ Opcode::LDA, value(writes[w]) });
+      code.push_back(Instruction{ Opcode::STA, Absolute{ AbsAddress::fromValue(writes[w].reg) } });
+    }
+    if (std::any_of(writes.begin(), writes.end(), [](const RegisterWrite &w) { return w.reg == 0x8000; })) {
+      code.push_back(Instruction{ Opcode::LDA, Absolute{ mmc3BankSelect() } });
+      code.push_back(Instruction{ Opcode::STA, Absolute{ AbsAddress::fromValue(0x8000) } });
+    }
+    h.append(code);
+    if (i + 1 < splits.size()) {
+      h.lda(lobyte(Label{ chain.handlers[i + 1] }))
+        .sta(abs(chain.target))
+        .lda(hibyte(Label{ chain.handlers[i + 1] }))
+        .sta(abs(chain.target + 1));
+    }
+    if (2 < critical)
+      h.pla().tay();
+    if (1 < critical)
+      h.pla().tax();
+    h.pla().rti();
+
+    // Straight-line code: the static count is exact.
+    uint32_t cycles = IrqEntry;
+    const auto &entries = h.instructions();
+    for (size_t e = 0; e < entries.size(); ++e) {
+      if (auto inst = std::get_if<Instruction>(&entries[e]))
+        cycles += analysis::instructionCycles(*inst);
+      if (e == firstStore)
+        chain.firstWriteCycle.push_back(cycles);
+      if (e == firstStore + critical - 1)
+        chain.lastWriteCycle.push_back(cycles);
+      if (e == reload && reload)
+        chain.reloadCycle.push_back(cycles);
+    }
+    if (!reload)
+      chain.reloadCycle.push_back(0);
+    chain.handlerCycles.push_back(cycles);
+    if (CyclesPerScanline <= chain.reloadCycle.back() + 6) // +6: IRQ latency jitter
+      throw std::invalid_argument("addIrqSplits: " + chain.handlers[i] + " re-arms the IRQ at cycle " +
+        std::to_string(chain.reloadCycle.back()) + ", after the scanline it counts from");
+    if (i + 1 < splits.size() && (splits[i + 1].scanline - splits[i].scanline) * CyclesPerScanline < cycles + 7)
+      throw std::invalid_argument("addIrqSplits: " + chain.handlers[i] + " takes " + std::to_string(cycles) +
+        " cycles, more than the time to the next split");
+    LOG_MSG << "addIrqSplits:" << chain.handlers[i] << "at scanline" << static_cast<int>(splits[i].scanline) << ": writes at cycles"
+      << chain.firstWriteCycle.back() << "-" << chain.lastWriteCycle.back() << "(+0-6 jitter)," << cycles << "cycles in total";
+  }
+  return chain;
+}
+
+cppnes::AbsAddress cppnes::Program::mmc3BankSelect()
+{
+  constexpr std::string_view name = "mmc3BankSelect";
+  for (const auto &v : vars_) {
+    if (v.name == name)
+      return AbsAddress{ 0, name, v.constant };
+  }
+  return declareVar(name);
+}
+
+cppnes::ChrAnimation cppnes::Program::addChrAnimation(std::string_view name, Mapper mapper, const std::vector<uint8_t> &banks,
+  uint8_t frameDelay, uint8_t reg, const Label &bankTable)
+{
+  if (mapper != Mapper::CNROM && mapper != Mapper::MMC3)
+    throw std::invalid_argument("addChrAnimation: CHR banks switch on CNROM and MMC3 only");
+  if (banks.empty() || frameDelay == 0 || 128 < frameDelay || 5 < reg)
+    throw std::invalid_argument("addChrAnimation: needs banks, a frameDelay of 1..128 and an MMC3 register R0-R5");
+  const std::string prefix = std::string(name) + "_";
+  ChrAnimation a;
+  a.name = name;
+  a.mapper = mapper;
+  a.reg = reg;
+  a.frameDelay = frameDelay;
+  a.count = static_cast<uint8_t>(banks.size());
+  a.sequence = Label{ prefix + "banks" };
+  addDataBlock(a.sequence).addBytes(banks);
+  a.bankTable = bankTable;
+  if (mapper == Mapper::CNROM && bankTable.name().empty())
+    a.bankTable = addBankTable(static_cast<uint8_t>(*std::max_element(banks.begin(), banks.end()) + 1));
+  if (mapper == Mapper::MMC3)
+    a.bankSelect = mmc3BankSelect();
+  a.timer = declareVar(prefix + "timer");
+  a.index = declareVar(prefix + "index");
+  return a;
+}
+
+cppnes::TileQueue cppnes::Program::addTileQueue(std::string_view name, uint8_t capacity, uint8_t tilesPerFrame)
+{
+  if (capacity < 2 || 128 < capacity || (capacity & (capacity - 1)) != 0 || tilesPerFrame == 0)
+    throw std::invalid_argument("addTileQueue: capacity must be a power of two 2..128 and tilesPerFrame > 0");
+  const std::string prefix = std::string(name) + "_";
+  TileQueue q;
+  q.name = name;
+  q.capacity = capacity;
+  q.tilesPerFrame = tilesPerFrame;
+  // aligned to their size: absx reads never cross a page
+  q.srcLo = allocRamAligned(prefix + "srcLo", capacity, capacity);
+  q.srcHi = allocRamAligned(prefix + "srcHi", capacity, capacity);
+  q.dstLo = allocRamAligned(prefix + "dstLo", capacity, capacity);
+  q.dstHi = allocRamAligned(prefix + "dstHi", capacity, capacity);
+  q.head = declareVar(prefix + "head");
+  q.tail = declareVar(prefix + "tail");
+  q.budget = declareTemp(prefix + "budget");
+  q.ptr = declareZpTemp(prefix + "ptr");
+  return q;
+}
+
 cppnes::Subroutine &cppnes::Program::initStandardReset()
 {
   std::string name{ "reset_handler" };
@@ -83,6 +583,206 @@ cppnes::Subroutine &cppnes::Program::initStandardReset()
     ;
 }
 
+cppnes::AbsAddress cppnes::Program::declareVar(std::string_view name, uint8_t size, bool constant)
+{
+  assert(0 < size && !name.empty());
+  if (size == 0 || name.empty())
+    throw std::logic_error("declareVar: name and size are required");
+  for (const auto &v : vars_) {
+    if (v.name == name)
+      throw std::logic_error("declareVar: duplicate variable name: " + std::string(name));
+  }
+  // Operands are matched to variables by name: nothing else may carry it.
+  const std::string n{ name };
+  if (n[0] == '@')
+    throw std::logic_error("declareVar: " + n + " is a local label name");
+  if (std::any_of(subroutines_.begin(), subroutines_.end(), [&](const auto &sub) { return sub->name() == n; }) ||
+    dataBlocks_.count(n) || constants_.count(n))
+    throw std::logic_error("declareVar: " + n + " is already a subroutine, data block or constant");
+  for (const auto *space : { &mmap_.zeroPage.space(), &mmap_.ram.space(), &mmap_.sram.space() }) {
+    const auto blocks = space->blocks();
+    if (std::any_of(blocks.begin(), blocks.end(), [&](const auto &b) { return b.name == n; }))
+      throw std::logic_error("declareVar: " + n + " is already the name of an allocated address");
+  }
+  SymbolicVar v;
+  v.name = name;
+  v.size = size;
+  v.constant = constant;
+  vars_.push_back(v);
+  // Placeholder: offset 0 of the named variable, rewritten by resolveVariables().
+  return AbsAddress{ 0, name, constant };
+}
+
+cppnes::AbsAddress cppnes::Program::declareTemp(std::string_view name, uint8_t size, bool constant)
+{
+  auto addr = declareVar(name, size, constant);
+  vars_.back().temporary = true;
+  return addr;
+}
+
+cppnes::ZpAddress cppnes::Program::declareZpTemp(std::string_view name, uint8_t size, bool constant)
+{
+  auto addr = declareTemp(name, size, constant);
+  vars_.back().zeroPageOnly = true;
+  return ZpAddress{ 0, addr.name(), constant };
+}
+
+void cppnes::Program::resolveVariables(const std::unordered_map<std::string, uint64_t> &accessCounts)
+{
+  bool pending = std::any_of(vars_.begin(), vars_.end(), [](const SymbolicVar &v) { return !v.resolved; });
+  if (!pending)
+    return;
+
+  // 1. Static access counts, weighted by loop nesting.
+  for (auto &sub : subroutines_) {
+    auto weights = analysis::entryWeights(*sub);
+    for (size_t i = 0; i < sub->instructions_.size(); ++i) {
+      if (auto inst = std::get_if<Instruction>(&sub->instructions_[i]))
+        forEachVarOperand(*inst, vars_, [&](SymbolicVar &v, uint16_t) { v.accesses += weights[i]; });
+    }
+  }
+  for (auto &v : vars_) {
+    auto it = accessCounts.find(v.name);
+    if (!v.resolved && it != accessCounts.end())
+      v.accesses = it->second;
+  }
+
+  // 2. Lifetimes of temporaries over the call graph.
+  auto live = temporaryLiveness(*this, vars_);
+
+  // 3. Hottest first into zero page, the rest into RAM. Temporaries go to a shared area per
+  // memory kind, sized by the peak of simultaneously live temporaries.
+  std::vector<SymbolicVar *> order;
+  for (auto &v : vars_) {
+    if (!v.resolved) order.push_back(&v);
+  }
+  std::stable_sort(order.begin(), order.end(), [](const SymbolicVar *a, const SymbolicVar *b) {
+    if (a->zeroPageOnly != b->zeroPageOnly)
+      return a->zeroPageOnly;
+    return a->accesses > b->accesses;
+    });
+  const uint16_t zpBudget = mmap_.zeroPage.available();
+  uint16_t zpFixed = 0;
+  TempPool zpTemps, ramTemps;
+  for (auto *v : order) {
+    if (v->temporary) {
+      const auto &l = live[v];
+      const uint16_t offset = zpTemps.fit(*v, l);
+      const bool fits = zpFixed + (std::max)(zpTemps.peak, static_cast<uint16_t>(offset + v->size)) <= zpBudget;
+      v->zeroPage = fits && (0 < v->accesses || v->zeroPageOnly);
+      if (v->zeroPage)
+        zpTemps.place(*v, l, offset);
+      else if (v->zeroPageOnly)
+        throw std::out_of_range("resolveVariables: no zero page left for " + v->name);
+      else
+        ramTemps.place(*v, l, ramTemps.fit(*v, l));
+      usage_.tempBytesDeclared += v->size;
+    } else {
+      v->zeroPage = 0 < v->accesses && zpFixed + zpTemps.peak + v->size <= zpBudget;
+      if (v->zeroPage)
+        zpFixed += v->size;
+    }
+  }
+  for (auto *v : order) {
+    if (v->temporary)
+      continue;
+    if (v->zeroPage)
+      v->address = mmap_.zeroPage.allocBlock(v->name, v->size, v->constant).value();
+    else
+      v->address = mmap_.ram.allocBlock(v->name, v->size, 0, v->constant).value();
+  }
+  if (zpTemps.peak) {
+    const uint16_t base = mmap_.zeroPage.allocBlock("temps", static_cast<uint8_t>(zpTemps.peak)).value();
+    for (auto &[v, l] : zpTemps.placed)
+      v->address += base;
+  }
+  if (ramTemps.peak) {
+    const uint16_t base = mmap_.ram.allocBlock("temps", ramTemps.peak).value();
+    for (auto &[v, l] : ramTemps.placed)
+      v->address += base;
+  }
+  for (auto *v : order)
+    LOG_MSG << "resolveVariables:" << v->name << (v->zeroPage ? "-> zero page" : "-> RAM") << v->address << "accesses" << v->accesses;
+  usage_.zeroPageBytes = mmap_.zeroPage.space().peak();
+  usage_.ramBytes = mmap_.ram.space().peak();
+  usage_.zeroPageTempBytes += zpTemps.peak;
+  usage_.ramTempBytes += ramTemps.peak;
+  LOG_MSG << "resolveVariables: peak zero page" << usage_.zeroPageBytes << "bytes, RAM" << usage_.ramBytes << "bytes; temporaries"
+    << usage_.tempBytesDeclared << "bytes in" << usage_.zeroPageTempBytes + usage_.ramTempBytes;
+
+  // 4. Re-encode operands to match the chosen placement.
+  for (auto &sub : subroutines_) {
+    for (auto &entry : sub->instructions_) {
+      auto inst = std::get_if<Instruction>(&entry);
+      if (!inst)
+        continue;
+      Operand rewritten;
+      bool changed = false;
+      forEachVarOperand(*inst, vars_, [&](SymbolicVar &v, uint16_t offset) {
+        uint16_t addr = static_cast<uint16_t>(v.address + offset);
+        std::string name = offset == 0 ? v.name : "";
+        bool constant = offset == 0 && v.constant;
+        changed = true;
+        if (std::holds_alternative<ZeroPage>(inst->operand)) {
+          rewritten = ZeroPage{ ZpAddress::fromValue(addr, name, constant) };
+        } else if (std::holds_alternative<ZeroPageX>(inst->operand)) {
+          rewritten = ZeroPageX{ ZpAddress::fromValue(addr, name) };
+        } else if (std::holds_alternative<ZeroPageY>(inst->operand)) {
+          rewritten = ZeroPageY{ ZpAddress::fromValue(addr, name) };
+        } else if (std::holds_alternative<IndexedIndirectX>(inst->operand)) {
+          rewritten = IndexedIndirectX{ ZpAddress::fromValue(addr, name) };
+        } else if (std::holds_alternative<IndexedIndirectY>(inst->operand)) {
+          rewritten = IndexedIndirectY{ ZpAddress::fromValue(addr, name) };
+        } else if (std::holds_alternative<Indirect>(inst->operand)) {
+          // JMP ($xxFF) reads its high byte from $xx00
+          if ((addr & 0xFF) == 0xFF)
+            throw std::runtime_error("resolveVariables: jmp (" + v.name + ") would read its vector across a page");
+          rewritten = Indirect{ AbsAddress{ addr, name, constant } };
+        } else if (std::holds_alternative<Absolute>(inst->operand)) {
+          // JMP and JSR have no zero page form
+          if (v.zeroPage && inst->opcode != Opcode::JMP && inst->opcode != Opcode::JSR)
+            rewritten = ZeroPage{ ZpAddress::fromValue(addr, name, constant) };
+          else
+            rewritten = Absolute{ AbsAddress{ addr, name, constant } };
+        } else if (std::holds_alternative<AbsoluteX>(inst->operand)) {
+          if (v.zeroPage && hasZeroPageX(inst->opcode))
+            rewritten = ZeroPageX{ ZpAddress::fromValue(addr, name) };
+          else
+            rewritten = AbsoluteX{ AbsAddress{ addr, name } };
+        } else {
+          if (v.zeroPage && inst->opcode == Opcode::LDX)
+            rewritten = ZeroPageY{ ZpAddress::fromValue(addr, name) };
+          else
+            rewritten = AbsoluteY{ AbsAddress{ addr, name } };
+        }
+        });
+      if (changed)
+        inst->operand = rewritten;
+    }
+  }
+  for (auto *v : order)
+    v->resolved = true;
+}
+
+std::unordered_map<std::string, uint64_t> cppnes::Program::loadAccessProfile(std::string_view path)
+{
+  std::ifstream file{ std::filesystem::path{ path } };
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open access profile: " + std::string(path));
+  std::unordered_map<std::string, uint64_t> counts;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream ss{ line };
+    std::string name;
+    uint64_t count = 0;
+    if (ss >> name >> count)
+      counts[name] += count;
+  }
+  return counts;
+}
+
 void cppnes::Program::addConstant(std::string_view name, int32_t value)
 {
   constants_[std::string(name)] = value;
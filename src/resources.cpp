@@ -1,6 +1,12 @@
 #include "nesdefs.hpp"
+#include "compression.hpp"
+#include "tables.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 
 void cppnes::Resources::loadCHR(std::string_view path)
 {
@@ -13,8 +19,8 @@ void cppnes::Resources::loadCHR(std::string_view path)
     throw std::runtime_error("Failed to open CHR file: " + p.string());
 
   auto size = file.tellg();
-  if (size <= 0 || 8192 < size) // NES CHR is max 8 KB
-    throw std::runtime_error("CHR file size invalid (08192 bytes expected)");
+  if (size <= 0 || (8192 < size && (size % 8192 != 0 || 0x40000 < size))) // 8 KB banks, 256 KB at most (MMC3)
+    throw std::runtime_error("CHR file size invalid (up to 8192 bytes, or whole 8 KB banks up to 256 KB expected)");
 
   chrData_.resize(static_cast<size_t>(size));
   file.seekg(0, std::ios::beg);
@@ -24,18 +30,165 @@ void cppnes::Resources::loadCHR(std::string_view path)
   chrPath_ = path;
 }
 
+void cppnes::Resources::addNametable(std::string_view label, std::vector<uint8_t> bytes)
+{
+  packedNametables_[std::string(label)] = std::move(bytes);
+}
+
+void cppnes::Resources::setCHR(std::vector<uint8_t> data)
+{
+  if (data.empty() || (8192 < data.size() && (data.size() % 8192 != 0 || 0x40000 < data.size())))
+    throw std::invalid_argument("setCHR: up to 8192 bytes, or whole 8 KB banks up to 256 KB expected");
+  if (data.size() % 16 != 0)
+    throw std::invalid_argument("setCHR: whole 16-byte tiles expected");
+  chrData_ = std::move(data);
+  chrPath_.clear();
+  chrUseFilename_ = false;
+}
+
+namespace {
+
+  // The Palette= line of a NES Screen Tool session: hex bytes, "[n]" repeating the previous
+  // byte up to n (hex) times in all; 4 sets of 16 bytes.
+  std::vector<uint8_t> nssPalettes(const std::string &text, size_t &set)
+  {
+    std::vector<uint8_t> bytes;
+    std::istringstream in(text);
+    for (std::string line; std::getline(in, line);) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.rfind("VarPalBank=", 0) == 0)
+        set = std::stoul(line.substr(11));
+      if (line.rfind("Palette=", 0) != 0)
+        continue;
+      for (size_t i = 8; i < line.size();) {
+        if (line[i] == '[') {
+          const size_t end = line.find(']', i);
+          if (bytes.empty() || end == std::string::npos)
+            throw std::runtime_error("Bad palette in NES Screen Tool session");
+          const size_t n = std::stoul(line.substr(i + 1, end - i - 1), nullptr, 16);
+          bytes.insert(bytes.end(), n ? n - 1 : 0, bytes.back());
+          i = end + 1;
+        } else {
+          bytes.push_back(static_cast<uint8_t>(std::stoul(line.substr(i, 2), nullptr, 16)));
+          i += 2;
+        }
+      }
+    }
+    return bytes;
+  }
+
+} // anonymous namespace
+
 void cppnes::Resources::loadPalettes(std::string_view path)
 {
-  // TODO:
+  std::filesystem::path p{ path };
+  std::ifstream file(p, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open palette file: " + p.string());
+  std::vector<uint8_t> bytes{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+  if (p.extension() == ".nss") {
+    size_t set = 0;
+    bytes = nssPalettes(std::string(bytes.begin(), bytes.end()), set);
+    if (bytes.size() < (set + 1) * 16)
+      throw std::runtime_error("No palette set " + std::to_string(set) + " in " + p.string());
+    bytes = std::vector<uint8_t>(bytes.begin() + set * 16, bytes.begin() + set * 16 + 16);
+  }
+  if (bytes.size() != 16 && bytes.size() != 32)
+    throw std::runtime_error("Palette file must hold 16 or 32 NES colors: " + p.string());
+  if (std::any_of(bytes.begin(), bytes.end(), [](uint8_t c) { return 0x3F < c; }))
+    throw std::runtime_error("Palette colors must be $00-$3F: " + p.string());
+  std::copy_n(bytes.begin(), 16, bgPal_.begin());
+  if (bytes.size() == 32)
+    std::copy_n(bytes.begin() + 16, 16, spPal_.begin());
+  hasPalettes_ = true;
 }
 
 void cppnes::Resources::setPalettes(std::array<uint8_t, 16> bg, std::array<uint8_t, 16> spr)
 {
   bgPal_ = bg;
   spPal_ = spr;
+  hasPalettes_ = true;
+}
+
+std::array<uint8_t, 32> cppnes::Resources::palettes() const
+{
+  std::array<uint8_t, 32> all;
+  std::copy(bgPal_.begin(), bgPal_.end(), all.begin());
+  std::copy(spPal_.begin(), spPal_.end(), all.begin() + 16);
+  return all;
+}
+
+void cppnes::Resources::setPaletteFade(uint8_t darkSteps, uint8_t lightSteps)
+{
+  if (8 < darkSteps + lightSteps + 1)
+    throw std::invalid_argument("setPaletteFade: 8 steps at most, the palettes included");
+  fadeDark_ = darkSteps;
+  fadeLight_ = lightSteps;
+}
+
+void cppnes::Resources::addDataBlocks(Program &prg) const
+{
+  if (!hasPalettes_)
+    return;
+  const auto all = palettes();
+  auto &block = prg.addDataBlock(paletteLabel()).align(32);
+  block.clear();
+  for (size_t p = 0; p < 8; ++p)
+    block.addBytes(std::vector<uint8_t>(all.begin() + p * 4, all.begin() + p * 4 + 4), (p < 4 ? "Background palette " : "Sprite palette ") + std::to_string(p % 4));
+  if (fadeDark_ + fadeLight_ == 0)
+    return;
+  auto &fade = prg.addDataBlock(paletteFadeLabel()).align(256);
+  fade.clear();
+  for (int step = -fadeDark_; step <= fadeLight_; ++step)
+    fade.generate(32, [&](size_t i) { return tables::fadeColor(all[i], step); }, "fade step " + std::to_string(step));
+}
+
+void cppnes::Resources::addNametable(std::string_view label, std::string_view filename, Compression compression)
+{
+  if (compression == Compression::None) {
+    nametables_[std::string(label)] = std::string(filename);
+    return;
+  }
+  std::error_code error;
+  const auto size = std::filesystem::file_size(std::filesystem::path{ filename }, error);
+  if (error)
+    throw std::runtime_error("Failed to open nametable: " + std::string(filename));
+  if (size == 0 || 1024 < size)
+    throw std::runtime_error("Nametable must be 1 to 1024 bytes: " + std::string(filename));
+  addAsset(label, compression == Compression::Rle ? assets::rle() : assets::lz(), { std::string(filename) });
+}
+
+void cppnes::Resources::addAsset(std::string_view label, assets::Converter converter, std::vector<std::string> files)
+{
+  if (files.empty())
+    throw std::invalid_argument("addAsset: no input files for " + std::string(label));
+  pendingAssets_.push_back({ std::string(label), std::move(converter), std::move(files) });
 }
 
-void cppnes::Resources::addNametable(std::string_view label, std::string_view filename)
+cppnes::assets::PipelineStats cppnes::Resources::buildAssets()
 {
-  nametables_[std::string(label)] = std::string(filename);
+  assets::Pipeline pipeline(assetCache_);
+  std::vector<std::pair<assets::Pipeline::Node, assets::Pipeline::Node>> nodes; // first input, output
+  for (const auto &asset : pendingAssets_) {
+    std::vector<assets::Pipeline::Node> inputs;
+    for (const auto &file : asset.files)
+      inputs.push_back(pipeline.addFile(file));
+    nodes.emplace_back(inputs.front(), pipeline.add(asset.label, asset.converter, inputs));
+  }
+  const auto stats = pipeline.run();
+  for (size_t i = 0; i < pendingAssets_.size(); ++i) {
+    const auto &asset = pendingAssets_[i];
+    const auto &packed = pipeline.output(nodes[i].second);
+    const size_t size = pipeline.output(nodes[i].first).size();
+    if (asset.converter.name == "rle") {
+      LOG_MSG << "addNametable:" << asset.label << size << "->" << packed.size() << "bytes RLE ("
+        << packed.size() * 100 / size << "%), decode" << compression::rleDecodeCycles(packed) << "cycles";
+    } else if (asset.converter.name == "lz") {
+      LOG_MSG << "addNametable:" << asset.label << size << "->" << packed.size() << "bytes LZ ("
+        << packed.size() * 100 / size << "%)";
+    }
+    packedNametables_[asset.label] = packed;
+  }
+  return stats;
 }
\ No newline at end of file
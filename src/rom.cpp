@@ -1,6 +1,7 @@
 #include "nesdefs.hpp"
 #include "asmemitter.hpp"
 #include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
 #include <fstream>
 #include <cassert>
 
@@ -9,8 +10,11 @@ struct cppnes::Rom::Impl {
   Program *prg_ = nullptr;
   Resources *resources_ = nullptr;
   AsmEmitterOptions emitterOptions_;
-  Mapper mapper_ = Mapper::CNROM;
+  Mapper mapper_ = Mapper::NROM;
   Mirroring mirroring_ = Mirroring::Horizontal;
+  uint8_t prgBanks_ = 0;
+  uint8_t chrBanks_ = 0;
+  bool chrRam_ = false;
 };
 
 cppnes::Rom::Rom() : imp(new Impl)
@@ -51,6 +55,74 @@ void cppnes::Rom::setEmitterOptions(const AsmEmitterOptions &options)
   imp->emitterOptions_ = options;
 }
 
+const cppnes::Program *cppnes::Rom::program() const
+{
+  return imp->prg_;
+}
+
+cppnes::Mapper cppnes::Rom::mapper() const
+{
+  return imp->mapper_;
+}
+
+void cppnes::Rom::setPrgBanks(uint8_t count)
+{
+  imp->prgBanks_ = count;
+}
+
+void cppnes::Rom::setChrBanks(uint8_t count)
+{
+  imp->chrBanks_ = count;
+}
+
+uint8_t cppnes::Rom::prgBanks() const
+{
+  if (imp->prgBanks_)
+    return imp->prgBanks_;
+  switch (imp->mapper_) {
+  case Mapper::NROM:
+  case Mapper::CNROM: return 2;
+  default: return 8;
+  }
+}
+
+void cppnes::Rom::setChrRam(bool enable)
+{
+  imp->chrRam_ = enable;
+}
+
+uint8_t cppnes::Rom::chrBanks() const
+{
+  if (imp->chrRam_)
+    return 0;
+  if (imp->chrBanks_)
+    return imp->chrBanks_;
+  const uint8_t banks = imp->mapper_ == Mapper::CNROM ? 4 : 1;
+  return imp->resources_ ? (std::max)(banks, imp->resources_->chrBanks()) : banks;
+}
+
+uint8_t cppnes::Rom::switchableBanks() const
+{
+  switch (imp->mapper_) {
+  case Mapper::UNROM:
+  case Mapper::MMC1:
+  case Mapper::MMC3: return prgBanks() - 1;
+  default: return 0;
+  }
+}
+
+uint8_t cppnes::Rom::mapperNumber() const
+{
+  switch (imp->mapper_) {
+  case Mapper::NROM: return 0;
+  case Mapper::MMC1: return 1;
+  case Mapper::UNROM: return 2;
+  case Mapper::CNROM: return 3;
+  case Mapper::MMC3: return 4;
+  }
+  return 0;
+}
+
 uint8_t cppnes::Rom::mirroringByte() const
 {
   switch (imp->mirroring_) {
@@ -70,14 +142,20 @@ void cppnes::Rom::emitAsm(std::string_view dirPath)
   if (!std::filesystem::exists(dir)) {
     std::filesystem::create_directories(dir);
   }
+  imp->resources_->addDataBlocks(*imp->prg_);
+  imp->prg_->resolveVariables();
+  imp->prg_->memoryMap().writeReport(dir);
   AsmEmitter emitter(imp->emitterOptions_);
   std::ofstream prg{ dir / "prg.asm" };
   std::ofstream cfg{ dir / "lnk.cfg" };
+  imp->resources_->buildAssets();
   emitter.emitInesHeader(*this, prg);
   emitter.emitPrgAsm(*imp->prg_, prg);
-  emitter.emitChars(*imp->resources_, prg);
+  if (imp->resources_->chrBanks() > chrBanks() && !imp->chrRam_)
+    throw std::runtime_error("Rom::emitAsm: the CHR data needs more CHR banks than setChrBanks gives");
+  emitter.emitChars(*imp->resources_, prg, !imp->chrRam_);
   emitter.emitStartup(prg);
-  emitter.emitLinkerConfig(cfg);
+  emitter.emitLinkerConfig(*this, cfg);
 }
 
 void cppnes::Rom::build(std::string_view outputPath, std::string_view workingDir)
@@ -0,0 +1,356 @@
+#include "sim6502.hpp"
+#include "analysis.hpp"
+#include "nesdefs_helper.hpp"
+#include <algorithm>
+
+cppnes::Simulator::Simulator(const Program *prg) : prg_(prg)
+{
+  onRead = [](uint16_t addr) -> std::optional<uint8_t> {
+    if (addr == PPUSTATUS.value()) return 0x80; // always in vblank
+    return std::nullopt;
+    };
+}
+
+void cppnes::Simulator::setLabel(std::string_view name, uint16_t address)
+{
+  labels_[std::string(name)] = address;
+}
+
+uint16_t cppnes::Simulator::labelAddress(std::string_view nameOrExpr) const
+{
+  std::string expr{ nameOrExpr };
+  int32_t offset = 0;
+  auto plus = expr.find('+');
+  if (plus != std::string::npos) {
+    offset = std::stoi(expr.substr(plus + 1));
+    expr = expr.substr(0, plus);
+  }
+  auto it = labels_.find(expr);
+  if (it != labels_.end())
+    return static_cast<uint16_t>(it->second + offset);
+  if (prg_) {
+    // label-relative reference to a resolved variable (#<var)
+    for (const auto &v : prg_->variables()) {
+      if (v.resolved && v.name == expr)
+        return static_cast<uint16_t>(v.address + offset);
+    }
+  }
+  throw std::runtime_error("Simulator: unknown label: " + expr);
+}
+
+void cppnes::Simulator::placeData(uint16_t base)
+{
+  if (!prg_)
+    return;
+  std::vector<const DataBlock *> blocks;
+  for (const auto &[name, db] : prg_->dataBlocks())
+    blocks.push_back(db.get());
+  std::sort(blocks.begin(), blocks.end(), [](const DataBlock *a, const DataBlock *b) { return a->label() < b->label(); });
+  uint32_t addr = base;
+  for (const DataBlock *db : blocks) {
+    addr = (addr + db->alignment() - 1) / db->alignment() * db->alignment();
+    if (db->isNoPageCross() && 256 < (addr & 0xFF) + db->size())
+      addr = (addr + 0xFF) & ~0xFFu;
+    setLabel(db->label(), static_cast<uint16_t>(addr));
+    for (const auto &entry : db->entries()) {
+      if (auto bytes = std::get_if<DataBlock::ByteEntry>(&entry)) {
+        for (uint8_t b : bytes->data) memory[addr++ & 0xFFFF] = b;
+      } else {
+        for (uint16_t w : std::get<DataBlock::WordEntry>(entry).data) {
+          memory[addr++ & 0xFFFF] = static_cast<uint8_t>(w & 0xFF);
+          memory[addr++ & 0xFFFF] = static_cast<uint8_t>(w >> 8);
+        }
+      }
+    }
+  }
+}
+
+uint8_t cppnes::Simulator::read(uint16_t addr)
+{
+  if (onRead) {
+    if (auto v = onRead(addr)) return *v;
+  }
+  return memory[addr];
+}
+
+void cppnes::Simulator::write(uint16_t addr, uint8_t value)
+{
+  memory[addr] = value;
+  if (onWrite) onWrite(addr, value);
+}
+
+void cppnes::Simulator::setNZ(uint8_t v)
+{
+  regs.p = static_cast<uint8_t>((regs.p & ~(N | Z)) | (v & 0x80) | (v == 0 ? Z : 0));
+}
+
+void cppnes::Simulator::push(uint8_t v)
+{
+  memory[0x0100 + regs.sp] = v;
+  --regs.sp;
+}
+
+uint8_t cppnes::Simulator::pull()
+{
+  ++regs.sp;
+  return memory[0x0100 + regs.sp];
+}
+
+const cppnes::Subroutine *cppnes::Simulator::findSubroutine(const std::string &name) const
+{
+  if (!prg_)
+    return nullptr;
+  for (const auto &sub : prg_->subroutines()) {
+    if (sub->name() == name) return sub.get();
+  }
+  return nullptr;
+}
+
+size_t cppnes::Simulator::findLabel(const Frame &f, const std::string &name) const
+{
+  const auto &entries = *f.entries;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    auto ldef = std::get_if<LabelDef>(&entries[i]);
+    if (ldef && ldef->label.name() == name) return i;
+  }
+  return entries.size();
+}
+
+uint64_t cppnes::Simulator::run(const Subroutine &sub, uint64_t maxCycles)
+{
+  std::vector<Frame> frames{ { &sub.instructions(), &sub, 0 } };
+  uint64_t cycles = 0;
+  while (step(frames, cycles)) {
+    if (maxCycles < cycles)
+      throw std::runtime_error("Simulator: cycle limit exceeded in " + sub.name());
+  }
+  return cycles;
+}
+
+uint64_t cppnes::Simulator::run(const std::vector<Instruction> &code, uint64_t maxCycles)
+{
+  return run(std::vector<Entry>(code.begin(), code.end()), maxCycles);
+}
+
+uint64_t cppnes::Simulator::run(const std::vector<Entry> &code, uint64_t maxCycles)
+{
+  std::vector<Frame> frames{ { &code, nullptr, 0 } };
+  uint64_t cycles = 0;
+  while (step(frames, cycles)) {
+    if (maxCycles < cycles)
+      throw std::runtime_error("Simulator: cycle limit exceeded");
+  }
+  return cycles;
+}
+
+bool cppnes::Simulator::step(std::vector<Frame> &frames, uint64_t &cycles)
+{
+  Frame &f = frames.back();
+  if (f.entries->size() <= f.pc) {
+    if (frames.size() == 1) return false;
+    throw std::runtime_error("Simulator: fell off the end of " + (f.sub ? f.sub->name() : std::string("code")));
+  }
+  auto inst = std::get_if<Instruction>(&(*f.entries)[f.pc++]);
+  if (!inst)
+    return true;
+
+  bool cross = false;
+  auto labelAddr = [&](const Label &l) { return labelAddress(l.name()); };
+  // Effective address of a memory operand.
+  auto ea = [&]() -> uint16_t {
+    return std::visit([&](const auto &op) -> uint16_t {
+      using T = std::decay_t<decltype(op)>;
+      if constexpr (std::is_same_v<T, ZeroPage>) {
+        return op.addr.value();
+      } else if constexpr (std::is_same_v<T, ZeroPageX> || std::is_same_v<T, ZeroPageY>) {
+        uint16_t base = std::holds_alternative<ZpAddress>(op.base) ? std::get<ZpAddress>(op.base).value() : labelAddr(std::get<Label>(op.base));
+        return static_cast<uint8_t>(base + (std::is_same_v<T, ZeroPageX> ? regs.x : regs.y));
+      } else if constexpr (std::is_same_v<T, Absolute>) {
+        return op.addr.value();
+      } else if constexpr (std::is_same_v<T, AbsoluteX> || std::is_same_v<T, AbsoluteY>) {
+        uint16_t base = std::holds_alternative<AbsAddress>(op.base) ? std::get<AbsAddress>(op.base).value() : labelAddr(std::get<Label>(op.base));
+        uint16_t addr = static_cast<uint16_t>(base + (std::is_same_v<T, AbsoluteX> ? regs.x : regs.y));
+        cross = (base & 0xFF00) != (addr & 0xFF00);
+        return addr;
+      } else if constexpr (std::is_same_v<T, IndexedIndirectX>) {
+        uint8_t ptr = static_cast<uint8_t>(op.addr.value() + regs.x);
+        return static_cast<uint16_t>(memory[ptr] | memory[static_cast<uint8_t>(ptr + 1)] << 8);
+      } else if constexpr (std::is_same_v<T, IndexedIndirectY>) {
+        uint8_t ptr = op.addr.value();
+        uint16_t base = static_cast<uint16_t>(memory[ptr] | memory[static_cast<uint8_t>(ptr + 1)] << 8);
+        uint16_t addr = static_cast<uint16_t>(base + regs.y);
+        cross = (base & 0xFF00) != (addr & 0xFF00);
+        return addr;
+      } else if constexpr (std::is_same_v<T, Label>) {
+        return labelAddr(op);
+      } else {
+        throw std::runtime_error("Simulator: operand has no address");
+      }
+      }, inst->operand);
+  };
+  // Operand value for read instructions.
+  auto value = [&]() -> uint8_t {
+    if (auto i = std::get_if<Immediate>(&inst->operand)) return i->value;
+    if (auto il = std::get_if<ImmediateLabel>(&inst->operand)) {
+      uint16_t a = labelAddr(il->label);
+      return il->which == ByteOf::Low ? static_cast<uint8_t>(a & 0xFF) : static_cast<uint8_t>(a >> 8);
+    }
+    return read(ea());
+  };
+  const bool accumulator = std::holds_alternative<Accumulator>(inst->operand);
+  // Read-modify-write on A or memory.
+  auto modify = [&](auto fn) {
+    if (accumulator) {
+      regs.a = fn(regs.a);
+      setNZ(regs.a);
+    } else {
+      uint16_t addr = ea();
+      uint8_t v = fn(read(addr));
+      write(addr, v);
+      setNZ(v);
+    }
+  };
+  auto setFlag = [&](Flag fl, bool on) { regs.p = static_cast<uint8_t>(on ? regs.p | fl : regs.p & ~fl); };
+  auto adc = [&](uint8_t m) {
+    unsigned sum = regs.a + m + (flag(C) ? 1 : 0);
+    setFlag(V, (~(regs.a ^ m) & (regs.a ^ sum) & 0x80) != 0);
+    setFlag(C, 0xFF < sum);
+    regs.a = static_cast<uint8_t>(sum);
+    setNZ(regs.a);
+  };
+  auto compare = [&](uint8_t reg, uint8_t m) {
+    setFlag(C, m <= reg);
+    setNZ(static_cast<uint8_t>(reg - m));
+  };
+  bool taken = false;
+  auto branch = [&](bool cond) {
+    taken = cond;
+    if (!cond) return;
+    const auto &target = std::get<Label>(inst->operand).name();
+    size_t idx = findLabel(f, target);
+    if (idx == f.entries->size())
+      throw std::runtime_error("Simulator: branch to unknown label " + target);
+    f.pc = idx;
+  };
+
+  switch (inst->opcode) {
+  case Opcode::LDA: regs.a = value(); setNZ(regs.a); break;
+  case Opcode::LDX: regs.x = value(); setNZ(regs.x); break;
+  case Opcode::LDY: regs.y = value(); setNZ(regs.y); break;
+  case Opcode::STA: write(ea(), regs.a); cross = false; break;
+  case Opcode::STX: write(ea(), regs.x); cross = false; break;
+  case Opcode::STY: write(ea(), regs.y); cross = false; break;
+  case Opcode::ADC: adc(value()); break;
+  case Opcode::SBC: adc(static_cast<uint8_t>(~value())); break;
+  case Opcode::AND: regs.a &= value(); setNZ(regs.a); break;
+  case Opcode::ORA: regs.a |= value(); setNZ(regs.a); break;
+  case Opcode::EOR: regs.a ^= value(); setNZ(regs.a); break;
+  case Opcode::CMP: compare(regs.a, value()); break;
+  case Opcode::CPX: compare(regs.x, value()); break;
+  case Opcode::CPY: compare(regs.y, value()); break;
+  case Opcode::BIT: {
+    uint8_t m = value();
+    setFlag(Z, (regs.a & m) == 0);
+    setFlag(N, (m & 0x80) != 0);
+    setFlag(V, (m & 0x40) != 0);
+    break;
+  }
+  case Opcode::ASL: modify([&](uint8_t v) { setFlag(C, (v & 0x80) != 0); return static_cast<uint8_t>(v << 1); }); cross = false; break;
+  case Opcode::LSR: modify([&](uint8_t v) { setFlag(C, (v & 0x01) != 0); return static_cast<uint8_t>(v >> 1); }); cross = false; break;
+  case Opcode::ROL: modify([&](uint8_t v) { uint8_t c = flag(C) ? 1 : 0; setFlag(C, (v & 0x80) != 0); return static_cast<uint8_t>(v << 1 | c); }); cross = false; break;
+  case Opcode::ROR: modify([&](uint8_t v) { uint8_t c = flag(C) ? 0x80 : 0; setFlag(C, (v & 0x01) != 0); return static_cast<uint8_t>(v >> 1 | c); }); cross = false; break;
+  case Opcode::INC: modify([](uint8_t v) { return static_cast<uint8_t>(v + 1); }); cross = false; break;
+  case Opcode::DEC: modify([](uint8_t v) { return static_cast<uint8_t>(v - 1); }); cross = false; break;
+  case Opcode::INX: setNZ(++regs.x); break;
+  case Opcode::INY: setNZ(++regs.y); break;
+  case Opcode::DEX: setNZ(--regs.x); break;
+  case Opcode::DEY: setNZ(--regs.y); break;
+  case Opcode::TAX: regs.x = regs.a; setNZ(regs.x); break;
+  case Opcode::TAY: regs.y = regs.a; setNZ(regs.y); break;
+  case Opcode::TXA: regs.a = regs.x; setNZ(regs.a); break;
+  case Opcode::TYA: regs.a = regs.y; setNZ(regs.a); break;
+  case Opcode::TSX: regs.x = regs.sp; setNZ(regs.x); break;
+  case Opcode::TXS: regs.sp = regs.x; break;
+  case Opcode::PHA: push(regs.a); break;
+  case Opcode::PHP: push(regs.p | B | 0x20); break;
+  case Opcode::PLA: regs.a = pull(); setNZ(regs.a); break;
+  case Opcode::PLP: regs.p = static_cast<uint8_t>((pull() & ~B) | 0x20); break;
+  case Opcode::CLC: setFlag(C, false); break;
+  case Opcode::SEC: setFlag(C, true); break;
+  case Opcode::CLI: setFlag(I, false); break;
+  case Opcode::SEI: setFlag(I, true); break;
+  case Opcode::CLV: setFlag(V, false); break;
+  case Opcode::CLD: setFlag(D, false); break;
+  case Opcode::SED: setFlag(D, true); break;
+  case Opcode::NOP: break;
+  case Opcode::BCC: branch(!flag(C)); break;
+  case Opcode::BCS: branch(flag(C)); break;
+  case Opcode::BEQ: branch(flag(Z)); break;
+  case Opcode::BNE: branch(!flag(Z)); break;
+  case Opcode::BMI: branch(flag(N)); break;
+  case Opcode::BPL: branch(!flag(N)); break;
+  case Opcode::BVC: branch(!flag(V)); break;
+  case Opcode::BVS: branch(flag(V)); break;
+  case Opcode::JMP: {
+    auto target = std::get_if<Label>(&inst->operand);
+    if (!target)
+      throw std::runtime_error("Simulator: only JMP to labels is supported");
+    size_t idx = findLabel(f, target->name());
+    if (idx < f.entries->size()) {
+      f.pc = idx;
+    } else if (auto callee = findSubroutine(target->name())) {
+      f = Frame{ &callee->instructions(), callee, 0 };
+    } else {
+      throw std::runtime_error("Simulator: jump to unknown label " + target->name());
+    }
+    break;
+  }
+  case Opcode::JSR: {
+    auto target = std::get_if<Label>(&inst->operand);
+    const Subroutine *callee = target ? findSubroutine(target->name()) : nullptr;
+    if (!callee)
+      throw std::runtime_error("Simulator: JSR to unknown subroutine");
+    push(0xFF); // return address placeholder, keeps SP accurate
+    push(0xFF);
+    cycles += analysis::instructionCycles(*inst);
+    frames.push_back(Frame{ &callee->instructions(), callee, 0 });
+    return true;
+  }
+  case Opcode::RTS:
+  case Opcode::RTI:
+    cycles += analysis::instructionCycles(*inst);
+    if (frames.size() == 1)
+      return false;
+    if (inst->opcode == Opcode::RTI)
+      regs.p = static_cast<uint8_t>((pull() & ~B) | 0x20);
+    pull();
+    pull();
+    frames.pop_back();
+    return true;
+  case Opcode::BRK:
+    throw std::runtime_error("Simulator: BRK");
+  }
+  cycles += analysis::instructionCycles(*inst, taken) + (cross ? 1 : 0);
+  return true;
+}
+
+std::optional<uint32_t> cppnes::verifyExhaustive(const Program *prg, const Subroutine &sub,
+  ZpAddress src, unsigned srcBits, ZpAddress dst, unsigned dstBits,
+  const std::function<uint32_t(uint32_t)> &expected)
+{
+  Simulator sim(prg);
+  sim.placeData();
+  const uint32_t mask = dstBits == 32 ? 0xFFFFFFFFu : (1u << dstBits) - 1;
+  for (uint32_t in = 0; in < (1u << srcBits); ++in) {
+    sim.regs = {};
+    for (unsigned b = 0; b < srcBits; b += 8)
+      sim.memory[static_cast<uint8_t>(src.value() + b / 8)] = static_cast<uint8_t>(in >> b);
+    sim.run(sub);
+    uint32_t out = 0;
+    for (unsigned b = 0; b < dstBits; b += 8)
+      out |= static_cast<uint32_t>(sim.memory[static_cast<uint8_t>(dst.value() + b / 8)]) << b;
+    if (out != (expected(in) & mask))
+      return in;
+  }
+  return std::nullopt;
+}
@@ -0,0 +1,456 @@
+#include "superopt.hpp"
+#include "sim6502.hpp"
+#include "3rdparty/nlohmann/json.hpp"
+#include "3rdparty/utils_log/logger.hpp"
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <unordered_map>
+
+namespace {
+
+  using namespace cppnes;
+
+  // In Opcode declaration order.
+  const char *const kMnemonics[] = {
+    "LDA", "STA", "LDX", "STX", "LDY", "STY", "ADC", "SBC", "ASL", "LSR",
+    "ROL", "ROR", "BIT", "AND", "ORA", "EOR", "CMP", "CPX", "CPY", "JMP",
+    "JSR", "RTS", "BCC", "BCS", "INX", "INY", "DEX", "DEY", "INC", "DEC",
+    "BEQ", "BMI", "BNE", "BPL", "BVC", "BVS", "BRK", "PHP", "PLP", "PHA",
+    "PLA", "CLC", "SEC", "CLI", "SEI", "CLV", "CLD", "SED", "RTI", "TAX",
+    "TXA", "TAY", "TYA", "TSX", "TXS", "NOP"
+  };
+  static_assert(std::size(kMnemonics) == static_cast<size_t>(Opcode::NOP) + 1);
+
+  enum class Mode { Implied, Accumulator, Immediate, ZeroPage, Absolute };
+
+  const std::vector<Opcode> kImmediateOps = {
+    Opcode::LDA, Opcode::LDX, Opcode::LDY, Opcode::ADC, Opcode::SBC, Opcode::AND,
+    Opcode::ORA, Opcode::EOR, Opcode::CMP, Opcode::CPX, Opcode::CPY
+  };
+  const std::vector<Opcode> kMemoryOps = {
+    Opcode::LDA, Opcode::LDX, Opcode::LDY, Opcode::STA, Opcode::STX, Opcode::STY,
+    Opcode::ADC, Opcode::SBC, Opcode::AND, Opcode::ORA, Opcode::EOR, Opcode::CMP,
+    Opcode::CPX, Opcode::CPY, Opcode::BIT, Opcode::ASL, Opcode::LSR, Opcode::ROL,
+    Opcode::ROR, Opcode::INC, Opcode::DEC
+  };
+  const std::vector<Opcode> kAccumulatorOps = { Opcode::ASL, Opcode::LSR, Opcode::ROL, Opcode::ROR };
+  const std::vector<Opcode> kImpliedOps = {
+    Opcode::INX, Opcode::INY, Opcode::DEX, Opcode::DEY, Opcode::TAX, Opcode::TAY,
+    Opcode::TXA, Opcode::TYA, Opcode::CLC, Opcode::SEC, Opcode::CLV
+  };
+
+  bool contains(const std::vector<Opcode> &ops, Opcode op)
+  {
+    return std::find(ops.begin(), ops.end(), op) != ops.end();
+  }
+
+  bool isIoAddress(uint16_t a)
+  {
+    return 0x2000 <= a && a < 0x4020;
+  }
+
+  Mode modeOf(const Instruction &inst)
+  {
+    const auto &op = inst.operand;
+    if (std::holds_alternative<std::monostate>(op) && contains(kImpliedOps, inst.opcode))
+      return Mode::Implied;
+    if (std::holds_alternative<Accumulator>(op) && contains(kAccumulatorOps, inst.opcode))
+      return Mode::Accumulator;
+    if (std::holds_alternative<Immediate>(op) && contains(kImmediateOps, inst.opcode))
+      return Mode::Immediate;
+    if (std::holds_alternative<ZeroPage>(op) && contains(kMemoryOps, inst.opcode))
+      return Mode::ZeroPage;
+    if (auto a = std::get_if<Absolute>(&op); a && contains(kMemoryOps, inst.opcode) && !isIoAddress(a->addr.value()))
+      return Mode::Absolute;
+    throw std::invalid_argument(std::string("superopt: unsupported instruction ") + kMnemonics[static_cast<size_t>(inst.opcode)]);
+  }
+
+  // Address of a memory operand (zero page or absolute).
+  std::optional<uint16_t> addressOf(const Instruction &inst)
+  {
+    if (auto z = std::get_if<ZeroPage>(&inst.operand)) return z->addr.value();
+    if (auto a = std::get_if<Absolute>(&inst.operand)) return a->addr.value();
+    return std::nullopt;
+  }
+
+  struct Cost {
+    uint32_t cycles = 0;
+    uint32_t bytes = 0;
+    bool operator<(const Cost &o) const { return cycles != o.cycles ? cycles < o.cycles : bytes < o.bytes; }
+  };
+
+  Cost costOf(const std::vector<Instruction> &seq)
+  {
+    Cost c;
+    for (const auto &inst : seq) {
+      c.cycles += analysis::instructionCycles(inst);
+      c.bytes += analysis::instructionBytes(inst);
+    }
+    return c;
+  }
+
+  struct State {
+    Simulator::Registers regs;
+    std::vector<uint8_t> mem; // one per address of the fragment
+  };
+
+  // Compares two end states, returning the RegBit mask of the registers/flags that differ.
+  // Memory differences are reported as 0x80.
+  uint8_t difference(const State &a, const State &b)
+  {
+    uint8_t d = 0;
+    if (a.regs.a != b.regs.a) d |= analysis::RegA;
+    if (a.regs.x != b.regs.x) d |= analysis::RegX;
+    if (a.regs.y != b.regs.y) d |= analysis::RegY;
+    auto p = a.regs.p ^ b.regs.p;
+    if (p & Simulator::N) d |= analysis::FlagN;
+    if (p & Simulator::Z) d |= analysis::FlagZ;
+    if (p & Simulator::C) d |= analysis::FlagC;
+    if (p & Simulator::V) d |= analysis::FlagV;
+    if (a.mem != b.mem) d |= 0x80;
+    return d;
+  }
+
+  class Searcher {
+  public:
+    Searcher(const std::vector<Instruction> &fragment, const superopt::SearchOptions &options)
+      : target_(fragment), options_(options)
+    {
+      std::vector<uint8_t> immediates{ 0x00, 0x01, 0xFF };
+      std::vector<std::pair<Mode, Operand>> memory;
+      for (const auto &inst : fragment) {
+        Mode m = modeOf(inst);
+        if (m == Mode::Immediate) {
+          uint8_t v = std::get<Immediate>(inst.operand).value;
+          if (std::find(immediates.begin(), immediates.end(), v) == immediates.end())
+            immediates.push_back(v);
+        }
+        if (auto a = addressOf(inst)) {
+          if (std::find(addrs_.begin(), addrs_.end(), *a) == addrs_.end()) {
+            addrs_.push_back(*a);
+            memory.emplace_back(m, inst.operand);
+          }
+        }
+      }
+      for (Opcode op : kImpliedOps) pool_.push_back({ op, std::monostate{} });
+      for (Opcode op : kAccumulatorOps) pool_.push_back({ op, Accumulator{} });
+      for (Opcode op : kImmediateOps) {
+        for (uint8_t v : immediates) pool_.push_back({ op, Immediate{ v } });
+      }
+      for (Opcode op : kMemoryOps) {
+        for (const auto &[m, operand] : memory) pool_.push_back({ op, operand });
+      }
+      std::stable_sort(pool_.begin(), pool_.end(), [](const Instruction &a, const Instruction &b) {
+        return costOf({ a }) < costOf({ b });
+        });
+      makeStates();
+      for (const auto &s : states_)
+        expected_.push_back(execute(target_, s));
+    }
+
+    std::optional<superopt::RewriteRule> run()
+    {
+      best_ = costOf(target_);
+      const Cost targetCost = best_;
+      std::vector<Instruction> seq;
+      if (equivalent(seq))
+        bestSeq_ = seq, best_ = {};
+      else
+        search(seq, {});
+      if (!bestSeq_)
+        return std::nullopt;
+      superopt::RewriteRule rule;
+      rule.pattern = target_;
+      rule.replacement = *bestSeq_;
+      for (size_t i = 0; i < states_.size(); ++i)
+        rule.dead |= difference(execute(rule.replacement, states_[i]), expected_[i]) & analysis::RegsAll;
+      rule.cyclesBefore = targetCost.cycles;
+      rule.bytesBefore = targetCost.bytes;
+      rule.cyclesAfter = best_.cycles;
+      rule.bytesAfter = best_.bytes;
+      return rule;
+    }
+
+  private:
+    void makeStates()
+    {
+      const uint8_t edges[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+      const size_t n = std::size(edges);
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+          for (uint8_t p : { uint8_t{ 0x24 }, uint8_t{ 0x24 | Simulator::C | Simulator::V } }) {
+            State s;
+            s.regs.a = edges[i];
+            s.regs.x = edges[j];
+            s.regs.y = edges[(i + j) % n];
+            s.regs.p = p;
+            for (size_t k = 0; k < addrs_.size(); ++k)
+              s.mem.push_back(edges[(j + k * 2 + i) % n]);
+            states_.push_back(s);
+          }
+        }
+      }
+      std::mt19937 rng(options_.seed);
+      for (size_t i = 0; i < options_.randomStates; ++i) {
+        State s;
+        s.regs.a = static_cast<uint8_t>(rng());
+        s.regs.x = static_cast<uint8_t>(rng());
+        s.regs.y = static_cast<uint8_t>(rng());
+        s.regs.p = static_cast<uint8_t>(0x24 | (rng() & (Simulator::N | Simulator::V | Simulator::Z | Simulator::C)));
+        for (size_t k = 0; k < addrs_.size(); ++k)
+          s.mem.push_back(static_cast<uint8_t>(rng()));
+        states_.push_back(s);
+      }
+      order_.resize(states_.size());
+      for (size_t i = 0; i < order_.size(); ++i) order_[i] = i;
+    }
+
+    State execute(const std::vector<Instruction> &seq, const State &s)
+    {
+      std::vector<Entry> code(seq.begin(), seq.end());
+      return execute(code, s);
+    }
+
+    State execute(const std::vector<Entry> &code, const State &s)
+    {
+      sim_.regs = s.regs;
+      for (size_t k = 0; k < addrs_.size(); ++k)
+        sim_.memory[addrs_[k]] = s.mem[k];
+      sim_.run(code);
+      State out{ sim_.regs, {} };
+      for (uint16_t a : addrs_)
+        out.mem.push_back(sim_.memory[a]);
+      return out;
+    }
+
+    bool equivalent(const std::vector<Instruction> &seq)
+    {
+      std::vector<Entry> code(seq.begin(), seq.end());
+      const uint8_t mask = static_cast<uint8_t>(options_.liveOut | 0x80);
+      for (size_t i = 0; i < order_.size(); ++i) {
+        size_t t = order_[i];
+        if (difference(execute(code, states_[t]), expected_[t]) & mask) {
+          // the state that told this candidate apart goes first for the next one
+          std::rotate(order_.begin(), order_.begin() + i, order_.begin() + i + 1);
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void search(std::vector<Instruction> &seq, Cost cost)
+    {
+      if (seq.size() == options_.maxLength)
+        return;
+      for (const auto &inst : pool_) {
+        Cost next{ cost.cycles + analysis::instructionCycles(inst), cost.bytes + analysis::instructionBytes(inst) };
+        if (!(next < best_))
+          break; // the pool is sorted by cost
+        seq.push_back(inst);
+        if (equivalent(seq)) {
+          best_ = next;
+          bestSeq_ = seq;
+        } else {
+          search(seq, next);
+        }
+        seq.pop_back();
+      }
+    }
+
+    std::vector<Instruction> target_;
+    superopt::SearchOptions options_;
+    std::vector<uint16_t> addrs_;
+    std::vector<Instruction> pool_;
+    std::vector<State> states_;
+    std::vector<State> expected_;
+    std::vector<size_t> order_;
+    Simulator sim_;
+    Cost best_;
+    std::optional<std::vector<Instruction>> bestSeq_;
+  };
+
+  std::string hex(uint32_t v, int digits)
+  {
+    static const char *const d = "0123456789ABCDEF";
+    std::string s(digits, '0');
+    for (int i = digits - 1; 0 <= i; --i, v >>= 4)
+      s[i] = d[v & 0xF];
+    return s;
+  }
+
+  std::string toAsm(const Instruction &inst)
+  {
+    std::string s = kMnemonics[static_cast<size_t>(inst.opcode)];
+    if (std::holds_alternative<Accumulator>(inst.operand)) s += " A";
+    else if (auto i = std::get_if<Immediate>(&inst.operand)) s += " #$" + hex(i->value, 2);
+    else if (auto z = std::get_if<ZeroPage>(&inst.operand)) s += " $" + hex(z->addr.value(), 2);
+    else if (auto a = std::get_if<Absolute>(&inst.operand)) s += " $" + hex(a->addr.value(), 4);
+    return s;
+  }
+
+  Instruction fromAsm(const std::string &text)
+  {
+    const std::string mnemonic = text.substr(0, 3);
+    auto it = std::find(std::begin(kMnemonics), std::end(kMnemonics), mnemonic);
+    if (it == std::end(kMnemonics))
+      throw std::runtime_error("superopt: unknown mnemonic in rule: " + text);
+    Instruction inst{ static_cast<Opcode>(it - std::begin(kMnemonics)), std::monostate{} };
+    std::string arg = text.size() > 4 ? text.substr(4) : "";
+    if (arg == "A") {
+      inst.operand = Accumulator{};
+    } else if (arg.size() == 4 && arg.compare(0, 2, "#$") == 0) {
+      inst.operand = Immediate{ static_cast<uint8_t>(std::stoul(arg.substr(2), nullptr, 16)) };
+    } else if (arg.size() == 3 && arg[0] == '$') {
+      inst.operand = ZeroPage{ ZpAddress{ static_cast<uint8_t>(std::stoul(arg.substr(1), nullptr, 16)) } };
+    } else if (arg.size() == 5 && arg[0] == '$') {
+      inst.operand = Absolute{ AbsAddress{ static_cast<uint16_t>(std::stoul(arg.substr(1), nullptr, 16)) } };
+    } else if (!arg.empty()) {
+      throw std::runtime_error("superopt: bad operand in rule: " + text);
+    }
+    modeOf(inst); // validates
+    return inst;
+  }
+
+  const std::pair<uint8_t, const char *> kRegNames[] = {
+    { analysis::RegA, "A" }, { analysis::RegX, "X" }, { analysis::RegY, "Y" },
+    { analysis::FlagN, "N" }, { analysis::FlagZ, "Z" }, { analysis::FlagC, "C" }, { analysis::FlagV, "V" }
+  };
+
+  // Pattern address -> address of the matched code, keeping names for the emitter.
+  using Binding = std::unordered_map<uint16_t, Operand>;
+
+  bool match(const Instruction &pattern, const Instruction &actual, Binding &binding)
+  {
+    if (pattern.opcode != actual.opcode || pattern.operand.index() != actual.operand.index())
+      return false;
+    if (auto i = std::get_if<Immediate>(&pattern.operand))
+      return i->value == std::get<Immediate>(actual.operand).value;
+    auto p = addressOf(pattern);
+    if (!p)
+      return true;
+    auto a = addressOf(actual);
+    if (std::holds_alternative<Absolute>(actual.operand) && isIoAddress(*a))
+      return false;
+    auto it = binding.find(*p);
+    if (it != binding.end())
+      return addressOf({ actual.opcode, it->second }) == a;
+    for (const auto &[from, to] : binding) {
+      if (addressOf({ actual.opcode, to }) == a)
+        return false; // two placeholders on one address could alias
+    }
+    binding.emplace(*p, actual.operand);
+    return true;
+  }
+
+} // anonymous namespace
+
+std::optional<cppnes::superopt::RewriteRule> cppnes::superopt::superoptimize(const std::vector<Instruction> &fragment, const SearchOptions &options)
+{
+  if (fragment.empty())
+    throw std::invalid_argument("superoptimize: empty fragment");
+  Searcher searcher(fragment, options);
+  return searcher.run();
+}
+
+std::optional<cppnes::superopt::RewriteRule> cppnes::superopt::superoptimize(const Subroutine &fragment, const SearchOptions &options)
+{
+  std::vector<Instruction> code;
+  for (const auto &e : fragment.instructions()) {
+    if (std::holds_alternative<LabelDef>(e))
+      throw std::invalid_argument("superoptimize: fragment must be straight-line code");
+    if (auto inst = std::get_if<Instruction>(&e))
+      code.push_back(*inst);
+  }
+  return superoptimize(code, options);
+}
+
+void cppnes::superopt::saveRules(const std::vector<RewriteRule> &rules, const std::filesystem::path &path)
+{
+  nlohmann::json j;
+  j["version"] = 1;
+  j["rules"] = nlohmann::json::array();
+  for (const auto &r : rules) {
+    nlohmann::json jr;
+    for (const auto &inst : r.pattern) jr["pattern"].push_back(toAsm(inst));
+    jr["replacement"] = nlohmann::json::array();
+    for (const auto &inst : r.replacement) jr["replacement"].push_back(toAsm(inst));
+    jr["dead"] = nlohmann::json::array();
+    for (const auto &[bit, name] : kRegNames) {
+      if (r.dead & bit) jr["dead"].push_back(name);
+    }
+    jr["cycles"] = { r.cyclesBefore, r.cyclesAfter };
+    jr["bytes"] = { r.bytesBefore, r.bytesAfter };
+    j["rules"].push_back(jr);
+  }
+  std::ofstream out(path);
+  if (!out)
+    throw std::runtime_error("saveRules: cannot write " + path.string());
+  out << j.dump(2) << "\n";
+}
+
+std::vector<cppnes::superopt::RewriteRule> cppnes::superopt::loadRules(const std::filesystem::path &path)
+{
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("loadRules: cannot read " + path.string());
+  nlohmann::json j = nlohmann::json::parse(in);
+  std::vector<RewriteRule> rules;
+  for (const auto &jr : j.at("rules")) {
+    RewriteRule r;
+    for (const auto &s : jr.at("pattern")) r.pattern.push_back(fromAsm(s.get<std::string>()));
+    for (const auto &s : jr.at("replacement")) r.replacement.push_back(fromAsm(s.get<std::string>()));
+    for (const auto &s : jr.at("dead")) {
+      for (const auto &[bit, name] : kRegNames) {
+        if (s.get<std::string>() == name) r.dead |= bit;
+      }
+    }
+    r.cyclesBefore = jr.at("cycles")[0];
+    r.cyclesAfter = jr.at("cycles")[1];
+    r.bytesBefore = jr.at("bytes")[0];
+    r.bytesAfter = jr.at("bytes")[1];
+    rules.push_back(std::move(r));
+  }
+  return rules;
+}
+
+int cppnes::Program::peephole(const std::vector<superopt::RewriteRule> &rules)
+{
+  using superopt::RewriteRule;
+  std::vector<const RewriteRule *> ordered;
+  for (const auto &r : rules) ordered.push_back(&r);
+  std::stable_sort(ordered.begin(), ordered.end(), [](const RewriteRule *a, const RewriteRule *b) {
+    return a->cyclesBefore - a->cyclesAfter > b->cyclesBefore - b->cyclesAfter;
+    });
+  int rewrites = 0;
+  for (auto &sub : subroutines_) {
+    auto &entries = sub->instructions_;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      for (const RewriteRule *rule : ordered) {
+        const size_t n = rule->pattern.size();
+        if (entries.size() < i + n)
+          continue;
+        Binding binding;
+        bool ok = true;
+        for (size_t k = 0; k < n && ok; ++k) {
+          auto inst = std::get_if<Instruction>(&entries[i + k]);
+          ok = inst && match(rule->pattern[k], *inst, binding);
+        }
+        if (!ok || !analysis::deadAfter(*sub, i + n - 1, rule->dead))
+          continue;
+        std::vector<Entry> replacement;
+        for (Instruction inst : rule->replacement) {
+          if (auto p = addressOf(inst))
+            inst.operand = binding.at(*p);
+          replacement.push_back(inst);
+        }
+        LOG_MSG << "peephole:" << sub->name() << "saves" << (rule->cyclesBefore - rule->cyclesAfter) << "cycles";
+        entries.erase(entries.begin() + i, entries.begin() + i + n);
+        entries.insert(entries.begin() + i, replacement.begin(), replacement.end());
+        ++rewrites;
+        break;
+      }
+    }
+  }
+  return rewrites;
+}
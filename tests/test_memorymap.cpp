@@ -0,0 +1,165 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "nesdefs_helper.hpp"
+
+TEST_CASE("Symbolic variables are promoted to zero page by access count", "[memorymap]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto filler = prg.allocZp("filler", static_cast<uint8_t>(ZeroPageAllocator::Max - ZeroPageAllocator::Min)); // leave 1 byte
+  (void)filler;
+  auto cold = prg.declareVar("cold");
+  auto hot = prg.declareVar("hot");
+  auto &sub = prg.addSubroutine("update");
+  sub.lda(abs(cold))
+    .ldx(imm(8))
+    .label("@loop")
+    .inc(abs(hot))
+    .lda(absx(hot))
+    .dex()
+    .bne("@loop")
+    .rts();
+
+  prg.resolveVariables();
+
+  const auto &vars = prg.variables();
+  REQUIRE(vars.size() == 2);
+  REQUIRE(vars[0].name == "cold");
+  REQUIRE_FALSE(vars[0].zeroPage);
+  REQUIRE(vars[0].address == RamAllocator::Min);
+  REQUIRE(vars[1].zeroPage);
+  REQUIRE(vars[1].address == ZeroPageAllocator::Max);
+
+  const auto &entries = sub.instructions();
+  REQUIRE(std::holds_alternative<Absolute>(std::get<Instruction>(entries[0]).operand));
+  REQUIRE(std::holds_alternative<ZeroPage>(std::get<Instruction>(entries[3]).operand));
+  REQUIRE(std::holds_alternative<ZeroPageX>(std::get<Instruction>(entries[4]).operand));
+
+  // Operands match variables by name: no other symbol may share it.
+  prg.addDataBlock(Label{ "map" });
+  REQUIRE_THROWS_AS(prg.declareVar("map"), std::logic_error);
+  REQUIRE_THROWS_AS(prg.declareVar("update"), std::logic_error);
+  REQUIRE_THROWS_AS(prg.declareVar("filler"), std::logic_error);
+  REQUIRE_THROWS_AS(prg.declareVar("@loop"), std::logic_error);
+  auto speed = prg.declareVar("speed");
+  (void)speed;
+  REQUIRE_THROWS_AS(prg.addDataBlock(Label{ "speed" }), std::logic_error);
+  REQUIRE_THROWS_AS(prg.addSubroutine("speed"), std::logic_error);
+}
+
+TEST_CASE("Placeholders are rewritten in every operand and read label-relative", "[memorymap]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto vector = prg.declareVar("vector", 2);
+  auto buffer = prg.declareVar("buffer", 16);
+  auto &sub = prg.addSubroutine("dispatch");
+  sub.inc(abs(vector)).inc(abs(vector))
+    .jmp(Indirect{ vector })
+    .jmp(Absolute{ vector });
+  bblocks::clearMemory(sub, buffer + 4, 8, ZpAddress{ 0x10 }, ZpAddress{ 0x12 });
+  REQUIRE_THROWS_AS(bblocks::clearPage(sub, buffer), std::invalid_argument);
+
+  prg.resolveVariables();
+  const auto &vars = prg.variables();
+  REQUIRE(vars[0].zeroPage);
+  const auto &entries = sub.instructions();
+  auto ind = std::get<Indirect>(std::get<Instruction>(entries[2]).operand);
+  REQUIRE(ind.addr.value() == vars[0].address);
+  auto jump = std::get<Absolute>(std::get<Instruction>(entries[3]).operand); // never shrunk to zero page
+  REQUIRE(jump.addr.value() == vars[0].address);
+  auto low = std::get<ImmediateLabel>(std::get<Instruction>(entries[4]).operand);
+  REQUIRE(low.label.name() == "buffer+4");
+}
+
+TEST_CASE("Access profile overrides static counts", "[memorymap]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto a = prg.declareVar("a");
+  auto b = prg.declareVar("b");
+  prg.addSubroutine("s").lda(abs(a)).lda(abs(a)).lda(abs(b)).rts();
+  prg.resolveVariables({ { "a", 1 }, { "b", 100 } });
+  REQUIRE(prg.variables()[1].address == ZeroPageAllocator::Min);
+  REQUIRE(prg.variables()[0].address == ZeroPageAllocator::Min + 1);
+}
+
+TEST_CASE("Temporaries with disjoint lifetimes share addresses", "[memorymap]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto t1 = prg.declareTemp("t1");
+  auto t2 = prg.declareTemp("t2");
+  auto t3 = prg.declareTemp("t3");
+  auto t4 = prg.declareTemp("t4");
+  auto ptr = prg.declareZpTemp("ptr");
+  auto &reset = prg.addSubroutine("reset");
+  reset.sta(abs(t1)).jsr("helper").lda(abs(t1)) // t1 live across the call
+    .sta(abs(t2)).lda(abs(t2))
+    .sta(zp(ptr)).sta(zp(ptr + 1)).ldy(imm(0)).lda(indy(ptr))
+    .label("forever")
+    .jmp("forever");
+  prg.setResetVector(reset);
+  prg.addSubroutine("helper").inc(abs(t3)).rts();
+  auto &nmi = prg.addSubroutine("nmi");
+  nmi.lda(abs(t4)).rti(); // may interrupt any of the others
+  prg.setNMIVector(nmi);
+
+  prg.resolveVariables();
+
+  auto address = [&](const std::string &name) {
+    for (const auto &v : prg.variables()) {
+      if (v.name == name) return v.address;
+    }
+    return uint16_t{ 0 };
+    };
+  REQUIRE(address("ptr") == ZeroPageAllocator::Min);
+  REQUIRE(address("t1") == ZeroPageAllocator::Min);
+  REQUIRE(address("t2") == ZeroPageAllocator::Min);
+  REQUIRE(address("t3") == ZeroPageAllocator::Min + 1);
+  REQUIRE(address("t4") == ZeroPageAllocator::Min + 2);
+  REQUIRE(prg.memoryUsage().zeroPageBytes == 3);
+  REQUIRE(prg.memoryUsage().zeroPageTempBytes == 3);
+  REQUIRE(prg.memoryUsage().tempBytesDeclared == 6);
+
+  const auto &entries = reset.instructions();
+  REQUIRE(std::get<ZeroPage>(std::get<Instruction>(entries[6]).operand).addr.value() == ZeroPageAllocator::Min + 1);
+  REQUIRE(std::get<IndexedIndirectY>(std::get<Instruction>(entries[8]).operand).addr.value() == ZeroPageAllocator::Min);
+}
+
+TEST_CASE("RAM allocator validates placement, frees, aligns and best-fits", "[memorymap]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  auto a = mem.ram.allocBlock("a", 0x10);
+  REQUIRE(a.value() == RamAllocator::Min);
+  REQUIRE_THROWS_AS(mem.ram.allocBlock("clash", 4, RamAllocator::Min + 0x0C), std::invalid_argument);
+  auto fixed = mem.ram.allocBlock("fixed", 0x20, 0x0340);
+  auto b = mem.ram.allocBlock("b", 0x08); // after a
+  REQUIRE(b.value() == 0x0310);
+  auto queue = mem.ram.allocAligned("vramQueue", 0x40, 0x100);
+  REQUIRE(queue.value() == 0x0400);
+
+  // free gaps: $0318-$033F (40), $0360-$03FF (160), $0440-$07FF; best fit takes the 40 byte one
+  mem.ram.free(a);
+  auto c = mem.ram.allocBlock("c", 0x18);
+  REQUIRE(c.value() == 0x0318);
+  auto d = mem.ram.allocBlock("d", 0x10); // reuses a's bytes
+  REQUIRE(d.value() == RamAllocator::Min);
+  REQUIRE_THROWS_AS(mem.ram.free(AbsAddress{ 0x0301 }), std::invalid_argument);
+  REQUIRE_THROWS_AS(mem.ram.allocBlock("huge", 0x500), std::out_of_range);
+  (void)fixed;
+
+  const auto &space = mem.ram.space();
+  REQUIRE(space.used() == 0x10 + 0x20 + 0x08 + 0x40 + 0x18);
+  REQUIRE(space.peak() == space.used());
+  REQUIRE(space.largestFree() == 0x07FF - 0x0440 + 1);
+  REQUIRE(space.fragmentation() > 0);
+  auto text = mem.reportText();
+  REQUIRE(text.find("$0400-$043F    64  vramQueue") != std::string::npos);
+  REQUIRE(mem.reportJson().find("\"vramQueue\"") != std::string::npos);
+}
@@ -0,0 +1,362 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "asmemitter.hpp"
+#include "analysis.hpp"
+#include "nesdefs_helper.hpp"
+#include "tables.hpp"
+#include "chr.hpp"
+#include "assets.hpp"
+#include "compression.hpp"
+#include "image.hpp"
+#include "sim6502.hpp"
+#include <fstream>
+#include <sstream>
+
+TEST_CASE("Constrained data blocks are packed without crossing pages", "[rom]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  prg.addDataBlock("Big").addBytes(std::vector<uint8_t>(200, 1)).noPageCross();
+  prg.addDataBlock("Palette").addBytes(std::vector<uint8_t>(32, 2)).noPageCross();
+  prg.addDataBlock("Page").addBytes(std::vector<uint8_t>(10, 3)).align(256);
+  prg.addDataBlock("Free").addBytes({ 1, 2, 3 });
+
+  auto layout = analysis::layoutConstrainedData(prg);
+  REQUIRE(layout.size() == 3);
+  for (const auto &p : layout) {
+    REQUIRE(p.offset / 256 == (p.offset + p.block->size() - 1) / 256);
+  }
+  REQUIRE(layout[0].block->label() == "Page");
+  REQUIRE(layout[0].offset == 0);
+  REQUIRE(layout[1].block->label() == "Big");
+  REQUIRE(layout[1].offset == 10);
+  REQUIRE(layout[2].block->label() == "Palette");
+  REQUIRE(layout[2].offset == 210); // fits in the rest of the first page
+
+  prg.addDataBlock("TooBig").addBytes(std::vector<uint8_t>(300, 0)).noPageCross();
+  REQUIRE_THROWS(analysis::layoutConstrainedData(prg));
+}
+
+TEST_CASE("Hot indexed reads of unconstrained data are reported", "[rom]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  prg.addDataBlock("Table").addBytes({ 1, 2, 3, 4 });
+  prg.addDataBlock("Safe").addBytes({ 1, 2, 3, 4 }).noPageCross();
+  auto &sub = prg.addSubroutine("s");
+  sub.lda(absx("Table")); // not in a loop
+  bblocks::loopX(sub, 4, [](Subroutine &s) { s.lda(absx("Table")).lda(absx("Safe")); });
+  auto warnings = analysis::pageCrossWarnings(prg);
+  REQUIRE(warnings.size() == 1);
+  REQUIRE(warnings[0].find("'Table'") != std::string::npos);
+}
+
+TEST_CASE("Split tables are generated at build time", "[rom]")
+{
+  using namespace cppnes;
+  static_assert(tables::bitReverse(0x01) == 0x80);
+  static_assert(tables::make<4>(tables::bitReverse)[3] == 0xC0);
+  static_assert(tables::quarterSquare(510) == 65025);
+  REQUIRE(tables::sine(64) == 127);
+  REQUIRE(tables::sine(192) == static_cast<uint8_t>(-127));
+
+  MemoryMap mem;
+  Program prg(mem);
+  auto rows = prg.addSplitTable("RowAddr", 30, [](size_t r) { return tables::ppuRowAddress(r); });
+  REQUIRE(rows.lo.name() == "RowAddr_lo");
+  auto &lo = prg.getDataBlock(rows.lo);
+  auto &hi = prg.getDataBlock(rows.hi);
+  REQUIRE(lo.size() == 30);
+  REQUIRE(lo.isNoPageCross());
+  REQUIRE(std::get<DataBlock::ByteEntry>(lo.entries()[1]).data[13] == 0xA0); // row 29: $23A0
+  REQUIRE(std::get<DataBlock::ByteEntry>(hi.entries()[1]).data[13] == 0x23);
+
+  auto qsq = prg.addSplitTable("QSq", 511, tables::quarterSquare);
+  REQUIRE(prg.getDataBlock(qsq.hi).alignment() == 256);
+}
+
+TEST_CASE("Mappers get their header, banked linker config and bank switching code", "[rom]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  Label table = prg.addBankTable(7);
+  REQUIRE(prg.addBankTable(3).name() == "bankTable1"); // the first table keeps its 7 bytes
+  REQUIRE(prg.getDataBlock(table).size() == 7);
+  prg.addSubroutine("banked").setBank(3).lda(imm(1)).rts();
+  auto &fixed = prg.addSubroutine("fixed");
+  fixed.bblocks().switchBank(Mapper::UNROM, 3, table).jsr(Label{ "banked" }).rts();
+  prg.setResetVector(fixed);
+  prg.setNMIVector(fixed);
+
+  Rom rom;
+  rom.setProgram(prg);
+  rom.setMapper(Mapper::UNROM);
+  AsmEmitter emitter;
+  std::ostringstream cfg, header, code;
+  emitter.emitLinkerConfig(rom, cfg);
+  emitter.emitInesHeader(rom, header);
+  emitter.emitPrgAsm(prg, code);
+  REQUIRE(cfg.str().find("PRG6:") != std::string::npos);
+  REQUIRE(cfg.str().find("PRG7:") == std::string::npos);
+  REQUIRE(cfg.str().find("BANK3:") != std::string::npos);
+  REQUIRE(cfg.str().find("start = $C000") != std::string::npos);
+  REQUIRE(header.str().find("$08                  ; PRG-ROM") != std::string::npos);
+  REQUIRE(header.str().find("$20                  ; Mapper low") != std::string::npos);
+  REQUIRE(code.str().find(".segment \"BANK3\"") != std::string::npos);
+
+  rom.setChrRam();
+  std::ostringstream chrRam;
+  emitter.emitLinkerConfig(rom, chrRam);
+  REQUIRE(chrRam.str().find("CHARS") == std::string::npos);
+
+  auto &mmc1 = prg.addSubroutine("mmc1");
+  mmc1.bblocks().switchBank(Mapper::MMC1, 5);
+  size_t writes = 0;
+  for (const auto &e : mmc1.instructions()) {
+    auto inst = std::get_if<Instruction>(&e);
+    writes += inst && inst->opcode == Opcode::STA;
+  }
+  REQUIRE(writes == 5);
+  REQUIRE_THROWS_AS(bblocks::switchBank(mmc1, Mapper::UNROM, 1), std::invalid_argument);
+  REQUIRE_THROWS_AS(bblocks::switchBank(mmc1, Mapper::NROM, 1), std::invalid_argument);
+}
+
+TEST_CASE("Bank packer keeps hot code fixed and calls other banks through trampolines", "[rom]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &reset = prg.addSubroutine("reset");
+  reset.jsr(Label{ "levelA" }).jsr(Label{ "levelB" }).rts();
+  auto &nmi = prg.addSubroutine("nmi");
+  nmi.jsr(Label{ "hot" }).rti();
+  prg.addSubroutine("hot").lda(imm(1)).rts();
+  auto &levelA = prg.addSubroutine("levelA");
+  levelA.ldx(imm(0)).lda(absx(Label{ "mapA" })).jsr(Label{ "helperA" }).jsr(Label{ "levelB" });
+  for (int i = 0; i < 10; ++i)
+    levelA.sta(cppnes::abs(0x0400 + i));
+  levelA.rts();
+  prg.addSubroutine("helperA").lda(imm(2)).rts();
+  auto &levelB = prg.addSubroutine("levelB");
+  levelB.ldx(imm(0)).lda(absx(Label{ "mapB" }));
+  for (int i = 0; i < 10; ++i)
+    levelB.sta(cppnes::abs(0x0500 + i));
+  levelB.rts();
+  prg.addDataBlock("mapA").addBytes(std::vector<uint8_t>(16, 1));
+  prg.addDataBlock("mapB").addBytes(std::vector<uint8_t>(16, 2));
+  prg.setResetVector(reset);
+  prg.setNMIVector(nmi);
+
+  BankPackOptions options;
+  options.banks = 2;
+  options.bankBytes = 64;
+  options.fixedBytes = 16;
+  auto report = prg.packBanks(options);
+  REQUIRE(prg.getSubroutine("nmi").bank() == FixedBank);
+  REQUIRE(prg.getSubroutine("hot").bank() == FixedBank);
+  const uint8_t bankA = prg.getSubroutine("levelA").bank();
+  const uint8_t bankB = prg.getSubroutine("levelB").bank();
+  REQUIRE(bankA != FixedBank);
+  REQUIRE(bankB != FixedBank);
+  REQUIRE(bankA != bankB);
+  REQUIRE(prg.getSubroutine("helperA").bank() == bankA);
+  REQUIRE(prg.getDataBlock("mapA").bank() == bankA);
+  REQUIRE(prg.getDataBlock("mapB").bank() == bankB);
+  REQUIRE(report.bankBytes.size() == 2);
+  REQUIRE(report.trampolines == 2); // levelA_far, levelB_far
+  REQUIRE(report.farCalls == 3);
+  REQUIRE(prg.getSubroutine("levelB_far").bank() == FixedBank);
+  // reset starts with farBank = 0 and bank 0 mapped (lda #0, sta farBank, tay, sta bankTable,y)
+  REQUIRE(std::get<Instruction>(reset.instructions()[1]).opcode == Opcode::STA);
+  auto target = std::get_if<Label>(&std::get<Instruction>(reset.instructions()[4]).operand);
+  REQUIRE((target && target->name() == "levelA_far"));
+  REQUIRE_THROWS_AS(prg.packBanks(options), std::logic_error);
+
+  // Registers pass through a trampoline both ways.
+  MemoryMap mem2;
+  Program regs(mem2);
+  auto &main = regs.addSubroutine("main");
+  main.lda(imm(1)).ldx(imm(2)).ldy(imm(3)).jsr(Label{ "far" })
+    .sta(cppnes::abs(0x0400)).stx(cppnes::abs(0x0401)).sty(cppnes::abs(0x0402)).rts();
+  auto &far = regs.addSubroutine("far");
+  far.sta(cppnes::abs(0x0410)).stx(cppnes::abs(0x0411)).sty(cppnes::abs(0x0412));
+  for (int i = 0; i < 8; ++i)
+    far.inc(cppnes::abs(0x0420 + i));
+  far.lda(imm(4)).ldx(imm(5)).ldy(imm(6)).rts();
+  regs.setResetVector(main);
+  options.pinned = { "main" };
+  options.fixedBytes = 0;
+  REQUIRE(regs.packBanks(options).trampolines == 1);
+  regs.resolveVariables();
+  Simulator sim(&regs);
+  sim.placeData();
+  const uint16_t farBank = regs.variables()[0].address;
+  sim.memory[farBank] = 0x55; // power-up RAM
+  sim.run(main);
+  REQUIRE(sim.memory[0x0410] == 1);
+  REQUIRE(sim.memory[0x0411] == 2);
+  REQUIRE(sim.memory[0x0412] == 3);
+  REQUIRE(sim.memory[0x0400] == 4);
+  REQUIRE(sim.memory[0x0401] == 5);
+  REQUIRE(sim.memory[0x0402] == 6);
+  REQUIRE(sim.memory[farBank] == 0); // the caller's bank, set by the reset code
+}
+
+TEST_CASE("CHR tiles are merged with their duplicates and flips, and references remapped", "[rom][chr]")
+{
+  using namespace cppnes;
+  const chr::Tile arrow{ 0x80, 0xC0, 0xE0, 0xF0, 0xE0, 0xC0, 0x80, 0x00, 0x01, 0x03, 0x07, 0x0F, 0x07, 0x03, 0x01, 0x00 };
+  const chr::Tile corner{ 0xFF, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+  REQUIRE(chr::flip(chr::flip(corner, chr::FlipH | chr::FlipV), chr::FlipH | chr::FlipV) == corner);
+  const chr::Tile tiles[] = { {}, arrow, corner, arrow, chr::flip(arrow, chr::FlipH), chr::flip(corner, chr::FlipH | chr::FlipV) };
+  std::vector<uint8_t> table;
+  for (const auto &t : tiles)
+    table.insert(table.end(), t.begin(), t.end());
+
+  auto bg = chr::deduplicate(table);
+  REQUIRE(bg.chr.size() == 5 * 16);
+  REQUIRE(bg.freed == std::vector<uint8_t>{ 3 });
+  metatiles::Nametable nt{};
+  nt[0] = 4;
+  nt[1] = 3;
+  chr::remap(nt, bg);
+  REQUIRE((nt[0] == 3 && nt[1] == 1));
+
+  auto spr = chr::deduplicate(table, true);
+  REQUIRE(spr.chr.size() == 3 * 16);
+  REQUIRE(spr.freed == std::vector<uint8_t>{ 3, 4, 5 });
+  REQUIRE((spr.duplicates == 1 && spr.flipped == 2));
+  std::vector<chr::SpriteTile> ship{ { 0, 0, 4, 0x01 }, { 8, 0, 5, 0x40 } };
+  chr::remap(ship, spr);
+  REQUIRE((ship[0].tile == 1 && ship[0].attributes == 0x41));
+  REQUIRE((ship[1].tile == 2 && ship[1].attributes == 0x80));
+  nt[0] = 4; // nametables cannot flip
+  REQUIRE_THROWS_AS(chr::remap(nt, spr), std::logic_error);
+
+  Resources rc;
+  rc.setCHR(spr.chr);
+  REQUIRE(rc.chrData().size() == 48);
+  REQUIRE_THROWS_AS(rc.setCHR(std::vector<uint8_t>(40)), std::invalid_argument);
+  rc.setCHR(chr::patternTables(bg, spr)); // sprite tiles still from $1000
+  REQUIRE(rc.chrData().size() == 0x2000);
+  REQUIRE(std::equal(spr.chr.begin(), spr.chr.end(), rc.chrData().begin() + 0x1000));
+}
+
+TEST_CASE("Asset pipeline converts in parallel and rebuilds only dirty assets", "[rom][assets]")
+{
+  using namespace cppnes;
+  const auto dir = std::filesystem::temp_directory_path() / "cppnes_assets_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir / "src");
+  auto writeScreen = [&](const std::string &name, uint8_t fill) {
+    std::vector<char> nt(1024, static_cast<char>(fill));
+    nt[5] = 1;
+    std::ofstream(dir / "src" / name, std::ios::binary).write(nt.data(), nt.size());
+  };
+  writeScreen("a.nam", 0x20);
+  writeScreen("b.nam", 0x30);
+  auto build = [&](assets::PipelineStats &stats) {
+    assets::Pipeline pipeline(dir / "cache", 4);
+    auto a = pipeline.addFile(dir / "src" / "a.nam");
+    auto b = pipeline.addFile(dir / "src" / "b.nam");
+    auto aRle = pipeline.add("a.rle", assets::rle(), { a });
+    auto bRle = pipeline.add("b.rle", assets::rle(), { b });
+    auto meta = pipeline.add("world", assets::metatileTables(), { a, b });
+    pipeline.add("world.lz", assets::lz(), { meta });
+    stats = pipeline.run();
+    REQUIRE(compression::rleDecode(pipeline.output(aRle)).size() == 1024);
+    REQUIRE(pipeline.output(bRle) != pipeline.output(aRle));
+    return pipeline.output(meta);
+  };
+
+  assets::PipelineStats stats;
+  const auto meta = build(stats);
+  REQUIRE((stats.converted == 4 && stats.cached == 0));
+  // the blocks of metatiles::addDataBlocks: 4 corner tables, then per screen map and attributes
+  const size_t count = meta[0] | meta[1] << 8;
+  REQUIRE(meta.size() == 2 + 4 * count + 2 * (240 + 64));
+  const auto set = metatiles::compile({ { "a", metatiles::loadNametable((dir / "src" / "a.nam").string()) },
+    { "b", metatiles::loadNametable((dir / "src" / "b.nam").string()) } });
+  REQUIRE(count == set.metatiles.size());
+  const auto attr = metatiles::attributeTable(set, set.screens[1]);
+  REQUIRE(std::equal(attr.begin(), attr.end(), meta.begin() + 2 + 4 * count + 304 + 240));
+  build(stats);
+  REQUIRE((stats.converted == 0 && stats.cached == 4));
+
+  // Resources run the same pipeline from Rom::emitAsm, sharing the cache.
+  Resources rc;
+  rc.setAssetCache(dir / "cache");
+  rc.addNametable("aRle", (dir / "src" / "a.nam").string(), Compression::Rle);
+  rc.addAsset("world", assets::metatileTables(), { (dir / "src" / "a.nam").string(), (dir / "src" / "b.nam").string() });
+  stats = rc.buildAssets();
+  REQUIRE((stats.converted == 0 && stats.cached == 2));
+  REQUIRE(rc.packedNametables().at("world") == meta);
+  REQUIRE(compression::rleDecode(rc.packedNametables().at("aRle")).size() == 1024);
+
+  writeScreen("b.nam", 0x31);
+  build(stats);
+  REQUIRE((stats.converted == 3 && stats.cached == 1));
+
+  assets::Pipeline failing;
+  failing.add("broken", assets::rle(), {});
+  REQUIRE_THROWS_AS(failing.run(), std::runtime_error);
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Images convert to deduplicated CHR, nametable and fitted palettes", "[rom][image]")
+{
+  using namespace cppnes;
+  // Black background; bricks (red/orange/white) on the left, sky blues on the right, grass at the bottom.
+  image::Image img{ 256, 240, std::vector<uint8_t>(256 * 240, 0x0F) };
+  for (size_t y = 0; y < 240; ++y) {
+    for (size_t x = 0; x < 256; ++x) {
+      uint8_t &c = img.pixels[y * 256 + x];
+      if (192 <= y)
+        c = (x + y) % 4 ? 0x2A : 0x0F;
+      else if (x < 128)
+        c = y % 8 == 0 ? 0x30 : (x % 16 < 2 ? 0x16 : (x + y) % 5 == 0 ? 0x27 : 0x0F);
+      else
+        c = (x / 8 + y / 8) % 2 ? 0x21 : 0x11;
+    }
+  }
+  std::vector<uint8_t> pgm{ 'P', '5', '\n', '2', '5', '6', ' ', '2', '4', '0', '\n', '2', '5', '5', '\n' };
+  pgm.insert(pgm.end(), img.pixels.begin(), img.pixels.end());
+  REQUIRE(image::decode(pgm).pixels == img.pixels);
+  // The same as an 8-bit BMP (bottom-up rows, BGRA palette).
+  const uint8_t colors[] = { 0x0F, 0x2A, 0x30, 0x16, 0x27, 0x21, 0x11 };
+  std::vector<uint8_t> bmp(14 + 40 + 4 * 7);
+  auto put = [&](size_t at, uint32_t v, size_t n) { for (size_t i = 0; i < n; ++i) bmp[at + i] = static_cast<uint8_t>(v >> (8 * i)); };
+  bmp[0] = 'B'; bmp[1] = 'M';
+  put(10, static_cast<uint32_t>(bmp.size()), 4); put(14, 40, 4); put(18, 256, 4); put(22, 240, 4); put(26, 1, 2); put(28, 8, 2); put(46, 7, 4);
+  const uint32_t rgb[] = { 0x000000, 0x58D854, 0xFCFCFC, 0xF83800, 0xFCA044, 0x3CBCFC, 0x0078F8 };
+  for (size_t i = 0; i < 7; ++i)
+    put(54 + i * 4, rgb[i], 3);
+  for (size_t y = 240; y-- > 0;) {
+    for (size_t x = 0; x < 256; ++x)
+      bmp.push_back(static_cast<uint8_t>(std::find(std::begin(colors), std::end(colors), img.pixels[y * 256 + x]) - colors));
+  }
+  REQUIRE(image::decode(bmp).pixels == img.pixels);
+
+  const auto screen = image::convert(img);
+  REQUIRE(screen.chr.size() / 16 < 40);
+  REQUIRE(screen.palettes[0] == 0x0F);
+  // Every pixel comes back from the tiles, attributes and palettes.
+  bool same = true;
+  for (size_t y = 0; y < 240; ++y) {
+    for (size_t x = 0; x < 256; ++x) {
+      const size_t tile = screen.nametable[(y / 8) * 32 + x / 8];
+      const uint8_t lo = screen.chr[tile * 16 + y % 8], hi = screen.chr[tile * 16 + 8 + y % 8];
+      const int slot = (lo >> (7 - x % 8) & 1) | (hi >> (7 - x % 8) & 1) << 1;
+      const int k = screen.nametable[960 + (y / 32) * 8 + x / 32] >> (((y / 16 % 2) * 2 + x / 16 % 2) * 2) & 3;
+      same = same && screen.palettes[k * 4 + slot] == img.pixels[y * 256 + x];
+    }
+  }
+  REQUIRE(same);
+
+  for (size_t x = 0; x < 4; ++x)
+    img.pixels[x] = static_cast<uint8_t>(0x01 + x); // 5 colors in the top-left area
+  REQUIRE_THROWS_AS(image::convert(img), std::invalid_argument);
+}
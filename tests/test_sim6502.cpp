@@ -0,0 +1,645 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "nesdefs_helper.hpp"
+#include "sim6502.hpp"
+#include "metatiles.hpp"
+#include "compression.hpp"
+#include "tables.hpp"
+#include <filesystem>
+#include <fstream>
+
+namespace {
+  const cppnes::ZpAddress SRC{ 0x10 };
+  const cppnes::ZpAddress DST{ 0x20 };
+}
+
+TEST_CASE("Simulator executes instructions and counts cycles", "[sim6502]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &sub = prg.addSubroutine("count");
+  Label loop("@loop");
+  sub.ldx(imm(10)).lda(immZero).label(loop).clc().adc(imm(3)).dex().bne(loop).sta(zp(DST)).rts();
+  Simulator sim;
+  uint64_t cycles = sim.run(sub);
+  REQUIRE(sim.memory[DST.value()] == 30);
+  // ldx, lda: 4; 10 x (clc adc dex bne) = 8 cycles, +1 for each of the 9 taken branches; sta: 3; rts: 6
+  REQUIRE(cycles == 4 + 89 + 3 + 6);
+}
+
+TEST_CASE("Simulator follows JSR and reads data blocks", "[sim6502]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  prg.addDataBlock(Label{ "Table" }).addBytes({ 5, 6, 7 });
+  auto &leaf = prg.addSubroutine("leaf");
+  leaf.ldx(imm(2)).lda(absx(Label{ "Table" })).rts();
+  auto &main = prg.addSubroutine("main");
+  main.jsr(Label{ "leaf" }).sta(zp(DST)).rts();
+  Simulator sim(&prg);
+  sim.placeData();
+  sim.run(main);
+  REQUIRE(sim.memory[DST.value()] == 7);
+  REQUIRE(sim.regs.sp == 0xFD);
+}
+
+TEST_CASE("Constant multiply matches for every k and input", "[sim6502]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  for (unsigned k = 0; k < 256; ++k) {
+    auto &sub = prg.addSubroutine("mul" + std::to_string(k));
+    bblocks::mulConst(sub, DST, SRC, static_cast<uint8_t>(k));
+    auto bad = verifyExhaustive(nullptr, sub, SRC, 8, DST, 8, [k](uint32_t x) { return x * k; });
+    INFO("k = " << k);
+    REQUIRE_FALSE(bad.has_value());
+  }
+  auto &tbl = prg.addSubroutine("mulTable");
+  bblocks::mulConst(tbl, DST, SRC, 77, &prg);
+  REQUIRE(prg.dataBlocks().count("MulConst77") == 1);
+  REQUIRE_FALSE(verifyExhaustive(&prg, tbl, SRC, 8, DST, 8, [](uint32_t x) { return x * 77; }).has_value());
+
+  for (uint16_t k : { 3, 10, 40, 255, 320, 1000, 0x7FFF }) {
+    auto &sub = prg.addSubroutine("mul16_" + std::to_string(k));
+    bblocks::mulConst16(sub, DST, SRC, k);
+    INFO("k = " << k);
+    REQUIRE_FALSE(verifyExhaustive(nullptr, sub, SRC, 16, DST, 16, [k](uint32_t x) { return x * k; }).has_value());
+  }
+}
+
+TEST_CASE("Constant divide matches for every k and input", "[sim6502]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  for (unsigned k = 1; k < 256; ++k) {
+    auto &sub = prg.addSubroutine("div" + std::to_string(k));
+    bblocks::divConst(sub, DST, SRC, static_cast<uint8_t>(k));
+    auto bad = verifyExhaustive(nullptr, sub, SRC, 8, DST, 8, [k](uint32_t x) { return x / k; });
+    INFO("k = " << k);
+    REQUIRE_FALSE(bad.has_value());
+  }
+  for (uint16_t k : { 1, 3, 7, 10, 256, 1000, 0x9000 }) {
+    auto &sub = prg.addSubroutine("div16_" + std::to_string(k));
+    bblocks::divConst16(sub, DST, SRC, k);
+    INFO("k = " << k);
+    REQUIRE_FALSE(verifyExhaustive(nullptr, sub, SRC, 16, DST, 16, [k](uint32_t x) { return x / k; }).has_value());
+  }
+  auto &sub = prg.addSubroutine("div0");
+  REQUIRE_THROWS(bblocks::divConst(sub, DST, SRC, 0));
+}
+
+TEST_CASE("Strength reduction beats a shift-and-add loop", "[sim6502]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &by10 = prg.addSubroutine("by10");
+  bblocks::mulConst(by10, DST, SRC, 10);
+  Simulator sim;
+  sim.memory[SRC.value()] = 25;
+  REQUIRE(sim.run(by10) <= 20); // lda, asl, asl, clc, adc, asl, sta
+  REQUIRE(sim.memory[DST.value()] == 250);
+}
+
+TEST_CASE("delayCycles burns exactly n cycles", "[sim6502]")
+{
+  using namespace cppnes;
+  using namespace cppnes::analysis;
+  MemoryMap mem;
+  Program prg(mem);
+  const uint8_t loopRegs = RegX | FlagN | FlagZ;
+  for (uint8_t clobber : { uint8_t{ 0 }, loopRegs, uint8_t{ RegsAll } }) {
+    for (uint32_t n : { 2u, 3u, 4u, 5u, 7u, 9u, 13u, 50u, 113u, 341u, 2273u, 20000u, 400000u }) {
+      if (clobber == 0 && 5000 < n)
+        continue;
+      auto &sub = prg.addSubroutine("delay" + std::to_string(n));
+      bblocks::delayCycles(sub, n, clobber);
+      Simulator sim;
+      sim.regs = { 0x11, 0x22, 0x33, 0xFD, 0xE5 };
+      INFO("n = " << n << " clobber = " << int(clobber));
+      REQUIRE(sim.run(sub) == n);
+      if (clobber == 0)
+        REQUIRE((sim.regs.a == 0x11 && sim.regs.x == 0x22 && sim.regs.y == 0x33 && sim.regs.p == 0xE5));
+      if (clobber == loopRegs)
+        REQUIRE(sim.regs.y == 0x33);
+    }
+  }
+  auto &one = prg.addSubroutine("one");
+  REQUIRE_THROWS(bblocks::delayCycles(one, 1));
+  auto &two = prg.addSubroutine("two");
+  bblocks::delayCycles(two, 2);
+  REQUIRE(subroutineBytes(two) == 1); // NOP
+  auto &big = prg.addSubroutine("big");
+  bblocks::delayCycles(big, 29780, RegsAll);
+  REQUIRE(subroutineBytes(big) <= 16);
+}
+
+TEST_CASE("balancedIf pads both paths to the same cycles", "[sim6502]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &sub = prg.addSubroutine("branchy");
+  sub.lda(zp(SRC));
+  bblocks::balancedIf(sub, Opcode::BNE,
+    [](Subroutine &s) { s.lda(imm(1)).sta(zp(DST)); },
+    [](Subroutine &s) { s.inc(zp(DST)).inc(zp(DST)).asl(zp(DST)); },
+    analysis::RegX | analysis::FlagN | analysis::FlagZ);
+  Simulator sim;
+  sim.memory[SRC.value()] = 0;
+  uint64_t thenCycles = sim.run(sub);
+  REQUIRE(sim.memory[DST.value()] == 1);
+  sim.memory[SRC.value()] = 5;
+  sim.memory[DST.value()] = 3;
+  uint64_t elseCycles = sim.run(sub);
+  REQUIRE(sim.memory[DST.value()] == 10);
+  REQUIRE(thenCycles == elseCycles);
+
+  auto &bad = prg.addSubroutine("bad");
+  REQUIRE_THROWS(bblocks::balancedIf(bad, Opcode::BEQ, [](Subroutine &s) { s.bne(Label{ "x" }); }, nullptr));
+}
+
+TEST_CASE("Entity table spawns, iterates and despawns through its lists", "[sim6502][entities]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto ents = prg.addEntityTable("ents", 4, { "x", "id" });
+  REQUIRE(ents.field("x").value() == 0x0300);
+  REQUIRE(ents.field("id").value() == 0x0304);
+  REQUIRE(ents.next.value() == 0x0308);
+  REQUIRE_THROWS_AS(ents.field("vx"), std::invalid_argument);
+
+  auto &sub = prg.addSubroutine("update");
+  sub.bblocks().entityInit(ents);
+  for (int i = 0; i < 3; ++i)
+    sub.bblocks().entitySpawn(ents, "full").txa().sta(ents("id"));
+  sub.bblocks().entityForEach(ents, [&](Subroutine &s) {
+    s.inc(ents("x"))
+      .lda(ents("id"))
+      .cmp(imm(1))
+      .bne("@keep")
+      .bblocks().entityDespawn(ents)
+      .label("@keep");
+    });
+  sub.label("full").rts();
+  prg.resolveVariables();
+
+  auto var = [&](const std::string &name) {
+    for (const auto &v : prg.variables()) {
+      if (v.name == name) return v.address;
+    }
+    return uint16_t{ 0 };
+    };
+  Simulator sim(&prg);
+  sim.run(sub);
+  // spawned 0, 1, 2 (live list 2 -> 1 -> 0); all visited once, 1 freed
+  REQUIRE(sim.memory[0x0300] == 1);
+  REQUIRE(sim.memory[0x0301] == 1);
+  REQUIRE(sim.memory[0x0302] == 1);
+  REQUIRE(sim.memory[0x0303] == 0);
+  REQUIRE(sim.memory[var("ents_live")] == 2);
+  REQUIRE(sim.memory[0x0308 + 2] == 0);
+  REQUIRE(sim.memory[0x0308 + 0] == 0xFF);
+  REQUIRE(sim.memory[var("ents_free")] == 1);
+  REQUIRE(sim.memory[0x0308 + 1] == 3);
+  REQUIRE(sim.memory[0x0308 + 3] == 0xFF);
+}
+
+TEST_CASE("Save slots are written across calls and verified on load", "[sim6502][save]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto save = prg.addSaveSlots("save", 10, 2);
+  REQUIRE(save.sram.value() == SramAllocator::Min);
+  REQUIRE(mem.sram.battery());
+  REQUIRE(mem.reportText().find("SRAM (battery)") != std::string::npos);
+
+  const AbsAddress RESULT{ 0x0700 };
+  auto &begin = prg.addSubroutine("begin");
+  begin.ldx(imm(1)).bblocks().saveBegin(save).rts();
+  auto &step = prg.addSubroutine("step");
+  step.bblocks().saveStep(save, 4).rts();
+  auto &load = prg.addSubroutine("load");
+  load.ldx(imm(1))
+    .bblocks().saveLoad(save, "@bad")
+    .lda(imm(1)).sta(abs(RESULT)).rts()
+    .label("@bad")
+    .lda(imm(2)).sta(abs(RESULT)).rts();
+  prg.resolveVariables();
+
+  Simulator sim(&prg);
+  sim.placeData();
+  for (uint16_t i = 0; i < 10; ++i)
+    sim.memory[save.buffer.value() + i] = static_cast<uint8_t>(3 * i + 1);
+  sim.run(begin);
+  const uint16_t slot1 = SramAllocator::Min + 12;
+  sim.run(step);
+  REQUIRE(sim.memory[slot1 + 3] == 10);
+  REQUIRE(sim.memory[slot1 + 4] == 0); // not yet
+  sim.run(step);
+  sim.run(step); // last 2 bytes and the checksum
+  REQUIRE(sim.memory[slot1 + 9] == 28);
+  uint8_t sum = 0x5A, eor = 0xA5;
+  for (uint16_t i = 0; i < 10; ++i) {
+    sum = static_cast<uint8_t>(sum + 3 * i + 1);
+    eor ^= static_cast<uint8_t>(3 * i + 1);
+  }
+  REQUIRE(sim.memory[slot1 + 10] == sum);
+  REQUIRE(sim.memory[slot1 + 11] == eor);
+  const uint64_t idle = sim.run(step);
+  REQUIRE(idle < 20);
+
+  for (uint16_t i = 0; i < 10; ++i)
+    sim.memory[save.buffer.value() + i] = 0;
+  sim.run(load);
+  REQUIRE(sim.memory[RESULT.value()] == 1);
+  REQUIRE(sim.memory[save.buffer.value() + 9] == 28);
+  sim.memory[slot1 + 5] ^= 0x10;
+  sim.run(load);
+  REQUIRE(sim.memory[RESULT.value()] == 2);
+}
+
+TEST_CASE("IRQ split chain writes back to back and re-arms for the next split", "[sim6502][irq]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  const AbsAddress scrollX = prg.allocRam("scrollX");
+  auto chain = prg.addIrqSplits("split", {
+    { 32, { { 0x2005, scrollX }, { 0x2005, uint8_t{ 0 } } } },
+    { 200, { { 0x2001, uint8_t{ 0x1E } } } } });
+  REQUIRE(prg.irqVector() == &prg.getSubroutine("split"));
+  REQUIRE(chain.handlers.size() == 2);
+  REQUIRE(chain.firstLatch == 32);
+  REQUIRE(chain.lastWriteCycle[0] == chain.firstWriteCycle[0] + 4);
+  REQUIRE(chain.reloadCycle[0] == chain.lastWriteCycle[0] + 4 + 2 + 4 + 4);
+  REQUIRE(chain.reloadCycle[1] == 0);
+
+  Simulator sim(&prg);
+  sim.setLabel("split_1", 0xE123);
+  sim.memory[scrollX.value()] = 0x55;
+  std::vector<std::pair<uint16_t, uint8_t>> ppu;
+  sim.onWrite = [&](uint16_t addr, uint8_t v) {
+    if (0x2000 <= addr && addr < 0x4000)
+      ppu.emplace_back(addr, v);
+  };
+  // jmp (target) and the IRQ sequence are not simulated
+  REQUIRE(sim.run(prg.getSubroutine("split_0")) + 12 == chain.handlerCycles[0]);
+  REQUIRE(ppu == std::vector<std::pair<uint16_t, uint8_t>>{ { 0x2005, 0x55 }, { 0x2005, 0 } });
+  REQUIRE(sim.memory[0xC000] == 200 - 32 - 1);
+  REQUIRE(sim.memory[chain.target.value()] == 0x23);
+  REQUIRE(sim.memory[chain.target.value() + 1] == 0xE1);
+  REQUIRE(sim.regs.sp == 0xFD);
+
+  // The reload does not wait for the other writes of a split.
+  std::vector<RegisterWrite> many(20, { 0x2001, uint8_t{ 0x1E } });
+  auto longChain = prg.addIrqSplits("long", { { 40, many }, { 100, many } });
+  REQUIRE(longChain.reloadCycle[0] == chain.reloadCycle[0] + 5 + 4); // Y saved and stored too
+  REQUIRE(longChain.reloadCycle[0] < longChain.handlerCycles[0] - 100);
+
+  REQUIRE_THROWS_AS(prg.addIrqSplits("tooClose", { { 10, { { 0x2001, uint8_t{ 0 } } } }, { 11, { { 0x2001, uint8_t{ 0 } } } } }),
+    std::invalid_argument);
+}
+
+TEST_CASE("Tile queue uploads queued tiles within the per-frame budget", "[sim6502][chr]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  std::vector<uint8_t> tiles(48);
+  for (size_t i = 0; i < tiles.size(); ++i)
+    tiles[i] = static_cast<uint8_t>(i);
+  prg.addDataBlock("tiles").addBytes(tiles);
+  auto queue = prg.addTileQueue("chr", 4, 2);
+  Label full("@full");
+  auto &push = prg.addSubroutine("push");
+  for (uint16_t t = 0; t < 3; ++t)
+    push.bblocks().tileQueuePush(queue, Label{ "tiles" }, t, 0x100 + t, full);
+  push.rts().label(full).lda(imm(0xFF)).sta(cppnes::abs(0x0010)).rts();
+  auto &flush = prg.addSubroutine("flush");
+  flush.bblocks().tileQueueFlush(queue, Unroll::by(4));
+  flush.rts();
+  prg.resolveVariables();
+
+  Simulator sim(&prg);
+  sim.placeData();
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> addr;
+  sim.onWrite = [&](uint16_t a, uint8_t v) {
+    if (a == 0x2006)
+      addr.push_back(v);
+    if (a == 0x2007)
+      data.push_back(v);
+  };
+  sim.run(push);
+  REQUIRE(sim.memory[0x0010] == 0);
+  sim.run(flush);
+  REQUIRE(addr == std::vector<uint8_t>{ 0x10, 0x00, 0x10, 0x10 });
+  REQUIRE(data == std::vector<uint8_t>(tiles.begin(), tiles.begin() + 32));
+  sim.run(flush);
+  REQUIRE(data == tiles);
+  sim.run(flush);
+  REQUIRE(data.size() == 48);
+  sim.run(push);
+  sim.run(push); // 6 pushes into 3 free entries
+  REQUIRE(sim.memory[0x0010] == 0xFF);
+
+  auto anim = prg.addChrAnimation("water", Mapper::CNROM, { 1, 2, 3 }, 8);
+  auto &step = prg.addSubroutine("step");
+  step.bblocks().chrAnimationStep(anim);
+  step.rts();
+  prg.resolveVariables();
+  Simulator frames(&prg);
+  frames.placeData();
+  std::vector<uint8_t> banks;
+  frames.onWrite = [&](uint16_t a, uint8_t v) {
+    if (0x8000 <= a)
+      banks.push_back(v);
+  };
+  for (int f = 0; f < 24; ++f)
+    frames.run(step);
+  REQUIRE(banks == std::vector<uint8_t>{ 1, 2, 3 });
+}
+
+TEST_CASE("MMC3 bank select writes go through the shadow and NMI code restores it", "[sim6502][banking]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto anim = prg.addChrAnimation("water", Mapper::MMC3, { 4, 5 }, 1, 2);
+  auto &nmi = prg.addSubroutine("nmi");
+  nmi.bblocks().chrAnimationStep(anim);
+  nmi.rts();
+  auto &main = prg.addSubroutine("main");
+  main.bblocks().switchBank(Mapper::MMC3, 3, Label{ "" }, prg.mmc3BankSelect());
+  main.rts();
+  REQUIRE_THROWS_AS(bblocks::switchBank(main, Mapper::MMC3, 3), std::invalid_argument);
+  prg.resolveVariables();
+  const uint16_t shadow = prg.variables().front().address;
+  Simulator sim(&prg);
+  sim.placeData();
+  std::vector<std::pair<uint16_t, uint8_t>> writes;
+  sim.onWrite = [&](uint16_t a, uint8_t v) {
+    if (0x8000 <= a)
+      writes.emplace_back(a, v);
+  };
+  sim.run(main);
+  REQUIRE(writes == std::vector<std::pair<uint16_t, uint8_t>>{ { 0x8000, 6 }, { 0x8001, 6 }, { 0x8000, 7 }, { 0x8001, 7 } });
+  REQUIRE(sim.memory[shadow] == 7);
+  // NMI taken between the main thread's select and data writes
+  writes.clear();
+  sim.memory[shadow] = 6;
+  REQUIRE(sim.run(nmi) == 46 + 6);
+  REQUIRE(writes == std::vector<std::pair<uint16_t, uint8_t>>{ { 0x8000, 2 }, { 0x8001, 4 }, { 0x8000, 6 } });
+}
+
+TEST_CASE("Metatile screens expand to the nametables they were compiled from", "[sim6502][metatiles]")
+{
+  using namespace cppnes;
+  // Two screens built from 5 metatiles (2x2 tiles + palette); the last attribute row only
+  // holds the top half of the screen.
+  auto screen = [](int seed) {
+    metatiles::Nametable nt{};
+    for (size_t my = 0; my < 15; ++my) {
+      for (size_t mx = 0; mx < 16; ++mx) {
+        const uint8_t m = static_cast<uint8_t>((mx * 3 + my * seed) % 5);
+        const size_t t = my * 64 + mx * 2;
+        for (size_t c = 0; c < 4; ++c)
+          nt[t + (c & 1) + (c >> 1) * 32] = static_cast<uint8_t>(m * 4 + c);
+        nt[960 + (my / 2) * 8 + mx / 2] |= static_cast<uint8_t>((m & 3) << (((my & 1) * 2 + (mx & 1)) * 2));
+      }
+    }
+    return nt;
+  };
+  const auto set = metatiles::compile({ { "title", screen(1) }, { "level", screen(2) } });
+  REQUIRE(set.metatiles.size() == 5);
+  REQUIRE(metatiles::expand(set, set.screens[1]) == screen(2));
+
+  for (Unroll policy : { Unroll{}, Unroll::by(4), Unroll::full() }) {
+    MemoryMap mem;
+    Program prg(mem);
+    auto tables = metatiles::addDataBlocks(prg, "meta", set);
+    auto &load = prg.addSubroutine("load");
+    load.bblocks().loadMetatileScreen(tables, Label{ "level" }, 0x2400, policy, prg.declareVar("attrShadow", 64));
+    load.rts();
+    prg.resolveVariables();
+    auto shadow = std::find_if(prg.variables().begin(), prg.variables().end(), [](const auto &v) { return v.name == "attrShadow"; });
+    Simulator sim(&prg);
+    sim.placeData();
+    std::vector<uint8_t> addr, data;
+    sim.onWrite = [&](uint16_t a, uint8_t v) {
+      if (a == 0x2006)
+        addr.push_back(v);
+      if (a == 0x2007)
+        data.push_back(v);
+    };
+    sim.run(load);
+    REQUIRE(addr == std::vector<uint8_t>{ 0x24, 0x00 });
+    REQUIRE(data.size() == 1024);
+    REQUIRE(std::equal(data.begin(), data.end(), screen(2).begin()));
+    REQUIRE(std::equal(data.begin() + 960, data.end(), sim.memory.begin() + shadow->address));
+  }
+
+  // Scrolling in metatile column 5 of "title" over the attributes of "level".
+  const auto titleAttr = metatiles::attributeTable(set, set.screens[0]);
+  REQUIRE(std::equal(titleAttr.begin(), titleAttr.end(), screen(1).begin() + 960));
+  const auto strips = metatiles::attributeStrips(set, set.screens[0]);
+  MemoryMap mem;
+  Program prg(mem);
+  metatiles::addDataBlocks(prg, "meta", set, true);
+  auto &column = prg.addSubroutine("column");
+  column.bblocks().loadAttributeColumn(Label{ "title_attrStrips" }, AbsAddress{ 0x0300 }, AbsAddress{ 0x0350 }, 0x2400);
+  column.rts();
+  prg.resolveVariables();
+  Simulator sim(&prg);
+  sim.placeData();
+  auto shadow = metatiles::attributeTable(set, set.screens[1]);
+  std::copy(shadow.begin(), shadow.end(), sim.memory.begin() + 0x0300);
+  sim.memory[0x0350] = 5;
+  std::vector<uint8_t> addr, data;
+  sim.onWrite = [&](uint16_t a, uint8_t v) {
+    if (a == 0x2006)
+      addr.push_back(v);
+    if (a == 0x2007)
+      data.push_back(v);
+  };
+  REQUIRE(sim.run(column) == 287 + 6);
+  std::vector<uint8_t> expectedAddr, expectedData;
+  for (size_t r = 0; r < 8; ++r) {
+    const size_t i = r * 8 + 2;
+    shadow[i] = static_cast<uint8_t>((shadow[i] & 0x33) | strips[5 * 8 + r]);
+    REQUIRE(strips[5 * 8 + r] == (titleAttr[i] & 0xCC));
+    expectedAddr.insert(expectedAddr.end(), { 0x27, static_cast<uint8_t>(0xC0 + i) });
+    expectedData.push_back(shadow[i]);
+  }
+  REQUIRE(addr == expectedAddr);
+  REQUIRE(data == expectedData);
+  REQUIRE(std::equal(shadow.begin(), shadow.end(), sim.memory.begin() + 0x0300));
+}
+
+TEST_CASE("RLE nametable unpacks into PPUDATA in the predicted cycles", "[sim6502][compression]")
+{
+  using namespace cppnes;
+  // Long runs, short runs and every byte value once, so the tag also has to be escaped.
+  std::vector<uint8_t> nt(1024, 0x20);
+  for (size_t i = 0; i < 256; ++i)
+    nt[100 + i] = static_cast<uint8_t>(i);
+  for (size_t i = 400; i < 700; ++i)
+    nt[i] = static_cast<uint8_t>(i / 3);
+  const auto packed = compression::rleEncode(nt);
+  REQUIRE(packed.size() < 600);
+  REQUIRE(compression::rleDecode(packed) == nt);
+
+  MemoryMap mem;
+  Program prg(mem);
+  prg.addDataBlock("title").align(256).addBytes(packed);
+  auto ptr = prg.declareZpTemp("ptr", 3);
+  auto &load = prg.addSubroutine("load");
+  load.bblocks().loadNametableRle(Label{ "title" }, ptr, 0x2800);
+  load.rts();
+  prg.resolveVariables();
+  Simulator sim(&prg);
+  sim.placeData();
+  std::vector<uint8_t> addr, data;
+  sim.onWrite = [&](uint16_t a, uint8_t v) {
+    if (a == 0x2006)
+      addr.push_back(v);
+    if (a == 0x2007)
+      data.push_back(v);
+  };
+  const uint64_t cycles = sim.run(load);
+  REQUIRE(addr == std::vector<uint8_t>{ 0x28, 0x00 });
+  REQUIRE(data == nt);
+  REQUIRE(cycles - 6 == compression::rleDecodeCycles(packed));
+}
+
+TEST_CASE("LZ data unpacks to RAM and VRAM at a measured bytes-per-frame rate", "[sim6502][compression]")
+{
+  using namespace cppnes;
+  // CHR-like data: tiles built from a few rows, some repeated whole, some noise.
+  std::vector<uint8_t> chr;
+  uint32_t seed = 7;
+  auto rnd = [&]() { return seed = seed * 1103515245 + 12345, static_cast<uint8_t>(seed >> 16); };
+  const uint8_t rows[] = { 0x00, 0xFF, 0x3C, 0x7E, 0x18, 0x81 };
+  for (int t = 0; t < 128; ++t) {
+    if (t % 5 == 4) {
+      const size_t from = chr.size() - 16 * (1 + rnd() % 4);
+      const std::vector<uint8_t> tile(chr.begin() + from, chr.begin() + from + 16);
+      chr.insert(chr.end(), tile.begin(), tile.end());
+      continue;
+    }
+    for (int r = 0; r < 16; ++r)
+      chr.push_back(t % 7 == 3 ? rnd() : rows[(t + r / 4) % 6]);
+  }
+  const auto packed = compression::lzEncode(chr);
+  REQUIRE(packed.size() < chr.size() * 2 / 3);
+  REQUIRE(compression::lzDecode(packed) == chr);
+  const auto all = compression::lzEncodeAll({ chr, { 1, 2, 3 }, std::vector<uint8_t>(300, 0x55) }, 3);
+  REQUIRE(all.size() == 3);
+  REQUIRE(all[0] == packed);
+  REQUIRE(compression::lzDecode(all[2]) == std::vector<uint8_t>(300, 0x55));
+
+  MemoryMap mem;
+  Program prg(mem);
+  prg.addDataBlock("chr").addBytes(packed);
+  auto ptr = prg.declareZpTemp("ptr", 6);
+  auto ring = prg.allocRamAligned("ring", 256);
+  auto &ram = prg.addSubroutine("ram");
+  ram.bblocks().decompressToRam(Label{ "chr" }, AbsAddress{ 0x6000 }, ptr);
+  ram.rts();
+  auto &vram = prg.addSubroutine("vram");
+  vram.bblocks().decompressToVram(Label{ "chr" }, 0x0000, ring, ptr);
+  vram.rts();
+  prg.resolveVariables();
+  Simulator sim(&prg);
+  sim.placeData();
+  std::vector<uint8_t> data;
+  sim.onWrite = [&](uint16_t a, uint8_t v) {
+    if (a == 0x2007)
+      data.push_back(v);
+  };
+  const uint64_t ramCycles = sim.run(ram);
+  REQUIRE(std::equal(chr.begin(), chr.end(), &sim.memory[0x6000]));
+  const uint64_t vramCycles = sim.run(vram);
+  REQUIRE(data == chr);
+  // bytes per NTSC frame (29780 cycles), measured 1385 and 1086
+  REQUIRE(1300 <= chr.size() * 29780 / ramCycles);
+  REQUIRE(1000 <= chr.size() * 29780 / vramCycles);
+
+  // Into a declared variable: its address is only known after resolveVariables.
+  MemoryMap mem2;
+  Program vars(mem2);
+  vars.addDataBlock("small").addBytes(all[1]);
+  auto buf = vars.declareVar("buf", 8);
+  auto &small = vars.addSubroutine("small");
+  small.bblocks().decompressToRam(Label{ "small" }, buf + 2, vars.declareZpTemp("ptr", 6));
+  small.rts();
+  vars.resolveVariables();
+  Simulator sim2(&vars);
+  sim2.placeData();
+  sim2.run(small);
+  const uint16_t bufAddress = vars.variables().front().address;
+  REQUIRE(std::vector<uint8_t>(&sim2.memory[bufAddress + 2], &sim2.memory[bufAddress + 5]) == std::vector<uint8_t>{ 1, 2, 3 });
+}
+
+TEST_CASE("Palettes load from files and fade through precomputed steps", "[sim6502][palette]")
+{
+  using namespace cppnes;
+  REQUIRE(tables::fadeColor(0x16, -1) == 0x06);
+  REQUIRE(tables::fadeColor(0x06, -1) == 0x0F);
+  REQUIRE(tables::fadeColor(0x0F, 2) == 0x10);
+  REQUIRE(tables::fadeColor(0x27, 2) == 0x30);
+  REQUIRE(tables::fadeColor(0x2D, -1) == 0x1D);
+  REQUIRE(tables::fadeColor(0x2D, -2) == 0x0F);
+  REQUIRE(tables::fadeColor(0x2D, 1) == 0x3D);
+  REQUIRE(tables::fadeColor(0x1D, 1) == 0x00);
+
+  const auto dir = std::filesystem::temp_directory_path();
+  std::ofstream(dir / "cppnes_test.nss") << "NSTssTXT\r\nVarPalBank=1\r\n"
+    "Palette=0f2d31300f0c21320f0525[2]0f0b1a29" "0f1c21320f112233[3]0f1223340f132435\r\n";
+  Resources rc;
+  rc.loadPalettes((dir / "cppnes_test.nss").string());
+  REQUIRE(rc.palettes()[4] == 0x0F);
+  REQUIRE(rc.palettes()[8] == 0x33); // set 1: 0f 1c 21 32 0f 11 22 33 33 33 0f 12 ...
+  std::vector<char> pal(32);
+  for (size_t i = 0; i < pal.size(); ++i)
+    pal[i] = static_cast<char>(i % 4 ? 0x11 + i : 0x0F);
+  std::ofstream(dir / "cppnes_test.pal", std::ios::binary).write(pal.data(), pal.size());
+  rc.loadPalettes((dir / "cppnes_test.pal").string());
+  REQUIRE(rc.palettes()[31] == 0x30);
+  std::filesystem::remove(dir / "cppnes_test.nss");
+  std::filesystem::remove(dir / "cppnes_test.pal");
+
+  MemoryMap mem;
+  Program prg(mem);
+  rc.setPaletteFade(3, 1);
+  rc.addDataBlocks(prg);
+  const AbsAddress step{ 0x0300 };
+  auto &load = prg.addSubroutine("load");
+  load.bblocks().loadPaletteStep(Resources::paletteFadeLabel(), step);
+  load.rts();
+  prg.resolveVariables();
+  Simulator sim(&prg);
+  sim.placeData();
+  std::vector<uint8_t> data;
+  sim.onWrite = [&](uint16_t a, uint8_t v) {
+    if (a == 0x2007)
+      data.push_back(v);
+  };
+  sim.memory[step.value()] = 3; // the palettes themselves
+  REQUIRE(sim.run(load) == 513 + 6);
+  REQUIRE(std::equal(data.begin(), data.end(), rc.palettes().begin()));
+  data.clear();
+  sim.memory[step.value()] = 0;
+  sim.run(load);
+  REQUIRE(data.size() == 32);
+  for (size_t i = 0; i < 32; ++i)
+    REQUIRE(data[i] == tables::fadeColor(rc.palettes()[i], -3));
+  REQUIRE(data[4] == 0x0F);
+}
@@ -0,0 +1,182 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "nesdefs_helper.hpp"
+#include "analysis.hpp"
+#include "sim6502.hpp"
+
+namespace {
+  const cppnes::Instruction &inst(const cppnes::Subroutine &sub, size_t i) {
+    return std::get<cppnes::Instruction>(sub.instructions()[i]);
+  }
+}
+
+TEST_CASE("Instruction size and cycle tables", "[subroutine]")
+{
+  using namespace cppnes;
+  using namespace cppnes::analysis;
+  REQUIRE(instructionBytes({ Opcode::NOP, std::monostate{} }) == 1);
+  REQUIRE(instructionBytes({ Opcode::LDA, Immediate{ 1 } }) == 2);
+  REQUIRE(instructionBytes({ Opcode::BNE, Label{ "l" } }) == 2);
+  REQUIRE(instructionBytes({ Opcode::JSR, Label{ "l" } }) == 3);
+  REQUIRE(instructionCycles({ Opcode::STA, AbsoluteX{ AbsAddress{ 0x300 } } }) == 5);
+  REQUIRE(instructionCycles({ Opcode::INC, ZeroPage{ ZpAddress{ 0x10 } } }) == 5);
+  REQUIRE(instructionCycles({ Opcode::BNE, Label{ "l" } }, true) == 3);
+  REQUIRE(instructionCycles({ Opcode::RTS, std::monostate{} }) == 6);
+}
+
+TEST_CASE("Single-call subroutines are inlined and removed", "[subroutine]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &nmi = prg.addSubroutine("nmi_handler");
+  nmi.jsr("readInput").jsr("big").jsr("big").rti();
+  prg.setNMIVector(nmi);
+  prg.addSubroutine("readInput")
+    .ldx(imm(8))
+    .label("@loop")
+    .dex()
+    .bne("@loop")
+    .rts();
+  auto &big = prg.addSubroutine("big");
+  for (int i = 0; i < 20; ++i)
+    big.sta(cppnes::abs(0x300u + i));
+  big.rts();
+
+  REQUIRE(prg.inlineSubroutines() == 1);
+  REQUIRE(prg.subroutines().size() == 2);
+  REQUIRE(std::get<LineComment>(nmi.instructions()[0]).comment == "inlined readInput");
+  REQUIRE(inst(nmi, 1).opcode == Opcode::LDX);
+  auto renamed = std::get<LabelDef>(nmi.instructions()[2]).label.name();
+  REQUIRE(renamed == "@readInput_loop_0"); // numbered per program, whatever ran before
+  REQUIRE(std::get<Label>(inst(nmi, 4).operand).name() == renamed);
+  REQUIRE(inst(nmi, 5).opcode == Opcode::JSR);
+}
+
+TEST_CASE("Inline hints override the cost model", "[subroutine]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &main = prg.addSubroutine("main");
+  main.jsr("once").jsr("twice").jsr("twice").jsr("twice");
+  prg.setResetVector(main);
+  prg.addSubroutine("once").setInline(InlineHint::Never).nop().rts();
+  auto &twice = prg.addSubroutine("twice").setInline(InlineHint::Always);
+  for (int i = 0; i < 40; ++i)
+    twice.nop();
+  twice.rts();
+
+  REQUIRE(prg.inlineSubroutines() == 3);
+  REQUIRE(prg.subroutines().size() == 2);
+  REQUIRE(prg.subroutines()[1]->name() == "once");
+}
+
+TEST_CASE("Inlining keeps caller branches in range and fall-through targets", "[subroutine]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &main = prg.addSubroutine("main");
+  main.label("@loop").jsr("big").dex().bne("@loop").jsr("tail").rts();
+  prg.setResetVector(main);
+  auto &big = prg.addSubroutine("big");
+  for (int i = 0; i < 50; ++i)
+    big.sta(cppnes::abs(0x300u + i));
+  big.rts();
+  prg.addSubroutine("pre").lda(imm(1)); // falls into tail
+  prg.addSubroutine("tail").sta(cppnes::abs(0x0400)).rts();
+
+  REQUIRE(prg.inlineSubroutines() == 1); // tail; big would put @loop out of reach of the bne
+  REQUIRE(inst(main, 1).opcode == Opcode::JSR);
+  REQUIRE(prg.subroutines().size() == 4);
+  REQUIRE(prg.subroutines()[3]->name() == "tail");
+}
+
+TEST_CASE("Unrolled bblock variants match their documented cost", "[subroutine][bblocks]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto straightCycles = [](const Subroutine &sub) {
+    uint32_t total = 0;
+    for (const auto &e : sub.instructions())
+      if (auto i = std::get_if<Instruction>(&e)) total += analysis::instructionCycles(*i);
+    return total;
+  };
+  const Unroll policies[] = { Unroll::rolled(), Unroll::by(4), Unroll::by(8), Unroll::full() };
+  prg.addDataBlock(Label{ "Screen" }).align(256).addBytes(std::vector<uint8_t>(1024, 0x20));
+  Simulator sim(&prg);
+  sim.placeData();
+  int id = 0;
+  for (auto policy : policies) {
+    auto &nt = prg.addSubroutine("nt" + std::to_string(id));
+    bblocks::loadNametable(nt, "Screen", ZpAddress{ 0x10 }, policy);
+    REQUIRE(analysis::subroutineBytes(nt) == bblocks::loadNametableCost(policy).bytes);
+
+    auto &page = prg.addSubroutine("page" + std::to_string(id));
+    bblocks::clearPage(page, AbsAddress{ 0x0300 }, policy);
+    REQUIRE(analysis::subroutineBytes(page) == bblocks::clearPageCost(policy).bytes);
+
+    auto &fill = prg.addSubroutine("fill" + std::to_string(id++));
+    bblocks::ppuFill(fill, 0x24, 30, policy);
+    REQUIRE(analysis::subroutineBytes(fill) == bblocks::ppuFillCost(30, policy).bytes);
+
+    if (policy.kind == Unroll::Kind::Full) {
+      REQUIRE(straightCycles(nt) == bblocks::loadNametableCost(policy).cycles);
+      REQUIRE(straightCycles(page) == bblocks::clearPageCost(policy).cycles);
+      REQUIRE(straightCycles(fill) == bblocks::ppuFillCost(30, policy).cycles);
+    }
+    REQUIRE(sim.run(nt) == bblocks::loadNametableCost(policy).cycles);
+    REQUIRE(sim.run(page) == bblocks::clearPageCost(policy).cycles);
+    REQUIRE(sim.run(fill) == bblocks::ppuFillCost(30, policy).cycles);
+  }
+  auto &fill32 = prg.addSubroutine("fill32");
+  bblocks::ppuFill(fill32, 0, 32);
+  REQUIRE(sim.run(fill32) == 355);
+  REQUIRE(bblocks::loadNametableCost(Unroll::by(8)).cycles < bblocks::loadNametableCost().cycles);
+  REQUIRE_THROWS(bblocks::clearPageCost(Unroll::by(3)));
+}
+
+TEST_CASE("Layout removes jumps and keeps hot loops within a page", "[subroutine][layout]")
+{
+  using namespace cppnes;
+  MemoryMap mem;
+  Program prg(mem);
+  auto &main = prg.addSubroutine("main");
+  main.jsr("work").label("forever").jmp("forever");
+  prg.setResetVector(main);
+  auto &nmi = prg.addSubroutine("nmi_handler");
+  for (int i = 0; i < 248; ++i)
+    nmi.nop();
+  nmi.jsr("spin").rti();
+  prg.setNMIVector(nmi);
+  auto &work = prg.addSubroutine("work");
+  work.beq("@skip").jmp("@far")
+    .label("@skip").nop().jmp("@next")
+    .label("@next").label("@far").jsr("filler").rts();
+  prg.addSubroutine("filler").nop().rts();
+  auto &spin = prg.addSubroutine("spin");
+  spin.ldx(imm(8)).label("@loop").dex().bne("@loop").rts();
+
+  auto report = prg.optimizeLayout();
+  REQUIRE(report.tailCalls == 1);
+  REQUIRE(report.jumpsRemoved == 1);
+  REQUIRE(report.branchesInverted == 1);
+  REQUIRE(work.instructions().size() == 6);
+  REQUIRE(inst(work, 0).opcode == Opcode::BNE);
+  REQUIRE(std::get<Label>(inst(work, 0).operand).name() == "@far");
+  REQUIRE(inst(work, 5).opcode == Opcode::JMP);
+
+  // hottest first: nmi_handler (252 bytes) then spin, whose loop would straddle $8100
+  REQUIRE(prg.subroutines()[0]->name() == "nmi_handler");
+  REQUIRE(prg.subroutines()[1]->name() == "spin");
+  REQUIRE(spin.padBefore() == 2);
+  REQUIRE(report.loopsAligned == 1);
+  REQUIRE(report.paddingBytes == 2);
+  REQUIRE(report.cyclesSavedPerFrame > 0);
+
+  REQUIRE_NOTHROW(prg.checkLayout());
+  prg.addDataBlock(Label{ "late" }).align(256).addBytes({ 1 }, "added after the layout");
+  REQUIRE_THROWS(prg.checkLayout());
+}
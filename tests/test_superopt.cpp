@@ -0,0 +1,68 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "nesdefs_helper.hpp"
+#include "superopt.hpp"
+#include <filesystem>
+
+TEST_CASE("Superoptimizer finds cheaper equivalent sequences", "[superopt]")
+{
+  using namespace cppnes;
+  using namespace cppnes::analysis;
+  const ZpAddress counter{ 0x10 };
+  superopt::SearchOptions opts;
+  opts.liveOut = FlagN | FlagZ;
+  auto rule = superopt::superoptimize({
+    { Opcode::LDA, zp(counter) }, { Opcode::CLC, std::monostate{} },
+    { Opcode::ADC, imm(1) }, { Opcode::STA, zp(counter) } }, opts);
+  REQUIRE(rule.has_value());
+  REQUIRE(rule->replacement.size() == 1);
+  REQUIRE(rule->replacement[0].opcode == Opcode::INC);
+  REQUIRE(rule->cyclesBefore == 10);
+  REQUIRE(rule->cyclesAfter == 5);
+  REQUIRE(rule->dead == (RegA | FlagC | FlagV));
+
+  // X = 0 with A and flags free: a single LDX #0
+  opts.liveOut = RegX;
+  auto ldx = superopt::superoptimize({ { Opcode::LDA, imm(0) }, { Opcode::TAX, std::monostate{} } }, opts);
+  REQUIRE(ldx.has_value());
+  REQUIRE(ldx->replacement.size() == 1);
+  REQUIRE(ldx->replacement[0].opcode == Opcode::LDX);
+
+  // already optimal with everything live
+  REQUIRE_FALSE(superopt::superoptimize({ { Opcode::INC, zp(counter) } }).has_value());
+  REQUIRE_THROWS(superopt::superoptimize({ { Opcode::LDA, abs(PPUSTATUS) } }));
+}
+
+TEST_CASE("Cached rewrite rules drive the peephole stage", "[superopt]")
+{
+  using namespace cppnes;
+  using namespace cppnes::analysis;
+  superopt::SearchOptions opts;
+  opts.liveOut = FlagN | FlagZ;
+  auto rule = superopt::superoptimize({
+    { Opcode::LDA, zp(0x10) }, { Opcode::CLC, std::monostate{} },
+    { Opcode::ADC, imm(1) }, { Opcode::STA, zp(0x10) } }, opts);
+  REQUIRE(rule.has_value());
+  auto path = std::filesystem::temp_directory_path() / "cppnes_rules.json";
+  superopt::saveRules({ *rule }, path);
+  auto rules = superopt::loadRules(path);
+  std::filesystem::remove(path);
+  REQUIRE(rules.size() == 1);
+  REQUIRE(rules[0].dead == rule->dead);
+  REQUIRE(rules[0].replacement[0].opcode == Opcode::INC);
+
+  MemoryMap mem;
+  Program prg(mem);
+  const ZpAddress score{ 0x42, "score" };
+  auto &sub = prg.addSubroutine("tick");
+  sub
+    .lda(zp(score)).clc().adc(imm(1)).sta(zp(score))  // A, C and V are overwritten below
+    .lda(zp(0x43)).clc().adc(zp(0x44)).sta(zp(0x45))
+    .lda(zp(score)).clc().adc(imm(1)).sta(zp(score))  // A is returned: kept
+    .rts();
+  REQUIRE(prg.peephole(rules) == 1);
+  const auto &inst = std::get<Instruction>(sub.instructions()[0]);
+  REQUIRE(inst.opcode == Opcode::INC);
+  REQUIRE(std::get<ZeroPage>(inst.operand).addr.name() == "score");
+  REQUIRE(sub.instructions().size() == 10);
+}